@@ -1,6 +1,8 @@
 #include "Accept.h"
 
 #include <algorithm>
+#include <cctype>
+#include <cstdlib>
 #include <boost/fusion/sequence/intrinsic_fwd.hpp>
 #include <boost/phoenix.hpp>
 #include <boost/spirit/home/qi/directive/lexeme.hpp>
@@ -119,3 +121,122 @@ Mime AcceptValues::highest_in(const std::vector<Mime>& options) {
         return Mime { .type = match.type, .subtype = match.subtype };
     }
 }
+
+Mime parse_content_type(std::string_view raw) {
+    raw = raw.substr(0, raw.find(';'));
+    while (!raw.empty() && (raw.front() == ' ' || raw.front() == '\t')) {
+        raw.remove_prefix(1);
+    }
+    while (!raw.empty() && (raw.back() == ' ' || raw.back() == '\t')) {
+        raw.remove_suffix(1);
+    }
+    auto slash = raw.find('/');
+    if (slash == 0 || slash == std::string_view::npos || slash + 1 == raw.size()) {
+        return {};
+    }
+    std::string lower(raw);
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return Mime { .type = lower.substr(0, slash), .subtype = lower.substr(slash + 1) };
+}
+
+bool accepts_encoding(std::string_view raw, std::string_view encoding) {
+    auto trim = [](std::string_view str) {
+        while (!str.empty() && str.front() == ' ') {
+            str.remove_prefix(1);
+        }
+        while (!str.empty() && str.back() == ' ') {
+            str.remove_suffix(1);
+        }
+        return str;
+    };
+    auto equals_ignoring_case = [](std::string_view a, std::string_view b) {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+            return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+        });
+    };
+    std::optional<bool> wildcard;
+    while (!raw.empty()) {
+        auto comma = raw.find(',');
+        auto item = raw.substr(0, comma);
+        raw = comma == std::string_view::npos ? std::string_view() : raw.substr(comma + 1);
+        auto semicolon = item.find(';');
+        auto name = trim(item.substr(0, semicolon));
+        bool allowed = true;
+        if (semicolon != std::string_view::npos) {
+            auto param = trim(item.substr(semicolon + 1));
+            if (param.starts_with("q=")) {
+                allowed = std::strtod(std::string(param.substr(2)).c_str(), nullptr) > 0;
+            }
+        }
+        if (equals_ignoring_case(name, encoding)) {
+            return allowed;
+        } else if (name == "*") {
+            wildcard = allowed;
+        }
+    }
+    return wildcard.value_or(false);
+}
+
+std::vector<std::string_view> entity_tags(std::string_view raw, bool weak) {
+    std::vector<std::string_view> tags;
+    while (!raw.empty()) {
+        auto comma = raw.find(',');
+        auto item = raw.substr(0, comma);
+        raw = comma == std::string_view::npos ? std::string_view() : raw.substr(comma + 1);
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) {
+            item.remove_prefix(1);
+        }
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) {
+            item.remove_suffix(1);
+        }
+        if (item.starts_with("W/")) {
+            if (!weak) {
+                continue;
+            }
+            item.remove_prefix(2);
+        }
+        bool quoted = item.size() >= 2 && item.front() == '"' && item.back() == '"';
+        if (quoted || item == "*") {
+            tags.push_back(item);
+        }
+    }
+    return tags;
+}
+
+TEST_CASE("accepts_encoding") {
+    CHECK(accepts_encoding("gzip", "gzip"));
+    CHECK(accepts_encoding("deflate, gzip;q=1.0, *;q=0.5", "gzip"));
+    CHECK(accepts_encoding("br, GZIP", "gzip"));
+    CHECK(accepts_encoding("*", "gzip"));
+    CHECK_FALSE(accepts_encoding("", "gzip"));
+    CHECK_FALSE(accepts_encoding("deflate, br", "gzip"));
+    CHECK_FALSE(accepts_encoding("gzip;q=0", "gzip"));
+    CHECK_FALSE(accepts_encoding("*, gzip;q=0", "gzip"));
+    CHECK_FALSE(accepts_encoding("identity", "gzip"));
+}
+
+TEST_CASE("parse_content_type") {
+    auto check = [](std::string_view raw, std::string_view type, std::string_view subtype) {
+        auto mime = parse_content_type(raw);
+        CHECK_EQ(mime.type, type);
+        CHECK_EQ(mime.subtype, subtype);
+    };
+    check("application/json", "application", "json");
+    check("application/json; charset=utf-8", "application", "json");
+    check(" Application/JSON ;charset=UTF-8", "application", "json");
+    check("application/octet-stream", "application", "octet-stream");
+    check("", "", "");
+    check("json", "", "");
+    check("/json", "", "");
+    check("application/", "", "");
+}
+
+TEST_CASE("entity_tags") {
+    using Tags = std::vector<std::string_view>;
+    CHECK_EQ(entity_tags("\"abc\"", false), (Tags { "\"abc\"" }));
+    CHECK_EQ(entity_tags(" \"a\", W/\"b\",\"c\" ", true), (Tags { "\"a\"", "\"b\"", "\"c\"" }));
+    CHECK_EQ(entity_tags("\"a\", W/\"b\"", false), (Tags { "\"a\"" }));
+    CHECK_EQ(entity_tags("*", false), (Tags { "*" }));
+    CHECK_EQ(entity_tags("abc, \", \"\"", true), (Tags { "\"\"" }));
+    CHECK(entity_tags("", true).empty());
+}
@@ -2,6 +2,7 @@
 
 #include <compare>
 #include <string>
+#include <string_view>
 #include <vector>
 
 struct AcceptMime {
@@ -27,3 +28,16 @@ public:
 private:
     std::vector<AcceptMime> m_values;
 };
+
+// the media type of a Content-Type header, in lowercase and without parameters
+// like charset. type and subtype are empty if it's malformed
+Mime parse_content_type(std::string_view raw);
+
+// whether an Accept-Encoding header allows `encoding` (like "gzip"), by name or
+// via "*", and not with q=0
+bool accepts_encoding(std::string_view raw, std::string_view encoding);
+
+// the entity tags of an If-Match or If-None-Match header, with their quotes, or "*".
+// weak tags (W/"...") are included without the W/ if `weak` is set, otherwise left
+// out, since they never match with the strong comparison. malformed ones are left out
+std::vector<std::string_view> entity_tags(std::string_view raw, bool weak);
@@ -0,0 +1,300 @@
+#include "Batch.h"
+
+#include <array>
+#include <doctest/doctest.h>
+#include <nlohmann/json.hpp>
+
+static void put_u32(std::string& out, uint32_t value) {
+    for (size_t i = 0; i < 4; ++i) {
+        out.push_back(static_cast<char>((value >> (i * 8)) & 0xff));
+    }
+}
+
+// reads one length-prefixed field off the front of `body`.
+// returns false if the body is too short
+static bool take_field(std::string_view& body, std::string_view& out_field) {
+    if (body.size() < 4) {
+        return false;
+    }
+    uint32_t length = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        length |= uint32_t(static_cast<uint8_t>(body[i])) << (i * 8);
+    }
+    body.remove_prefix(4);
+    if (body.size() < length) {
+        return false;
+    }
+    out_field = body.substr(0, length);
+    body.remove_prefix(length);
+    return true;
+}
+
+static std::span<const uint8_t> as_bytes(std::string_view str) {
+    return { reinterpret_cast<const uint8_t*>(str.data()), str.size() };
+}
+
+bool parse_batch_keys(std::string_view body, std::vector<std::string>& out_keys) {
+    while (!body.empty()) {
+        std::string_view key;
+        if (!take_field(body, key)) {
+            return false;
+        }
+        out_keys.emplace_back(key);
+    }
+    return true;
+}
+
+bool parse_batch_keys_json(std::string_view body, std::vector<std::string>& out_keys) {
+    auto json = nlohmann::json::parse(body, nullptr, false);
+    if (!json.is_array()) {
+        return false;
+    }
+    for (const auto& key : json) {
+        if (!key.is_string()) {
+            return false;
+        }
+        out_keys.push_back(key.get<std::string>());
+    }
+    return true;
+}
+
+bool parse_batch_writes(std::string_view body, std::vector<KVStore::KVWrite>& out_writes) {
+    while (!body.empty()) {
+        std::string_view key, mime, value;
+        if (!take_field(body, key) || !take_field(body, mime) || !take_field(body, value)) {
+            return false;
+        }
+        out_writes.push_back({ .key = key, .value = as_bytes(value), .mime = mime });
+    }
+    return true;
+}
+
+bool parse_batch_writes_json(std::string_view body, std::vector<std::string>& out_storage, std::vector<KVStore::KVWrite>& out_writes) {
+    auto json = nlohmann::json::parse(body, nullptr, false);
+    if (!json.is_array()) {
+        return false;
+    }
+    // the writes point into the storage, so it must never reallocate
+    out_storage.clear();
+    out_storage.reserve(json.size() * 3);
+    for (const auto& entry : json) {
+        if (!entry.is_object() || !entry.contains("key") || !entry["key"].is_string()
+            || !entry.contains("value") || !entry["value"].is_string()) {
+            return false;
+        }
+        const auto& key = out_storage.emplace_back(entry["key"].get<std::string>());
+        auto& value = out_storage.emplace_back();
+        if (!base64_decode(entry["value"].get<std::string>(), value)) {
+            return false;
+        }
+        std::string mime = "application/octet-stream";
+        if (entry.contains("mime")) {
+            if (!entry["mime"].is_string()) {
+                return false;
+            }
+            mime = entry["mime"].get<std::string>();
+        }
+        const auto& stored_mime = out_storage.emplace_back(std::move(mime));
+        out_writes.push_back({ .key = key, .value = as_bytes(value), .mime = stored_mime });
+    }
+    return true;
+}
+
+std::string encode_batch_values(std::span<const std::optional<KVStore::KVValueView>> values) {
+    size_t size = 0;
+    for (const auto& value : values) {
+        size += 9 + (value ? value->mime.size() + value->value.size() : 0);
+    }
+    std::string out;
+    out.reserve(size);
+    for (const auto& value : values) {
+        out.push_back(value ? 1 : 0);
+        if (value) {
+            put_u32(out, static_cast<uint32_t>(value->mime.size()));
+            out.append(value->mime);
+            put_u32(out, static_cast<uint32_t>(value->value.size()));
+            out.append(reinterpret_cast<const char*>(value->value.data()), value->value.size());
+        } else {
+            put_u32(out, 0);
+            put_u32(out, 0);
+        }
+    }
+    return out;
+}
+
+std::string encode_batch_values_json(std::span<const std::string> keys, std::span<const std::optional<KVStore::KVValueView>> values) {
+    auto json = nlohmann::json::array();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        nlohmann::json entry = { { "key", keys[i] }, { "found", values[i].has_value() } };
+        if (values[i]) {
+            entry["mime"] = values[i]->mime;
+            entry["value"] = base64_encode(values[i]->value);
+        }
+        json.push_back(std::move(entry));
+    }
+    // keys and mime types are bytes, not necessarily UTF-8
+    return json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+static constexpr std::string_view base64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string base64_encode(std::span<const uint8_t> data) {
+    std::string out;
+    out.reserve((data.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < data.size(); i += 3) {
+        uint32_t n = (uint32_t(data[i]) << 16) | (uint32_t(data[i + 1]) << 8) | data[i + 2];
+        out.push_back(base64_chars[(n >> 18) & 63]);
+        out.push_back(base64_chars[(n >> 12) & 63]);
+        out.push_back(base64_chars[(n >> 6) & 63]);
+        out.push_back(base64_chars[n & 63]);
+    }
+    if (i < data.size()) {
+        uint32_t n = uint32_t(data[i]) << 16;
+        if (i + 1 < data.size()) {
+            n |= uint32_t(data[i + 1]) << 8;
+        }
+        out.push_back(base64_chars[(n >> 18) & 63]);
+        out.push_back(base64_chars[(n >> 12) & 63]);
+        out.push_back(i + 1 < data.size() ? base64_chars[(n >> 6) & 63] : '=');
+        out.push_back('=');
+    }
+    return out;
+}
+
+bool base64_decode(std::string_view encoded, std::string& out_data) {
+    static const auto table = [] {
+        std::array<int8_t, 256> result {};
+        result.fill(-1);
+        for (size_t i = 0; i < base64_chars.size(); ++i) {
+            result[static_cast<uint8_t>(base64_chars[i])] = static_cast<int8_t>(i);
+        }
+        return result;
+    }();
+    if (encoded.size() % 4 != 0) {
+        return false;
+    }
+    out_data.clear();
+    out_data.reserve(encoded.size() / 4 * 3);
+    for (size_t i = 0; i < encoded.size(); i += 4) {
+        bool last = i + 4 == encoded.size();
+        uint32_t n = 0;
+        size_t padding = 0;
+        for (size_t k = 0; k < 4; ++k) {
+            char c = encoded[i + k];
+            if (c == '=' && last && k >= 2) {
+                ++padding;
+                n <<= 6;
+                continue;
+            }
+            int8_t value = table[static_cast<uint8_t>(c)];
+            if (value < 0 || padding > 0) {
+                return false;
+            }
+            n = (n << 6) | uint32_t(value);
+        }
+        out_data.push_back(static_cast<char>((n >> 16) & 0xff));
+        if (padding < 2) {
+            out_data.push_back(static_cast<char>((n >> 8) & 0xff));
+        }
+        if (padding < 1) {
+            out_data.push_back(static_cast<char>(n & 0xff));
+        }
+    }
+    return true;
+}
+
+TEST_CASE("base64") {
+    for (std::string data : { "", "f", "fo", "foo", "foob", "fooba", "foobar" }) {
+        std::string decoded;
+        CHECK(base64_decode(base64_encode(as_bytes(data)), decoded));
+        CHECK_EQ(decoded, data);
+    }
+    CHECK_EQ(base64_encode(as_bytes("foobar")), "Zm9vYmFy");
+    CHECK_EQ(base64_encode(as_bytes("fooba")), "Zm9vYmE=");
+    std::string decoded;
+    CHECK_FALSE(base64_decode("Zm9", decoded));
+    CHECK_FALSE(base64_decode("Zm=v", decoded));
+    CHECK_FALSE(base64_decode("Zm9*", decoded));
+}
+
+TEST_CASE("batch encoding") {
+    SUBCASE("keys") {
+        std::string body;
+        put_u32(body, 3);
+        body += "abc";
+        put_u32(body, 0);
+        std::vector<std::string> keys;
+        CHECK(parse_batch_keys(body, keys));
+        CHECK_EQ(keys, std::vector<std::string>({ "abc", "" }));
+
+        keys.clear();
+        CHECK_FALSE(parse_batch_keys(body.substr(0, 5), keys));
+
+        keys.clear();
+        CHECK(parse_batch_keys_json(R"(["a", "b/c"])", keys));
+        CHECK_EQ(keys, std::vector<std::string>({ "a", "b/c" }));
+        CHECK_FALSE(parse_batch_keys_json(R"(["a", 1])", keys));
+        CHECK_FALSE(parse_batch_keys_json(R"({"a": 1})", keys));
+    }
+    SUBCASE("writes") {
+        std::string body;
+        put_u32(body, 1);
+        body += "k";
+        put_u32(body, 10);
+        body += "text/plain";
+        put_u32(body, 5);
+        body += "hello";
+        std::vector<KVStore::KVWrite> writes;
+        REQUIRE(parse_batch_writes(body, writes));
+        REQUIRE_EQ(writes.size(), 1);
+        CHECK_EQ(writes[0].key, "k");
+        CHECK_EQ(writes[0].mime, "text/plain");
+        CHECK_EQ(std::string(writes[0].value.begin(), writes[0].value.end()), "hello");
+
+        writes.clear();
+        CHECK_FALSE(parse_batch_writes(body.substr(0, body.size() - 1), writes));
+
+        std::vector<std::string> storage;
+        writes.clear();
+        REQUIRE(parse_batch_writes_json(R"([{"key": "a", "value": "aGVsbG8="}, {"key": "b", "mime": "text/plain", "value": ""}])", storage, writes));
+        REQUIRE_EQ(writes.size(), 2);
+        CHECK_EQ(writes[0].key, "a");
+        CHECK_EQ(writes[0].mime, "application/octet-stream");
+        CHECK_EQ(std::string(writes[0].value.begin(), writes[0].value.end()), "hello");
+        CHECK_EQ(writes[1].mime, "text/plain");
+        CHECK(writes[1].value.empty());
+        CHECK_FALSE(parse_batch_writes_json(R"([{"key": "a", "value": "not base64"}])", storage, writes));
+    }
+    SUBCASE("values") {
+        std::string value = "hi";
+        std::vector<std::optional<KVStore::KVValueView>> values = {
+            KVStore::KVValueView { .value = as_bytes(value), .mime = "text/plain", .owner = nullptr },
+            std::nullopt,
+        };
+        std::string encoded = encode_batch_values(values);
+        std::string expected;
+        expected.push_back(1);
+        put_u32(expected, 10);
+        expected += "text/plain";
+        put_u32(expected, 2);
+        expected += "hi";
+        expected.push_back(0);
+        put_u32(expected, 0);
+        put_u32(expected, 0);
+        CHECK_EQ(encoded, expected);
+
+        std::vector<std::string> keys = { "a", "b" };
+        auto json = nlohmann::json::parse(encode_batch_values_json(keys, values));
+        CHECK_EQ(json[0]["key"], "a");
+        CHECK_EQ(json[0]["found"], true);
+        CHECK_EQ(json[0]["value"], "aGk=");
+        CHECK_EQ(json[1]["found"], false);
+
+        // keys aren't necessarily UTF-8
+        keys = { std::string("a\xff", 2), "b" };
+        json = nlohmann::json::parse(encode_batch_values_json(keys, values));
+        CHECK_EQ(json[0]["key"], "a\xef\xbf\xbd");
+        CHECK_EQ(json[0]["value"], "aGk=");
+    }
+}
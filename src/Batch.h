@@ -0,0 +1,42 @@
+#pragma once
+
+#include "KVStore.h"
+
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Encodings of the /mget and /mset request and response bodies.
+//
+// The binary format is a sequence of records made of length-prefixed fields.
+// Every length is a 32 bit little-endian integer.
+//  - mget request:  [key length][key] per key
+//  - mget response: [found (1 byte, 0 or 1)][mime length][mime][value length][value] per key,
+//                   in the order of the request. mime and value are empty if not found.
+//  - mset request:  [key length][key][mime length][mime][value length][value] per entry
+//
+// The JSON format uses base64 for values:
+//  - mget request:  ["key", ...]
+//  - mget response: [{"key": "...", "found": true, "mime": "...", "value": "<base64>"}, ...]
+//  - mset request:  [{"key": "...", "mime": "...", "value": "<base64>"}, ...]
+// mime is optional in JSON mset requests and defaults to application/octet-stream.
+
+// returns false if the body is malformed
+bool parse_batch_keys(std::string_view body, std::vector<std::string>& out_keys);
+bool parse_batch_keys_json(std::string_view body, std::vector<std::string>& out_keys);
+
+// the writes point into `body`.
+// returns false if the body is malformed
+bool parse_batch_writes(std::string_view body, std::vector<KVStore::KVWrite>& out_writes);
+// the writes point into `out_storage`.
+// returns false if the body is malformed
+bool parse_batch_writes_json(std::string_view body, std::vector<std::string>& out_storage, std::vector<KVStore::KVWrite>& out_writes);
+
+std::string encode_batch_values(std::span<const std::optional<KVStore::KVValueView>> values);
+std::string encode_batch_values_json(std::span<const std::string> keys, std::span<const std::optional<KVStore::KVValueView>> values);
+
+std::string base64_encode(std::span<const uint8_t> data);
+// returns false if the input isn't valid base64
+bool base64_decode(std::string_view encoded, std::string& out_data);
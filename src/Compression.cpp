@@ -0,0 +1,141 @@
+#include "Compression.h"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <doctest/doctest.h>
+#include <string>
+#include <zlib.h>
+
+// gzip adds 10 bytes of header and 8 of trailer to the deflate stream
+static constexpr int gzip_window_bits = 15 + 16;
+
+std::string_view encoding_name(KVEncoding encoding) {
+    switch (encoding) {
+    case KVEncoding::Identity:
+        return {};
+    case KVEncoding::Gzip:
+        return "gzip";
+    default:
+        return {};
+    }
+}
+
+bool is_compressible_mime(std::string_view mime) {
+    // parameters like charset don't matter
+    mime = mime.substr(0, mime.find(';'));
+    while (!mime.empty() && mime.back() == ' ') {
+        mime.remove_suffix(1);
+    }
+    std::string lower(mime);
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    static constexpr std::array<std::string_view, 5> types {
+        "application/json",
+        "application/javascript",
+        "application/xml",
+        "application/x-ndjson",
+        "application/x-www-form-urlencoded",
+    };
+    return lower.starts_with("text/") || lower.ends_with("+json") || lower.ends_with("+xml")
+        || std::find(types.begin(), types.end(), lower) != types.end();
+}
+
+int gzip_compress(std::span<const uint8_t> data, std::vector<uint8_t>& out_data) {
+    out_data.clear();
+    if (data.size() > UINT_MAX) {
+        return 1;
+    }
+    z_stream stream {};
+    // the fastest level gets most of the ratio of the higher ones on text, at a
+    // fraction of the cost, and writes are what pays for it
+    if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, gzip_window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -ENOMEM;
+    }
+    // not worth it if it doesn't save an eighth, so that's all the room it gets
+    out_data.resize(data.size() - data.size() / 8);
+    stream.next_in = const_cast<Bytef*>(data.data());
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = out_data.data();
+    stream.avail_out = static_cast<uInt>(out_data.size());
+    int ret = deflate(&stream, Z_FINISH);
+    size_t size = stream.total_out;
+    deflateEnd(&stream);
+    if (ret != Z_STREAM_END) {
+        out_data.clear();
+        return 1;
+    }
+    out_data.resize(size);
+    return 0;
+}
+
+int gzip_decompress(std::span<const uint8_t> data, std::vector<uint8_t>& out_data) {
+    if (data.size() < 18 || data.size() > UINT_MAX) {
+        return -EBADMSG;
+    }
+    // the trailer ends with the size of the uncompressed data (mod 2^32, but
+    // values are smaller than that)
+    uint32_t size;
+    std::memcpy(&size, data.data() + data.size() - sizeof(size), sizeof(size));
+    out_data.resize(size);
+    z_stream stream {};
+    if (inflateInit2(&stream, gzip_window_bits) != Z_OK) {
+        return -ENOMEM;
+    }
+    stream.next_in = const_cast<Bytef*>(data.data());
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = out_data.data();
+    stream.avail_out = static_cast<uInt>(out_data.size());
+    int ret = inflate(&stream, Z_FINISH);
+    bool complete = ret == Z_STREAM_END && stream.total_out == size && stream.avail_in == 0;
+    inflateEnd(&stream);
+    if (!complete) {
+        out_data.clear();
+        return -EBADMSG;
+    }
+    return 0;
+}
+
+TEST_CASE("gzip") {
+    std::string json;
+    for (int i = 0; i < 200; ++i) {
+        json += R"({"id": )" + std::to_string(i) + R"(, "name": "some name", "tags": ["a", "b", "c"]},)";
+    }
+    std::span<const uint8_t> data(reinterpret_cast<const uint8_t*>(json.data()), json.size());
+    std::vector<uint8_t> compressed;
+    REQUIRE_EQ(gzip_compress(data, compressed), 0);
+    CHECK_LT(compressed.size(), json.size() / 5);
+    // gzip magic
+    CHECK_EQ(compressed[0], 0x1f);
+    CHECK_EQ(compressed[1], 0x8b);
+    std::vector<uint8_t> decompressed;
+    REQUIRE_EQ(gzip_decompress(compressed, decompressed), 0);
+    CHECK(std::equal(decompressed.begin(), decompressed.end(), data.begin(), data.end()));
+
+    // random data doesn't get smaller
+    std::vector<uint8_t> noise(1000);
+    uint32_t state = 1;
+    for (auto& byte : noise) {
+        state = state * 1664525 + 1013904223;
+        byte = static_cast<uint8_t>(state >> 24);
+    }
+    CHECK_EQ(gzip_compress(noise, compressed), 1);
+    CHECK(compressed.empty());
+    CHECK_EQ(gzip_compress({}, compressed), 1);
+
+    compressed.clear();
+    REQUIRE_EQ(gzip_compress(data, compressed), 0);
+    compressed[compressed.size() / 2] ^= 0xff;
+    CHECK_EQ(gzip_decompress(compressed, decompressed), -EBADMSG);
+    CHECK_EQ(gzip_decompress(noise, decompressed), -EBADMSG);
+
+    CHECK(is_compressible_mime("application/json"));
+    CHECK(is_compressible_mime("text/html; charset=utf-8"));
+    CHECK(is_compressible_mime("Application/LD+JSON"));
+    CHECK(is_compressible_mime("image/svg+xml"));
+    CHECK_FALSE(is_compressible_mime("image/png"));
+    CHECK_FALSE(is_compressible_mime("application/octet-stream"));
+    CHECK_FALSE(is_compressible_mime("application/json-seq-but-not-really"));
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+// how a value is stored, kept in the top byte of the entry's mime length
+enum class KVEncoding : uint8_t {
+    Identity = 0,
+    // gzip (RFC 1952), so it can be sent as it is with `Content-Encoding: gzip`
+    Gzip = 1,
+};
+
+// the Content-Encoding of the stored bytes, empty for Identity
+std::string_view encoding_name(KVEncoding encoding);
+
+// whether values of this mime type usually compress well: text, JSON, XML,
+// JavaScript and the like. images, video and archives are compressed already
+bool is_compressible_mime(std::string_view mime);
+
+// compresses `data` into out_data. returns 1 if it wouldn't save at least an
+// eighth, then out_data is left empty, otherwise 0
+int gzip_compress(std::span<const uint8_t> data, std::vector<uint8_t>& out_data);
+// decompresses a single gzip member. returns -EBADMSG if it's not valid gzip, otherwise 0
+int gzip_decompress(std::span<const uint8_t> data, std::vector<uint8_t>& out_data);
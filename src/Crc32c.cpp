@@ -0,0 +1,146 @@
+#include "Crc32c.h"
+
+#include <array>
+#include <cstring>
+#include <doctest/doctest.h>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define KV_CRC32C_X86 1
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define KV_CRC32C_ARM 1
+#include <arm_acle.h>
+#endif
+
+// reflected polynomial 0x1EDC6F41
+static constexpr uint32_t polynomial = 0x82f63b78;
+
+// slicing-by-8: table[k][b] is the crc of byte b followed by k zero bytes
+static const std::array<std::array<uint32_t, 256>, 8> table = [] {
+    std::array<std::array<uint32_t, 256>, 8> result {};
+    for (uint32_t b = 0; b < 256; ++b) {
+        uint32_t crc = b;
+        for (int i = 0; i < 8; ++i) {
+            crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
+        }
+        result[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+        for (size_t k = 1; k < 8; ++k) {
+            result[k][b] = (result[k - 1][b] >> 8) ^ result[0][result[k - 1][b] & 0xff];
+        }
+    }
+    return result;
+}();
+
+// works on the inverted crc
+static uint32_t crc32c_software(const uint8_t* data, size_t size, uint32_t crc) {
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        // the table is built for little endian words
+        word ^= crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^ table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff]
+            ^ table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^ table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+    }
+    for (; size > 0; --size, ++data) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *data) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(KV_CRC32C_X86)
+#if !defined(_MSC_VER)
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t
+crc32c_hardware(const uint8_t* data, size_t size, uint32_t crc) {
+    uint64_t crc64 = crc;
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<uint32_t>(crc64);
+    for (; size > 0; --size, ++data) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+
+static bool has_hardware_crc() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#elif defined(KV_CRC32C_ARM)
+static uint32_t crc32c_hardware(const uint8_t* data, size_t size, uint32_t crc) {
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; --size, ++data) {
+        crc = __crc32cb(crc, *data);
+    }
+    return crc;
+}
+
+static bool has_hardware_crc() {
+    return true;
+}
+#else
+static uint32_t crc32c_hardware(const uint8_t* data, size_t size, uint32_t crc) {
+    return crc32c_software(data, size, crc);
+}
+
+static bool has_hardware_crc() {
+    return false;
+}
+#endif
+
+uint32_t crc32c(std::span<const uint8_t> data, uint32_t crc) {
+    static const bool hardware = has_hardware_crc();
+    if (hardware) {
+        return ~crc32c_hardware(data.data(), data.size(), ~crc);
+    }
+    return ~crc32c_software(data.data(), data.size(), ~crc);
+}
+
+TEST_CASE("crc32c") {
+    auto as_bytes = [](std::string_view str) {
+        return std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(str.data()), str.size());
+    };
+    // check values from RFC 3720, appendix B.4
+    CHECK_EQ(crc32c(as_bytes("123456789")), 0xe3069283);
+    std::vector<uint8_t> zeros(32, 0);
+    CHECK_EQ(crc32c(zeros), 0x8a9136aa);
+    std::vector<uint8_t> ones(32, 0xff);
+    CHECK_EQ(crc32c(ones), 0x62a8ab43);
+    CHECK_EQ(crc32c({}), 0);
+
+    // continued checksums, and both implementations, at every alignment and length
+    std::vector<uint8_t> data(1000);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<uint8_t>(i * 31 + 7);
+    }
+    uint32_t whole = crc32c(data);
+    for (size_t split : { 0u, 1u, 7u, 8u, 9u, 500u, 999u, 1000u }) {
+        std::span<const uint8_t> span(data);
+        CHECK_EQ(crc32c(span.subspan(split), crc32c(span.first(split))), whole);
+    }
+    for (size_t offset = 0; offset < 8; ++offset) {
+        for (size_t size = 0; size < 40; ++size) {
+            CHECK_EQ(~crc32c_hardware(data.data() + offset, size, ~0u), ~crc32c_software(data.data() + offset, size, ~0u));
+        }
+    }
+}
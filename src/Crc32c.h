@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+// CRC-32C (Castagnoli), like iSCSI, ext4 and most storage formats use it. Runs on
+// the CPU's crc32 instructions (SSE 4.2 on x86, the CRC extension on ARMv8) where
+// available, which checksum several bytes per cycle, and on a table otherwise.
+//
+// Pass the previous result as `crc` to continue a checksum over more data, so
+// crc32c(b, crc32c(a)) == crc32c(a + b).
+uint32_t crc32c(std::span<const uint8_t> data, uint32_t crc = 0);
@@ -0,0 +1,54 @@
+#include "ETag.h"
+
+#include <array>
+#include <charconv>
+#include <doctest/doctest.h>
+#include <fmt/core.h>
+
+static constexpr size_t etag_digits = 8;
+static constexpr std::string_view gzip_suffix = "-gz";
+
+std::string etag_of(const KeyVersion& version, bool gzip) {
+    return fmt::format("\"{:08x}{:08x}{:08x}{}\"", version.checksum, version.value_size, version.mime_word, gzip ? gzip_suffix : "");
+}
+
+std::optional<KeyVersion> version_of_etag(std::string_view etag) {
+    if (etag.size() < 2 || etag.front() != '"' || etag.back() != '"') {
+        return std::nullopt;
+    }
+    std::string_view hex = etag.substr(1, etag.size() - 2);
+    if (hex.ends_with(gzip_suffix)) {
+        hex.remove_suffix(gzip_suffix.size());
+    }
+    std::array<uint32_t, 3> words;
+    if (hex.size() != words.size() * etag_digits) {
+        return std::nullopt;
+    }
+    for (size_t i = 0; i < words.size(); ++i) {
+        const char* begin = hex.data() + i * etag_digits;
+        auto [ptr, ec] = std::from_chars(begin, begin + etag_digits, words[i], 16);
+        if (ec != std::errc() || ptr != begin + etag_digits) {
+            return std::nullopt;
+        }
+    }
+    return KeyVersion { .checksum = words[0], .value_size = words[1], .mime_word = words[2] };
+}
+
+TEST_CASE("etag_of") {
+    KeyVersion version { .checksum = 0xdeadbeef, .value_size = 42, .mime_word = 0x01000018 };
+    CHECK_EQ(etag_of(version, false), "\"deadbeef0000002a01000018\"");
+    CHECK_EQ(etag_of(version, true), "\"deadbeef0000002a01000018-gz\"");
+    CHECK_NE(etag_of(version, false), etag_of(version, true));
+    CHECK_EQ(version.encoding(), 1);
+
+    // both representations have the same version
+    CHECK(version_of_etag(etag_of(version, false)) == version);
+    CHECK(version_of_etag(etag_of(version, true)) == version);
+
+    CHECK_FALSE(version_of_etag(""));
+    CHECK_FALSE(version_of_etag("*"));
+    CHECK_FALSE(version_of_etag("\"deadbeef0000002a0100001\""));
+    CHECK_FALSE(version_of_etag("\"deadbeef0000002a01000018-br\""));
+    CHECK_FALSE(version_of_etag("\"deadbeef0000002a0100001x\""));
+    CHECK_FALSE(version_of_etag("deadbeef0000002a01000018-gz\"\""));
+}
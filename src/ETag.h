@@ -0,0 +1,14 @@
+#pragma once
+
+#include "KeyDir.h"
+#include <optional>
+#include <string>
+#include <string_view>
+
+// the strong ETag of a value: its version in hex, see KVStore::KVVersion. the gzip
+// encoded representation is a different entity than the identity one, so its tag
+// gets a "-gz" suffix inside the quotes
+std::string etag_of(const KeyVersion& version, bool gzip);
+
+// the version in an ETag made by etag_of, of either representation
+std::optional<KeyVersion> version_of_etag(std::string_view etag);
@@ -0,0 +1,285 @@
+#include "File.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <random>
+#include <vector>
+
+#if defined(_WIN32)
+#include <io.h>
+#include <sys/stat.h>
+#include <windows.h>
+#else
+#include <climits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+static void close_fd(int fd) {
+#if defined(_WIN32)
+    ::_close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+std::shared_ptr<PReadFile> PReadFile::open(const std::string& path) {
+#if defined(_WIN32)
+    int fd = ::_open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+    if (fd < 0) {
+        return nullptr;
+    }
+    return std::shared_ptr<PReadFile>(new PReadFile(fd));
+}
+
+PReadFile::PReadFile(int fd)
+    : m_fd(fd) {
+}
+
+PReadFile::~PReadFile() {
+    if (m_fd >= 0) {
+        close_fd(m_fd);
+    }
+}
+
+// see PReadFile::read_at
+static int read_fd_at(int fd, void* buffer, size_t size, uint64_t offset) {
+    auto* dest = static_cast<uint8_t*>(buffer);
+    while (size > 0) {
+#if defined(_WIN32)
+        // ReadFile with an OVERLAPPED offset is the windows equivalent of pread
+        OVERLAPPED ov {};
+        ov.Offset = static_cast<DWORD>(offset & 0xffffffff);
+        ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD chunk = size > 0x40000000 ? 0x40000000 : static_cast<DWORD>(size);
+        DWORD n = 0;
+        if (!ReadFile(reinterpret_cast<HANDLE>(_get_osfhandle(fd)), dest, chunk, &n, &ov)) {
+            if (GetLastError() == ERROR_HANDLE_EOF) {
+                return 1;
+            }
+            return -EIO;
+        }
+#else
+        ssize_t n = ::pread(fd, dest, size, static_cast<off_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+#endif
+        if (n == 0) {
+            return 1;
+        }
+        dest += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return 0;
+}
+
+int PReadFile::read_at(void* buffer, size_t size, uint64_t offset) const {
+    return read_fd_at(m_fd, buffer, size, offset);
+}
+
+std::shared_ptr<FileMapping> FileMapping::map(const PReadFile& file, uint64_t capacity) {
+#if defined(_WIN32)
+    (void)file;
+    (void)capacity;
+    errno = ENOTSUP;
+    return nullptr;
+#else
+    // the mapping keeps its own reference to the file, the handle may be closed before it
+    void* data = ::mmap(nullptr, capacity, PROT_READ, MAP_SHARED, file.m_fd, 0);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+    return std::shared_ptr<FileMapping>(new FileMapping(static_cast<const uint8_t*>(data), capacity));
+#endif
+}
+
+FileMapping::FileMapping(const uint8_t* data, uint64_t capacity)
+    : m_data(data)
+    , m_capacity(capacity) {
+}
+
+FileMapping::~FileMapping() {
+#if !defined(_WIN32)
+    ::munmap(const_cast<uint8_t*>(m_data), m_capacity);
+#endif
+}
+
+std::shared_ptr<AppendFile> AppendFile::open(const std::string& path) {
+#if defined(_WIN32)
+    int fd = ::_open(path.c_str(), _O_RDWR | _O_BINARY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    int64_t size = ::_lseeki64(fd, 0, SEEK_END);
+#else
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    int64_t size = ::fstat(fd, &st) == 0 ? st.st_size : -1;
+#endif
+    if (size < 0) {
+        int err = errno;
+        close_fd(fd);
+        errno = err;
+        return nullptr;
+    }
+    return std::shared_ptr<AppendFile>(new AppendFile(fd, static_cast<uint64_t>(size)));
+}
+
+std::shared_ptr<AppendFile> AppendFile::create_temporary(const std::string& prefix) {
+    std::random_device random;
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        std::string path = fmt::format("{}.{:08x}{:08x}.tmp", prefix, random(), random());
+#if defined(_WIN32)
+        // _O_TEMPORARY deletes it when the last handle is closed
+        int fd = ::_open(path.c_str(), _O_RDWR | _O_BINARY | _O_CREAT | _O_EXCL | _O_TEMPORARY, _S_IREAD | _S_IWRITE);
+#else
+        int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | O_CREAT | O_EXCL, 0600);
+#endif
+        if (fd < 0) {
+            if (errno == EEXIST) {
+                continue;
+            }
+            return nullptr;
+        }
+#if !defined(_WIN32)
+        // the open file lives on without a name
+        ::unlink(path.c_str());
+#endif
+        return std::shared_ptr<AppendFile>(new AppendFile(fd, 0));
+    }
+    errno = EEXIST;
+    return nullptr;
+}
+
+AppendFile::AppendFile(int fd, uint64_t size)
+    : m_fd(fd)
+    , m_size(size) {
+}
+
+AppendFile::~AppendFile() {
+    if (m_fd >= 0) {
+        close_fd(m_fd);
+    }
+}
+
+int AppendFile::append(std::span<const std::span<const uint8_t>> slices) {
+    uint64_t offset = m_size;
+#if defined(_WIN32)
+    HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle(m_fd));
+    for (auto slice : slices) {
+        while (!slice.empty()) {
+            OVERLAPPED ov {};
+            ov.Offset = static_cast<DWORD>(offset & 0xffffffff);
+            ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD chunk = slice.size() > 0x40000000 ? 0x40000000 : static_cast<DWORD>(slice.size());
+            DWORD n = 0;
+            if (!WriteFile(handle, slice.data(), chunk, &n, &ov)) {
+                (void)truncate(m_size);
+                return -EIO;
+            }
+            slice = slice.subspan(n);
+            offset += n;
+        }
+    }
+#else
+    std::vector<iovec> iov;
+    iov.reserve(slices.size());
+    for (auto slice : slices) {
+        if (!slice.empty()) {
+            iov.push_back(iovec { const_cast<uint8_t*>(slice.data()), slice.size() });
+        }
+    }
+    size_t first = 0;
+    while (first < iov.size()) {
+        int count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+        ssize_t n = ::pwritev(m_fd, iov.data() + first, count, static_cast<off_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int err = errno;
+            (void)truncate(m_size);
+            return -err;
+        }
+        offset += static_cast<uint64_t>(n);
+        // skip what was written, which may end in the middle of a slice
+        auto written = static_cast<size_t>(n);
+        while (first < iov.size() && written >= iov[first].iov_len) {
+            written -= iov[first].iov_len;
+            ++first;
+        }
+        if (written > 0) {
+            iov[first].iov_base = static_cast<uint8_t*>(iov[first].iov_base) + written;
+            iov[first].iov_len -= written;
+        }
+    }
+#endif
+    m_size = offset;
+    return 0;
+}
+
+int AppendFile::read_at(void* buffer, size_t size, uint64_t offset) const {
+    return read_fd_at(m_fd, buffer, size, offset);
+}
+
+int AppendFile::truncate(uint64_t size) {
+#if defined(_WIN32)
+    int ret = ::_chsize_s(m_fd, static_cast<__int64>(size));
+    if (ret != 0) {
+        return -ret;
+    }
+#else
+    if (::ftruncate(m_fd, static_cast<off_t>(size)) != 0) {
+        return -errno;
+    }
+#endif
+    m_size = size;
+    return 0;
+}
+
+int AppendFile::sync() const {
+#if defined(_WIN32)
+    if (!FlushFileBuffers(reinterpret_cast<HANDLE>(_get_osfhandle(m_fd)))) {
+        return -EIO;
+    }
+#elif defined(__APPLE__)
+    if (::fsync(m_fd) != 0) {
+        return -errno;
+    }
+#else
+    if (::fdatasync(m_fd) != 0) {
+        return -errno;
+    }
+#endif
+    return 0;
+}
+
+int sync_directory(const std::string& path) {
+#if defined(_WIN32)
+    (void)path;
+    return 0;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    int ret = ::fsync(fd) == 0 ? 0 : -errno;
+    close_fd(fd);
+    return ret;
+#endif
+}
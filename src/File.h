@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+
+// A read-only handle to a file which is only ever accessed with positional
+// reads (pread). It has no shared cursor, so any number of threads can read
+// from it at the same time without locking.
+class PReadFile {
+public:
+    // returns nullptr and sets errno on failure
+    static std::shared_ptr<PReadFile> open(const std::string& path);
+
+    PReadFile(const PReadFile&) = delete;
+    PReadFile& operator=(const PReadFile&) = delete;
+
+    ~PReadFile();
+
+    // reads exactly `size` bytes at `offset`.
+    // returns negative errno on error, 1 if less than size was read,
+    // and otherwise 0
+    [[nodiscard]] int read_at(void* buffer, size_t size, uint64_t offset) const;
+
+private:
+    friend class FileMapping;
+
+    explicit PReadFile(int fd);
+
+    int m_fd { -1 };
+};
+
+// A read-only, shared memory mapping of a file. The mapping may be larger than
+// the file: bytes appended to the file later become visible through it, but
+// only bytes which exist in the file may be accessed.
+class FileMapping {
+public:
+    // maps the file which `file` has open, even if it was renamed or replaced since.
+    // returns nullptr and sets errno on failure, or on platforms without mmap
+    static std::shared_ptr<FileMapping> map(const PReadFile& file, uint64_t capacity);
+
+    FileMapping(const FileMapping&) = delete;
+    FileMapping& operator=(const FileMapping&) = delete;
+
+    ~FileMapping();
+
+    const uint8_t* data() const { return m_data; }
+    uint64_t capacity() const { return m_capacity; }
+
+private:
+    FileMapping(const uint8_t* data, uint64_t capacity);
+
+    const uint8_t* m_data { nullptr };
+    uint64_t m_capacity { 0 };
+};
+
+// A file which is only ever appended to. It keeps track of its own size, so
+// the offset of every append is known without asking the OS. Not thread safe,
+// except for sync(), which may run concurrently with appends.
+class AppendFile {
+public:
+    // returns nullptr and sets errno on failure
+    static std::shared_ptr<AppendFile> open(const std::string& path);
+    // creates a new, empty file with a name which starts with `prefix`. it's deleted
+    // once it's closed, and doesn't outlive the process.
+    // returns nullptr and sets errno on failure
+    static std::shared_ptr<AppendFile> create_temporary(const std::string& prefix);
+
+    AppendFile(const AppendFile&) = delete;
+    AppendFile& operator=(const AppendFile&) = delete;
+
+    ~AppendFile();
+
+    uint64_t size() const { return m_size; }
+
+    // appends all slices, in order, with as few write syscalls as possible.
+    // returns negative errno on error, otherwise 0. on error, the file is
+    // truncated back to where it was before.
+    [[nodiscard]] int append(std::span<const std::span<const uint8_t>> slices);
+    // returns negative errno on error, otherwise 0
+    [[nodiscard]] int truncate(uint64_t size);
+    // reads exactly `size` bytes at `offset`, like PReadFile::read_at
+    [[nodiscard]] int read_at(void* buffer, size_t size, uint64_t offset) const;
+    // flushes written data to the disk (fdatasync).
+    // returns negative errno on error, otherwise 0
+    [[nodiscard]] int sync() const;
+
+private:
+    AppendFile(int fd, uint64_t size);
+
+    int m_fd { -1 };
+    uint64_t m_size { 0 };
+};
+
+// flushes the directory's entries to the disk, so that files created, renamed or
+// removed in it stay that way after a crash. a no-op on windows.
+// returns negative errno on error, otherwise 0
+[[nodiscard]] int sync_directory(const std::string& path);
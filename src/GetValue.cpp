@@ -0,0 +1,243 @@
+#include "GetValue.h"
+
+#include "Accept.h"
+#include "ETag.h"
+#include <algorithm>
+#include <cstring>
+#include <doctest/doctest.h>
+#include <filesystem>
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+#include <thread>
+#include <vector>
+
+void get_value(KVStore& store, const std::string& key, const httplib::Request& req, httplib::Response& res, bool compression) {
+    // httplib answers a Range request (with one range or many) by asking the
+    // content provider for just those bytes, so only they are read. ranges are
+    // of the value itself, and with If-Range only of the version the client has.
+    // that's compared strongly, and we send no Last-Modified, so a date never matches
+    bool ranged = !req.ranges.empty();
+    bool if_range = ranged && req.has_header("If-Range");
+    KVStore::KVVersion range_version {};
+    if (if_range) {
+        ranged = store.version_of(key, range_version) == 0 && req.get_header_value("If-Range") == etag_of(range_version, false);
+    }
+    // compressed values are sent as they're stored, if the client can take them
+    bool keep_encoded = !ranged && accepts_encoding(req.get_header_value("Accept-Encoding"), "gzip");
+
+    // a client which has the value already gets an answer from the keydir alone.
+    // it may have either representation, so tags are compared by version
+    if (req.has_header("If-None-Match")) {
+        KVStore::KVVersion version;
+        if (store.version_of(key, version) == 0) {
+            for (auto tag : entity_tags(req.get_header_value("If-None-Match"), true)) {
+                if (tag == "*" || version_of_etag(tag) == version) {
+                    spdlog::info("GET {}: Not modified", req.path);
+                    bool gzip = keep_encoded && KVEncoding(version.encoding()) == KVEncoding::Gzip;
+                    res.set_header("ETag", etag_of(version, gzip));
+                    res.status = 304;
+                    return;
+                }
+            }
+        }
+    }
+
+    KVStore::KVValueRef ref;
+    int ret = store.lookup(key, ref, keep_encoded, ranged);
+    spdlog::info("GET {}: {}", req.path, ret == 1 ? "Not found" : std::strerror(-ret));
+    if (ret < 0) {
+        res.set_content(fmt::format("error: {}", std::strerror(-ret)), "text/plain");
+        res.status = 500;
+        return;
+    }
+    if (ret == 1) {
+        res.set_content("Not found", "text/plain");
+        res.status = 404;
+        return;
+    }
+
+    // the value may have changed since If-Range was checked
+    if (if_range && ranged && ref.version() != range_version) {
+        ranged = false;
+    }
+    // httplib sends the ranges, with 206
+    res.status = ranged ? 206 : 200;
+    res.set_header("ETag", etag_of(ref.version(), !ref.encoding().empty()));
+    res.set_header("Accept-Ranges", "bytes");
+    if (!ref.encoding().empty()) {
+        res.set_header("Content-Encoding", std::string(ref.encoding()));
+    }
+    if (compression) {
+        res.set_header("Vary", "Accept-Encoding");
+    }
+    // stream the value from the store file, so a request costs the same
+    // amount of memory no matter how large the value is
+    auto provider = [ref, buffer = std::vector<char>()](size_t offset, size_t length, httplib::DataSink& sink) mutable {
+        if (const uint8_t* data = ref.mapped_value()) {
+            return sink.write(reinterpret_cast<const char*>(data) + offset, length);
+        }
+        if (buffer.empty()) {
+            buffer.resize(std::min<size_t>(ref.size(), 64 * 1024));
+        }
+        size_t n = std::min(length, buffer.size());
+        if (ref.read(offset, buffer.data(), n) != 0) {
+            spdlog::error("GET: failed to read value at offset {}", offset);
+            return false;
+        }
+        return sink.write(buffer.data(), n);
+    };
+    if (ranged || req.ranges.empty()) {
+        res.set_content_provider(ref.size(), std::string(ref.mime()), std::move(provider));
+    } else {
+        // If-Range didn't match, so all of the value is sent. httplib cuts content of a
+        // known length to the requested ranges, content without one (chunked) it doesn't
+        res.set_chunked_content_provider(std::string(ref.mime()),
+            [provider = std::move(provider), size = ref.size()](size_t offset, httplib::DataSink& sink) mutable {
+                if (offset >= size) {
+                    sink.done();
+                    return true;
+                }
+                return provider(offset, size - offset, sink);
+            });
+    }
+}
+
+TEST_CASE("get_value over HTTP") {
+    std::string dir = "./test-get-value";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    {
+        KVStore store(dir + "/store", KVOptions { .compression = true });
+        std::string text = "0123456789abcdefghij";
+        REQUIRE_EQ(store.write_entry("text", std::vector<uint8_t>(text.begin(), text.end()), "text/plain"), 0);
+        // compressed when it's stored
+        std::vector<uint8_t> zeroes(4096, '0');
+        REQUIRE_EQ(store.write_entry("zeroes", zeroes, "text/plain"), 0);
+
+        httplib::Server server;
+        server.Get("/kv/(.+)", [&](const httplib::Request& req, httplib::Response& res) {
+            get_value(store, req.matches[1].str(), req, res, true);
+        });
+        int port = server.bind_to_any_port("127.0.0.1");
+        REQUIRE(port > 0);
+        std::thread listener([&] { server.listen_after_bind(); });
+        server.wait_until_ready();
+
+        httplib::Client client("127.0.0.1", port);
+        client.set_decompress(false);
+
+        auto full = client.Get("/kv/text");
+        REQUIRE(full);
+        CHECK_EQ(full->status, 200);
+        CHECK_EQ(full->body, text);
+        CHECK_EQ(full->get_header_value("Accept-Ranges"), "bytes");
+        CHECK_FALSE(full->has_header("Content-Range"));
+        std::string etag = full->get_header_value("ETag");
+        CHECK(version_of_etag(etag));
+
+        auto missing = client.Get("/kv/nothing");
+        REQUIRE(missing);
+        CHECK_EQ(missing->status, 404);
+
+        SUBCASE("range") {
+            auto res = client.Get("/kv/text", { { "Range", "bytes=2-5" } });
+            REQUIRE(res);
+            CHECK_EQ(res->status, 206);
+            CHECK_EQ(res->body, "2345");
+            CHECK_EQ(res->get_header_value("Content-Range"), "bytes 2-5/20");
+            CHECK_EQ(res->get_header_value("ETag"), etag);
+
+            res = client.Get("/kv/text", { { "Range", "bytes=-3" } });
+            REQUIRE(res);
+            CHECK_EQ(res->status, 206);
+            CHECK_EQ(res->body, "hij");
+        }
+
+        SUBCASE("multiple ranges") {
+            auto res = client.Get("/kv/text", { { "Range", "bytes=0-1,10-12" } });
+            REQUIRE(res);
+            CHECK_EQ(res->status, 206);
+            CHECK(res->get_header_value("Content-Type").starts_with("multipart/byteranges"));
+            CHECK_NE(res->body.find("Content-Range: bytes 0-1/20"), std::string::npos);
+            CHECK_NE(res->body.find("01"), std::string::npos);
+            CHECK_NE(res->body.find("Content-Range: bytes 10-12/20"), std::string::npos);
+            CHECK_NE(res->body.find("abc"), std::string::npos);
+        }
+
+        SUBCASE("If-Range") {
+            // the version the client has: just the range
+            auto res = client.Get("/kv/text", { { "Range", "bytes=2-5" }, { "If-Range", etag } });
+            REQUIRE(res);
+            CHECK_EQ(res->status, 206);
+            CHECK_EQ(res->body, "2345");
+
+            // another version, a weak tag, or a date: all of the value
+            for (std::string other : { std::string("\"000000000000000000000000\""), "W/" + etag, std::string("Wed, 21 Oct 2015 07:28:00 GMT") }) {
+                res = client.Get("/kv/text", { { "Range", "bytes=2-5" }, { "If-Range", other } });
+                REQUIRE(res);
+                CHECK_EQ(res->status, 200);
+                CHECK_EQ(res->body, text);
+                CHECK_FALSE(res->has_header("Content-Range"));
+                CHECK_EQ(res->get_header_value("Transfer-Encoding"), "chunked");
+            }
+
+            // larger than a piece read at a time
+            std::vector<uint8_t> large(200 * 1024);
+            for (size_t i = 0; i < large.size(); ++i) {
+                large[i] = static_cast<uint8_t>(i * 7);
+            }
+            REQUIRE_EQ(store.write_entry("large", large, "application/octet-stream"), 0);
+            res = client.Get("/kv/large", { { "Range", "bytes=100-199" }, { "If-Range", etag } });
+            REQUIRE(res);
+            CHECK_EQ(res->status, 200);
+            CHECK(res->body == std::string(large.begin(), large.end()));
+
+            // the value changed since the client got its tag
+            REQUIRE_EQ(store.write_entry("text", std::vector<uint8_t>(text.rbegin(), text.rend()), "text/plain"), 0);
+            res = client.Get("/kv/text", { { "Range", "bytes=2-5" }, { "If-Range", etag } });
+            REQUIRE(res);
+            CHECK_EQ(res->status, 200);
+            CHECK_EQ(res->body, std::string(text.rbegin(), text.rend()));
+            CHECK_NE(res->get_header_value("ETag"), etag);
+        }
+
+        SUBCASE("encoded") {
+            auto res = client.Get("/kv/zeroes", { { "Accept-Encoding", "gzip" } });
+            REQUIRE(res);
+            CHECK_EQ(res->status, 200);
+            CHECK_EQ(res->get_header_value("Content-Encoding"), "gzip");
+            CHECK_EQ(res->get_header_value("Vary"), "Accept-Encoding");
+            std::string gzip_etag = res->get_header_value("ETag");
+            CHECK(gzip_etag.ends_with("-gz\""));
+
+            auto identity = client.Get("/kv/zeroes", { { "Accept-Encoding", "identity" } });
+            REQUIRE(identity);
+            CHECK_FALSE(identity->has_header("Content-Encoding"));
+            CHECK_EQ(identity->body, std::string(4096, '0'));
+            std::string identity_etag = identity->get_header_value("ETag");
+            CHECK_EQ(version_of_etag(identity_etag), version_of_etag(gzip_etag));
+            CHECK_NE(identity_etag, gzip_etag);
+
+            // either tag is the same version, the 304 has the tag of what would've been sent
+            res = client.Get("/kv/zeroes", { { "Accept-Encoding", "gzip" }, { "If-None-Match", identity_etag } });
+            REQUIRE(res);
+            CHECK_EQ(res->status, 304);
+            CHECK_EQ(res->get_header_value("ETag"), gzip_etag);
+            res = client.Get("/kv/zeroes", { { "Accept-Encoding", "identity" }, { "If-None-Match", gzip_etag } });
+            REQUIRE(res);
+            CHECK_EQ(res->status, 304);
+            CHECK_EQ(res->get_header_value("ETag"), identity_etag);
+
+            // ranges are of the identity representation, even if the client takes gzip
+            res = client.Get("/kv/zeroes", { { "Accept-Encoding", "gzip" }, { "Range", "bytes=0-9" }, { "If-Range", identity_etag } });
+            REQUIRE(res);
+            CHECK_EQ(res->status, 206);
+            CHECK_FALSE(res->has_header("Content-Encoding"));
+            CHECK_EQ(res->body, std::string(10, '0'));
+        }
+
+        server.stop();
+        listener.join();
+    }
+    std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "KVStore.h"
+#include <httplib.h>
+#include <string>
+
+// answers a GET of `key`: the value, streamed from the store, or 304, 404 or 500.
+// handles If-None-Match, Range and If-Range. `compression` is KVOptions::compression,
+// with which responses vary by Accept-Encoding
+void get_value(KVStore& store, const std::string& key, const httplib::Request& req, httplib::Response& res, bool compression);
@@ -1,7 +1,25 @@
 #include "KVStore.h"
+#include "Crc32c.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <chrono>
 #include <doctest/doctest.h>
+#include <functional>
+#include <future>
+#include <latch>
+#include <limits>
+#include <optional>
+#include <thread>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 // error checked version of fwrite
 // returns negative value on error, otherwise 0
@@ -10,7 +28,7 @@
     if (n != size) {
         // error
         spdlog::info("debug: error writing to file: {}", std::strerror(errno));
-        return errno;
+        return -errno;
     }
     return 0;
 }
@@ -26,7 +44,7 @@
             return 1;
         } else if (std::ferror(file)) {
             spdlog::info("debug: error reading from file: {}", std::strerror(errno));
-            return errno;
+            return -errno;
         } else {
             return -1; // should never happen :)
         }
@@ -34,395 +52,4444 @@
     return 0;
 }
 
-int KVStore::write_entry_impl(const KVEntry& entry) {
-    std::fseek(m_file, 0, SEEK_END);
-    std::fpos_t pos;
-    if (std::fgetpos(m_file, &pos) < 0) {
-        return errno;
+// 64 bit version of fseek, from the start of the file
+// returns negative value on error, otherwise 0
+[[nodiscard]] static int file_seek(std::FILE* file, uint64_t offset) {
+#if defined(_WIN32)
+    int ret = _fseeki64(file, static_cast<int64_t>(offset), SEEK_SET);
+#else
+    int ret = fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+    return ret == 0 ? 0 : -errno;
+}
+
+// size of the KVHeader, where the first entry starts
+static constexpr uint64_t header_size = 12;
+
+// minor versions of the v3 format, by the feature they added. the header of a store's
+// first segment has the oldest one which can hold all of its entries, so a store which
+// doesn't use a feature stays readable by versions from before it
+static constexpr uint8_t format_checksums = 0;
+static constexpr uint8_t format_interned_mimes = 1;
+static constexpr uint8_t format_tombstones = 2;
+static constexpr uint8_t format_expiry = 3;
+static constexpr uint8_t latest_format = format_expiry;
+
+// creates a file with just the header in it
+static int create_store_file(const std::string& filename, uint8_t format = format_checksums) {
+    std::FILE* file = std::fopen(filename.c_str(), "wb");
+    if (!file) {
+        return -errno;
     }
-    m_keydir[entry.key] = pos;
-    int ret = entry.write_to_file(m_file);
-    if (ret < 0) {
-        return ret;
+    KVStore::KVHeader hdr;
+    hdr.set_version(PRJ_VERSION_MAJOR, format, 0);
+    int ret = hdr.write_to_file(file);
+    if (std::fclose(file) != 0 && ret == 0) {
+        ret = -errno;
+    }
+    return ret;
+}
+// rewrites the header of an existing store file with the given format, and syncs it
+static int write_format(const std::string& filename, uint8_t format) {
+    std::FILE* file = std::fopen(filename.c_str(), "r+b");
+    if (!file) {
+        return -errno;
+    }
+    KVStore::KVHeader hdr;
+    hdr.set_version(PRJ_VERSION_MAJOR, format, 0);
+    int ret = hdr.write_to_file(file);
+    if (std::fclose(file) != 0 && ret == 0) {
+        ret = -errno;
+    }
+    if (ret == 0) {
+        auto synced = AppendFile::open(filename);
+        ret = synced ? synced->sync() : -errno;
+    }
+    return ret;
+}
+
+// what the keydir can hold, see KeyDir. segment ids and value offsets are checked
+// where segments are created and entries appended, these can't run out
+static_assert(MimeTable::max_types <= KeyDir::max_mime_size, "mime ids don't fit into the keydir");
+static_assert(uint8_t(KVEncoding::Gzip) <= KeyLocation::encoding_mask, "encodings don't fit into the keydir");
+
+// the hint file lives next to the store
+static std::string hint_path(const std::string& filename) {
+    return filename + ".hint";
+}
+
+// the interned mime types of all segments, see MimeTable
+static std::string mime_table_path(const std::string& filename) {
+    return filename + ".mime";
+}
+
+// the merge which is being moved into place, see write_merge_manifest
+static std::string merge_manifest_path(const std::string& filename) {
+    return filename + ".merge";
+}
+
+// the directory which the store's files are in
+static std::string directory_of(const std::string& filename) {
+    auto path = std::filesystem::path(filename);
+    return path.has_parent_path() ? path.parent_path().string() : ".";
+}
+
+// syncs a file which was just created, and the directory it's in, so that the file
+// is still there after a crash
+static int sync_new_file(const std::string& filename) {
+    auto synced = AppendFile::open(filename);
+    int ret = synced ? synced->sync() : -errno;
+    if (ret == 0) {
+        ret = sync_directory(directory_of(filename));
+    }
+    return ret;
+}
+
+// hint file layout, all numbers in native byte order like in the store:
+// [magic][end of the store data it covers (u64)][number of records (u64)]
+// and then a record per key:
+// [key length (u32)][value length (u32)][mime word (u32)][data checksum (u32)][value offset (u64)][expiry (u64)][key]
+// where the expiry time is only there if the mime word says so, like in the entry
+static constexpr std::array<uint8_t, 8> hint_magic = { 'K', 'V', 'H', 'I', 'N', 'T', '0', '3' };
+
+// merge manifest layout, in native byte order:
+// [magic][output segment id (u32)][number of inputs (u32)][input segment ids (u32 each)]
+// [temporary file name length (u32)][temporary file name][checksum of everything before (u32)]
+static constexpr std::array<uint8_t, 8> merge_magic = { 'K', 'V', 'M', 'E', 'R', 'G', 'E', '1' };
+
+// checks value and mime against the checksum behind them. `data` is all three,
+// location.data_size() bytes. returns -EBADMSG if they don't match, otherwise 0
+static int verify_data(const uint8_t* data, const KeyLocation& location) {
+    uint32_t checksum;
+    std::memcpy(&checksum, data + location.data_size() - sizeof(checksum), sizeof(checksum));
+    if (crc32c({ data, location.data_size() - sizeof(checksum) }) != checksum) {
+        spdlog::error("read: checksum mismatch in value at offset {} of segment {}", location.value_offset, location.segment);
+        return -EBADMSG;
     }
     return 0;
 }
-int KVStore::read_entry(const std::string& key, std::vector<uint8_t>& out_value, std::string& out_mime) {
-    KVEntry entry;
-    std::unique_lock lock(m_mtx);
-    if (m_keydir.contains(key)) {
-        std::fpos_t pos = m_keydir.at(key);
-        if (std::fsetpos(m_file, &pos) < 0) {
-            return errno;
+// checks value and mime of the entry at `location` against their checksum, reading
+// them from the current position of `file`, which is left behind the entry.
+// returns negative errno on error, -EBADMSG if they don't match, 1 if the file ends early
+static int verify_data_in_file(std::FILE* file, const KeyLocation& location, uint32_t& out_checksum) {
+    std::array<uint8_t, 64 * 1024> buffer;
+    uint32_t checksum = 0;
+    uint64_t left = location.data_size() - sizeof(uint32_t);
+    while (left > 0) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(left, buffer.size()));
+        int ret = file_read(buffer.data(), n, file);
+        if (ret != 0) {
+            return ret;
         }
-    } else {
-        return 1;
+        checksum = crc32c({ buffer.data(), n }, checksum);
+        left -= n;
+    }
+    int ret = file_read(&out_checksum, sizeof(out_checksum), file);
+    if (ret != 0) {
+        return ret;
+    }
+    return checksum == out_checksum ? 0 : -EBADMSG;
+}
+// decompresses a value as it was stored
+static int decode_value(const KeyLocation& location, std::span<const uint8_t> stored, std::vector<uint8_t>& out_value) {
+    int ret = -ENOTSUP;
+    if (location.encoding == uint8_t(KVEncoding::Gzip)) {
+        ret = gzip_decompress(stored, out_value);
+    }
+    if (ret != 0) {
+        spdlog::error("read: failed to decode value at offset {} of segment {}: {}", location.value_offset, location.segment, std::strerror(-ret));
+    }
+    return ret;
+}
+// turns a view of a value as it's stored into one of the value itself, which owns
+// the decompressed value and a copy of the mime, unless that's interned
+static int decode_view(const KeyLocation& location, KVStore::KVValueView& view) {
+    if (location.encoding == uint8_t(KVEncoding::Identity)) {
+        return 0;
     }
-    int ret = entry.read_from_file(m_file);
+    auto buffer = std::make_shared<std::vector<uint8_t>>();
+    int ret = decode_value(location, view.value, *buffer);
+    if (ret != 0) {
+        return ret;
+    }
+    size_t value_size = buffer->size();
+    if (location.mime_id == 0) {
+        buffer->insert(buffer->end(), view.mime.begin(), view.mime.end());
+        view.mime = { reinterpret_cast<const char*>(buffer->data() + value_size), view.mime.size() };
+    }
+    view.value = { buffer->data(), value_size };
+    view.owner = std::move(buffer);
+    return 0;
+}
+int KVStore::mime_of(const KVLocation& location, const uint8_t* data, std::string_view& out_mime) const {
+    if (location.mime_id == 0) {
+        out_mime = { reinterpret_cast<const char*>(data + location.value_size), location.mime_size };
+        return 0;
+    }
+    const std::string* mime = m_mimes.find(location.mime_id);
+    if (!mime) {
+        spdlog::error("read: unknown mime type {} of value at offset {} of segment {}", location.mime_id, location.value_offset, location.segment);
+        return -EBADMSG;
+    }
+    out_mime = *mime;
+    return 0;
+}
+int KVStore::view_of(const KVLocation& location, const uint8_t* data, std::shared_ptr<const void> owner, KVValueView& out_view) const {
+    int ret = mime_of(location, data, out_view.mime);
+    if (ret != 0) {
+        return ret;
+    }
+    out_view.value = { data, location.value_size };
+    out_view.owner = std::move(owner);
+    return decode_view(location, out_view);
+}
+int KVStore::read_location(const PReadFile& file, const KVLocation& location, std::vector<uint8_t>& out_value, std::string& out_mime) const {
+    // value, mime and checksum are adjacent, read them straight into the output
+    // and split mime and checksum off the end
+    out_value.resize(location.data_size());
+    int ret = file.read_at(out_value.data(), out_value.size(), location.value_offset);
     if (ret < 0) {
         // error
         return ret;
     } else if (ret > 0) {
         return -EIO;
     }
-    std::swap(out_value, entry.value);
-    std::swap(out_mime, entry.mime);
-    return 0;
-}
-int KVStore::write_entry(const std::string& key, const std::vector<uint8_t>& value, const std::string& mime) {
-    KVEntry entry {
-        .key_length = { .value = static_cast<uint32_t>(key.size()) },
-        .value_length = { .value = static_cast<uint32_t>(value.size()) },
-        .mime_length = { .value = static_cast<uint32_t>(mime.size()) },
-        .key = key,
-        .value = value,
-        .mime = mime,
-    };
-    std::unique_lock lock(m_mtx);
-    int ret = write_entry_impl(entry);
-    if (ret < 0) {
+    ret = verify_data(out_value.data(), location);
+    if (ret != 0) {
         return ret;
     }
-    // flush to make sure it's saved
-    std::fflush(m_file);
+    std::string_view mime;
+    ret = mime_of(location, out_value.data(), mime);
+    if (ret != 0) {
+        return ret;
+    }
+    out_mime.assign(mime);
+    out_value.resize(location.value_size);
+    if (location.encoding != uint8_t(KVEncoding::Identity)) {
+        std::vector<uint8_t> stored;
+        std::swap(stored, out_value);
+        return decode_value(location, stored, out_value);
+    }
     return 0;
 }
-int KVStore::index() {
-    std::unique_lock lock(m_mtx);
-    int ret = std::fseek(m_file, 12, SEEK_SET);
-    if (ret < 0) {
-        return errno;
+int KVStore::read_entry(const std::string& key, std::vector<uint8_t>& out_value, std::string& out_mime) {
+    if (m_options.mmap_reads || m_cache) {
+        KVValueView view;
+        int ret = read_entry(key, view);
+        if (ret != 0) {
+            return ret;
+        }
+        out_value.assign(view.value.begin(), view.value.end());
+        out_mime.assign(view.mime);
+        return 0;
     }
-    KVEntry entry;
-    // TODO: handle errors
-    spdlog::info("index: collecting kv entries...");
+    KVLocation location;
+    std::shared_ptr<PReadFile> file;
+    {
+        const auto& shard = m_shards[shard_of(key)];
+        std::shared_lock lock(shard.mtx);
+        auto found = shard.keydir.find(key);
+        if (!found || !found->live(now())) {
+            return 1;
+        }
+        location = *found;
+        // keeps the file open even if a merge replaces it while we read
+        std::shared_lock segments_lock(m_segments_mtx);
+        file = m_segments.at(location.segment)->file;
+    }
+    return read_location(*file, location, out_value, out_mime);
+}
+int KVStore::find_location(const std::string& key, KVLocation& out_location, std::shared_ptr<PReadFile>& out_file, std::shared_ptr<FileMapping>& out_mapping) {
     for (;;) {
-        std::fpos_t pos;
-        ret = std::fgetpos(m_file, &pos);
-        if (ret < 0) {
-            return errno;
+        {
+            const auto& shard = m_shards[shard_of(key)];
+            std::shared_lock lock(shard.mtx);
+            auto found = shard.keydir.find(key);
+            if (!found || !found->live(now())) {
+                return 1;
+            }
+            out_location = *found;
+            // keeps the file open even if a merge replaces it while we read
+            std::shared_lock segments_lock(m_segments_mtx);
+            const auto& segment = *m_segments.at(out_location.segment);
+            out_file = segment.file;
+            out_mapping = segment.mapping;
+        }
+        uint64_t end = out_location.end();
+        if (!m_options.mmap_reads || (out_mapping && out_mapping->capacity() >= end)) {
+            return 0;
+        }
+        // the location may be stale after remapping (a merge could have replaced
+        // the segment), so look it up again together with the new mapping
+        out_mapping = nullptr;
+        if (ensure_mapping(out_location.segment, end) != 0) {
+            return 0;
+        }
+    }
+}
+int KVStore::read_entry(const std::string& key, KVValueView& out_view) {
+    KVLocation location;
+    std::shared_ptr<PReadFile> file;
+    std::shared_ptr<FileMapping> mapping;
+    int ret = find_location(key, location, file, mapping);
+    if (ret != 0) {
+        return ret;
+    }
+    if (mapping) {
+        const uint8_t* data = mapping->data() + location.value_offset;
+        ret = verify_data(data, location);
+        if (ret != 0) {
+            return ret;
         }
-        ret = entry.read_from_file(m_file);
+        return view_of(location, data, std::move(mapping), out_view);
+    }
+    if (m_cache) {
+        ValueCache::Buffer cached;
+        ret = read_cached(key, location, *file, cached);
         if (ret < 0) {
-            // error
-            spdlog::info("index: error reading from file: {}", std::strerror(ret));
             return ret;
-        } else if (ret > 0) {
-            spdlog::info("index: end of file");
-            break;
+        } else if (ret == 0) {
+            const uint8_t* data = cached->data();
+            return view_of(location, data, std::move(cached), out_view);
         }
-        m_keydir[entry.key] = pos;
     }
-    spdlog::info("index: collected {} kv entries", m_keydir.size());
-    return 0;
+    // pread fallback: value and mime share one buffer, which the view owns
+    auto buffer = std::make_shared<std::vector<uint8_t>>(location.data_size());
+    ret = file->read_at(buffer->data(), buffer->size(), location.value_offset);
+    if (ret < 0) {
+        return ret;
+    } else if (ret > 0) {
+        return -EIO;
+    }
+    ret = verify_data(buffer->data(), location);
+    if (ret != 0) {
+        return ret;
+    }
+    const uint8_t* data = buffer->data();
+    return view_of(location, data, std::move(buffer), out_view);
 }
-int KVStore::merge() {
-    int ret = index();
+int KVStore::read_cached(const std::string& key, const KVLocation& location, const PReadFile& file, ValueCache::Buffer& out_buffer) {
+    out_buffer = m_cache->find(key, location);
+    if (out_buffer) {
+        return 0;
+    }
+    // the checksum is cached too, but only checked once
+    uint64_t size = location.data_size();
+    if (!m_cache->admits(size + key.size())) {
+        return 1;
+    }
+    auto buffer = std::make_shared<std::vector<uint8_t>>(size);
+    int ret = file.read_at(buffer->data(), buffer->size(), location.value_offset);
     if (ret < 0) {
         return ret;
+    } else if (ret > 0) {
+        return -EIO;
     }
-
-    std::unique_lock lock(m_mtx);
-
-    auto temp_path = std::filesystem::temp_directory_path();
-    auto temp_file = temp_path / (std::filesystem::path(m_filename).filename().string() + ".kv_temporary");
-
-    size_t n = 1;
-    auto name = temp_file;
-    while (std::filesystem::exists(name)) {
-        name = fmt::format("{}.{}", temp_file.string(), n);
-        ++n;
+    ret = verify_data(buffer->data(), location);
+    if (ret != 0) {
+        return ret;
     }
-    temp_file = name;
-
-    spdlog::info("merge: creating temporary file \"{}\"", temp_file.string());
-    size_t entries = 0;
-    {
-        // temporary kv store will handle closing the file again
-        KVStore tmp_store(temp_file.string());
-        KVEntry entry;
-        for (const auto& [key, pos] : m_keydir) {
-            (void)key; // ignore
-            ret = std::fsetpos(m_file, &pos);
-            if (ret < 0) {
-                return errno;
+    m_cache->insert(key, location, buffer);
+    out_buffer = std::move(buffer);
+    return 0;
+}
+int KVStore::read_entries(std::span<const std::string> keys, std::vector<std::optional<KVValueView>>& out_values) {
+    out_values.assign(keys.size(), std::nullopt);
+    // an existing key, and the file (and mapping) of the segment it's in
+    struct Found {
+        size_t index;
+        KVLocation location;
+        std::shared_ptr<PReadFile> file;
+        std::shared_ptr<FileMapping> mapping;
+    };
+    std::vector<Found> found;
+    for (;;) {
+        found.clear();
+        // a segment which isn't mapped far enough
+        std::optional<std::pair<uint32_t, uint64_t>> unmapped;
+        {
+            // all keys are resolved against the same version of the store
+            uint64_t mask = 0;
+            for (const auto& key : keys) {
+                mask |= uint64_t(1) << shard_of(key);
+            }
+            ShardLocks locks(*this, mask, true);
+            std::shared_lock segments_lock(m_segments_mtx);
+            uint64_t time = now();
+            for (size_t i = 0; i < keys.size(); ++i) {
+                auto found_location = m_shards[shard_of(keys[i])].keydir.find(keys[i]);
+                if (!found_location || !found_location->live(time)) {
+                    continue;
+                }
+                const auto& location = *found_location;
+                const auto& segment = *m_segments.at(location.segment);
+                found.push_back(Found { .index = i, .location = location, .file = segment.file, .mapping = segment.mapping });
+                uint64_t end = location.end();
+                if (m_options.mmap_reads && !unmapped && (!segment.mapping || segment.mapping->capacity() < end)) {
+                    unmapped.emplace(location.segment, end);
+                }
+            }
+        }
+        // same as in find_location. where mapping fails, values are read with pread
+        if (!unmapped || ensure_mapping(unmapped->first, unmapped->second) != 0) {
+            break;
+        }
+    }
+    // read in file order, so the reads are as sequential as possible. all values
+    // which aren't mapped share one buffer, each with its mime and checksum right
+    // behind it, like in the file.
+    std::sort(found.begin(), found.end(), [](const Found& a, const Found& b) {
+        return std::tie(a.location.segment, a.location.value_offset) < std::tie(b.location.segment, b.location.value_offset);
+    });
+    auto is_mapped = [](const Found& entry) {
+        return entry.mapping && entry.mapping->capacity() >= entry.location.end();
+    };
+    // values which are cached don't need to be read. a batch doesn't add to the
+    // cache though, it's a read of many keys once
+    std::vector<ValueCache::Buffer> cached(found.size());
+    uint64_t total = 0;
+    for (size_t i = 0; i < found.size(); ++i) {
+        const auto& entry = found[i];
+        if (is_mapped(entry)) {
+            continue;
+        }
+        if (m_cache) {
+            cached[i] = m_cache->find(keys[entry.index], entry.location);
+        }
+        if (!cached[i]) {
+            total += entry.location.data_size();
+        }
+    }
+    auto buffer = std::make_shared<std::vector<uint8_t>>(total);
+    uint8_t* dest = buffer->data();
+    for (size_t i = 0; i < found.size(); ++i) {
+        const auto& entry = found[i];
+        const auto& location = entry.location;
+        int ret = 0;
+        auto& view = out_values[entry.index].emplace();
+        if (cached[i]) {
+            ret = view_of(location, cached[i]->data(), cached[i], view);
+        } else if (is_mapped(entry)) {
+            const uint8_t* data = entry.mapping->data() + location.value_offset;
+            ret = verify_data(data, location);
+            if (ret != 0) {
+                return ret;
             }
-            ret = entry.read_from_file(m_file);
+            ret = view_of(location, data, entry.mapping, view);
+        } else {
+            size_t size = location.data_size();
+            ret = entry.file->read_at(dest, size, location.value_offset);
             if (ret < 0) {
-                // error
-                spdlog::info("merge: failed due to error reading file: {}", ret);
                 return ret;
             } else if (ret > 0) {
-                spdlog::info("merge: end of file");
-                break;
+                return -EIO;
             }
-            tmp_store.write_entry_impl(entry);
-            ++entries;
+            ret = verify_data(dest, location);
+            if (ret != 0) {
+                return ret;
+            }
+            ret = view_of(location, dest, buffer, view);
+            dest += size;
+        }
+        if (ret != 0) {
+            return ret;
         }
-        std::fflush(tmp_store.m_file);
     }
-    // close the old file, move it, move the new file, remove the old one
-    spdlog::info("merge: closing file \"{}\"", m_filename);
-    std::fclose(m_file);
-
-    // get old file size
-    auto old_size = std::filesystem::file_size(m_filename);
-
-    std::string bak_file = temp_file.string() + ".bak";
-    spdlog::info("merge: moving file \"{}\" -> \"{}\"", m_filename, bak_file);
-    std::filesystem::copy(m_filename, bak_file, std::filesystem::copy_options::overwrite_existing);
-
-    spdlog::info("merge: moving new file \"{}\" -> \"{}\"", temp_file.string(), m_filename);
-    std::filesystem::copy(temp_file, m_filename, std::filesystem::copy_options::overwrite_existing);
-
-    spdlog::info("merge: opening \"{}\" as new kv store", m_filename);
-
-    m_file = std::fopen(m_filename.data(), "a+b");
-
-    // TODO: Restore old file?
-    if (!m_file) {
-        return errno;
+    return 0;
+}
+int KVStore::lookup(const std::string& key, KVValueRef& out_ref, bool keep_encoded, bool partial) {
+    out_ref.m_buffer = nullptr;
+    out_ref.m_mapping_checked = true;
+    out_ref.m_mime.clear();
+    out_ref.m_interned_mime = nullptr;
+    int ret = find_location(key, out_ref.m_location, out_ref.m_file, out_ref.m_mapping);
+    if (ret != 0) {
+        return ret;
     }
-
-    if (entries != m_keydir.size()) {
-        spdlog::info("merge: something went wrong, maybe entries were lost. keeping the old file in the temporary directory.");
-    } else {
-        spdlog::info("merge: removing old file \"{}\"", bak_file);
-        std::filesystem::remove(bak_file);
-        spdlog::info("merge: removing old file \"{}\"", temp_file.string());
-        std::filesystem::remove(temp_file);
+    const KVLocation& location = out_ref.m_location;
+    out_ref.m_size = location.value_size;
+    out_ref.m_encoding = KVEncoding(location.encoding);
+    if (location.mime_id != 0) {
+        out_ref.m_interned_mime = m_mimes.find(location.mime_id);
+        if (!out_ref.m_interned_mime) {
+            spdlog::error("read: unknown mime type {} of value at offset {} of segment {}", location.mime_id, location.value_offset, location.segment);
+            return -EBADMSG;
+        }
     }
-
-    lock.unlock();
-
-    ret = index();
+    bool decode = !keep_encoded && out_ref.m_encoding != KVEncoding::Identity;
+    // replaces the stored value with the decompressed one, in memory
+    auto decode_into_ref = [&](std::span<const uint8_t> stored) {
+        auto decoded = std::make_shared<std::vector<uint8_t>>();
+        int decode_ret = decode_value(location, stored, *decoded);
+        out_ref.m_size = decoded->size();
+        out_ref.m_encoding = KVEncoding::Identity;
+        out_ref.m_buffer = std::move(decoded);
+        return decode_ret;
+    };
+    if (out_ref.m_mapping) {
+        const uint8_t* data = out_ref.m_mapping->data() + location.value_offset;
+        if (partial && !decode) {
+            // touches only the pages which are read, see KVValueRef::read
+            out_ref.m_mime.assign(reinterpret_cast<const char*>(data + location.value_size), location.mime_size);
+            std::memcpy(&out_ref.m_checksum, data + location.value_size + location.mime_size, sizeof(uint32_t));
+            out_ref.m_mapping_checked = false;
+            out_ref.m_checked_size = 0;
+            out_ref.m_partial_checksum = 0;
+            return location.value_size == 0 ? out_ref.check_partial(nullptr, 0) : 0;
+        }
+        ret = verify_data(data, location);
+        if (ret != 0) {
+            return ret;
+        }
+        out_ref.m_mime.assign(reinterpret_cast<const char*>(data + location.value_size), location.mime_size);
+        return decode ? decode_into_ref({ data, location.value_size }) : 0;
+    }
+    if (m_cache) {
+        // values small enough to be cached are read right away
+        ret = read_cached(key, location, *out_ref.m_file, out_ref.m_buffer);
+        if (ret < 0) {
+            return ret;
+        } else if (ret == 0) {
+            out_ref.m_mime.assign(reinterpret_cast<const char*>(out_ref.m_buffer->data() + location.value_size), location.mime_size);
+            return decode ? decode_into_ref({ out_ref.m_buffer->data(), location.value_size }) : 0;
+        }
+    }
+    if (decode) {
+        // only values which were written in one piece are compressed, so this fits in memory
+        std::vector<uint8_t> value;
+        std::string mime;
+        ret = read_location(*out_ref.m_file, location, value, mime);
+        if (ret != 0) {
+            return ret;
+        }
+        if (location.mime_id == 0) {
+            out_ref.m_mime = std::move(mime);
+        }
+        out_ref.m_size = value.size();
+        out_ref.m_encoding = KVEncoding::Identity;
+        out_ref.m_buffer = std::make_shared<const std::vector<uint8_t>>(std::move(value));
+        return 0;
+    }
+    // the value is checked as it's read, see KVValueRef::read
+    out_ref.m_mime.resize(location.mime_size + sizeof(uint32_t));
+    ret = out_ref.m_file->read_at(out_ref.m_mime.data(), out_ref.m_mime.size(), location.value_offset + location.value_size);
     if (ret < 0) {
         return ret;
+    } else if (ret > 0) {
+        return -EIO;
+    }
+    std::memcpy(&out_ref.m_checksum, out_ref.m_mime.data() + location.mime_size, sizeof(uint32_t));
+    out_ref.m_mime.resize(location.mime_size);
+    out_ref.m_checked_size = 0;
+    out_ref.m_partial_checksum = 0;
+    if (location.value_size == 0) {
+        return out_ref.check_partial(nullptr, 0);
     }
-
-    spdlog::info("merge: merged {} entries, reduced store size from {} to {} bytes", entries, old_size, std::filesystem::file_size(m_filename));
     return 0;
 }
-KVStore::~KVStore() {
-    std::unique_lock lock(m_mtx);
-    if (m_file) {
-        std::fclose(m_file);
-        m_file = nullptr;
+const uint8_t* KVStore::KVValueRef::mapped_value() const {
+    if (m_buffer) {
+        return m_buffer->data();
+    }
+    return m_mapping && m_mapping_checked ? m_mapping->data() + m_location.value_offset : nullptr;
+}
+int KVStore::KVValueRef::read(uint64_t offset, void* buffer, size_t size) const {
+    if (offset + size > m_size) {
+        return -EINVAL;
+    }
+    if (const uint8_t* data = mapped_value()) {
+        std::memcpy(buffer, data + offset, size);
+        return 0;
+    }
+    if (m_mapping) {
+        std::memcpy(buffer, m_mapping->data() + m_location.value_offset + offset, size);
+    } else {
+        int ret = m_file->read_at(buffer, size, m_location.value_offset + offset);
+        if (ret > 0) {
+            return -EIO;
+        } else if (ret < 0) {
+            return ret;
+        }
+    }
+    if (offset == m_checked_size) {
+        return check_partial(static_cast<const uint8_t*>(buffer), size);
+    }
+    return 0;
+}
+int KVStore::KVValueRef::check_partial(const uint8_t* data, size_t size) const {
+    m_partial_checksum = crc32c({ data, size }, m_partial_checksum);
+    m_checked_size += size;
+    if (m_checked_size == m_location.value_size) {
+        // only a mime type which isn't interned is part of the checksum
+        auto mime_bytes = std::span(reinterpret_cast<const uint8_t*>(m_mime.data()), m_mime.size());
+        if (crc32c(mime_bytes, m_partial_checksum) != m_checksum) {
+            spdlog::error("read: checksum mismatch in value at offset {} of segment {}", m_location.value_offset, m_location.segment);
+            return -EBADMSG;
+        }
+    }
+    return 0;
+}
+int KVStore::ensure_mapping(uint32_t segment_id, uint64_t end) {
+    std::unique_lock lock(m_segments_mtx);
+    auto iter = m_segments.find(segment_id);
+    if (iter == m_segments.end()) {
+        // merged away in the meantime, the next lookup finds the new segment
+        return 0;
+    }
+    auto& segment = *iter->second;
+    if (segment.mapping && segment.mapping->capacity() >= end) {
+        return 0;
+    }
+    uint64_t capacity;
+    if (segment.sealed) {
+        // sealed segments don't grow, so they're mapped exactly once
+        capacity = segment.size;
+    } else {
+        std::error_code ec;
+        uint64_t file_size = std::filesystem::file_size(segment.filename, ec);
+        if (ec) {
+            return -ec.value();
+        }
+        // map ahead of the end of the file, so that appends don't need a remap every time.
+        // address space is cheap, only the touched pages cost memory.
+        constexpr uint64_t min_capacity = 1024 * 1024;
+        capacity = std::bit_ceil(std::max({ end, file_size, min_capacity }));
+    }
+    // through the open handle, since a merge may already have renamed a new file over the path
+    auto mapping = FileMapping::map(*segment.file, capacity);
+    if (!mapping) {
+        int err = errno;
+        spdlog::info("failed to map \"{}\": {}, falling back to pread", segment.filename, std::strerror(err));
+        return -err;
+    }
+    segment.mapping = std::move(mapping);
+    return 0;
+}
+int KVStore::write_entry(const std::string& key, std::span<const uint8_t> value, const std::string& mime, uint64_t expires_at) {
+    KVWrite entry { .key = key, .value = value, .mime = mime, .expires_at = expires_at };
+    return write_entries({ &entry, 1 });
+}
+int KVStore::write_entries(std::span<const KVWrite> entries) {
+    for (const auto& entry : entries) {
+        if (entry.key.size() > std::numeric_limits<uint32_t>::max() || entry.value.size() > std::numeric_limits<uint32_t>::max()
+            || entry.mime.size() > KeyDir::max_mime_size) {
+            return -EFBIG;
+        }
+    }
+    if (entries.empty()) {
+        return 0;
+    }
+    // mime types are interned by each writer before the group commit too, since
+    // a new one is synced to disk first
+    std::vector<uint32_t> mime_ids(entries.size());
+    uint8_t format = format_checksums;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        mime_ids[i] = entries[i].tombstone ? 0 : m_mimes.intern(entries[i].mime);
+        if (entries[i].tombstone) {
+            format = std::max(format, format_tombstones);
+        } else if (entries[i].expires_at != 0) {
+            format = std::max(format, format_expiry);
+        } else if (mime_ids[i] != 0) {
+            format = std::max(format, format_interned_mimes);
+        }
+    }
+    int ret = require_format(format);
+    if (ret != 0) {
+        return ret;
+    }
+    if (!m_options.compression) {
+        return commit_entries(entries, mime_ids);
+    }
+    // compressed by each writer, before the group commit, so writers don't wait
+    // for each other's compression
+    std::vector<KVWrite> encoded(entries.begin(), entries.end());
+    std::vector<std::vector<uint8_t>> compressed(entries.size());
+    for (size_t i = 0; i < encoded.size(); ++i) {
+        auto& entry = encoded[i];
+        if (entry.tombstone || entry.encoding != KVEncoding::Identity || entry.value.size() < m_options.compression_min_size || !is_compressible_mime(entry.mime)) {
+            continue;
+        }
+        if (gzip_compress(entry.value, compressed[i]) == 0) {
+            entry.value = compressed[i];
+            entry.encoding = KVEncoding::Gzip;
+        }
+    }
+    return commit_entries(encoded, mime_ids);
+}
+int KVStore::delete_entry(const std::string& key) {
+    if (key.size() > std::numeric_limits<uint32_t>::max()) {
+        return -EFBIG;
+    }
+    {
+        const auto& shard = m_shards[shard_of(key)];
+        std::shared_lock lock(shard.mtx);
+        auto found = shard.keydir.find(key);
+        if (!found || !found->live(now())) {
+            return 1;
+        }
     }
+    // a concurrent delete of the same key may write a second tombstone, which is harmless
+    KVWrite tombstone { .key = key, .value = {}, .mime = {}, .tombstone = true };
+    return write_entries({ &tombstone, 1 });
 }
-KVStore::KVStore(const std::string& path) {
-    bool exists = std::filesystem::exists(path);
+int KVStore::commit_entries(std::span<const KVWrite> entries, std::span<const uint32_t> mime_ids) {
+    PendingWrite write { .entries = entries, .mime_ids = mime_ids };
+    std::unique_lock lock(m_commit_mtx);
+    m_commit_queue.push_back(&write);
+    if (m_commit_leader) {
+        // someone else is writing right now, and will pick this up next
+        m_commit_cv.wait(lock, [&] { return write.done; });
+        return write.result;
+    }
+    m_commit_leader = true;
+    while (!m_commit_queue.empty()) {
+        std::vector<PendingWrite*> group;
+        std::swap(group, m_commit_queue);
+        lock.unlock();
 
-    m_filename = path;
+        int ret;
+        {
+            std::unique_lock write_lock(m_mtx);
+            ret = write_group(group);
+        }
 
-    if (!exists || std::filesystem::file_size(path) == 0) {
-        m_file = std::fopen(fmt::format("{}.kvs", path).c_str(), "w+b");
-        if (!m_file) {
-            throw std::runtime_error(fmt::format("could not create file '{}': {}", path, std::strerror(errno)));
+        lock.lock();
+        for (auto* pending : group) {
+            // failed conditions are set by write_group already
+            if (ret != 0) {
+                pending->result = ret;
+            }
+            pending->done = true;
         }
-        KVHeader hdr;
-        hdr.set_version(PRJ_VERSION_MAJOR, PRJ_VERSION_MINOR, PRJ_VERSION_PATCH);
-        int ret = hdr.write_to_file(m_file);
-        if (ret < 0) {
-            throw std::runtime_error(fmt::format("could not write header into new file '{}': {}", path, std::strerror(errno)));
+        m_commit_cv.notify_all();
+    }
+    m_commit_leader = false;
+    return write.result;
+}
+int KVStore::write_group(const std::vector<PendingWrite*>& group) {
+    size_t entry_count = 0;
+    for (const auto* pending : group) {
+        entry_count += pending->entries.size();
+    }
+    // slices point into these, so they mustn't reallocate
+    std::vector<std::array<KVSize, 4>> heads;
+    heads.reserve(entry_count);
+    std::vector<uint64_t> expiries;
+    expiries.reserve(entry_count);
+    std::vector<KVSize> checksums;
+    checksums.reserve(entry_count);
+    std::vector<std::span<const uint8_t>> slices;
+    slices.reserve(entry_count * 6);
+    std::vector<KVLocation> locations;
+    locations.reserve(entry_count);
+    if (m_append_file->size() >= m_options.segment_size) {
+        int ret = roll_over();
+        if (ret != 0) {
+            return ret;
         }
-    } else {
-        m_file = std::fopen(path.c_str(), "a+b");
-        if (!m_file) {
-            throw std::runtime_error(fmt::format("could not create file '{}': {}", path, std::strerror(errno)));
+    }
+    // the locations written by this group so far, for the conditions of later writes.
+    // only kept if there are any
+    bool conditional = false;
+    for (const auto* pending : group) {
+        for (const auto& entry : pending->entries) {
+            conditional = conditional || entry.condition.exists;
         }
     }
-    if (!KVHeader::is_header(m_file)) {
-        spdlog::info("file has no header, must be a kvstore from before v2.0.0.");
-        // TODO: convert from old to new format
-        assert(!"not implemented");
+    std::map<std::string_view, KVLocation> group_locations;
+    uint64_t time = now();
+    uint64_t offset = m_append_file->size();
+    for (auto* pending : group) {
+        if (conditional) {
+            bool holds = true;
+            for (const auto& entry : pending->entries) {
+                if (!entry.condition.exists) {
+                    continue;
+                }
+                std::optional<KVLocation> current;
+                if (auto written = group_locations.find(entry.key); written != group_locations.end()) {
+                    current = written->second;
+                } else {
+                    const auto& shard = m_shards[shard_of(entry.key)];
+                    std::shared_lock lock(shard.mtx);
+                    current = shard.keydir.find(entry.key);
+                }
+                holds = holds && condition_holds(entry.condition, current, time);
+            }
+            if (!holds) {
+                pending->result = 1;
+                continue;
+            }
+        }
+        for (size_t i = 0; i < pending->entries.size(); ++i) {
+            const auto& entry = pending->entries[i];
+            uint32_t mime_id = pending->mime_ids[i];
+            auto value = entry.tombstone ? std::span<const uint8_t>() : entry.value;
+            auto mime_size = entry.tombstone || mime_id != 0 ? 0 : entry.mime.size();
+            KVEntry header;
+            header.set_head(entry.key, KVLocation {
+                                           .value_offset = 0,
+                                           .value_size = static_cast<uint32_t>(value.size()),
+                                           .mime_size = static_cast<uint32_t>(mime_size),
+                                           .segment = 0,
+                                           .encoding = uint8_t(entry.tombstone ? KVEncoding::Identity : entry.encoding),
+                                           .mime_id = mime_id,
+                                           .tombstone = entry.tombstone,
+                                           .expires_at = entry.tombstone ? 0 : entry.expires_at,
+                                       });
+            locations.push_back(header.location_at(m_active_id, offset));
+            offset = locations.back().end();
+
+            std::span<const uint8_t> mime(reinterpret_cast<const uint8_t*>(entry.mime.data()), mime_size);
+            auto& checksum = checksums.emplace_back();
+            checksum.value = crc32c(mime, crc32c(value));
+            locations.back().checksum = checksum.value;
+            if (conditional) {
+                group_locations.insert_or_assign(entry.key, locations.back());
+            }
+            const auto& head = heads.emplace_back(header.head());
+            slices.emplace_back(head.front().bytes, sizeof(head));
+            slices.emplace_back(reinterpret_cast<const uint8_t*>(entry.key.data()), entry.key.size());
+            const auto& expires_at = expiries.emplace_back(header.expires_at);
+            slices.emplace_back(reinterpret_cast<const uint8_t*>(&expires_at), header.expiry().size());
+            slices.push_back(value);
+            slices.push_back(mime);
+            slices.emplace_back(checksum.bytes, sizeof(checksum));
+        }
+    }
+    if (locations.empty()) {
+        return 0;
+    }
+    // offsets only grow, so the last one is the largest
+    if (locations.back().value_offset > KeyDir::max_value_offset) {
+        spdlog::error("write: segment {} is full at {} bytes", m_active_id, m_append_file->size());
+        return -EFBIG;
+    }
+    uint64_t start = m_append_file->size();
+    int ret = m_append_file->append(slices);
+    if (ret == 0) {
+        ret = sync_after_write();
+        if (ret != 0) {
+            // the entries must not come back on the next start, after their writers were
+            // told they failed. append already cuts them off if it fails itself
+            int truncate_ret = m_append_file->truncate(start);
+            if (truncate_ret != 0) {
+                spdlog::info("write: failed to roll back {} unsynced entries: {}", entry_count, std::strerror(-truncate_ret));
+            }
+        }
+    }
+    if (ret != 0) {
+        spdlog::info("write: failed to write {} entries: {}", entry_count, std::strerror(-ret));
+        return ret;
+    }
+    // the entries reached the OS, so they can be published. all at once, so
+    // a batch is either entirely visible to readers or not at all
+    uint64_t mask = 0;
+    for (const auto* pending : group) {
+        for (const auto& entry : pending->entries) {
+            mask |= uint64_t(1) << shard_of(entry.key);
+        }
+    }
+    ShardLocks locks(*this, mask, false);
+    std::shared_lock segments_lock(m_segments_mtx);
+    auto location = locations.begin();
+    for (const auto* pending : group) {
+        if (pending->result != 0) {
+            continue;
+        }
+        for (const auto& entry : pending->entries) {
+            if (entry.out_version) {
+                *entry.out_version = location->version();
+            }
+            set_location(entry.key, *location++);
+        }
+    }
+    return 0;
+}
+bool KVStore::condition_holds(const KVCondition& condition, const std::optional<KVLocation>& location, uint64_t now) {
+    if (!condition.exists) {
+        return true;
+    }
+    if (!location || !location->live(now)) {
+        return false;
+    }
+    return condition.versions.empty() || std::find(condition.versions.begin(), condition.versions.end(), location->version()) != condition.versions.end();
+}
+size_t KVStore::shard_of(std::string_view key) {
+    // the key dir uses the low and high bits of the same hash, so mix it first
+    return static_cast<size_t>((uint64_t(std::hash<std::string_view> {}(key)) * 0x9e3779b97f4a7c15) >> (64 - keydir_shard_bits));
+}
+KVStore::ShardLocks::ShardLocks(const KVStore& store, uint64_t mask, bool shared)
+    : m_store(store)
+    , m_mask(mask)
+    , m_shared(shared) {
+    // always in ascending order, so two holders of several shards can't deadlock
+    for (size_t i = 0; i < keydir_shards; ++i) {
+        if (m_mask & (uint64_t(1) << i)) {
+            if (m_shared) {
+                m_store.m_shards[i].mtx.lock_shared();
+            } else {
+                m_store.m_shards[i].mtx.lock();
+            }
+        }
+    }
+}
+KVStore::ShardLocks::~ShardLocks() {
+    for (size_t i = 0; i < keydir_shards; ++i) {
+        if (m_mask & (uint64_t(1) << i)) {
+            if (m_shared) {
+                m_store.m_shards[i].mtx.unlock_shared();
+            } else {
+                m_store.m_shards[i].mtx.unlock();
+            }
+        }
+    }
+}
+void KVStore::set_location(std::string_view key, const KVLocation& location) {
+    auto previous = m_shards[shard_of(key)].keydir.insert_or_assign(key, location);
+    if (previous) {
+        // the previous entry is dead now
+        m_segments.at(previous->segment)->live_bytes -= previous->entry_size(key.size());
+    }
+    m_segments.at(location.segment)->live_bytes += location.entry_size(key.size());
+    // overwrites, by far the most common write, don't touch the index
+    bool existed = previous && !previous->tombstone;
+    if (m_options.ordered_index && existed == location.tombstone) {
+        std::unique_lock index_lock(m_index_mtx);
+        if (location.tombstone) {
+            m_index.erase(key);
+        } else {
+            m_index.insert(key);
+        }
+    }
+    if (m_cache) {
+        // the old value would never be found again anyway, this only frees it early
+        m_cache->erase(key);
+    }
+    if (location.expires_at != 0) {
+        m_expiring = true;
+        {
+            // a key which has a timer already keeps it. it's moved on when it fires, if the
+            // key expires later by then
+            std::unique_lock expiry_lock(m_expiry_mtx);
+            m_wheel.add(key, location.expires_at);
+        }
+        std::call_once(m_expiry_started, [this] { m_expiry_thread = std::thread(&KVStore::expiry_thread_main, this); });
+    }
+}
+uint64_t KVStore::now() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+}
+void KVStore::expiry_thread_main() {
+    std::unique_lock lock(m_expiry_mtx);
+    std::vector<TimerWheel::Timer> due;
+    while (!m_expiry_stop) {
+        m_expiry_cv.wait_for(lock, m_options.expiry_interval, [&] { return m_expiry_stop; });
+        if (m_expiry_stop) {
+            break;
+        }
+        due.clear();
+        m_wheel.advance(now(), due);
+        if (due.empty()) {
+            continue;
+        }
+        lock.unlock();
+        evict_expired(due);
+        lock.lock();
+    }
+}
+void KVStore::evict_expired(std::vector<TimerWheel::Timer>& timers) {
+    uint64_t time = now();
+    uint64_t evicted = 0;
+    for (auto& timer : timers) {
+        auto& shard = m_shards[shard_of(timer.key)];
+        std::unique_lock lock(shard.mtx);
+        auto location = shard.keydir.find(timer.key);
+        // overwritten since, by an entry which doesn't expire
+        if (!location || location->tombstone || location->expires_at == 0) {
+            continue;
+        }
+        if (!location->expired(time)) {
+            // overwritten by an entry which expires later, or the clock went back
+            std::unique_lock expiry_lock(m_expiry_mtx);
+            m_wheel.add(timer.key, std::max(location->expires_at, timer.due));
+            continue;
+        }
+        // an older entry of the key would come back, the next merge drops both
+        if (!location->evictable) {
+            continue;
+        }
+        shard.keydir.erase(timer.key);
+        {
+            std::shared_lock segments_lock(m_segments_mtx);
+            m_segments.at(location->segment)->live_bytes -= location->entry_size(timer.key.size());
+        }
+        if (m_options.ordered_index) {
+            std::unique_lock index_lock(m_index_mtx);
+            m_index.erase(timer.key);
+        }
+        if (m_cache) {
+            m_cache->erase(timer.key);
+        }
+        ++evicted;
+    }
+    m_evicted_keys += evicted;
+}
+int KVStore::sync_after_write() {
+    switch (m_options.durability) {
+    case KVDurability::None:
+        return 0;
+    case KVDurability::Batch:
+        return m_options.sync_hook ? m_options.sync_hook(*m_append_file) : m_append_file->sync();
+    case KVDurability::Interval: {
+        std::unique_lock lock(m_sync_mtx);
+        m_sync_dirty = true;
+        return 0;
+    }
+    default:
+        return 0;
+    }
+}
+void KVStore::sync_thread_main() {
+    std::unique_lock lock(m_sync_mtx);
+    while (!m_sync_stop) {
+        m_sync_cv.wait_for(lock, m_options.sync_interval, [&] { return m_sync_stop; });
+        if (!m_sync_dirty) {
+            continue;
+        }
+        m_sync_dirty = false;
+        lock.unlock();
+        std::shared_ptr<AppendFile> file;
+        {
+            std::unique_lock write_lock(m_mtx);
+            file = m_append_file;
+        }
+        // runs alongside new appends
+        int ret = file->sync();
+        if (ret != 0) {
+            spdlog::error("sync: failed to sync \"{}\": {}", m_filename, std::strerror(-ret));
+        }
+        lock.lock();
+    }
+}
+int KVStore::begin_entry(const std::string& key, uint32_t value_size, const std::string& mime, KVEntryWriter& out_writer, uint64_t expires_at, const KVCondition& condition) {
+    assert(!out_writer.m_store);
+    if (key.size() > std::numeric_limits<uint32_t>::max() || mime.size() > KeyDir::max_mime_size) {
+        return -EFBIG;
+    }
+    if (condition.exists) {
+        const auto& shard = m_shards[shard_of(key)];
+        std::shared_lock shard_lock(shard.mtx);
+        if (!condition_holds(condition, shard.keydir.find(key), now())) {
+            return 1;
+        }
+    }
+    out_writer.m_buffer.clear();
+    out_writer.m_spill = nullptr;
+    if (value_size > max_buffered_value) {
+        out_writer.m_spill = AppendFile::create_temporary(m_filename + ".upload");
+        if (!out_writer.m_spill) {
+            int err = errno;
+            spdlog::error("write: failed to create a spill file for \"{}\": {}", key, std::strerror(err));
+            return -err;
+        }
+    } else {
+        out_writer.m_buffer.reserve(value_size);
+    }
+    out_writer.m_store = this;
+    out_writer.m_key = key;
+    out_writer.m_mime = mime;
+    out_writer.m_value_size = value_size;
+    out_writer.m_expires_at = expires_at;
+    out_writer.m_exists = condition.exists;
+    out_writer.m_versions.assign(condition.versions.begin(), condition.versions.end());
+    out_writer.m_checksum = 0;
+    return 0;
+}
+int KVStore::KVEntryWriter::append(std::span<const uint8_t> chunk) {
+    if (!m_store) {
+        return -EINVAL;
+    }
+    uint64_t written = m_spill ? m_spill->size() : m_buffer.size();
+    if (written + chunk.size() > m_value_size) {
+        spdlog::info("write: entry \"{}\" is larger than announced ({} bytes)", m_key, m_value_size);
+        reset();
+        return -EINVAL;
+    }
+    if (m_spill) {
+        int ret = m_spill->append({ &chunk, 1 });
+        if (ret != 0) {
+            reset();
+            return ret;
+        }
+        m_checksum = crc32c(chunk, m_checksum);
+    } else {
+        m_buffer.insert(m_buffer.end(), chunk.begin(), chunk.end());
+    }
+    return 0;
+}
+int KVStore::KVEntryWriter::commit() {
+    if (!m_store) {
+        return -EINVAL;
+    }
+    uint64_t written = m_spill ? m_spill->size() : m_buffer.size();
+    if (written != m_value_size) {
+        spdlog::info("write: entry \"{}\" is smaller than announced ({} of {} bytes)", m_key, written, m_value_size);
+        reset();
+        return -EINVAL;
+    }
+    KVStore& store = *m_store;
+    KVCondition condition { .exists = m_exists, .versions = m_versions };
+    if (!m_spill) {
+        // a small value goes through the group commit, like any other write
+        KVWrite write { .key = m_key, .value = m_buffer, .mime = m_mime, .expires_at = m_expires_at, .condition = condition, .out_version = &m_version };
+        int ret = store.write_entries({ &write, 1 });
+        reset();
+        return ret;
+    }
+
+    uint32_t mime_id = store.m_mimes.intern(m_mime);
+    if (mime_id != 0) {
+        m_mime.clear();
+    }
+    uint8_t format = m_expires_at != 0 ? format_expiry : mime_id != 0 ? format_interned_mimes : format_checksums;
+    int format_ret = store.require_format(format);
+    if (format_ret != 0) {
+        reset();
+        return format_ret;
+    }
+    // only now the entry is written, in one go
+    std::unique_lock lock(store.m_mtx);
+    if (m_exists) {
+        const auto& shard = store.m_shards[shard_of(m_key)];
+        std::shared_lock shard_lock(shard.mtx);
+        if (!condition_holds(condition, shard.keydir.find(m_key), now())) {
+            lock.unlock();
+            reset();
+            return 1;
+        }
+    }
+    if (store.m_append_file->size() >= store.m_options.segment_size) {
+        int ret = store.roll_over();
+        if (ret != 0) {
+            lock.unlock();
+            reset();
+            return ret;
+        }
+    }
+    AppendFile& file = *store.m_append_file;
+    uint64_t offset = file.size();
+    KVEntry entry;
+    entry.set_head(m_key, KVLocation {
+                              .value_offset = 0,
+                              .value_size = m_value_size,
+                              .mime_size = static_cast<uint32_t>(m_mime.size()),
+                              .segment = 0,
+                              .mime_id = mime_id,
+                              .expires_at = m_expires_at,
+                          });
+    if (entry.location_at(store.m_active_id, offset).value_offset > KeyDir::max_value_offset) {
+        spdlog::error("write: segment {} is full at {} bytes", store.m_active_id, offset);
+        lock.unlock();
+        reset();
+        return -EFBIG;
+    }
+    auto head = entry.head();
+    std::array<std::span<const uint8_t>, 3> head_slices {
+        std::span<const uint8_t>(head.front().bytes, sizeof(head)),
+        std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(m_key.data()), m_key.size()),
+        entry.expiry(),
+    };
+    int ret = file.append(head_slices);
+    // the value, copied over from the spill file
+    std::vector<uint8_t> buffer(std::min<uint64_t>(m_value_size, 1024 * 1024));
+    for (uint64_t copied = 0; ret == 0 && copied < m_value_size; copied += buffer.size()) {
+        std::span<const uint8_t> piece = std::span(buffer).first(std::min<uint64_t>(buffer.size(), m_value_size - copied));
+        ret = m_spill->read_at(buffer.data(), piece.size(), copied);
+        if (ret > 0) {
+            ret = -EIO;
+        } else if (ret == 0) {
+            ret = file.append({ &piece, 1 });
+        }
+    }
+    std::span<const uint8_t> mime(reinterpret_cast<const uint8_t*>(m_mime.data()), m_mime.size());
+    KVSize checksum;
+    checksum.value = crc32c(mime, m_checksum);
+    if (ret == 0) {
+        std::array<std::span<const uint8_t>, 2> slices { mime, std::span<const uint8_t>(checksum.bytes, sizeof(checksum)) };
+        ret = file.append(slices);
+    }
+    if (ret == 0) {
+        ret = store.sync_after_write();
+    }
+    if (ret != 0) {
+        // cut the partial entry off again, so the next entry starts where this one did
+        int truncate_ret = file.truncate(offset);
+        if (truncate_ret != 0) {
+            spdlog::info("write: failed to roll back partial entry \"{}\": {}", m_key, std::strerror(-truncate_ret));
+        }
+        lock.unlock();
+        reset();
+        return ret;
+    }
+    KVLocation location = entry.location_at(store.m_active_id, offset);
+    location.checksum = checksum.value;
+    {
+        std::unique_lock shard_lock(store.m_shards[shard_of(m_key)].mtx);
+        std::shared_lock segments_lock(store.m_segments_mtx);
+        store.set_location(m_key, location);
+    }
+    lock.unlock();
+    m_version = location.version();
+    reset();
+    return 0;
+}
+void KVStore::KVEntryWriter::reset() {
+    // the store only ever sees whole entries, there's nothing to roll back
+    m_store = nullptr;
+    m_spill = nullptr;
+    m_buffer = {};
+}
+KVStore::KVEntryWriter::~KVEntryWriter() {
+    reset();
+}
+int KVStore::index_impl(ShardedKeyDir& keydir) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::shared_ptr<Segment>> segments;
+    {
+        std::shared_lock lock(m_segments_mtx);
+        for (const auto& [id, segment] : m_segments) {
+            segments.push_back(segment);
+        }
+    }
+    spdlog::info("index: collecting kv entries...");
+    // oldest segment first, so newer entries replace older ones
+    for (const auto& segment : segments) {
+        int ret = index_segment(*segment, keydir);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    size_t count = 0;
+    for (const auto& shard : keydir) {
+        count += shard.size();
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    spdlog::info("index: collected {} kv entries from {} segments in {} ms", count, segments.size(), ms);
+    return 0;
+}
+int KVStore::index_segment(Segment& segment, ShardedKeyDir& keydir) {
+    uint64_t offset = header_size;
+    std::vector<std::pair<std::string, KVLocation>> records;
+    if (load_hint(segment, records, offset) == 0) {
+        spdlog::info("index: loaded {} kv entries from hint file of \"{}\", scanning from offset {}", records.size(), segment.filename, offset);
+        for (auto& shard : keydir) {
+            shard.reserve(shard.size() + records.size() / keydir_shards);
+        }
+        for (const auto& [key, location] : records) {
+            keydir[shard_of(key)].insert_or_assign(key, location);
+        }
+    } else {
+        offset = header_size;
+    }
+    segment.hint_end = offset;
+    uint64_t file_size = segment_end(segment);
+    std::FILE* file = std::fopen(segment.filename.c_str(), "rb");
+    if (!file) {
+        return -errno;
+    }
+    if (!KVHeader::is_header(file)) {
+        spdlog::info("index: \"{}\" is not a kv store file", segment.filename);
+        std::fclose(file);
+        return -EINVAL;
+    }
+    int ret = file_seek(file, offset);
+    KVEntry entry;
+    uint64_t scanned = 0;
+    // entries which were torn by a crash can only be at the end of the active segment.
+    // there, values are checked too, everywhere else they're skipped and checked on read.
+    // a bad key or length means the rest of the file can't be parsed, a bad value only
+    // that the entry is broken, unless it's the last one
+    bool active = !segment.sealed;
+    bool corrupt = false;
+    while (ret == 0 && offset < file_size) {
+        ret = entry.read_key_from_file(file, file_size - offset);
+        if (ret == -EBADMSG || ret > 0) {
+            corrupt = true;
+            ret = 0;
+            break;
+        } else if (ret < 0) {
+            // error
+            spdlog::info("index: error reading from file: {}", std::strerror(-ret));
+            break;
+        }
+        auto location = entry.location_at(segment.id, offset);
+        uint64_t end = location.end();
+        if (end > file_size) {
+            corrupt = true;
+            break;
+        }
+        if (location.value_offset > KeyDir::max_value_offset) {
+            spdlog::error("index: \"{}\" is larger than a segment can be", segment.filename);
+            ret = -EFBIG;
+            break;
+        }
+        if (active) {
+            ret = verify_data_in_file(file, location, location.checksum);
+            if (ret == -EBADMSG && end < file_size) {
+                // reads of it fail, rather than return an older value
+                spdlog::error("index: \"{}\" has a corrupt value at offset {}", segment.filename, offset);
+                ret = 0;
+            } else if (ret == -EBADMSG || ret > 0) {
+                corrupt = true;
+                ret = 0;
+                break;
+            } else if (ret < 0) {
+                spdlog::info("index: error reading from file: {}", std::strerror(-ret));
+                break;
+            }
+        } else {
+            // only the key and the checksum are needed, skip over value and mime without reading them
+            ret = file_seek(file, end - sizeof(location.checksum));
+            if (ret == 0) {
+                ret = file_read(&location.checksum, sizeof(location.checksum), file);
+            }
+        }
+        keydir[shard_of(entry.key)].insert_or_assign(entry.key, location);
+        offset = end;
+        ++scanned;
+    }
+    std::fclose(file);
+    spdlog::info("index: end of \"{}\", scanned {} entries ({} bytes)", segment.filename, scanned, offset - segment.hint_end);
+    if (active) {
+        m_good_end = offset;
+    }
+    if (corrupt && active) {
+        // cut the torn entry off, so new entries don't land behind it
+        spdlog::error("index: \"{}\" has a corrupt entry at offset {}, truncating {} bytes", segment.filename, offset, file_size - offset);
+        ret = m_append_file->truncate(offset);
+        if (ret == 0) {
+            m_truncated_bytes += file_size - offset;
+        }
+    } else if (corrupt) {
+        spdlog::error("index: \"{}\" has a corrupt entry at offset {}, ignoring the {} bytes after it", segment.filename, offset, file_size - offset);
+    }
+    return ret;
+}
+template <typename Records>
+static int write_hint_file(const std::string& path, uint64_t end, const Records& records) {
+    auto temp_path = path + ".kv_temporary";
+    std::FILE* temp = std::fopen(temp_path.c_str(), "wb");
+    if (!temp) {
+        return -errno;
+    }
+    std::fclose(temp);
+    auto file = AppendFile::open(temp_path);
+    if (!file) {
+        int err = errno;
+        std::filesystem::remove(temp_path);
+        return -err;
+    }
+    // records are collected in a buffer and appended whenever it's full
+    constexpr size_t buffer_size = 1024 * 1024;
+    std::vector<uint8_t> buffer;
+    buffer.reserve(buffer_size);
+    auto put = [&](const void* data, size_t size) {
+        const auto* bytes = static_cast<const uint8_t*>(data);
+        buffer.insert(buffer.end(), bytes, bytes + size);
+    };
+    auto flush = [&] {
+        std::span<const uint8_t> slice(buffer);
+        int ret = file->append({ &slice, 1 });
+        buffer.clear();
+        return ret;
+    };
+    int ret = 0;
+    uint64_t count = records.size();
+    put(hint_magic.data(), hint_magic.size());
+    put(&end, sizeof(end));
+    put(&count, sizeof(count));
+    for (const auto& [key, location] : records) {
+        uint32_t key_length = static_cast<uint32_t>(key.size());
+        put(&key_length, sizeof(key_length));
+        put(&location.value_size, sizeof(location.value_size));
+        uint32_t mime_word = location.mime_word();
+        put(&mime_word, sizeof(mime_word));
+        put(&location.checksum, sizeof(location.checksum));
+        put(&location.value_offset, sizeof(location.value_offset));
+        if (location.expires_at != 0) {
+            put(&location.expires_at, sizeof(location.expires_at));
+        }
+        put(key.data(), key.size());
+        if (buffer.size() >= buffer_size) {
+            ret = flush();
+            if (ret != 0) {
+                break;
+            }
+        }
+    }
+    if (ret == 0) {
+        ret = flush();
+    }
+    // the hints have to be on disk before they replace the old ones
+    if (ret == 0) {
+        ret = file->sync();
+    }
+    file = nullptr;
+    if (ret != 0) {
+        spdlog::info("hint: failed to write \"{}\": {}", temp_path, std::strerror(-ret));
+        std::filesystem::remove(temp_path);
+        return ret;
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp_path, path, ec);
+    if (ec) {
+        spdlog::info("hint: failed to move \"{}\" into place: {}", temp_path, ec.message());
+        std::filesystem::remove(temp_path);
+        return -ec.value();
+    }
+    return 0;
+}
+// writes the manifest of a merge whose temporary file is complete, before it's moved into
+// place. once the manifest is on disk, a merge which was cut short by a crash is finished
+// on the next start, so the inputs don't outlive the entries it dropped.
+static int write_merge_manifest(const std::string& path, uint32_t output_id, const std::vector<uint32_t>& inputs, const std::string& temp_name) {
+    std::vector<uint8_t> buffer;
+    auto put = [&](const void* data, size_t size) {
+        const auto* bytes = static_cast<const uint8_t*>(data);
+        buffer.insert(buffer.end(), bytes, bytes + size);
+    };
+    uint32_t count = static_cast<uint32_t>(inputs.size());
+    uint32_t name_length = static_cast<uint32_t>(temp_name.size());
+    put(merge_magic.data(), merge_magic.size());
+    put(&output_id, sizeof(output_id));
+    put(&count, sizeof(count));
+    put(inputs.data(), inputs.size() * sizeof(uint32_t));
+    put(&name_length, sizeof(name_length));
+    put(temp_name.data(), temp_name.size());
+    uint32_t checksum = crc32c(buffer);
+    put(&checksum, sizeof(checksum));
+
+    std::FILE* created = std::fopen(path.c_str(), "wb");
+    if (!created) {
+        return -errno;
+    }
+    std::fclose(created);
+    auto file = AppendFile::open(path);
+    int ret = file ? 0 : -errno;
+    if (ret == 0) {
+        std::span<const uint8_t> slice(buffer);
+        ret = file->append({ &slice, 1 });
+    }
+    if (ret == 0) {
+        ret = file->sync();
+    }
+    file = nullptr;
+    if (ret == 0) {
+        ret = sync_directory(directory_of(path));
+    }
+    if (ret != 0) {
+        std::filesystem::remove(path);
+    }
+    return ret;
+}
+// returns 1 if there's no manifest, -EBADMSG if it's torn, negative errno on error, otherwise 0
+static int read_merge_manifest(const std::string& path, uint32_t& out_output_id, std::vector<uint32_t>& out_inputs, std::string& out_temp_name) {
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+        return errno == ENOENT ? 1 : -errno;
+    }
+    std::vector<uint8_t> buffer;
+    std::array<uint8_t, 4096> chunk;
+    size_t n;
+    while ((n = std::fread(chunk.data(), 1, chunk.size(), file)) > 0) {
+        buffer.insert(buffer.end(), chunk.begin(), chunk.begin() + static_cast<std::ptrdiff_t>(n));
+    }
+    bool failed = std::ferror(file) != 0;
+    std::fclose(file);
+    if (failed) {
+        return -EIO;
+    }
+    size_t offset = 0;
+    auto get = [&](void* data, size_t size) {
+        if (buffer.size() - offset < size) {
+            return false;
+        }
+        std::memcpy(data, buffer.data() + offset, size);
+        offset += size;
+        return true;
+    };
+    std::array<uint8_t, 8> magic;
+    uint32_t count = 0;
+    uint32_t name_length = 0;
+    uint32_t checksum = 0;
+    if (!get(magic.data(), magic.size()) || magic != merge_magic || !get(&out_output_id, sizeof(out_output_id))
+        || !get(&count, sizeof(count)) || buffer.size() - offset < uint64_t(count) * sizeof(uint32_t)) {
+        return -EBADMSG;
+    }
+    out_inputs.resize(count);
+    if (!get(out_inputs.data(), out_inputs.size() * sizeof(uint32_t)) || !get(&name_length, sizeof(name_length))
+        || buffer.size() - offset < name_length) {
+        return -EBADMSG;
+    }
+    out_temp_name.assign(reinterpret_cast<const char*>(buffer.data() + offset), name_length);
+    offset += name_length;
+    size_t checked = offset;
+    if (!get(&checksum, sizeof(checksum)) || offset != buffer.size() || crc32c({ buffer.data(), checked }) != checksum) {
+        return -EBADMSG;
+    }
+    return 0;
+}
+int KVStore::recover_merge() {
+    auto path = merge_manifest_path(m_filename);
+    uint32_t output_id = 0;
+    std::vector<uint32_t> inputs;
+    std::string temp_name;
+    int ret = read_merge_manifest(path, output_id, inputs, temp_name);
+    if (ret == 1) {
+        return 0;
+    }
+    auto dir = directory_of(m_filename);
+    auto empty_file = segment_filename(0) + ".kv_temporary_empty";
+    std::error_code ec;
+    if (ret == -EBADMSG) {
+        // torn while it was written, so nothing was moved yet
+        spdlog::info("merge: ignoring torn manifest \"{}\"", path);
+    } else if (ret != 0) {
+        return ret;
+    } else if (auto temp_file = (std::filesystem::path(dir) / temp_name).string(); std::filesystem::exists(temp_file)) {
+        // the merged file wasn't moved into place, the inputs are all still there
+        spdlog::info("merge: discarding \"{}\" of an interrupted merge", temp_file);
+        std::filesystem::remove(temp_file, ec);
+        std::filesystem::remove(hint_path(temp_file), ec);
+        std::filesystem::remove(empty_file, ec);
+    } else {
+        // the merged file replaced the newest input, so the others are finished off, or
+        // the keys it dropped would come back from them
+        auto output_filename = segment_filename(output_id);
+        spdlog::info("merge: finishing interrupted merge into \"{}\"", output_filename);
+        if (std::filesystem::exists(hint_path(temp_file))) {
+            std::filesystem::rename(hint_path(temp_file), hint_path(output_filename), ec);
+        }
+        for (uint32_t id : inputs) {
+            if (id == output_id) {
+                continue;
+            }
+            auto filename = segment_filename(id);
+            std::filesystem::remove(hint_path(filename), ec);
+            if (id != 0) {
+                std::filesystem::remove(filename, ec);
+            } else if (std::filesystem::exists(empty_file)) {
+                // with the format of the first segment it replaces
+                int format_ret = write_format(empty_file, std::get<1>(m_header.get_version()));
+                ec = std::error_code(-format_ret, std::generic_category());
+                if (!ec) {
+                    std::filesystem::rename(empty_file, filename, ec);
+                }
+            }
+            if (ec) {
+                spdlog::error("merge: failed to remove merged segment \"{}\": {}", filename, ec.message());
+                return -ec.value();
+            }
+        }
+    }
+    ret = sync_directory(dir);
+    if (ret == 0) {
+        std::filesystem::remove(path, ec);
+        ret = ec ? -ec.value() : sync_directory(dir);
+    }
+    return ret;
+}
+int KVStore::write_hints() {
+    // hints from a keydir which is missing keys would hide them on the next start
+    if (!m_indexed) {
+        return -EINVAL;
+    }
+    std::vector<std::shared_ptr<Segment>> segments;
+    {
+        std::shared_lock lock(m_segments_mtx);
+        for (const auto& [id, segment] : m_segments) {
+            uint64_t end = segment_end(*segment);
+            if (end != segment->hint_end && end > header_size) {
+                segments.push_back(segment);
+            }
+        }
+    }
+    if (segments.empty()) {
+        return 0;
+    }
+    // the hints of a segment are the keys whose latest entry is in it. older entries
+    // are left out, they're replaced by newer segments when indexing anyway.
+    std::map<uint32_t, std::vector<std::pair<std::string_view, KVLocation>>> records;
+    for (const auto& segment : segments) {
+        records[segment->id];
+    }
+    // the keys are views into the keydir, so it must not change until they're written
+    ShardLocks locks(*this, all_shards, true);
+    for (const auto& shard : m_shards) {
+        shard.keydir.for_each([&](std::string_view key, const KVLocation& location) {
+            auto iter = records.find(location.segment);
+            if (iter != records.end()) {
+                iter->second.emplace_back(key, location);
+            }
+        });
+    }
+    for (const auto& segment : segments) {
+        uint64_t end = segment_end(*segment);
+        int ret = write_hint_file(hint_path(segment->filename), end, records[segment->id]);
+        if (ret != 0) {
+            return ret;
+        }
+        segment->hint_end = end;
+    }
+    return 0;
+}
+int KVStore::load_hint(const Segment& segment, std::vector<std::pair<std::string, KVLocation>>& out_records, uint64_t& out_end) {
+    auto path = hint_path(segment.filename);
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+        return 1;
+    }
+    std::vector<char> file_buffer(1024 * 1024);
+    std::setvbuf(file, file_buffer.data(), _IOFBF, file_buffer.size());
+    // the record with the highest offset, to check against the segment
+    size_t last = 0;
+    auto read_hints = [&]() -> std::string_view {
+        std::array<uint8_t, 8> magic;
+        uint64_t end = 0;
+        uint64_t count = 0;
+        if (file_read(magic.data(), magic.size(), file) != 0 || magic != hint_magic
+            || file_read(&end, sizeof(end), file) != 0 || file_read(&count, sizeof(count), file) != 0) {
+            return "invalid header";
+        }
+        // the segment was truncated or replaced since the hints were written
+        if (end < header_size || end > segment_end(segment)) {
+            return "hints don't match the store";
+        }
+        out_records.reserve(count);
+        for (uint64_t i = 0; i < count; ++i) {
+            uint32_t key_length;
+            uint32_t mime_word;
+            KVLocation location;
+            location.segment = segment.id;
+            if (file_read(&key_length, sizeof(key_length), file) != 0
+                || file_read(&location.value_size, sizeof(location.value_size), file) != 0
+                || file_read(&mime_word, sizeof(mime_word), file) != 0
+                || file_read(&location.checksum, sizeof(location.checksum), file) != 0
+                || file_read(&location.value_offset, sizeof(location.value_offset), file) != 0) {
+                return "truncated";
+            }
+            location.set_mime_word(mime_word);
+            if (KVLocation::expires(mime_word) && file_read(&location.expires_at, sizeof(location.expires_at), file) != 0) {
+                return "truncated";
+            }
+            std::string key(key_length, '\0');
+            if (file_read(key.data(), key.size(), file) != 0) {
+                return "truncated";
+            }
+            if (location.value_offset < header_size + location.head_size(key_length)
+                || location.end() > end) {
+                return "hints don't match the store";
+            }
+            if (out_records.empty() || location.value_offset > out_records[last].second.value_offset) {
+                last = out_records.size();
+            }
+            out_records.emplace_back(std::move(key), location);
+        }
+        if (std::fgetc(file) != EOF) {
+            return "trailing data";
+        }
+        out_end = end;
+        return {};
+    };
+    auto error = read_hints();
+    std::fclose(file);
+    // spot check the latest entry: if the segment was rewritten since the hints
+    // were written, it's very unlikely to have the same key at the same offset
+    if (error.empty() && !out_records.empty()) {
+        const auto& [key, location] = out_records[last];
+        std::string actual(location.head_size(key.size()), '\0');
+        int ret = segment.file->read_at(actual.data(), actual.size(), location.value_offset - actual.size());
+        std::array<KVSize, 4> head;
+        std::memcpy(head.data(), actual.data(), sizeof(head));
+        KVEntry expected;
+        expected.set_head(key, location);
+        if (ret != 0 || std::memcmp(head.data(), expected.head().data(), sizeof(head)) != 0
+            || std::string_view(actual).substr(sizeof(head), key.size()) != key) {
+            error = "hints don't match the store";
+        }
+    }
+    if (!error.empty()) {
+        spdlog::info("index: ignoring hint file \"{}\": {}", path, error);
+        out_records.clear();
+        return 1;
+    }
+    return 0;
+}
+int KVStore::checkpoint() {
+    std::unique_lock merge_lock(m_merge_mtx);
+    std::unique_lock lock(m_mtx);
+    return write_hints();
+}
+int KVStore::index() {
+    std::unique_lock merge_lock(m_merge_mtx);
+    std::unique_lock lock(m_mtx);
+    ShardedKeyDir keydir;
+    int ret = index_impl(keydir);
+    if (ret < 0) {
+        return ret;
+    }
+    // built in one go, before anything is locked
+    TimerWheel wheel(static_cast<uint64_t>(m_options.expiry_interval.count()), now());
+    for (const auto& shard : keydir) {
+        shard.for_each([&](std::string_view key, const KVLocation& location) {
+            if (location.expires_at != 0 && !location.tombstone) {
+                wheel.add(key, location.expires_at);
+            }
+        });
+    }
+    KeyIndex key_index;
+    if (m_options.ordered_index) {
+        std::vector<std::string_view> keys;
+        for (const auto& shard : keydir) {
+            shard.for_each([&](std::string_view key, const KVLocation& location) {
+                if (!location.tombstone) {
+                    keys.push_back(key);
+                }
+            });
+        }
+        std::sort(keys.begin(), keys.end());
+        key_index.assign(keys);
+    }
+    ShardLocks locks(*this, all_shards, false);
+    std::unique_lock segments_lock(m_segments_mtx);
+    {
+        std::unique_lock index_lock(m_index_mtx);
+        m_index.swap(key_index);
+    }
+    for (auto& [id, segment] : m_segments) {
+        segment->live_bytes = 0;
+    }
+    for (size_t i = 0; i < keydir_shards; ++i) {
+        m_shards[i].keydir = std::move(keydir[i]);
+        m_shards[i].keydir.for_each([&](std::string_view key, const KVLocation& location) {
+            m_segments.at(location.segment)->live_bytes += location.entry_size(key.size());
+        });
+    }
+    bool expiring = !wheel.empty();
+    m_expiring = expiring;
+    {
+        std::unique_lock expiry_lock(m_expiry_mtx);
+        std::swap(m_wheel, wheel);
+    }
+    if (expiring) {
+        std::call_once(m_expiry_started, [this] { m_expiry_thread = std::thread(&KVStore::expiry_thread_main, this); });
+    }
+    m_indexed = true;
+    return 0;
+}
+std::string KVStore::segment_filename(const std::string& filename, uint32_t id) {
+    return id == 0 ? filename : fmt::format("{}.{}", filename, id);
+}
+uint64_t KVStore::segment_end(const Segment& segment) const {
+    return segment.sealed ? segment.size : m_append_file->size();
+}
+int KVStore::require_format(uint8_t format) {
+    if (m_format >= format) {
+        return 0;
+    }
+    std::unique_lock lock(m_format_mtx);
+    if (m_format >= format) {
+        return 0;
+    }
+    int ret = write_format(m_filename, format);
+    if (ret != 0) {
+        spdlog::error("store: failed to raise the format of \"{}\" to v{}.{}: {}", m_filename, PRJ_VERSION_MAJOR, format, std::strerror(-ret));
+        return ret;
+    }
+    spdlog::info("store: \"{}\" is in format v{}.{} now", m_filename, PRJ_VERSION_MAJOR, format);
+    m_format = format;
+    return 0;
+}
+std::vector<uint32_t> KVStore::segment_ids(const std::string& filename) {
+    // segments after the first are named like the store, with their id appended
+    auto store_path = std::filesystem::path(filename);
+    auto prefix = store_path.filename().string() + ".";
+    auto dir = store_path.has_parent_path() ? store_path.parent_path() : std::filesystem::path(".");
+    std::vector<uint32_t> ids { 0 };
+    for (const auto& dir_entry : std::filesystem::directory_iterator(dir)) {
+        auto name = dir_entry.path().filename().string();
+        if (!name.starts_with(prefix)) {
+            continue;
+        }
+        std::string_view suffix = std::string_view(name).substr(prefix.size());
+        uint32_t id = 0;
+        auto [ptr, ec] = std::from_chars(suffix.data(), suffix.data() + suffix.size(), id);
+        // hint files, merge temporaries and so on
+        if (ec != std::errc() || ptr != suffix.data() + suffix.size() || id == 0) {
+            continue;
+        }
+        ids.push_back(id);
+    }
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+void KVStore::open_segments() {
+    auto ids = segment_ids(m_filename);
+    if (ids.back() > KeyDir::max_segment) {
+        throw std::runtime_error(fmt::format("segment id {} of '{}' is too large", ids.back(), m_filename));
+    }
+    for (uint32_t id : ids) {
+        auto segment = std::make_shared<Segment>();
+        segment->id = id;
+        segment->filename = segment_filename(id);
+        segment->file = PReadFile::open(segment->filename);
+        if (!segment->file) {
+            throw std::runtime_error(fmt::format("could not open file '{}' for reading: {}", segment->filename, std::strerror(errno)));
+        }
+        if (id != ids.back()) {
+            segment->sealed = true;
+            segment->size = std::filesystem::file_size(segment->filename);
+        }
+        m_segments[id] = std::move(segment);
+    }
+    m_active_id = ids.back();
+    m_append_file = AppendFile::open(segment_filename(m_active_id));
+    if (!m_append_file) {
+        throw std::runtime_error(fmt::format("could not open file '{}' for writing: {}", segment_filename(m_active_id), std::strerror(errno)));
+    }
+    if (ids.size() > 1) {
+        spdlog::info("store \"{}\" has {} segments", m_filename, ids.size());
+    }
+}
+int KVStore::roll_over() {
+    // the background sync only knows about the active segment
+    if (m_options.durability == KVDurability::Interval) {
+        int ret = m_append_file->sync();
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    if (m_active_id >= KeyDir::max_segment) {
+        spdlog::error("segment: \"{}\" has run out of segment ids", m_filename);
+        return -EOVERFLOW;
+    }
+    uint32_t id = m_active_id + 1;
+    auto segment = std::make_shared<Segment>();
+    segment->id = id;
+    segment->filename = segment_filename(id);
+    segment->hint_end = header_size;
+    int ret = create_store_file(segment->filename, m_format);
+    if (ret != 0) {
+        spdlog::info("segment: failed to create \"{}\": {}", segment->filename, std::strerror(-ret));
+        return ret;
+    }
+    auto append_file = AppendFile::open(segment->filename);
+    segment->file = PReadFile::open(segment->filename);
+    if (!append_file || !segment->file) {
+        int err = errno;
+        std::filesystem::remove(segment->filename);
+        return -err;
+    }
+    // synced writes to the new segment must not vanish together with the file
+    if (m_options.durability != KVDurability::None) {
+        ret = sync_new_file(segment->filename);
+        if (ret != 0) {
+            spdlog::info("segment: failed to sync \"{}\": {}", segment->filename, std::strerror(-ret));
+            std::filesystem::remove(segment->filename);
+            return ret;
+        }
+    }
+    {
+        std::unique_lock lock(m_segments_mtx);
+        auto& sealed = *m_segments.at(m_active_id);
+        sealed.size = m_append_file->size();
+        sealed.sealed = true;
+        m_segments[id] = segment;
+    }
+    spdlog::info("segment: sealed \"{}\" at {} bytes, continuing in \"{}\"", segment_filename(m_active_id), m_append_file->size(), segment->filename);
+    m_append_file = std::move(append_file);
+    m_active_id = id;
+    return 0;
+}
+int KVStore::merge() {
+    KVMergeResult result;
+    return merge(result);
+}
+int KVStore::merge(KVMergeResult& out_result) {
+    // one merge at a time. reads and writes go on while merging, only the
+    // final swap holds them up.
+    std::unique_lock merge_lock(m_merge_mtx);
+    std::vector<uint32_t> ids;
+    {
+        std::unique_lock lock(m_mtx);
+        // writes continue in a new segment, so the active one can be merged too
+        if (m_append_file->size() > header_size) {
+            int ret = roll_over();
+            if (ret != 0) {
+                return ret;
+            }
+        }
+        std::shared_lock segments_lock(m_segments_mtx);
+        for (const auto& [id, segment] : m_segments) {
+            if (segment->sealed) {
+                ids.push_back(id);
+            }
+        }
+    }
+    return merge_segments(ids, out_result);
+}
+int KVStore::merge_segments(const std::vector<uint32_t>& ids, KVMergeResult& out_result, uint64_t rate_limit) {
+    out_result = {};
+    if (ids.empty()) {
+        return 0;
+    }
+    // the inputs of an earlier merge which couldn't be removed are only known to its manifest
+    if (std::filesystem::exists(merge_manifest_path(m_filename))) {
+        spdlog::error("merge: an earlier merge of \"{}\" is unfinished until the next start", m_filename);
+        return -EBUSY;
+    }
+    // the merged entries go into the newest of the segments. all other entries
+    // of those keys are in older segments, so they stay replaced by the merged ones.
+    uint32_t output_id = *std::max_element(ids.begin(), ids.end());
+    auto output_filename = segment_filename(output_id);
+
+    // the temporary file lives next to the store, so it can be renamed into place
+    auto temp_file = output_filename + ".kv_temporary";
+
+    size_t n = 1;
+    auto name = temp_file;
+    while (std::filesystem::exists(name)) {
+        name = fmt::format("{}.{}", temp_file, n);
+        ++n;
+    }
+    temp_file = name;
+
+    // the live entries of the merged segments. the keydir may change meanwhile,
+    // but only by entries in the active segment, which isn't merged.
+    std::map<uint32_t, std::shared_ptr<Segment>> inputs;
+    std::vector<std::pair<std::string, KVLocation>> entries;
+    // tombstones and expired entries which are left out, since nothing they hide survives the merge
+    std::vector<std::pair<std::string, KVLocation>> dropped;
+    // a tombstone (or expired entry) has to stay as long as an older segment may still hold
+    // an entry of its key
+    uint32_t oldest_kept = std::numeric_limits<uint32_t>::max();
+    {
+        std::shared_lock segments_lock(m_segments_mtx);
+        for (uint32_t id : ids) {
+            inputs[id] = m_segments.at(id);
+            assert(inputs[id]->sealed);
+        }
+        for (const auto& [id, segment] : m_segments) {
+            bool empty = segment->sealed && segment->size <= header_size;
+            if (!inputs.contains(id) && !empty) {
+                oldest_kept = std::min(oldest_kept, id);
+            }
+        }
+    }
+    uint64_t time = now();
+    // a shard at a time, since the entries don't have to be a consistent snapshot
+    for (const auto& shard : m_shards) {
+        std::shared_lock lock(shard.mtx);
+        shard.keydir.for_each([&](std::string_view key, const KVLocation& location) {
+            if (!inputs.contains(location.segment)) {
+                return;
+            }
+            if (!location.live(time) && location.segment < oldest_kept) {
+                dropped.emplace_back(key, location);
+            } else {
+                entries.emplace_back(key, location);
+            }
+        });
+    }
+    // in file order, so the old files are read sequentially
+    std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+        return std::tie(a.second.segment, a.second.value_offset) < std::tie(b.second.segment, b.second.value_offset);
+    });
+
+    spdlog::info("merge: merging {} segments into temporary file \"{}\"", ids.size(), temp_file);
+    int ret = create_store_file(temp_file, m_format);
+    std::shared_ptr<AppendFile> temp_append;
+    if (ret == 0) {
+        temp_append = AppendFile::open(temp_file);
+        if (!temp_append) {
+            ret = -errno;
+        }
+    }
+    auto fail = [&](std::string_view what) {
+        spdlog::info("merge: failed due to error {}: {}. keeping the old files.", what, std::strerror(-ret));
+        std::filesystem::remove(temp_file);
+        std::filesystem::remove(hint_path(temp_file));
+        return ret;
+    };
+    if (ret != 0) {
+        return fail("creating temporary file");
+    }
+
+    // entries are collected in a buffer and appended whenever it's full
+    constexpr size_t buffer_size = 1024 * 1024;
+    std::vector<uint8_t> buffer;
+    buffer.reserve(buffer_size);
+    auto merge_start = std::chrono::steady_clock::now();
+    auto flush = [&] {
+        std::span<const uint8_t> slice(buffer);
+        int append_ret = temp_append->append({ &slice, 1 });
+        buffer.clear();
+        if (append_ret != 0 || rate_limit == 0) {
+            return append_ret;
+        }
+        // leave the disk to foreground reads and writes, by waiting until
+        // the rate is back under the limit. gives up if the store closes.
+        auto due = merge_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(double(temp_append->size()) / double(rate_limit)));
+        std::unique_lock lock(m_compaction_mtx);
+        if (m_compaction_cv.wait_until(lock, due, [&] { return m_compaction_stop; })) {
+            return -ECANCELED;
+        }
+        return 0;
+    };
+    // where each entry was before the merge, to tell whether it changed since
+    std::vector<KVLocation> old_locations;
+    old_locations.reserve(entries.size());
+    for (auto& [key, location] : entries) {
+        KVEntry entry;
+        uint64_t entry_offset = temp_append->size() + buffer.size();
+        size_t head_start = buffer.size();
+        buffer.resize(head_start + sizeof(entry.head()));
+        buffer.insert(buffer.end(), key.begin(), key.end());
+        if (location.expires_at != 0) {
+            const auto* expiry = reinterpret_cast<const uint8_t*>(&location.expires_at);
+            buffer.insert(buffer.end(), expiry, expiry + sizeof(location.expires_at));
+        }
+        // value, mime and checksum are adjacent, so they're copied with a single read.
+        // the checksum is copied as it is, so a value which went bad stays detectable
+        size_t start = buffer.size();
+        buffer.resize(start + location.data_size());
+        ret = inputs.at(location.segment)->file->read_at(buffer.data() + start, buffer.size() - start, location.value_offset);
+        if (ret != 0) {
+            ret = ret < 0 ? ret : -EIO;
+            return fail("reading file");
+        }
+        old_locations.push_back(location);
+        KVLocation sizes = location;
+        if (location.mime_id == 0 && location.mime_size > 0) {
+            // entries from before the mime type was interned get the compact form. that needs
+            // a new checksum, so only intact ones do
+            uint32_t checksum;
+            std::memcpy(&checksum, buffer.data() + buffer.size() - sizeof(checksum), sizeof(checksum));
+            const uint8_t* data = buffer.data() + start;
+            uint32_t value_checksum = crc32c({ data, location.value_size });
+            uint32_t mime_id = 0;
+            if (crc32c({ data + location.value_size, location.mime_size }, value_checksum) == checksum) {
+                mime_id = m_mimes.intern({ reinterpret_cast<const char*>(data + location.value_size), location.mime_size });
+            }
+            if (mime_id != 0 && require_format(format_interned_mimes) != 0) {
+                mime_id = 0;
+            }
+            if (mime_id != 0) {
+                sizes.mime_size = 0;
+                sizes.mime_id = mime_id;
+                buffer.resize(start + location.value_size);
+                buffer.insert(buffer.end(), reinterpret_cast<const uint8_t*>(&value_checksum), reinterpret_cast<const uint8_t*>(&value_checksum) + sizeof(value_checksum));
+            }
+        }
+        entry.set_head(key, sizes);
+        auto head = entry.head();
+        std::memcpy(buffer.data() + head_start, head.data(), sizeof(head));
+        location = entry.location_at(output_id, entry_offset);
+        if (location.value_offset > KeyDir::max_value_offset) {
+            ret = -EFBIG;
+            return fail("merging more than a segment holds");
+        }
+        std::memcpy(&location.checksum, buffer.data() + buffer.size() - sizeof(location.checksum), sizeof(location.checksum));
+        if (buffer.size() >= buffer_size) {
+            ret = flush();
+            if (ret != 0) {
+                return fail("writing temporary file");
+            }
+        }
+    }
+    ret = flush();
+    if (ret != 0) {
+        return fail("writing temporary file");
+    }
+    // the new file has to be on disk before it replaces the old ones
+    ret = temp_append->sync();
+    if (ret != 0) {
+        return fail("syncing temporary file");
+    }
+    // so the new segment doesn't have to be indexed on the next start
+    uint64_t new_size = temp_append->size();
+    ret = write_hint_file(hint_path(temp_file), new_size, entries);
+    if (ret != 0) {
+        return fail("writing hint file");
+    }
+    temp_append = nullptr;
+    // the first segment is the file the store is known by, so it's never removed.
+    // if it's merged into a newer one, it's replaced by an empty file.
+    auto empty_file = segment_filename(0) + ".kv_temporary_empty";
+    if (output_id != 0 && inputs.contains(0)) {
+        ret = create_store_file(empty_file, m_format);
+        if (ret == 0) {
+            auto empty_append = AppendFile::open(empty_file);
+            ret = empty_append ? empty_append->sync() : -errno;
+        }
+        if (ret != 0) {
+            std::filesystem::remove(empty_file);
+            return fail("creating empty file");
+        }
+    }
+
+    auto segment = std::make_shared<Segment>();
+    segment->id = output_id;
+    segment->filename = output_filename;
+    segment->sealed = true;
+    segment->size = new_size;
+    segment->hint_end = new_size;
+    // opened before it's moved into place, the handle stays with the file through the rename
+    segment->file = PReadFile::open(temp_file);
+    if (!segment->file) {
+        ret = -errno;
+        std::filesystem::remove(empty_file);
+        return fail("opening temporary file");
+    }
+    std::shared_ptr<Segment> empty;
+    if (output_id != 0 && inputs.contains(0)) {
+        empty = std::make_shared<Segment>();
+        empty->id = 0;
+        empty->filename = segment_filename(0);
+        empty->file = PReadFile::open(empty_file);
+        empty->sealed = true;
+        empty->size = header_size;
+        empty->hint_end = header_size;
+        if (!empty->file) {
+            ret = -errno;
+            std::filesystem::remove(empty_file);
+            return fail("opening empty file");
+        }
+    }
+    uint64_t old_size = 0;
+    for (const auto& [id, input] : inputs) {
+        old_size += input->size;
+    }
+
+    // the new files have to be in the directory before the manifest refers to them. from
+    // the manifest on, an interrupted merge is finished on the next start instead of
+    // leaving older inputs behind, which hold entries of the keys it dropped.
+    auto dir = directory_of(m_filename);
+    auto manifest = merge_manifest_path(m_filename);
+    ret = sync_directory(dir);
+    if (ret == 0) {
+        std::vector<uint32_t> input_ids;
+        for (const auto& [id, input] : inputs) {
+            input_ids.push_back(id);
+        }
+        ret = write_merge_manifest(manifest, output_id, input_ids, std::filesystem::path(temp_file).filename().string());
+    }
+    if (ret != 0) {
+        std::filesystem::remove(empty_file);
+        return fail("writing manifest");
+    }
+
+    // readers keep reading from the old file through their handles and mappings until the
+    // swap, since rename replaces the directory entry, not the file itself.
+    // the old hints must never be used with the new file, so they go first
+    std::error_code ec;
+    std::filesystem::remove(hint_path(output_filename), ec);
+    spdlog::info("merge: moving new file \"{}\" -> \"{}\"", temp_file, output_filename);
+    {
+        // the first segment's header has the store's format, which may have been raised
+        // since the new file was created
+        std::unique_lock format_lock(m_format_mtx);
+        if (output_id == 0) {
+            ret = write_format(temp_file, m_format);
+            ec = std::error_code(-ret, std::generic_category());
+        }
+        if (!ec) {
+            std::filesystem::rename(temp_file, output_filename, ec);
+        }
+    }
+    if (ec) {
+        spdlog::info("merge: failed to move new file into place: {}", ec.message());
+        std::filesystem::remove(empty_file);
+        std::filesystem::remove(manifest);
+        ret = -ec.value();
+        return fail("renaming");
+    }
+    std::filesystem::rename(hint_path(temp_file), hint_path(output_filename), ec);
+    if (ec) {
+        spdlog::info("merge: failed to move new hint file into place: {}", ec.message());
+    }
+    // the inputs may only go once the new file is in place for good
+    int sync_ret = sync_directory(dir);
+    {
+        // only the segments and the locations of the merged entries change under the locks.
+        // new readers have to wait until the keydir matches the new files.
+        ShardLocks locks(*this, all_shards, false);
+        std::unique_lock segments_lock(m_segments_mtx);
+        m_segments[output_id] = segment;
+
+        // only entries which didn't change while merging move to their merged location,
+        // the others were overwritten in the active segment
+        for (const auto& [key, location] : dropped) {
+            auto& keydir = m_shards[shard_of(key)].keydir;
+            auto current = keydir.find(key);
+            if (current && current->segment == location.segment && current->value_offset == location.value_offset) {
+                keydir.erase(key);
+                if (location.tombstone) {
+                    ++out_result.dropped_tombstones;
+                    continue;
+                }
+                ++out_result.dropped_expired;
+                if (m_options.ordered_index) {
+                    std::unique_lock index_lock(m_index_mtx);
+                    m_index.erase(key);
+                }
+                if (m_cache) {
+                    m_cache->erase(key);
+                }
+            }
+        }
+        for (size_t i = 0; i < entries.size(); ++i) {
+            auto& keydir = m_shards[shard_of(entries[i].first)].keydir;
+            auto current = keydir.find(entries[i].first);
+            if (current && current->segment == old_locations[i].segment
+                && current->value_offset == old_locations[i].value_offset) {
+                keydir.insert_or_assign(entries[i].first, entries[i].second);
+                if (m_cache) {
+                    m_cache->relocate(entries[i].first, old_locations[i], entries[i].second);
+                }
+                segment->live_bytes += entries[i].second.entry_size(entries[i].first.size());
+            }
+        }
+        for (const auto& [id, input] : inputs) {
+            if (id == 0 && empty) {
+                m_segments[0] = empty;
+            } else if (id != output_id) {
+                m_segments.erase(id);
+            }
+        }
+    }
+
+    // nothing refers to the merged segments anymore. reads in flight still hold their
+    // handles, which keep the files around until they're done.
+    for (const auto& [id, input] : inputs) {
+        if (id == output_id || sync_ret != 0) {
+            continue;
+        }
+        std::filesystem::remove(hint_path(input->filename), ec);
+        if (id == 0) {
+            std::unique_lock format_lock(m_format_mtx);
+            ret = write_format(empty_file, m_format);
+            ec = std::error_code(-ret, std::generic_category());
+            if (!ec) {
+                std::filesystem::rename(empty_file, input->filename, ec);
+            }
+        } else {
+            std::filesystem::remove(input->filename, ec);
+        }
+        if (ec) {
+            spdlog::info("merge: failed to remove merged segment \"{}\": {}", input->filename, ec.message());
+            sync_ret = -ec.value();
+        }
+    }
+    if (sync_ret == 0) {
+        sync_ret = sync_directory(dir);
+    }
+    // otherwise the manifest stays, and the next start removes what's left of the inputs
+    if (sync_ret == 0) {
+        std::filesystem::remove(manifest, ec);
+        sync_ret = ec ? -ec.value() : sync_directory(dir);
+    }
+    if (sync_ret != 0) {
+        spdlog::error("merge: failed to remove the merged segments for good, finishing on the next start: {}", std::strerror(-sync_ret));
+    }
+
+    out_result.entries = entries.size();
+    // the first segment stays behind as an empty file, if it was merged into another
+    uint64_t kept_size = new_size + (output_id != 0 && inputs.contains(0) ? header_size : 0);
+    out_result.reclaimed_bytes = old_size > kept_size ? old_size - kept_size : 0;
+    m_reclaimed_bytes += out_result.reclaimed_bytes;
+    spdlog::info("merge: merged {} entries from {} segments, dropped {} deleted and {} expired keys, reduced size from {} to {} bytes",
+        entries.size(), ids.size(), out_result.dropped_tombstones, out_result.dropped_expired, old_size, new_size);
+    return 0;
+}
+std::vector<uint32_t> KVStore::pick_compaction() {
+    // (dead ratio, id, size) of the sealed segments with dead entries
+    std::vector<std::tuple<double, uint32_t, uint64_t>> candidates;
+    uint64_t total_dead = 0;
+    {
+        std::shared_lock lock(m_segments_mtx);
+        for (const auto& [id, segment] : m_segments) {
+            if (!segment->sealed || segment->size <= header_size) {
+                continue;
+            }
+            uint64_t dead = segment->size - header_size - segment->live_bytes;
+            if (dead > 0) {
+                total_dead += dead;
+                candidates.emplace_back(double(dead) / double(segment->size - header_size), id, segment->size);
+            }
+        }
+    }
+    // the most garbage first, as long as the run doesn't get too large
+    std::sort(candidates.begin(), candidates.end(), std::greater {});
+    bool too_much_waste = total_dead >= m_options.compaction_waste;
+    std::vector<uint32_t> ids;
+    uint64_t bytes = 0;
+    for (const auto& [ratio, id, size] : candidates) {
+        if (ratio < m_options.compaction_ratio && !too_much_waste) {
+            break;
+        }
+        if (!ids.empty() && bytes + size > m_options.compaction_max_bytes) {
+            break;
+        }
+        ids.push_back(id);
+        bytes += size;
+    }
+    return ids;
+}
+void KVStore::compaction_thread_main() {
+    std::unique_lock lock(m_compaction_mtx);
+    while (!m_compaction_stop) {
+        m_compaction_cv.wait_for(lock, m_options.compaction_interval, [&] { return m_compaction_stop; });
+        if (m_compaction_stop) {
+            break;
+        }
+        lock.unlock();
+        {
+            std::unique_lock merge_lock(m_merge_mtx);
+            auto ids = pick_compaction();
+            if (!ids.empty()) {
+                spdlog::info("compaction: merging {} segments of \"{}\"", ids.size(), m_filename);
+                KVMergeResult result;
+                int ret = merge_segments(ids, result, m_options.compaction_rate);
+                if (ret != 0 && ret != -ECANCELED) {
+                    spdlog::error("compaction: failed to merge segments of \"{}\": {}", m_filename, std::strerror(-ret));
+                }
+            }
+        }
+        lock.lock();
+    }
+}
+KVStore::~KVStore() {
+    if (m_expiry_thread.joinable()) {
+        {
+            std::unique_lock lock(m_expiry_mtx);
+            m_expiry_stop = true;
+        }
+        m_expiry_cv.notify_all();
+        m_expiry_thread.join();
+    }
+    if (m_compaction_thread.joinable()) {
+        {
+            std::unique_lock lock(m_compaction_mtx);
+            m_compaction_stop = true;
+        }
+        m_compaction_cv.notify_all();
+        m_compaction_thread.join();
+    }
+    if (m_sync_thread.joinable()) {
+        {
+            std::unique_lock lock(m_sync_mtx);
+            m_sync_stop = true;
+        }
+        m_sync_cv.notify_all();
+        m_sync_thread.join();
+        if (m_sync_dirty) {
+            (void)m_append_file->sync();
+        }
+    }
+    std::unique_lock merge_lock(m_merge_mtx);
+    std::unique_lock lock(m_mtx);
+    // so the next start doesn't have to index what was written since the last hints
+    int ret = write_hints();
+    if (ret != 0) {
+        spdlog::error("hint: failed to write hint files for \"{}\": {}", m_filename, std::strerror(-ret));
+    }
+}
+KVStore::KVStore(const std::string& path, const KVOptions& options)
+    : m_options(options)
+    , m_wheel(static_cast<uint64_t>(options.expiry_interval.count()), now()) {
+    // new stores get the .kvs extension, existing files are used as-is
+    m_filename = std::filesystem::exists(path) ? path : fmt::format("{}.kvs", path);
+
+    bool exists = std::filesystem::exists(m_filename);
+
+    if (!exists || std::filesystem::file_size(m_filename) == 0) {
+        int ret = create_store_file(m_filename);
+        if (ret == 0 && m_options.durability != KVDurability::None) {
+            ret = sync_new_file(m_filename);
+        }
+        if (ret != 0) {
+            throw std::runtime_error(fmt::format("could not create file '{}': {}", m_filename, std::strerror(-ret)));
+        }
+    }
+    std::FILE* file = std::fopen(m_filename.c_str(), "rb");
+    if (!file) {
+        throw std::runtime_error(fmt::format("could not open file '{}': {}", m_filename, std::strerror(errno)));
+    }
+    if (!KVHeader::is_header(file)) {
+        spdlog::info("file has no header, must be a kvstore from before v2.0.0.");
+        // TODO: convert from old to new format
+        assert(!"not implemented");
+    }
+    int ret = m_header.parse_from_file(file);
+    std::fclose(file);
+    if (ret < 0) {
+        spdlog::info("error: failed to parse header of kvstore: {}", std::strerror(ret));
+        throw std::runtime_error("failed to parse header");
+    }
+    auto [maj, min, pat] = m_header.get_version();
+    if (maj == 2) {
+        migrate_from_v2();
+    } else if (PRJ_VERSION_MAJOR != maj) {
+        spdlog::info("error: header version mismatch: {} (ours) != {} (file)", PRJ_VERSION_MAJOR, maj);
+        // TODO: Implement porting to newer versions
+        throw std::runtime_error("invalid kvstore version");
+    } else if (min > latest_format) {
+        spdlog::info("error: store uses format v{}.{}, which is newer than ours (v{}.{})", maj, min, PRJ_VERSION_MAJOR, latest_format);
+        throw std::runtime_error("kvstore format too new");
+    } else {
+        m_format = min;
+    }
+    ret = m_mimes.open(mime_table_path(m_filename));
+    if (ret != 0) {
+        throw std::runtime_error(fmt::format("could not open mime types '{}': {}", mime_table_path(m_filename), std::strerror(-ret)));
+    }
+    if (m_options.cache_size > 0) {
+        m_cache = std::make_unique<ValueCache>(m_options.cache_size);
+    }
+    ret = recover_merge();
+    if (ret != 0) {
+        throw std::runtime_error(fmt::format("could not finish interrupted merge: {}", std::strerror(-ret)));
+    }
+    open_segments();
+    ret = index();
+    if (ret < 0) {
+        throw std::runtime_error(fmt::format("could not index '{}': {}", m_filename, std::strerror(-ret)));
+    }
+    if (m_options.durability == KVDurability::Interval) {
+        m_sync_thread = std::thread(&KVStore::sync_thread_main, this);
+    }
+    if (m_options.auto_compaction) {
+        m_compaction_thread = std::thread(&KVStore::compaction_thread_main, this);
+    }
+}
+void KVStore::KVEntry::set_head(std::string_view key_view, const KVLocation& sizes) {
+    key_length.value = static_cast<uint32_t>(key_view.size());
+    value_length.value = sizes.value_size;
+    mime_length.value = sizes.mime_word();
+    expires_at = sizes.expires_at;
+    std::array lengths { key_length, value_length, mime_length };
+    key_checksum.value = crc32c({ reinterpret_cast<const uint8_t*>(key_view.data()), key_view.size() },
+        crc32c({ lengths.front().bytes, sizeof(lengths) }));
+    if (expires_at != 0) {
+        key_checksum.value = crc32c(expiry(), key_checksum.value);
+    }
+}
+KVStore::KVLocation KVStore::KVEntry::location_at(uint32_t segment, uint64_t offset) const {
+    KVLocation location {
+        .value_offset = offset + sizeof(head()) + key_length.value + expiry().size(),
+        .value_size = value_length.value,
+        .mime_size = 0,
+        .segment = segment,
+        .expires_at = expires_at,
+    };
+    location.set_mime_word(mime_length.value);
+    return location;
+}
+int KVStore::KVEntry::read_key_from_file(std::FILE* file, uint64_t available) {
+    std::array<KVSize, 4> read_head;
+    int ret = file_read(read_head.front().bytes, sizeof(read_head), file);
+    if (ret != 0) {
+        return ret;
+    }
+    // a garbage length mustn't make us allocate gigabytes for the key
+    if (sizeof(read_head) + read_head[0].value > available) {
+        return 1;
+    }
+    key.resize(read_head[0].value, ' ');
+    ret = file_read(key.data(), key.size(), file);
+    if (ret != 0) {
+        return ret;
+    }
+    KVLocation sizes { .value_offset = 0, .value_size = read_head[1].value, .mime_size = 0, .segment = 0 };
+    sizes.set_mime_word(read_head[2].value);
+    if (KVLocation::expires(read_head[2].value)) {
+        if (sizeof(read_head) + read_head[0].value + sizeof(uint64_t) > available) {
+            return 1;
+        }
+        ret = file_read(&sizes.expires_at, sizeof(uint64_t), file);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    set_head(key, sizes);
+    // a mime word which doesn't survive the round trip is garbage, too
+    if (key_length.value != read_head[0].value || mime_length.value != read_head[2].value || key_checksum.value != read_head[3].value) {
+        return -EBADMSG;
+    }
+    return 0;
+}
+
+// rewrites a segment of the v2 format, which has no checksums, in the current format.
+// the old file is only replaced once the new one is on disk. returns 1 if the
+// segment is in the current format already, otherwise 0 or negative errno
+int KVStore::migrate_segment_from_v2(const std::string& filename) {
+    std::FILE* input = std::fopen(filename.c_str(), "rb");
+    if (!input) {
+        return -errno;
+    }
+    KVHeader header;
+    if (!KVHeader::is_header(input) || header.parse_from_file(input) != 0) {
+        std::fclose(input);
+        return -EINVAL;
+    }
+    if (std::get<0>(header.get_version()) != 2) {
+        std::fclose(input);
+        return 1;
+    }
+    auto temp_path = filename + ".kv_temporary";
+    int ret = create_store_file(temp_path);
+    auto output = ret == 0 ? AppendFile::open(temp_path) : nullptr;
+    if (!output) {
+        ret = ret != 0 ? ret : -errno;
+        std::fclose(input);
+        std::filesystem::remove(temp_path);
+        return ret;
+    }
+    uint64_t input_size = std::filesystem::file_size(filename);
+    uint64_t offset = header_size;
+    uint64_t count = 0;
+    std::vector<uint8_t> buffer;
+    ret = file_seek(input, offset);
+    while (ret == 0 && offset < input_size) {
+        std::array<KVSize, 3> lengths;
+        ret = file_read(lengths.front().bytes, sizeof(lengths), input);
+        uint64_t entry_size = sizeof(lengths) + uint64_t(lengths[0].value) + lengths[1].value + lengths[2].value;
+        if (ret > 0 || (ret == 0 && offset + entry_size > input_size)) {
+            spdlog::error("migrate: \"{}\" ends in a partial entry at offset {}, dropping it", filename, offset);
+            ret = 0;
+            break;
+        } else if (ret < 0) {
+            break;
+        } else if (lengths[2].value > KeyDir::max_mime_size) {
+            ret = -EFBIG;
+            break;
+        }
+        std::string key(lengths[0].value, '\0');
+        buffer.resize(size_t(lengths[1].value) + lengths[2].value + sizeof(uint32_t));
+        ret = file_read(key.data(), key.size(), input);
+        if (ret == 0) {
+            ret = file_read(buffer.data(), buffer.size() - sizeof(uint32_t), input);
+        }
+        if (ret != 0) {
+            ret = ret < 0 ? ret : -EIO;
+            break;
+        }
+        KVEntry entry;
+        entry.set_head(key, KVLocation { .value_offset = 0, .value_size = lengths[1].value, .mime_size = lengths[2].value, .segment = 0 });
+        uint32_t checksum = crc32c({ buffer.data(), buffer.size() - sizeof(checksum) });
+        std::memcpy(buffer.data() + buffer.size() - sizeof(checksum), &checksum, sizeof(checksum));
+        auto head = entry.head();
+        std::array<std::span<const uint8_t>, 3> slices {
+            std::span<const uint8_t>(head.front().bytes, sizeof(head)),
+            std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(key.data()), key.size()),
+            std::span<const uint8_t>(buffer),
+        };
+        ret = output->append(slices);
+        offset += entry_size;
+        ++count;
+    }
+    std::fclose(input);
+    if (ret == 0) {
+        ret = output->sync();
+    }
+    output = nullptr;
+    std::error_code ec;
+    if (ret == 0) {
+        std::filesystem::rename(temp_path, filename, ec);
+        ret = -ec.value();
+    }
+    if (ret != 0) {
+        spdlog::error("migrate: failed to migrate \"{}\": {}", filename, std::strerror(-ret));
+        std::filesystem::remove(temp_path, ec);
+        return ret;
+    }
+    // the hints point at the old offsets
+    std::filesystem::remove(hint_path(filename), ec);
+    spdlog::info("migrate: rewrote {} entries of \"{}\" with checksums", count, filename);
+    return 0;
+}
+void KVStore::migrate_from_v2() {
+    spdlog::info("migrate: \"{}\" is a v2 store, adding checksums", m_filename);
+    // newest segment first, so an interrupted migration leaves the first segment,
+    // whose version is what's checked on open, in the old format
+    auto ids = segment_ids(m_filename);
+    for (auto iter = ids.rbegin(); iter != ids.rend(); ++iter) {
+        int ret = migrate_segment_from_v2(segment_filename(*iter));
+        if (ret < 0) {
+            throw std::runtime_error(fmt::format("failed to migrate '{}': {}", segment_filename(*iter), std::strerror(-ret)));
+        }
+    }
+}
+
+int KVStore::verify(const std::string& filename, size_t threads, KVVerifyResult& out_result) {
+    // a run of whole entries, the unit of work of the checking threads
+    struct Chunk {
+        std::string filename;
+        uint64_t begin;
+        uint64_t end;
+    };
+    constexpr uint64_t chunk_size = 64 * 1024 * 1024;
+    std::mutex mtx;
+    auto add_error = [&](std::string error) {
+        spdlog::error("verify: {}", error);
+        std::unique_lock lock(mtx);
+        out_result.errors.push_back(std::move(error));
+    };
+    // runs fn(i) for every i below count, on up to `threads` threads
+    auto parallel = [&](size_t count, const std::function<int(size_t)>& fn) {
+        std::atomic<size_t> next = 0;
+        std::atomic<int> result = 0;
+        auto work = [&] {
+            for (size_t i = next++; i < count; i = next++) {
+                int ret = fn(i);
+                if (ret < 0) {
+                    result = ret;
+                }
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < std::min(threads, count); ++i) {
+            workers.emplace_back(work);
+        }
+        work();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        return result.load();
+    };
+    auto open_buffered = [](const std::string& path, std::vector<char>& buffer) {
+        std::FILE* file = std::fopen(path.c_str(), "rb");
+        if (file) {
+            buffer.resize(1024 * 1024);
+            std::setvbuf(file, buffer.data(), _IOFBF, buffer.size());
+        }
+        return file;
+    };
+
+    // first, find where the chunks start by walking the heads of the entries and
+    // skipping over the values. that's a fraction of the reads, one thread per segment
+    auto ids = segment_ids(filename);
+    std::vector<std::vector<Chunk>> segment_chunks(ids.size());
+    int ret = parallel(ids.size(), [&](size_t i) {
+        auto path = segment_filename(filename, ids[i]);
+        std::error_code ec;
+        uint64_t size = std::filesystem::file_size(path, ec);
+        if (ec) {
+            return -ec.value();
+        }
+        std::vector<char> buffer;
+        std::FILE* file = open_buffered(path, buffer);
+        if (!file) {
+            return -errno;
+        }
+        KVHeader header;
+        if (!KVHeader::is_header(file) || header.parse_from_file(file) != 0 || std::get<0>(header.get_version()) != PRJ_VERSION_MAJOR) {
+            std::fclose(file);
+            add_error(fmt::format("\"{}\" is not a v{} store file", path, PRJ_VERSION_MAJOR));
+            return 0;
+        }
+        if (std::get<1>(header.get_version()) > latest_format) {
+            std::fclose(file);
+            add_error(fmt::format("\"{}\" uses a newer format (v{}.{})", path, PRJ_VERSION_MAJOR, std::get<1>(header.get_version())));
+            return 0;
+        }
+        uint64_t offset = header_size;
+        uint64_t begin = offset;
+        KVEntry entry;
+        int walk_ret = file_seek(file, offset);
+        while (walk_ret == 0 && offset < size) {
+            walk_ret = entry.read_key_from_file(file, size - offset);
+            uint64_t end = walk_ret == 0 ? entry.location_at(ids[i], offset).end() : 0;
+            if (walk_ret == -EBADMSG || walk_ret > 0 || end > size) {
+                add_error(fmt::format("\"{}\": corrupt entry at offset {}, the {} bytes after it can't be read", path, offset, size - offset));
+                walk_ret = 0;
+                break;
+            } else if (walk_ret < 0) {
+                break;
+            }
+            walk_ret = file_seek(file, end);
+            offset = end;
+            if (offset - begin >= chunk_size) {
+                segment_chunks[i].push_back(Chunk { .filename = path, .begin = begin, .end = offset });
+                begin = offset;
+            }
+        }
+        std::fclose(file);
+        if (offset > begin) {
+            segment_chunks[i].push_back(Chunk { .filename = path, .begin = begin, .end = offset });
+        }
+        return walk_ret;
+    });
+    if (ret < 0) {
+        return ret;
+    }
+
+    // then check every entry of every chunk, in parallel
+    std::vector<Chunk> chunks;
+    for (auto& list : segment_chunks) {
+        chunks.insert(chunks.end(), std::make_move_iterator(list.begin()), std::make_move_iterator(list.end()));
+    }
+    ret = parallel(chunks.size(), [&](size_t i) {
+        const auto& chunk = chunks[i];
+        std::vector<char> buffer;
+        std::FILE* file = open_buffered(chunk.filename, buffer);
+        if (!file) {
+            return -errno;
+        }
+        uint64_t offset = chunk.begin;
+        uint64_t entries = 0;
+        KVEntry entry;
+        int check_ret = file_seek(file, offset);
+        while (check_ret == 0 && offset < chunk.end) {
+            check_ret = entry.read_key_from_file(file, chunk.end - offset);
+            if (check_ret != 0) {
+                // the heads were fine a moment ago, so the file changed
+                check_ret = check_ret < 0 ? check_ret : -EIO;
+                break;
+            }
+            auto location = entry.location_at(0, offset);
+            uint32_t checksum;
+            check_ret = verify_data_in_file(file, location, checksum);
+            if (check_ret == -EBADMSG) {
+                add_error(fmt::format("\"{}\": corrupt value of key \"{}\" at offset {}", chunk.filename, entry.key, offset));
+                check_ret = 0;
+            } else if (check_ret != 0) {
+                check_ret = check_ret < 0 ? check_ret : -EIO;
+                break;
+            }
+            offset = location.end();
+            ++entries;
+        }
+        std::fclose(file);
+        std::unique_lock lock(mtx);
+        out_result.entries += entries;
+        out_result.bytes += offset - chunk.begin;
+        return check_ret;
+    });
+    std::sort(out_result.errors.begin(), out_result.errors.end());
+    return ret;
+}
+
+// removes the store's files, with all segments and hint files
+static void remove_store_files(const std::string& filename) {
+    auto store_path = std::filesystem::path(filename);
+    auto name = store_path.filename().string();
+    auto dir = store_path.has_parent_path() ? store_path.parent_path() : std::filesystem::path(".");
+    for (const auto& dir_entry : std::filesystem::directory_iterator(dir)) {
+        auto entry_name = dir_entry.path().filename().string();
+        if (entry_name == name || entry_name.starts_with(name + ".")) {
+            std::filesystem::remove(dir_entry.path());
+        }
+    }
+}
+
+TEST_CASE("KVStore store / load") {
+    std::string file = "./test-store.kvstore";
+    {
+        KVStore store(file);
+        file = store.getFilename();
+
+        SUBCASE("normal string") {
+            std::string msg = "hello, world";
+            std::string key = "my-key";
+            std::string mime = "text/plain";
+            std::vector<uint8_t> value(msg.begin(), msg.end());
+
+            int ret = store.write_entry(key, value, mime);
+
+            CHECK_EQ(ret, 0);
+
+            std::vector<uint8_t> r_value;
+            std::string r_mime;
+            ret = store.read_entry(key, r_value, r_mime);
+            CHECK_EQ(ret, 0);
+            CHECK_EQ(mime, r_mime);
+            CHECK(std::equal(value.begin(), value.end(), r_value.begin(), r_value.end()));
+        }
+        SUBCASE("normal binary") {
+            std::string key = "my-key";
+            std::string mime = "application/octet-stream";
+            std::vector<uint8_t> value = { 0, 5, 3, 134, 5, 0, 1, 0, 0 };
+
+            int ret = store.write_entry(key, value, mime);
+
+            CHECK_EQ(ret, 0);
+
+            std::vector<uint8_t> r_value;
+            std::string r_mime;
+            ret = store.read_entry(key, r_value, r_mime);
+            CHECK_EQ(ret, 0);
+            CHECK_EQ(mime, r_mime);
+            CHECK(std::equal(value.begin(), value.end(), r_value.begin(), r_value.end()));
+        }
+        SUBCASE("multiple same key same value") {
+            std::string key = "my-key";
+            std::string mime = "application/octet-stream";
+            std::vector<uint8_t> value = { 0, 5, 3, 134, 5, 0, 1, 0, 0 };
+
+            for (size_t i = 0; i < 10; ++i) {
+                int ret = store.write_entry(key, value, mime);
+                CHECK_EQ(ret, 0);
+            }
+
+            std::vector<uint8_t> r_value;
+            std::string r_mime;
+            int ret = store.read_entry(key, r_value, r_mime);
+            CHECK_EQ(ret, 0);
+            CHECK_EQ(mime, r_mime);
+            CHECK(std::equal(value.begin(), value.end(), r_value.begin(), r_value.end()));
+        }
+        SUBCASE("multiple same key different value") {
+            std::string key = "my-key";
+            std::string mime = "application/octet-stream";
+            std::vector<uint8_t> value = { 0, 5, 3, 134, 5, 0, 1, 0, 0 };
+
+            for (size_t i = 0; i < 10; ++i) {
+                std::vector<uint8_t> temp_value = {
+                    static_cast<unsigned char>(i),
+                    static_cast<unsigned char>(i * 2),
+                    static_cast<unsigned char>(i * 3)
+                };
+                int ret = store.write_entry(key, temp_value, mime);
+                CHECK_EQ(ret, 0);
+            }
+
+            // finally write the last value, which is the one we then expect to read
+            int ret = store.write_entry(key, value, mime);
+            CHECK_EQ(ret, 0);
+
+            std::vector<uint8_t> r_value;
+            std::string r_mime;
+            ret = store.read_entry(key, r_value, r_mime);
+            CHECK_EQ(ret, 0);
+            CHECK_EQ(mime, r_mime);
+            CHECK(std::equal(value.begin(), value.end(), r_value.begin(), r_value.end()));
+        }
+        SUBCASE("multiple writes, merge, read") {
+            std::string key = "my-key";
+            std::string mime = "application/octet-stream";
+            std::vector<uint8_t> value = { 0, 5, 3, 134, 5, 0, 1, 0, 0 };
+
+            for (size_t i = 0; i < 10; ++i) {
+                std::vector<uint8_t> temp_value = {
+                    static_cast<unsigned char>(i),
+                    static_cast<unsigned char>(i * 2),
+                    static_cast<unsigned char>(i * 3)
+                };
+                int ret = store.write_entry(key, temp_value, mime);
+                CHECK_EQ(ret, 0);
+            }
+
+            // finally write the last value, which is the one we then expect to read
+            int ret = store.write_entry(key, value, mime);
+            CHECK_EQ(ret, 0);
+
+            store.merge();
+
+            std::vector<uint8_t> r_value;
+            std::string r_mime;
+            ret = store.read_entry(key, r_value, r_mime);
+            CHECK_EQ(ret, 0);
+            CHECK_EQ(mime, r_mime);
+            CHECK(std::equal(value.begin(), value.end(), r_value.begin(), r_value.end()));
+        }
+    }
+    remove_store_files(file);
+}
+
+TEST_CASE("KVStore concurrent reads") {
+    std::string file = "./test-store-concurrent.kvstore";
+    {
+        KVStore store(file);
+        file = store.getFilename();
+
+        constexpr size_t key_count = 1000;
+        constexpr size_t reads_per_thread = 20000;
+        for (size_t i = 0; i < key_count; ++i) {
+            std::vector<uint8_t> value(2048, static_cast<uint8_t>(i));
+            REQUIRE_EQ(store.write_entry(fmt::format("key-{}", i), value, "application/octet-stream"), 0);
+        }
+
+        // returns reads per second over all threads
+        auto run_readers = [&](size_t thread_count) {
+            std::atomic<size_t> errors = 0;
+            std::vector<std::thread> threads;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t t = 0; t < thread_count; ++t) {
+                threads.emplace_back([&, t] {
+                    std::vector<uint8_t> value;
+                    std::string mime;
+                    for (size_t i = 0; i < reads_per_thread; ++i) {
+                        size_t k = (i * 7919 + t) % key_count;
+                        if (store.read_entry(fmt::format("key-{}", k), value, mime) != 0
+                            || value.size() != 2048 || value.front() != static_cast<uint8_t>(k)) {
+                            ++errors;
+                        }
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            CHECK_EQ(errors, 0);
+            return double(thread_count * reads_per_thread) / elapsed.count();
+        };
+
+        size_t cores = std::max<size_t>(2, std::thread::hardware_concurrency());
+        double single = run_readers(1);
+        double multi = run_readers(cores);
+        spdlog::info("concurrent reads: {:.0f} reads/s with 1 thread, {:.0f} reads/s with {} threads ({:.2f}x)",
+            single, multi, cores, multi / single);
+        if (std::thread::hardware_concurrency() > 1) {
+            WARN_GT(multi, single);
+        }
+
+        SUBCASE("reads during writes") {
+            std::atomic<bool> stop = false;
+            std::thread writer([&] {
+                std::vector<uint8_t> value(2048, 0);
+                for (size_t i = 0; !stop; ++i) {
+                    value.assign(2048, static_cast<uint8_t>(i % key_count));
+                    CHECK_EQ(store.write_entry(fmt::format("key-{}", i % key_count), value, "application/octet-stream"), 0);
+                }
+            });
+            run_readers(cores);
+            stop = true;
+            writer.join();
+        }
+    }
+    remove_store_files(file);
+}
+TEST_CASE("KVStore keydir contention") {
+    std::string file = "./test-store-contention.kvstore";
+    {
+        // mapped reads don't make a syscall, so the keydir locks are most of what they share
+        KVStore store(file, KVOptions { .mmap_reads = true });
+        file = store.getFilename();
+
+        constexpr size_t key_count = 10000;
+        constexpr size_t ops_per_thread = 20000;
+        for (size_t i = 0; i < key_count; ++i) {
+            std::vector<uint8_t> value(64, static_cast<uint8_t>(i));
+            REQUIRE_EQ(store.write_entry(fmt::format("key-{}", i), value, "application/octet-stream"), 0);
+        }
+
+        // returns operations per second over all threads. every `write_every`th
+        // operation is a write, and every 5000th lists all keys
+        auto run = [&](size_t thread_count, size_t write_every) {
+            std::atomic<size_t> errors = 0;
+            std::vector<std::thread> threads;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t t = 0; t < thread_count; ++t) {
+                threads.emplace_back([&, t] {
+                    std::vector<uint8_t> value;
+                    std::string mime;
+                    for (size_t i = 0; i < ops_per_thread; ++i) {
+                        size_t k = (i * 7919 + t * 104729) % key_count;
+                        auto key = fmt::format("key-{}", k);
+                        if (i % 5000 == 4999) {
+                            if (store.get_all_keys().size() != key_count) {
+                                ++errors;
+                            }
+                        } else if (write_every != 0 && i % write_every == 0) {
+                            value.assign(64, static_cast<uint8_t>(k));
+                            if (store.write_entry(key, value, "application/octet-stream") != 0) {
+                                ++errors;
+                            }
+                        } else if (store.read_entry(key, value, mime) != 0 || value.size() != 64 || value.front() != static_cast<uint8_t>(k)) {
+                            ++errors;
+                        }
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            CHECK_EQ(errors, 0);
+            return double(thread_count * ops_per_thread) / elapsed.count();
+        };
+
+        size_t cores = std::max<size_t>(2, std::thread::hardware_concurrency());
+        for (size_t write_every : { 0u, 10u, 2u }) {
+            double single = run(1, write_every);
+            double multi = run(cores, write_every);
+            spdlog::info("keydir contention, {}% writes: {:.0f} ops/s with 1 thread, {:.0f} ops/s with {} threads ({:.2f}x)",
+                write_every == 0 ? 0 : 100 / write_every, single, multi, cores, multi / single);
+        }
+    }
+    remove_store_files(file);
+}
+TEST_CASE("KVStore group commit") {
+    // writes/s by number of concurrent writers, for every durability policy
+    for (auto durability : { KVDurability::None, KVDurability::Batch, KVDurability::Interval }) {
+        std::string file = "./test-store-group-commit.kvstore";
+        {
+            KVStore store(file, KVOptions { .durability = durability, .sync_interval = std::chrono::milliseconds(10) });
+            file = store.getFilename();
+
+            constexpr size_t writes_per_client = 200;
+            std::string results;
+            for (size_t clients : { 1u, 4u, 16u }) {
+                std::vector<std::thread> threads;
+                auto start = std::chrono::steady_clock::now();
+                for (size_t c = 0; c < clients; ++c) {
+                    threads.emplace_back([&, c] {
+                        std::vector<uint8_t> value(128, static_cast<uint8_t>(c));
+                        for (size_t i = 0; i < writes_per_client; ++i) {
+                            CHECK_EQ(store.write_entry(fmt::format("{}-{}-{}", clients, c, i), value, "application/octet-stream"), 0);
+                        }
+                    });
+                }
+                for (auto& thread : threads) {
+                    thread.join();
+                }
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                results += fmt::format(" {} clients: {:.0f} writes/s,", clients, double(clients * writes_per_client) / elapsed.count());
+            }
+            results.pop_back();
+            const char* names[] = { "none", "batch", "interval" };
+            spdlog::info("group commit (durability {}):{}", names[static_cast<int>(durability)], results);
+
+            // every write landed, and the file indexes to the same result
+            REQUIRE_EQ(store.index(), 0);
+            CHECK_EQ(store.get_all_keys().size(), (1 + 4 + 16) * writes_per_client);
+            std::vector<uint8_t> r_value;
+            std::string r_mime;
+            REQUIRE_EQ(store.read_entry("16-15-199", r_value, r_mime), 0);
+            CHECK_EQ(r_value, std::vector<uint8_t>(128, 15));
+        }
+        remove_store_files(file);
+    }
+}
+
+TEST_CASE("KVStore failed sync") {
+    std::string file = "./test-store-failed-sync.kvstore";
+    std::vector<uint8_t> value(128, 1);
+    {
+        bool fail = false;
+        KVStore store(file, KVOptions { .durability = KVDurability::Batch, .sync_hook = [&](AppendFile& append_file) { return fail ? -EIO : append_file.sync(); } });
+        file = store.getFilename();
+        REQUIRE_EQ(store.write_entry("kept", value, "text/plain"), 0);
+        KVStore::KVVersion version {};
+        REQUIRE_EQ(store.version_of("kept", version), 0);
+        auto size = std::filesystem::file_size(file);
+
+        // a write whose sync fails is cut off again, whether it went through the group
+        // commit or was streamed
+        fail = true;
+        CHECK_EQ(store.write_entry("lost", value, "text/plain"), -EIO);
+        KVCondition condition { .exists = true, .versions = { &version, 1 } };
+        KVStore::KVWrite write { .key = "kept", .value = value, .mime = "text/plain", .condition = condition };
+        CHECK_EQ(store.write_entries({ &write, 1 }), -EIO);
+        KVStore::KVEntryWriter writer;
+        REQUIRE_EQ(store.begin_entry("lost-streamed", 2 * 1024 * 1024, "text/plain", writer), 0);
+        REQUIRE_EQ(writer.append(std::vector<uint8_t>(2 * 1024 * 1024, 2)), 0);
+        CHECK_EQ(writer.commit(), -EIO);
+        CHECK_EQ(std::filesystem::file_size(file), size);
+
+        // later writes start where the failed ones did
+        fail = false;
+        REQUIRE_EQ(store.write_entry("after", value, "text/plain"), 0);
+        KVStore::KVVersion r_version {};
+        REQUIRE_EQ(store.version_of("kept", r_version), 0);
+        CHECK(r_version == version);
+    }
+    {
+        // and they don't come back on the next start, when the segment is scanned
+        std::filesystem::remove(hint_path(file));
+        KVStore store(file, KVOptions { .durability = KVDurability::Batch });
+        CHECK_EQ(store.recovery().truncated_bytes, 0);
+        auto keys = store.get_all_keys();
+        std::sort(keys.begin(), keys.end());
+        std::vector<std::string> expected { "after", "kept" };
+        CHECK_EQ(keys, expected);
+        std::vector<uint8_t> r_value;
+        std::string r_mime;
+        REQUIRE_EQ(store.read_entry("after", r_value, r_mime), 0);
+        CHECK_EQ(r_value, value);
+    }
+    remove_store_files(file);
+}
+
+TEST_CASE("KVStore batches") {
+    for (bool mmap_reads : { false, true }) {
+        std::string file = "./test-store-batches.kvstore";
+        {
+            KVStore store(file, KVOptions { .mmap_reads = mmap_reads });
+            file = store.getFilename();
+
+            std::vector<std::string> values = { "one", "two", "three" };
+            std::vector<KVStore::KVWrite> writes;
+            for (size_t i = 0; i < values.size(); ++i) {
+                writes.push_back({
+                    .key = values[i],
+                    .value = { reinterpret_cast<const uint8_t*>(values[i].data()), values[i].size() },
+                    .mime = i == 0 ? "text/plain" : "application/octet-stream",
+                });
+            }
+            REQUIRE_EQ(store.write_entries(writes), 0);
+            // overwrite one, so the file order differs from the key order
+            REQUIRE_EQ(store.write_entry("one", std::vector<uint8_t> { 1 }, "application/octet-stream"), 0);
+
+            std::vector<std::string> keys = { "three", "missing", "one", "two" };
+            std::vector<std::optional<KVStore::KVValueView>> r_values;
+            REQUIRE_EQ(store.read_entries(keys, r_values), 0);
+            REQUIRE_EQ(r_values.size(), keys.size());
+            REQUIRE(r_values[0].has_value());
+            CHECK_EQ(std::string(r_values[0]->value.begin(), r_values[0]->value.end()), "three");
+            CHECK_EQ(r_values[0]->mime, "application/octet-stream");
+            CHECK_FALSE(r_values[1].has_value());
+            REQUIRE(r_values[2].has_value());
+            CHECK_EQ(std::vector<uint8_t>(r_values[2]->value.begin(), r_values[2]->value.end()), std::vector<uint8_t> { 1 });
+            REQUIRE(r_values[3].has_value());
+            CHECK_EQ(std::string(r_values[3]->value.begin(), r_values[3]->value.end()), "two");
+        }
+        remove_store_files(file);
+    }
+}
+
+TEST_CASE("KVStore mmap reads") {
+    std::string file = "./test-store-mmap.kvstore";
+    {
+        KVStore store(file, KVOptions { .mmap_reads = true });
+        file = store.getFilename();
+
+        // large enough to outgrow the initial mapping a few times
+        constexpr size_t key_count = 64;
+        constexpr size_t value_size = 64 * 1024;
+        for (size_t i = 0; i < key_count; ++i) {
+            std::vector<uint8_t> value(value_size, static_cast<uint8_t>(i));
+            REQUIRE_EQ(store.write_entry(fmt::format("key-{}", i), value, "application/octet-stream"), 0);
+
+            KVStore::KVValueView view;
+            REQUIRE_EQ(store.read_entry(fmt::format("key-{}", i), view), 0);
+            CHECK_EQ(view.value.size(), value_size);
+            CHECK(std::equal(value.begin(), value.end(), view.value.begin(), view.value.end()));
+            CHECK_EQ(view.mime, "application/octet-stream");
+        }
+
+        SUBCASE("views survive merge") {
+            KVStore::KVValueView before;
+            REQUIRE_EQ(store.read_entry("key-3", before), 0);
+            std::vector<uint8_t> value(value_size, 42);
+            REQUIRE_EQ(store.write_entry("key-3", value, "text/plain"), 0);
+            REQUIRE_EQ(store.merge(), 0);
+
+            CHECK(std::all_of(before.value.begin(), before.value.end(), [](uint8_t b) { return b == 3; }));
+            KVStore::KVValueView after;
+            REQUIRE_EQ(store.read_entry("key-3", after), 0);
+            CHECK(std::equal(value.begin(), value.end(), after.value.begin(), after.value.end()));
+            CHECK_EQ(after.mime, "text/plain");
+
+            std::vector<uint8_t> r_value;
+            std::string r_mime;
+            REQUIRE_EQ(store.read_entry("key-5", r_value, r_mime), 0);
+            CHECK_EQ(r_value.size(), value_size);
+            CHECK_EQ(r_value.front(), 5);
+        }
+    }
+    remove_store_files(file);
+}
+
+TEST_CASE("KVStore value cache") {
+    std::string file = "./test-store-cache.kvstore";
+    {
+        KVStore store(file, KVOptions { .cache_size = 1024 * 1024 });
+        file = store.getFilename();
+        auto as_bytes = [](std::string_view str) {
+            return std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(str.data()), str.size());
+        };
+        auto read = [&](const std::string& key) -> std::string {
+            std::vector<uint8_t> value;
+            std::string mime;
+            CHECK_EQ(store.read_entry(key, value, mime), 0);
+            return std::string(value.begin(), value.end()) + "|" + mime;
+        };
+
+        REQUIRE_EQ(store.write_entry("key", as_bytes("first"), "text/plain"), 0);
+        CHECK_EQ(read("key"), "first|text/plain");
+        CHECK_EQ(read("key"), "first|text/plain");
+        auto stats = store.cache_stats();
+        CHECK_EQ(stats.misses, 1);
+        CHECK_EQ(stats.hits, 1);
+        CHECK_EQ(stats.entries, 1);
+
+        // writes are visible right away, never the cached value
+        REQUIRE_EQ(store.write_entry("key", as_bytes("second"), "text/html"), 0);
+        CHECK_EQ(store.cache_stats().entries, 0);
+        CHECK_EQ(read("key"), "second|text/html");
+
+        // lookups serve cached values from memory
+        KVStore::KVValueRef ref;
+        REQUIRE_EQ(store.lookup("key", ref), 0);
+        REQUIRE(ref.mapped_value());
+        CHECK_EQ(std::string(reinterpret_cast<const char*>(ref.mapped_value()), ref.size()), "second");
+        CHECK_EQ(ref.mime(), "text/html");
+        char buffer[3];
+        REQUIRE_EQ(ref.read(3, buffer, 3), 0);
+        CHECK_EQ(std::string(buffer, 3), "ond");
+
+        // a merge moves the value, but it stays cached
+        REQUIRE_EQ(store.write_entry("other", as_bytes("value"), "text/plain"), 0);
+        REQUIRE_EQ(store.merge(), 0);
+        uint64_t hits = store.cache_stats().hits;
+        CHECK_EQ(read("key"), "second|text/html");
+        CHECK_EQ(store.cache_stats().hits, hits + 1);
+
+        std::vector<std::string> keys = { "other", "key", "missing" };
+        std::vector<std::optional<KVStore::KVValueView>> values;
+        REQUIRE_EQ(store.read_entries(keys, values), 0);
+        REQUIRE(values[0]);
+        REQUIRE(values[1]);
+        CHECK_FALSE(values[2]);
+        CHECK_EQ(std::string(values[0]->value.begin(), values[0]->value.end()), "value");
+        CHECK_EQ(std::string(values[1]->value.begin(), values[1]->value.end()), "second");
+        CHECK_EQ(store.cache_stats().hits, hits + 2);
+    }
+    remove_store_files(file);
+}
+TEST_CASE("KVStore streamed writes") {
+    std::string file = "./test-store-streamed.kvstore";
+    {
+        KVStore store(file);
+        file = store.getFilename();
+
+        std::vector<uint8_t> value(100 * 1000);
+        for (size_t i = 0; i < value.size(); ++i) {
+            value[i] = static_cast<uint8_t>(i * 13);
+        }
+        std::span<const uint8_t> all(value);
+
+        SUBCASE("in chunks") {
+            KVStore::KVEntryWriter writer;
+            REQUIRE_EQ(store.begin_entry("streamed", static_cast<uint32_t>(value.size()), "text/plain", writer), 0);
+            for (size_t offset = 0; offset < value.size(); offset += 4096) {
+                REQUIRE_EQ(writer.append(all.subspan(offset, std::min<size_t>(4096, value.size() - offset))), 0);
+            }
+            REQUIRE_EQ(writer.commit(), 0);
+
+            std::vector<uint8_t> r_value;
+            std::string r_mime;
+            REQUIRE_EQ(store.read_entry("streamed", r_value, r_mime), 0);
+            CHECK(r_value == value);
+            CHECK_EQ(r_mime, "text/plain");
+        }
+        SUBCASE("aborted entries are rolled back") {
+            REQUIRE_EQ(store.write_entry("before", all.first(10), "text/plain"), 0);
+            auto size_before = std::filesystem::file_size(file);
+            {
+                KVStore::KVEntryWriter writer;
+                REQUIRE_EQ(store.begin_entry("aborted", static_cast<uint32_t>(value.size()), "text/plain", writer), 0);
+                REQUIRE_EQ(writer.append(all.first(1000)), 0);
+                // goes out of scope without commit
+            }
+            CHECK_EQ(std::filesystem::file_size(file), size_before);
+            {
+                KVStore::KVEntryWriter writer;
+                REQUIRE_EQ(store.begin_entry("too-short", 10, "text/plain", writer), 0);
+                REQUIRE_EQ(writer.append(all.first(5)), 0);
+                CHECK_LT(writer.commit(), 0);
+            }
+            {
+                KVStore::KVEntryWriter writer;
+                REQUIRE_EQ(store.begin_entry("too-long", 10, "text/plain", writer), 0);
+                CHECK_LT(writer.append(all.first(11)), 0);
+            }
+            CHECK_EQ(std::filesystem::file_size(file), size_before);
+            REQUIRE_EQ(store.write_entry("after", all.first(20), "text/plain"), 0);
+
+            std::vector<uint8_t> r_value;
+            std::string r_mime;
+            CHECK_EQ(store.read_entry("aborted", r_value, r_mime), 1);
+            CHECK_EQ(store.read_entry("too-short", r_value, r_mime), 1);
+            REQUIRE_EQ(store.read_entry("after", r_value, r_mime), 0);
+            CHECK(std::equal(r_value.begin(), r_value.end(), value.begin(), value.begin() + 20));
+
+            // the file still indexes cleanly
+            REQUIRE_EQ(store.index(), 0);
+            REQUIRE_EQ(store.read_entry("before", r_value, r_mime), 0);
+            CHECK_EQ(r_value.size(), 10);
+        }
+        SUBCASE("a stalled upload doesn't block other writers") {
+            // collected in memory, and in a spill file
+            std::vector<uint8_t> large(3 * 1024 * 1024 + 7);
+            for (size_t i = 0; i < large.size(); ++i) {
+                large[i] = static_cast<uint8_t>(i * 7);
+            }
+            for (std::span<const uint8_t> streamed : { all, std::span<const uint8_t>(large) }) {
+                KVStore::KVEntryWriter writer;
+                REQUIRE_EQ(store.begin_entry("stalled", static_cast<uint32_t>(streamed.size()), "text/plain", writer), 0);
+                size_t half = streamed.size() / 2;
+                REQUIRE_EQ(writer.append(streamed.first(half)), 0);
+                // the rest of the upload takes its time, meanwhile others write
+                auto other = std::async(std::launch::async, [&] { return store.write_entry("other", all.first(10), "text/plain"); });
+                REQUIRE(other.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+                CHECK_EQ(other.get(), 0);
+                REQUIRE_EQ(writer.append(streamed.subspan(half, 1000)), 0);
+                REQUIRE_EQ(writer.append(streamed.subspan(half + 1000)), 0);
+                REQUIRE_EQ(writer.commit(), 0);
+                KVStore::KVVersion version {};
+                REQUIRE_EQ(store.version_of("stalled", version), 0);
+                CHECK(version == writer.version());
+
+                std::vector<uint8_t> r_value;
+                std::string r_mime;
+                REQUIRE_EQ(store.read_entry("stalled", r_value, r_mime), 0);
+                CHECK(std::equal(r_value.begin(), r_value.end(), streamed.begin(), streamed.end()));
+                CHECK_EQ(r_mime, "text/plain");
+                REQUIRE_EQ(store.read_entry("other", r_value, r_mime), 0);
+                CHECK_EQ(r_value.size(), 10);
+
+                // the condition is checked again when the entry is written
+                KVStore::KVEntryWriter conditional;
+                REQUIRE_EQ(store.begin_entry("other", static_cast<uint32_t>(streamed.size()), "text/plain", conditional, 0, { .exists = true }), 0);
+                REQUIRE_EQ(conditional.append(streamed), 0);
+                REQUIRE_EQ(store.delete_entry("other"), 0);
+                CHECK_EQ(conditional.commit(), 1);
+                CHECK_EQ(store.read_entry("other", r_value, r_mime), 1);
+            }
+            REQUIRE_EQ(store.index(), 0);
+            // spill files are gone
+            for (const auto& dir_entry : std::filesystem::directory_iterator(".")) {
+                CHECK_FALSE(dir_entry.path().filename().string().starts_with(std::filesystem::path(file).filename().string() + ".upload"));
+            }
+        }
+    }
+    remove_store_files(file);
+}
+
+TEST_CASE("KVStore value refs") {
+    for (bool mmap_reads : { false, true }) {
+        std::string file = "./test-store-refs.kvstore";
+        {
+            KVStore store(file, KVOptions { .mmap_reads = mmap_reads });
+            file = store.getFilename();
+
+            std::vector<uint8_t> value(300 * 1000);
+            for (size_t i = 0; i < value.size(); ++i) {
+                value[i] = static_cast<uint8_t>(i * 31);
+            }
+            REQUIRE_EQ(store.write_entry("big", value, "application/octet-stream"), 0);
+
+            KVStore::KVValueRef ref;
+            REQUIRE_EQ(store.lookup("big", ref), 0);
+            CHECK_EQ(ref.size(), value.size());
+            CHECK_EQ(ref.mime(), "application/octet-stream");
+            CHECK_EQ(ref.mapped_value() != nullptr, mmap_reads);
+
+            // read it back in odd-sized pieces
+            std::vector<uint8_t> r_value;
+            std::vector<uint8_t> chunk(7001);
+            for (uint64_t offset = 0; offset < ref.size(); offset += chunk.size()) {
+                size_t n = std::min<uint64_t>(chunk.size(), ref.size() - offset);
+                REQUIRE_EQ(ref.read(offset, chunk.data(), n), 0);
+                r_value.insert(r_value.end(), chunk.begin(), chunk.begin() + long(n));
+            }
+            CHECK(r_value == value);
+            CHECK_LT(ref.read(ref.size() - 10, chunk.data(), 11), 0);
+
+            // ranges, without checking (or touching) the rest of the value
+            REQUIRE_EQ(store.lookup("big", ref, false, true), 0);
+            CHECK_EQ(ref.mapped_value(), nullptr);
+            for (uint64_t offset : { uint64_t(123456), uint64_t(0), value.size() - chunk.size() }) {
+                REQUIRE_EQ(ref.read(offset, chunk.data(), chunk.size()), 0);
+                CHECK(std::equal(chunk.begin(), chunk.end(), value.begin() + long(offset)));
+            }
+            CHECK_EQ(store.lookup("missing", ref), 1);
+        }
+        remove_store_files(file);
+    }
+}
+
+TEST_CASE("KVStore merge while writing") {
+    std::string file = "./test-store-online-merge.kvstore";
+    {
+        KVStore store(file);
+        file = store.getFilename();
+        auto value_of = [](size_t key, size_t round) {
+            return std::vector<uint8_t>(100 + key % 50, static_cast<uint8_t>(key + round));
+        };
+        constexpr size_t key_count = 500;
+        for (size_t round = 0; round < 3; ++round) {
+            for (size_t i = 0; i < key_count; ++i) {
+                REQUIRE_EQ(store.write_entry(fmt::format("key-{}", i), value_of(i, round), "text/plain"), 0);
+            }
+        }
+        // keeps overwriting the first half of the keys and adding new ones while merging
+        std::atomic<bool> stop = false;
+        std::atomic<size_t> rounds = 3;
+        std::thread writer([&] {
+            for (size_t round = 3; !stop; ++round) {
+                for (size_t i = 0; i < key_count / 2; ++i) {
+                    REQUIRE_EQ(store.write_entry(fmt::format("key-{}", i), value_of(i, round), "text/plain"), 0);
+                }
+                REQUIRE_EQ(store.write_entry(fmt::format("new-{}", round), value_of(0, round), "text/plain"), 0);
+                rounds = round + 1;
+            }
+        });
+        for (size_t i = 0; i < 3; ++i) {
+            REQUIRE_EQ(store.merge(), 0);
+        }
+        stop = true;
+        writer.join();
+
+        auto check = [&](KVStore& s) {
+            std::vector<uint8_t> r_value;
+            std::string r_mime;
+            for (size_t i = 0; i < key_count; ++i) {
+                REQUIRE_EQ(s.read_entry(fmt::format("key-{}", i), r_value, r_mime), 0);
+                CHECK_EQ(r_value, value_of(i, i < key_count / 2 ? rounds - 1 : 2));
+                CHECK_EQ(r_mime, "text/plain");
+            }
+            for (size_t round = 3; round < rounds; ++round) {
+                REQUIRE_EQ(s.read_entry(fmt::format("new-{}", round), r_value, r_mime), 0);
+                CHECK_EQ(r_value, value_of(0, round));
+            }
+            CHECK_EQ(s.get_all_keys().size(), key_count + rounds - 3);
+        };
+        check(store);
+        // the keydir matches what's in the file
+        REQUIRE_EQ(store.index(), 0);
+        check(store);
+    }
+    remove_store_files(file);
+}
+
+TEST_CASE("KVStore segments") {
+    for (bool mmap_reads : { false, true }) {
+        std::string file = "./test-store-segments.kvstore";
+        KVOptions options { .mmap_reads = mmap_reads, .segment_size = 16 * 1024 };
+        auto value_of = [](size_t key, size_t round) {
+            return std::vector<uint8_t>(500 + key, static_cast<uint8_t>(key + round));
+        };
+        auto check = [&](KVStore& store, size_t rounds) {
+            std::vector<std::string> keys;
+            for (size_t i = 0; i < 100; ++i) {
+                keys.push_back(fmt::format("key-{}", i));
+                std::vector<uint8_t> r_value;
+                std::string r_mime;
+                REQUIRE_EQ(store.read_entry(keys.back(), r_value, r_mime), 0);
+                CHECK_EQ(r_value, value_of(i, i % 2 == 0 ? rounds - 1 : 0));
+            }
+            std::vector<std::optional<KVStore::KVValueView>> values;
+            REQUIRE_EQ(store.read_entries(keys, values), 0);
+            for (size_t i = 0; i < keys.size(); ++i) {
+                REQUIRE(values[i]);
+                CHECK_EQ(values[i]->value.size(), value_of(i, 0).size());
+            }
+        };
+        auto segment_count = [&] {
+            size_t count = 0;
+            for (const auto& dir_entry : std::filesystem::directory_iterator(".")) {
+                auto name = dir_entry.path().filename().string();
+                count += name.starts_with("test-store-segments.kvstore.kvs") && !name.ends_with(".hint") && !name.ends_with(".mime");
+            }
+            return count;
+        };
+        {
+            KVStore store(file, options);
+            file = store.getFilename();
+            // the even keys are overwritten a few times, the odd ones only written once
+            for (size_t round = 0; round < 3; ++round) {
+                for (size_t i = 0; i < 100; i += round == 0 ? 1 : 2) {
+                    REQUIRE_EQ(store.write_entry(fmt::format("key-{}", i), value_of(i, round), "text/plain"), 0);
+                }
+            }
+            CHECK_GT(segment_count(), 5);
+            check(store, 3);
+        }
+        {
+            KVStore store(file, options);
+            check(store, 3);
+            auto before = store.disk_size();
+            REQUIRE_EQ(store.merge(), 0);
+            // one merged segment, the empty first one and the new active one
+            CHECK_EQ(segment_count(), 3);
+            CHECK_LT(store.disk_size(), before);
+            check(store, 3);
+            // writes after the merge go to the new active segment
+            for (size_t i = 0; i < 100; i += 2) {
+                REQUIRE_EQ(store.write_entry(fmt::format("key-{}", i), value_of(i, 3), "text/plain"), 0);
+            }
+            check(store, 4);
+        }
+        {
+            KVStore store(file, options);
+            check(store, 4);
+            CHECK_EQ(store.get_all_keys().size(), 100);
+        }
+        remove_store_files(file);
+    }
+}
+
+TEST_CASE("KVStore segment limits") {
+    std::string file = "./test-store-segment-limits.kvstore";
+    std::vector<uint8_t> value(100, 'v');
+    {
+        KVStore store(file);
+        file = store.getFilename();
+        REQUIRE_EQ(store.write_entry("a", value, "text/plain"), 0);
+    }
+    // the last segment id the keydir holds is taken, so there's none to roll over to
+    REQUIRE_EQ(create_store_file(fmt::format("{}.{}", file, KeyDir::max_segment)), 0);
+    {
+        KVStore store(file, KVOptions { .segment_size = 1 });
+        CHECK_EQ(store.write_entry("b", value, "text/plain"), -EOVERFLOW);
+        KVStore::KVEntryWriter writer;
+        REQUIRE_EQ(store.begin_entry("b", 3 * 1024 * 1024, "text/plain", writer), 0);
+        std::vector<uint8_t> chunk(1024 * 1024, 'c');
+        for (int i = 0; i < 3; ++i) {
+            REQUIRE_EQ(writer.append(chunk), 0);
+        }
+        CHECK_EQ(writer.commit(), -EOVERFLOW);
+        std::vector<uint8_t> r_value;
+        std::string r_mime;
+        CHECK_EQ(store.read_entry("a", r_value, r_mime), 0);
+        CHECK_EQ(store.read_entry("b", r_value, r_mime), 1);
+    }
+    // and ids past it can't be opened
+    REQUIRE_EQ(create_store_file(fmt::format("{}.{}", file, KeyDir::max_segment + 1)), 0);
+    CHECK_THROWS_AS(KVStore(file), std::runtime_error);
+    remove_store_files(file);
+}
+
+TEST_CASE("KVStore compaction") {
+    std::string file = "./test-store-compaction.kvstore";
+    {
+        KVOptions options {
+            .segment_size = 16 * 1024,
+            .auto_compaction = true,
+            .compaction_ratio = 0.5,
+            .compaction_rate = 10 * 1024 * 1024,
+            .compaction_interval = std::chrono::milliseconds(10),
+        };
+        KVStore store(file, options);
+        file = store.getFilename();
+        std::vector<uint8_t> value(1000, 1);
+        for (size_t i = 0; i < 100; ++i) {
+            REQUIRE_EQ(store.write_entry(fmt::format("key-{}", i), value, "text/plain"), 0);
+        }
+        CHECK_EQ(store.dead_bytes(), 0);
+        // every overwrite makes the previous entry dead
+        for (size_t round = 2; round < 5; ++round) {
+            std::fill(value.begin(), value.end(), static_cast<uint8_t>(round));
+            for (size_t i = 0; i < 100; ++i) {
+                REQUIRE_EQ(store.write_entry(fmt::format("key-{}", i), value, "text/plain"), 0);
+            }
+        }
+        uint64_t entry_size = 5 * 4 + std::string("key-00").size() + value.size() + std::string("text/plain").size();
+        // the compaction may have started already, so only the upper bound is exact
+        CHECK_LE(store.dead_bytes(), 3 * 90 * entry_size + 3 * 10 * (entry_size - 1));
+        // the sealed segments are all garbage by now, so they're merged in the background
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (store.dead_bytes() > 16 * 1024 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        CHECK_LE(store.dead_bytes(), 16 * 1024);
+        for (size_t i = 0; i < 100; ++i) {
+            std::vector<uint8_t> r_value;
+            std::string r_mime;
+            REQUIRE_EQ(store.read_entry(fmt::format("key-{}", i), r_value, r_mime), 0);
+            CHECK_EQ(r_value, value);
+        }
+        // the accounting matches what indexing finds
+        uint64_t dead = store.dead_bytes();
+        REQUIRE_EQ(store.index(), 0);
+        CHECK_EQ(store.dead_bytes(), dead);
+    }
+    remove_store_files(file);
+}
+
+TEST_CASE("KVStore hint files") {
+    std::string file = "./test-store-hints.kvstore";
+    std::vector<uint8_t> value(1000, 7);
+    auto check_all = [&](KVStore& store, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            std::vector<uint8_t> r_value;
+            std::string r_mime;
+            REQUIRE_EQ(store.read_entry(fmt::format("key-{}", i), r_value, r_mime), 0);
+            CHECK_EQ(r_value.size(), value.size() + i);
+            CHECK_EQ(r_mime, "text/plain");
+        }
+    };
+    {
+        KVStore store(file);
+        file = store.getFilename();
+        for (size_t i = 0; i < 100; ++i) {
+            value.resize(1000 + i);
+            REQUIRE_EQ(store.write_entry(fmt::format("key-{}", i), value, "text/plain"), 0);
+        }
+        REQUIRE_EQ(store.checkpoint(), 0);
+        CHECK(std::filesystem::exists(hint_path(file)));
+        // written after the hints, found by scanning the rest of the file
+        for (size_t i = 100; i < 150; ++i) {
+            value.resize(1000 + i);
+            REQUIRE_EQ(store.write_entry(fmt::format("key-{}", i), value, "text/plain"), 0);
+        }
+        value.resize(1000);
+        REQUIRE_EQ(store.write_entry("key-0", value, "text/plain"), 0);
+    }
+    {
+        KVStore store(file);
+        CHECK_EQ(store.get_all_keys().size(), 150);
+        check_all(store, 150);
+        REQUIRE_EQ(store.write_entry("extra", value, "text/plain"), 0);
+    }
+    {
+        // the hints written on close are dropped, so the older ones (written on
+        // the last close) have to be combined with a scan of the rest
+        auto older = hint_path(file) + ".older";
+        std::filesystem::copy_file(hint_path(file), older);
+        {
+            KVStore store(file);
+            REQUIRE_EQ(store.write_entry("extra-2", value, "text/plain"), 0);
+        }
+        std::filesystem::rename(older, hint_path(file));
+        KVStore store(file);
+        CHECK_EQ(store.get_all_keys().size(), 152);
+        check_all(store, 150);
+    }
+    {
+        // hints from before a merge don't match the merged file
+        auto stale = hint_path(file) + ".stale";
+        std::filesystem::copy_file(hint_path(file), stale);
+        {
+            KVStore store(file);
+            REQUIRE_EQ(store.merge(), 0);
+        }
+        std::filesystem::rename(stale, hint_path(file));
+        KVStore store(file);
+        CHECK_EQ(store.get_all_keys().size(), 152);
+        check_all(store, 150);
+    }
+    {
+        std::filesystem::resize_file(hint_path(file), std::filesystem::file_size(hint_path(file)) - 1);
+        KVStore store(file);
+        CHECK_EQ(store.get_all_keys().size(), 152);
+        check_all(store, 150);
+    }
+    {
+        // a store which can't be indexed isn't opened, so it writes no hints which
+        // claim its segments have no keys
+        std::filesystem::remove(hint_path(file));
+        auto broken = file + ".1";
+        std::FILE* f = std::fopen(broken.c_str(), "wb");
+        REQUIRE(f);
+        std::fputs("not a kv store file", f);
+        std::fclose(f);
+        CHECK_THROWS_AS(KVStore(file), std::runtime_error);
+        CHECK_FALSE(std::filesystem::exists(hint_path(file)));
+        std::filesystem::remove(broken);
+        KVStore store(file);
+        CHECK_EQ(store.get_all_keys().size(), 152);
+        check_all(store, 150);
+    }
+    remove_store_files(file);
+}
+
+TEST_CASE("KVStore compression") {
+    std::string json;
+    for (int i = 0; i < 200; ++i) {
+        json += fmt::format(R"({{"id": {}, "name": "item", "tags": ["a", "b"]}},)", i);
+    }
+    std::vector<uint8_t> text(json.begin(), json.end());
+    std::vector<uint8_t> binary(text.size());
+    for (size_t i = 0; i < binary.size(); ++i) {
+        binary[i] = static_cast<uint8_t>((i * 2654435761u) >> 13);
+    }
+    std::vector<uint8_t> small(text.begin(), text.begin() + 100);
+    auto check_values = [&](KVStore& store) {
+        std::vector<uint8_t> r_value;
+        std::string r_mime;
+        REQUIRE_EQ(store.read_entry("text", r_value, r_mime), 0);
+        CHECK(r_value == text);
+        CHECK_EQ(r_mime, "application/json");
+        REQUIRE_EQ(store.read_entry("binary", r_value, r_mime), 0);
+        CHECK(r_value == binary);
+        REQUIRE_EQ(store.read_entry("small", r_value, r_mime), 0);
+        CHECK(r_value == small);
+
+        std::vector<std::string> keys { "binary", "text", "missing" };
+        std::vector<std::optional<KVStore::KVValueView>> views;
+        REQUIRE_EQ(store.read_entries(keys, views), 0);
+        REQUIRE(views[1]);
+        CHECK(std::equal(views[1]->value.begin(), views[1]->value.end(), text.begin(), text.end()));
+        CHECK_EQ(views[1]->mime, "application/json");
+        CHECK_FALSE(views[2]);
+
+        KVStore::KVValueRef ref;
+        REQUIRE_EQ(store.lookup("text", ref), 0);
+        CHECK_EQ(ref.size(), text.size());
+        CHECK(ref.encoding().empty());
+        r_value.resize(ref.size());
+        REQUIRE_EQ(ref.read(0, r_value.data(), r_value.size()), 0);
+        CHECK(r_value == text);
+
+        // as stored, to be sent with Content-Encoding
+        REQUIRE_EQ(store.lookup("text", ref, true), 0);
+        CHECK_EQ(ref.encoding(), "gzip");
+        CHECK_LT(ref.size(), text.size() / 4);
+        std::vector<uint8_t> stored(ref.size());
+        REQUIRE_EQ(ref.read(0, stored.data(), stored.size()), 0);
+        REQUIRE_EQ(gzip_decompress(stored, r_value), 0);
+        CHECK(r_value == text);
+        REQUIRE_EQ(store.lookup("binary", ref, true), 0);
+        CHECK(ref.encoding().empty());
+        CHECK_EQ(ref.size(), binary.size());
+    };
+    for (bool mmap_reads : { false, true }) {
+        std::string file = "./test-store-compression.kvstore";
+        KVOptions options { .mmap_reads = mmap_reads, .cache_size = mmap_reads ? 0 : uint64_t(16 * 1024 * 1024), .compression = true };
+        {
+            KVStore store(file, options);
+            file = store.getFilename();
+            REQUIRE_EQ(store.write_entry("text", text, "application/json"), 0);
+            REQUIRE_EQ(store.write_entry("binary", binary, "application/octet-stream"), 0);
+            REQUIRE_EQ(store.write_entry("small", small, "application/json"), 0);
+            // the json went from 10 KB to a few hundred bytes
+            CHECK_LT(store.disk_size(), binary.size() + small.size() + text.size() / 4);
+            check_values(store);
+        }
+        {
+            // the encoding comes from the hint file
+            KVStore store(file, options);
+            check_values(store);
+            REQUIRE_EQ(store.merge(), 0);
+            check_values(store);
+        }
+        std::filesystem::remove(hint_path(file));
+        {
+            // and from the entry
+            KVStore store(file, options);
+            check_values(store);
+        }
+        KVVerifyResult result;
+        REQUIRE_EQ(KVStore::verify(file, 1, result), 0);
+        CHECK(result.errors.empty());
+        remove_store_files(file);
+    }
+}
+
+TEST_CASE("KVStore mime interning") {
+    std::string file = "./test-store-mime.kvstore";
+    std::string long_mime = "text/plain; " + std::string(MimeTable::max_type_size, 'x');
+    std::vector<uint8_t> value(100, 'v');
+    {
+        KVStore store(file);
+        file = store.getFilename();
+        auto before = store.disk_size();
+        REQUIRE_EQ(store.write_entry("a", value, "application/octet-stream"), 0);
+        // interned types take no room in the entry
+        CHECK_EQ(store.disk_size(), before + 4 * 4 + 1 + value.size() + 4);
+        REQUIRE_EQ(store.write_entry("b", value, "application/octet-stream"), 0);
+        REQUIRE_EQ(store.write_entry("long", value, long_mime), 0);
+        REQUIRE_EQ(store.write_entry("none", value, ""), 0);
+        KVStore::KVEntryWriter writer;
+        REQUIRE_EQ(store.begin_entry("streamed", uint32_t(value.size()), "text/csv", writer), 0);
+        REQUIRE_EQ(writer.append(value), 0);
+        REQUIRE_EQ(writer.commit(), 0);
+    }
+    std::vector<std::pair<std::string, std::string>> expected {
+        { "a", "application/octet-stream" },
+        { "b", "application/octet-stream" },
+        { "long", long_mime },
+        { "none", "" },
+        { "streamed", "text/csv" },
+    };
+    auto check_mimes = [&](KVStore& store) {
+        std::vector<std::string> keys;
+        for (const auto& [key, mime] : expected) {
+            std::vector<uint8_t> r_value;
+            std::string r_mime;
+            REQUIRE_EQ(store.read_entry(key, r_value, r_mime), 0);
+            CHECK_EQ(r_value, value);
+            CHECK_EQ(r_mime, mime);
+            KVStore::KVValueView view;
+            REQUIRE_EQ(store.read_entry(key, view), 0);
+            CHECK_EQ(view.mime, mime);
+            KVStore::KVValueRef ref;
+            REQUIRE_EQ(store.lookup(key, ref), 0);
+            CHECK_EQ(ref.mime(), mime);
+            std::vector<uint8_t> streamed(ref.size());
+            CHECK_EQ(ref.read(0, streamed.data(), streamed.size()), 0);
+            keys.push_back(key);
+        }
+        std::vector<std::optional<KVStore::KVValueView>> views;
+        REQUIRE_EQ(store.read_entries(keys, views), 0);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            REQUIRE(views[i]);
+            CHECK_EQ(views[i]->mime, expected[i].second);
+        }
+    };
+    for (const auto& options : { KVOptions {}, KVOptions { .mmap_reads = true }, KVOptions { .cache_size = 1024 * 1024 } }) {
+        KVStore store(file, options);
+        check_mimes(store);
+        REQUIRE_EQ(store.merge(), 0);
+        check_mimes(store);
+    }
+    // without the table, the types are gone
+    std::filesystem::remove(file + ".mime");
+    {
+        KVStore store(file);
+        std::vector<uint8_t> r_value;
+        std::string r_mime;
+        CHECK_EQ(store.read_entry("a", r_value, r_mime), -EBADMSG);
+        REQUIRE_EQ(store.read_entry("long", r_value, r_mime), 0);
+        CHECK_EQ(r_mime, long_mime);
+    }
+    remove_store_files(file);
+}
+
+TEST_CASE("KVStore delete") {
+    std::string file = "./test-store-delete.kvstore";
+    std::vector<uint8_t> value(1000, 'v');
+    auto exists = [](KVStore& store, const std::string& key) -> bool {
+        std::vector<uint8_t> r_value;
+        std::string r_mime;
+        int ret = store.read_entry(key, r_value, r_mime);
+        KVStore::KVValueRef ref;
+        CHECK_EQ(store.lookup(key, ref), ret);
+        std::vector<std::optional<KVStore::KVValueView>> views;
+        CHECK_EQ(store.read_entries(std::vector<std::string> { key }, views), 0);
+        CHECK_EQ(views.at(0).has_value(), ret == 0);
+        return ret == 0;
+    };
+    {
+        KVStore store(file);
+        file = store.getFilename();
+        for (const auto* key : { "a", "b", "c" }) {
+            REQUIRE_EQ(store.write_entry(key, value, "text/plain"), 0);
+        }
+        CHECK_EQ(store.delete_entry("b"), 0);
+        CHECK_EQ(store.delete_entry("b"), 1);
+        CHECK_EQ(store.delete_entry("missing"), 1);
+        CHECK_FALSE(exists(store, "b"));
+        CHECK(exists(store, "a"));
+        CHECK_EQ(store.get_all_keys().size(), 2);
+        // a deleted key can be written again
+        CHECK_EQ(store.delete_entry("c"), 0);
+        REQUIRE_EQ(store.write_entry("c", value, "text/plain"), 0);
+        CHECK(exists(store, "c"));
     }
-    int ret = m_header.parse_from_file(m_file);
-    if (ret < 0) {
-        spdlog::info("error: failed to parse header of kvstore: {}", std::strerror(ret));
-        throw std::runtime_error("failed to parse header");
+    // from the hints, and from the entries
+    for (bool hints : { true, false }) {
+        if (!hints) {
+            std::filesystem::remove(hint_path(file));
+        }
+        KVStore store(file);
+        CHECK_FALSE(exists(store, "b"));
+        CHECK(exists(store, "c"));
+        CHECK_EQ(store.get_all_keys().size(), 2);
+        CHECK_EQ(store.key_count(), 2);
     }
-    auto [maj, min, pat] = m_header.get_version();
-    if (PRJ_VERSION_MAJOR != maj) {
-        spdlog::info("error: header version mismatch: {} (ours) != {} (file)", PRJ_VERSION_MAJOR, maj);
-        // TODO: Implement porting to newer versions
-        throw std::runtime_error("invalid kvstore version");
+    {
+        // a full merge drops the tombstone, and the key's entries before it
+        KVStore store(file);
+        KVMergeResult result;
+        REQUIRE_EQ(store.merge(result), 0);
+        CHECK_EQ(result.entries, 2);
+        CHECK_EQ(result.dropped_tombstones, 1);
+        // b, the first c, and both tombstones
+        CHECK_EQ(result.reclaimed_bytes, 2 * (4 * 4 + 1 + value.size() + 4) + 2 * (4 * 4 + 1 + 4));
+        CHECK_EQ(store.reclaimed_bytes(), result.reclaimed_bytes);
+        CHECK_EQ(store.dead_bytes(), 0);
+        CHECK_FALSE(exists(store, "b"));
+        CHECK_EQ(store.delete_entry("b"), 1);
+        // nothing left to drop
+        REQUIRE_EQ(store.merge(result), 0);
+        CHECK_EQ(result.dropped_tombstones, 0);
     }
-    index();
-}
-int KVStore::KVEntry::write_to_file(std::FILE* file) const {
-    assert(key_length.value == key.size());
-    assert(value_length.value == value.size());
-    assert(mime_length.value == mime.size());
-    int ret = file_write(key_length.bytes, sizeof(key_length.bytes), file);
-    if (ret != 0) {
-        return ret;
+    {
+        KVStore store(file);
+        CHECK_FALSE(exists(store, "b"));
+        CHECK_EQ(store.get_all_keys().size(), 2);
     }
-    ret = file_write(value_length.bytes, sizeof(value_length.bytes), file);
-    if (ret != 0) {
-        return ret;
+    KVVerifyResult result;
+    REQUIRE_EQ(KVStore::verify(file, 1, result), 0);
+    CHECK(result.errors.empty());
+    remove_store_files(file);
+}
+
+TEST_CASE("KVStore interrupted merge") {
+    std::string file = "./test-store-interrupted-merge.kvstore";
+    std::vector<uint8_t> value(1000, 'v');
+    auto exists = [](KVStore& store, const std::string& key) {
+        std::vector<uint8_t> r_value;
+        std::string r_mime;
+        return store.read_entry(key, r_value, r_mime) == 0;
+    };
+    {
+        KVStore store(file);
+        file = store.getFilename();
+        REQUIRE_EQ(store.write_entry("a", value, "text/plain"), 0);
+        REQUIRE_EQ(store.write_entry("b", value, "text/plain"), 0);
+        // a in the first segment, its tombstone in the second
+        REQUIRE_EQ(store.merge(), 0);
+        REQUIRE_EQ(store.delete_entry("a"), 0);
+        std::filesystem::copy_file(file, file + ".older");
+        KVMergeResult result;
+        REQUIRE_EQ(store.merge(result), 0);
+        CHECK_EQ(result.dropped_tombstones, 1);
+        CHECK_FALSE(std::filesystem::exists(merge_manifest_path(file)));
     }
-    ret = file_write(mime_length.bytes, sizeof(mime_length.bytes), file);
-    if (ret != 0) {
-        return ret;
+    auto temp_name = [&](uint32_t id) {
+        return std::filesystem::path(fmt::format("{}.{}.kv_temporary", file, id)).filename().string();
+    };
+    // as if it crashed after the merged file was moved into place, but before the first
+    // segment, which still has a, was replaced
+    std::filesystem::rename(file + ".older", file);
+    REQUIRE_EQ(create_store_file(file + ".kv_temporary_empty"), 0);
+    REQUIRE_EQ(write_merge_manifest(merge_manifest_path(file), 1, { 0, 1 }, temp_name(1)), 0);
+    {
+        KVStore store(file);
+        CHECK_FALSE(exists(store, "a"));
+        CHECK(exists(store, "b"));
+        CHECK_EQ(std::filesystem::file_size(file), header_size);
+        CHECK_FALSE(std::filesystem::exists(file + ".kv_temporary_empty"));
+        CHECK_FALSE(std::filesystem::exists(merge_manifest_path(file)));
     }
-    ret = file_write(key.data(), key.size(), file);
-    if (ret != 0) {
-        return ret;
+    // as if it crashed before the merged file was moved into place
+    auto temp_file = file + ".2.kv_temporary";
+    REQUIRE_EQ(create_store_file(temp_file), 0);
+    REQUIRE_EQ(write_merge_manifest(merge_manifest_path(file), 2, { 1, 2 }, temp_name(2)), 0);
+    {
+        KVStore store(file);
+        CHECK(exists(store, "b"));
+        CHECK_FALSE(std::filesystem::exists(temp_file));
+        CHECK(std::filesystem::exists(file + ".1"));
+        CHECK_FALSE(std::filesystem::exists(merge_manifest_path(file)));
     }
-    ret = file_write(value.data(), value.size(), file);
-    if (ret != 0) {
-        return errno;
+    // torn while it was written
+    std::FILE* torn = std::fopen(merge_manifest_path(file).c_str(), "wb");
+    REQUIRE(torn);
+    std::fwrite(merge_magic.data(), 1, merge_magic.size(), torn);
+    std::fclose(torn);
+    {
+        KVStore store(file);
+        CHECK(exists(store, "b"));
+        CHECK_FALSE(std::filesystem::exists(merge_manifest_path(file)));
     }
-    ret = file_write(mime.data(), mime.size(), file);
-    if (ret != 0) {
-        return errno;
+    remove_store_files(file);
+}
+
+TEST_CASE("KVStore scan") {
+    for (bool ordered_index : { true, false }) {
+        std::string file = "./test-store-scan.kvstore";
+        KVOptions options { .ordered_index = ordered_index };
+        std::vector<uint8_t> value(10, 'v');
+        using Keys = std::vector<std::string>;
+        auto check_scans = [](const KVStore& store) {
+            CHECK_EQ(store.scan({}), (Keys { "a", "a/1", "a/3", "a/4", "ab", "b/1", "b/2" }));
+            CHECK_EQ(store.scan({ .prefix = "a/" }), (Keys { "a/1", "a/3", "a/4" }));
+            CHECK_EQ(store.scan({ .prefix = "a/", .start = "a/2" }), (Keys { "a/3", "a/4" }));
+            CHECK_EQ(store.scan({ .prefix = "a/", .start = "" }), (Keys { "a/1", "a/3", "a/4" }));
+            CHECK_EQ(store.scan({ .start = "a/3", .end = "b/1" }), (Keys { "a/3", "a/4", "ab" }));
+            CHECK_EQ(store.scan({ .start = "a/3", .limit = 2 }), (Keys { "a/3", "a/4" }));
+            CHECK_EQ(store.scan({ .prefix = "b", .limit = 0 }), (Keys {}));
+            CHECK_EQ(store.scan({ .prefix = "c" }), (Keys {}));
+            CHECK_EQ(store.scan({ .start = "b/3" }), (Keys {}));
+        };
+        {
+            KVStore store(file, options);
+            file = store.getFilename();
+            CHECK_EQ(store.scan({}), (Keys {}));
+            for (const auto* key : { "b/2", "a/1", "ab", "a/2", "a/3", "b/1", "a" }) {
+                REQUIRE_EQ(store.write_entry(key, value, "text/plain"), 0);
+            }
+            // overwritten, deleted, and deleted and written again
+            REQUIRE_EQ(store.write_entry("a/1", value, "text/plain"), 0);
+            REQUIRE_EQ(store.delete_entry("a/2"), 0);
+            REQUIRE_EQ(store.delete_entry("a/4"), 1);
+            REQUIRE_EQ(store.delete_entry("b/1"), 0);
+            REQUIRE_EQ(store.write_entry("b/1", value, "text/plain"), 0);
+            std::vector<KVStore::KVWrite> writes {
+                { .key = "a/4", .value = value, .mime = "text/plain" },
+                { .key = "a/5", .value = value, .mime = "text/plain" },
+                { .key = "a/5", .value = {}, .mime = {}, .tombstone = true },
+            };
+            REQUIRE_EQ(store.write_entries(writes), 0);
+            check_scans(store);
+        }
+        {
+            // rebuilt on open, and unchanged by merging
+            KVStore store(file, options);
+            check_scans(store);
+            REQUIRE_EQ(store.merge(), 0);
+            check_scans(store);
+        }
+        remove_store_files(file);
     }
-    return 0;
 }
-int KVStore::KVEntry::read_from_file(std::FILE* file) {
-    int ret = file_read(key_length.bytes, sizeof(key_length.bytes), file);
-    if (ret != 0) {
-        return ret;
+
+TEST_CASE("KVStore expiry") {
+    std::string file = "./test-store-expiry.kvstore";
+    KVOptions options { .expiry_interval = std::chrono::milliseconds(10) };
+    std::vector<uint8_t> value(10, 'v');
+    using Keys = std::vector<std::string>;
+    uint64_t hour = KVStore::now() + 3600 * 1000;
+    auto wait_for_evictions = [](const KVStore& store, uint64_t count) {
+        for (int i = 0; i < 500 && store.evicted_keys() < count; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return store.evicted_keys();
+    };
+    auto check_reads = [&](KVStore& store) {
+        std::vector<uint8_t> read;
+        std::string mime;
+        CHECK_EQ(store.read_entry("keep", read, mime), 0);
+        CHECK_EQ(store.read_entry("long", read, mime), 0);
+        CHECK_EQ(read, value);
+        for (const auto* key : { "short", "streamed", "batch" }) {
+            CHECK_EQ(store.read_entry(key, read, mime), 1);
+            KVStore::KVValueRef ref;
+            CHECK_EQ(store.lookup(key, ref), 1);
+        }
+        std::vector<std::optional<KVStore::KVValueView>> views;
+        Keys keys { "long", "short" };
+        REQUIRE_EQ(store.read_entries(keys, views), 0);
+        CHECK(views[0]);
+        CHECK_FALSE(views[1]);
+        auto all = store.get_all_keys();
+        std::sort(all.begin(), all.end());
+        CHECK_EQ(all, (Keys { "keep", "long" }));
+        CHECK_EQ(store.scan({}), (Keys { "keep", "long" }));
+        CHECK_EQ(store.scan({ .limit = 1 }), (Keys { "keep" }));
+        CHECK_EQ(store.delete_entry("short"), 1);
+    };
+    {
+        KVStore store(file, options);
+        file = store.getFilename();
+        uint64_t soon = KVStore::now() + 1;
+        REQUIRE_EQ(store.write_entry("keep", value, "text/plain"), 0);
+        REQUIRE_EQ(store.write_entry("long", value, "text/plain", hour), 0);
+        REQUIRE_EQ(store.write_entry("short", value, "text/plain", soon), 0);
+        KVStore::KVEntryWriter writer;
+        REQUIRE_EQ(store.begin_entry("streamed", static_cast<uint32_t>(value.size()), "text/plain", writer, soon), 0);
+        REQUIRE_EQ(writer.append(value), 0);
+        REQUIRE_EQ(writer.commit(), 0);
+        KVStore::KVWrite batch { .key = "batch", .value = value, .mime = "text/plain", .expires_at = soon };
+        REQUIRE_EQ(store.write_entries({ &batch, 1 }), 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        check_reads(store);
+        // nothing older of them is left anywhere, so they go right away
+        CHECK_EQ(wait_for_evictions(store, 3), 3);
+        check_reads(store);
     }
-    ret = file_read(value_length.bytes, sizeof(value_length.bytes), file);
-    if (ret != 0) {
-        return ret;
+    {
+        // evicted keys aren't in the hints
+        KVStore store(file, options);
+        check_reads(store);
     }
-    ret = file_read(mime_length.bytes, sizeof(mime_length.bytes), file);
-    if (ret != 0) {
-        return ret;
+    std::filesystem::remove(hint_path(file));
+    {
+        // but still in the entries
+        KVStore store(file, options);
+        check_reads(store);
+        CHECK_EQ(wait_for_evictions(store, 3), 3);
+        // the expiry time is kept by merging
+        KVMergeResult result;
+        REQUIRE_EQ(store.merge(result), 0);
+        CHECK_EQ(result.entries, 2);
+        check_reads(store);
     }
-    key.resize(key_length.value, ' ');
-    ret = file_read(key.data(), key.size(), file);
-    if (ret != 0) {
-        return ret;
+    KVVerifyResult verified;
+    REQUIRE_EQ(KVStore::verify(file, 1, verified), 0);
+    CHECK(verified.errors.empty());
+    remove_store_files(file);
+
+    // a key which is written again before it expires keeps its first timer, which moves on
+    // to the new expiry time when it fires
+    {
+        KVStore store(file, options);
+        file = store.getFilename();
+        uint64_t start = KVStore::now();
+        REQUIRE_EQ(store.write_entry("renewed", value, "text/plain", start + 50), 0);
+        for (int i = 0; i < 10; ++i) {
+            REQUIRE_EQ(store.write_entry("renewed", value, "text/plain", start + 500), 0);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(150));
+        std::vector<uint8_t> read;
+        std::string mime;
+        if (KVStore::now() < start + 500) {
+            CHECK_EQ(store.read_entry("renewed", read, mime), 0);
+            CHECK_EQ(store.evicted_keys(), 0);
+        }
+        CHECK_EQ(wait_for_evictions(store, 1), 1);
+        CHECK_EQ(store.read_entry("renewed", read, mime), 1);
     }
-    value.resize(value_length.value);
-    ret = file_read(value.data(), value.size(), file);
-    if (ret != 0) {
-        return errno;
+    remove_store_files(file);
+
+    // an expired entry which hides an older one in an older segment stays until a merge drops both
+    options.segment_size = 1;
+    {
+        KVStore store(file, options);
+        file = store.getFilename();
+        REQUIRE_EQ(store.write_entry("a", value, "text/plain"), 0);
+        REQUIRE_EQ(store.write_entry("a", value, "text/plain", KVStore::now() + 1), 0);
+        REQUIRE_EQ(store.write_entry("b", value, "text/plain", KVStore::now() + 1), 0);
+        std::vector<uint8_t> read;
+        std::string mime;
+        CHECK_EQ(wait_for_evictions(store, 1), 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        CHECK_EQ(store.evicted_keys(), 1);
+        CHECK_EQ(store.read_entry("a", read, mime), 1);
+        KVMergeResult result;
+        REQUIRE_EQ(store.merge(result), 0);
+        CHECK_EQ(result.entries, 0);
+        CHECK_EQ(result.dropped_expired, 1);
+        CHECK_EQ(store.read_entry("a", read, mime), 1);
+        CHECK_EQ(store.scan({}), (Keys {}));
     }
-    mime.resize(mime_length.value, ' ');
-    ret = file_read(mime.data(), mime.size(), file);
-    if (ret != 0) {
-        return ret;
+    {
+        KVStore store(file, options);
+        CHECK_EQ(store.get_all_keys(), (Keys {}));
     }
-    return 0;
+    remove_store_files(file);
 }
 
-TEST_CASE("KVStore store / load") {
-    auto file = "./test-store.kvstore";
+TEST_CASE("KVStore versions") {
+    std::string file = "./test-store-versions.kvstore";
+    auto bytes = [](std::string_view str) { return std::span(reinterpret_cast<const uint8_t*>(str.data()), str.size()); };
+    KVStore::KVVersion first {};
+    KVStore::KVVersion second {};
     {
         KVStore store(file);
+        file = store.getFilename();
+        KVStore::KVWrite write { .key = "a", .value = bytes("one"), .mime = "text/plain", .out_version = &first };
+        REQUIRE_EQ(store.write_entries({ &write, 1 }), 0);
+        KVStore::KVVersion version {};
+        REQUIRE_EQ(store.version_of("a", version), 0);
+        CHECK(version == first);
+        KVStore::KVValueRef ref;
+        REQUIRE_EQ(store.lookup("a", ref), 0);
+        CHECK(ref.version() == first);
+        CHECK_EQ(store.version_of("missing", version), 1);
 
-        SUBCASE("normal string") {
-            std::string msg = "hello, world";
-            std::string key = "my-key";
-            std::string mime = "text/plain";
-            std::vector<uint8_t> value(msg.begin(), msg.end());
+        // the same value has the same version, another one doesn't
+        REQUIRE_EQ(store.write_entries({ &write, 1 }), 0);
+        CHECK(store.lookup("a", ref) == 0);
+        CHECK(ref.version() == first);
+        write.value = bytes("two");
+        write.out_version = &second;
+        REQUIRE_EQ(store.write_entries({ &write, 1 }), 0);
+        CHECK_FALSE(second == first);
 
-            int ret = store.write_entry(key, value, mime);
+        // compare-and-set
+        KVStore::KVWrite cas { .key = "a", .value = bytes("three"), .mime = "text/plain", .condition = { .exists = true, .versions = { &first, 1 } } };
+        CHECK_EQ(store.write_entries({ &cas, 1 }), 1);
+        cas.key = "missing";
+        cas.condition.versions = {};
+        CHECK_EQ(store.write_entries({ &cas, 1 }), 1);
+        CHECK_EQ(store.version_of("missing", version), 1);
+        // a batch is written entirely or not at all
+        std::vector<KVStore::KVWrite> batch {
+            { .key = "b", .value = bytes("b"), .mime = "text/plain" },
+            { .key = "a", .value = bytes("three"), .mime = "text/plain", .condition = { .exists = true, .versions = { &first, 1 } } },
+        };
+        CHECK_EQ(store.write_entries(batch), 1);
+        CHECK_EQ(store.version_of("b", version), 1);
+        batch[1].condition.versions = { &second, 1 };
+        CHECK_EQ(store.write_entries(batch), 0);
+        CHECK_EQ(store.version_of("b", version), 0);
 
-            CHECK_EQ(ret, 0);
+        // streamed writes check the condition when they start
+        KVStore::KVVersion current {};
+        REQUIRE_EQ(store.version_of("a", current), 0);
+        KVStore::KVEntryWriter writer;
+        CHECK_EQ(store.begin_entry("a", 4, "text/plain", writer, 0, { .exists = true, .versions = { &second, 1 } }), 1);
+        REQUIRE_EQ(store.begin_entry("a", 4, "text/plain", writer, 0, { .exists = true, .versions = { &current, 1 } }), 0);
+        REQUIRE_EQ(writer.append(bytes("four")), 0);
+        REQUIRE_EQ(writer.commit(), 0);
+        REQUIRE_EQ(store.version_of("a", version), 0);
+        CHECK(version == writer.version());
+        second = version;
+    }
+    auto check_versions = [&](const KVStore& store) {
+        KVStore::KVVersion version {};
+        REQUIRE_EQ(store.version_of("a", version), 0);
+        CHECK(version == second);
+    };
+    {
+        // from the hints, the entries, and after merging
+        KVStore store(file);
+        check_versions(store);
+    }
+    std::filesystem::remove(hint_path(file));
+    {
+        KVStore store(file);
+        check_versions(store);
+        REQUIRE_EQ(store.merge(), 0);
+        check_versions(store);
+    }
+    remove_store_files(file);
 
-            std::vector<uint8_t> r_value;
-            std::string r_mime;
-            ret = store.read_entry(key, r_value, r_mime);
-            CHECK_EQ(ret, 0);
-            CHECK_EQ(mime, r_mime);
-            CHECK(std::equal(value.begin(), value.end(), r_value.begin(), r_value.end()));
+    // concurrent increments of a counter only ever succeed against the latest value
+    {
+        KVStore store(file);
+        file = store.getFilename();
+        REQUIRE_EQ(store.write_entry("counter", bytes("0"), "text/plain"), 0);
+        constexpr int threads = 4;
+        constexpr int increments = 50;
+        std::vector<std::thread> workers;
+        std::atomic<int> conflicts = 0;
+        std::latch start(threads);
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&] {
+                start.arrive_and_wait();
+                for (int done = 0; done < increments;) {
+                    KVStore::KVValueRef ref;
+                    if (store.lookup("counter", ref) != 0) {
+                        return;
+                    }
+                    std::string count(ref.size(), '\0');
+                    if (ref.read(0, count.data(), count.size()) != 0) {
+                        return;
+                    }
+                    auto version = ref.version();
+                    // let the others get in between
+                    std::this_thread::yield();
+                    auto next = std::to_string(std::stoi(count) + 1);
+                    KVStore::KVWrite write { .key = "counter", .value = bytes(next), .mime = "text/plain", .condition = { .exists = true, .versions = { &version, 1 } } };
+                    int ret = store.write_entries({ &write, 1 });
+                    if (ret == 0) {
+                        ++done;
+                    } else if (ret == 1) {
+                        ++conflicts;
+                    } else {
+                        return;
+                    }
+                }
+            });
         }
-        SUBCASE("normal binary") {
-            std::string key = "my-key";
-            std::string mime = "application/octet-stream";
-            std::vector<uint8_t> value = { 0, 5, 3, 134, 5, 0, 1, 0, 0 };
-
-            int ret = store.write_entry(key, value, mime);
-
-            CHECK_EQ(ret, 0);
-
-            std::vector<uint8_t> r_value;
-            std::string r_mime;
-            ret = store.read_entry(key, r_value, r_mime);
-            CHECK_EQ(ret, 0);
-            CHECK_EQ(mime, r_mime);
-            CHECK(std::equal(value.begin(), value.end(), r_value.begin(), r_value.end()));
+        for (auto& worker : workers) {
+            worker.join();
         }
-        SUBCASE("multiple same key same value") {
-            std::string key = "my-key";
-            std::string mime = "application/octet-stream";
-            std::vector<uint8_t> value = { 0, 5, 3, 134, 5, 0, 1, 0, 0 };
-
-            for (size_t i = 0; i < 10; ++i) {
-                int ret = store.write_entry(key, value, mime);
-                CHECK_EQ(ret, 0);
-            }
+        std::vector<uint8_t> value;
+        std::string mime;
+        REQUIRE_EQ(store.read_entry("counter", value, mime), 0);
+        CHECK_EQ(std::string(value.begin(), value.end()), std::to_string(threads * increments));
+        spdlog::info("compare-and-set: {} conflicts in {} increments", conflicts.load(), threads * increments);
+    }
+    remove_store_files(file);
+}
 
-            std::vector<uint8_t> r_value;
-            std::string r_mime;
-            int ret = store.read_entry(key, r_value, r_mime);
-            CHECK_EQ(ret, 0);
-            CHECK_EQ(mime, r_mime);
-            CHECK(std::equal(value.begin(), value.end(), r_value.begin(), r_value.end()));
+TEST_CASE("KVStore checksums") {
+    std::string file = "./test-store-checksums.kvstore";
+    std::vector<uint8_t> value(1000, 'a');
+    std::vector<uint8_t> bad_value(100 * 1000, 'b');
+    {
+        KVStore store(file);
+        file = store.getFilename();
+        REQUIRE_EQ(store.write_entry("a", value, "text/plain"), 0);
+        REQUIRE_EQ(store.write_entry("b", bad_value, "text/plain"), 0);
+        REQUIRE_EQ(store.write_entry("c", value, "text/plain"), 0);
+    }
+    // flip a bit in the middle of the value of "b"
+    auto flip_at = [&](uint64_t offset) {
+        std::FILE* f = std::fopen(file.c_str(), "r+b");
+        REQUIRE(f);
+        REQUIRE_EQ(file_seek(f, offset), 0);
+        int byte = std::fgetc(f);
+        REQUIRE_EQ(file_seek(f, offset), 0);
+        std::fputc(byte ^ 0x10, f);
+        std::fclose(f);
+    };
+    // text/plain is interned, so the entries hold no mime
+    uint64_t b_value = header_size + (5 * 4 + 1 + value.size()) + 4 * 4 + 1;
+    flip_at(b_value + bad_value.size() / 2);
+    for (bool mmap_reads : { false, true }) {
+        KVStore store(file, KVOptions { .mmap_reads = mmap_reads, .cache_size = mmap_reads ? 0 : uint64_t(64 * 1024 * 1024) });
+        std::vector<uint8_t> r_value;
+        std::string r_mime;
+        CHECK_EQ(store.read_entry("a", r_value, r_mime), 0);
+        CHECK_EQ(store.read_entry("b", r_value, r_mime), -EBADMSG);
+        CHECK_EQ(store.read_entry("c", r_value, r_mime), 0);
+        KVStore::KVValueRef ref;
+        CHECK_EQ(store.lookup("b", ref), -EBADMSG);
+    }
+    for (bool mmap_reads : { false, true }) {
+        // streamed from the file (or read in parts from the mapping), the read which
+        // completes the value fails
+        KVStore store(file, KVOptions { .mmap_reads = mmap_reads });
+        KVStore::KVValueRef ref;
+        REQUIRE_EQ(store.lookup("b", ref, false, true), 0);
+        CHECK_EQ(ref.mapped_value(), nullptr);
+        std::vector<uint8_t> chunk(64 * 1024);
+        CHECK_EQ(ref.read(0, chunk.data(), chunk.size()), 0);
+        CHECK_EQ(ref.read(chunk.size(), chunk.data(), ref.size() - chunk.size()), -EBADMSG);
+        // a range which isn't read from the start can't be checked
+        REQUIRE_EQ(store.lookup("b", ref, false, true), 0);
+        CHECK_EQ(ref.read(ref.size() - 10, chunk.data(), 10), 0);
+        CHECK_EQ(chunk[9], 'b');
+    }
+    // without hints, the active segment is scanned and checked. the broken
+    // value isn't the last entry, so it stays (and fails to read)
+    std::filesystem::remove(hint_path(file));
+    uint64_t good_size = std::filesystem::file_size(file);
+    {
+        KVStore store(file);
+        CHECK_EQ(store.get_all_keys().size(), 3);
+        CHECK_EQ(std::filesystem::file_size(file), good_size);
+    }
+    // a torn entry at the end is cut off
+    for (size_t torn : { 3u, 20u, 1020u }) {
+        std::filesystem::remove(hint_path(file));
+        {
+            KVStore store(file);
+            REQUIRE_EQ(store.write_entry("torn", value, "text/plain"), 0);
         }
-        SUBCASE("multiple same key different value") {
-            std::string key = "my-key";
-            std::string mime = "application/octet-stream";
-            std::vector<uint8_t> value = { 0, 5, 3, 134, 5, 0, 1, 0, 0 };
-
-            for (size_t i = 0; i < 10; ++i) {
-                std::vector<uint8_t> temp_value = {
-                    static_cast<unsigned char>(i),
-                    static_cast<unsigned char>(i * 2),
-                    static_cast<unsigned char>(i * 3)
-                };
-                int ret = store.write_entry(key, temp_value, mime);
-                CHECK_EQ(ret, 0);
-            }
-
-            // finally write the last value, which is the one we then expect to read
-            int ret = store.write_entry(key, value, mime);
-            CHECK_EQ(ret, 0);
-
-            std::vector<uint8_t> r_value;
-            std::string r_mime;
-            ret = store.read_entry(key, r_value, r_mime);
-            CHECK_EQ(ret, 0);
-            CHECK_EQ(mime, r_mime);
-            CHECK(std::equal(value.begin(), value.end(), r_value.begin(), r_value.end()));
+        std::filesystem::remove(hint_path(file));
+        std::filesystem::resize_file(file, good_size + torn);
+        {
+            KVStore store(file);
+            CHECK_EQ(std::filesystem::file_size(file), good_size);
+            CHECK_EQ(store.recovery().good_end, good_size);
+            CHECK_EQ(store.recovery().truncated_bytes, torn);
+            CHECK_EQ(store.get_all_keys().size(), 3);
+            REQUIRE_EQ(store.write_entry("d", value, "text/plain"), 0);
         }
-        SUBCASE("multiple writes, merge, read") {
-            std::string key = "my-key";
-            std::string mime = "application/octet-stream";
-            std::vector<uint8_t> value = { 0, 5, 3, 134, 5, 0, 1, 0, 0 };
-
-            for (size_t i = 0; i < 10; ++i) {
-                std::vector<uint8_t> temp_value = {
-                    static_cast<unsigned char>(i),
-                    static_cast<unsigned char>(i * 2),
-                    static_cast<unsigned char>(i * 3)
-                };
-                int ret = store.write_entry(key, temp_value, mime);
-                CHECK_EQ(ret, 0);
-            }
-
-            // finally write the last value, which is the one we then expect to read
-            int ret = store.write_entry(key, value, mime);
-            CHECK_EQ(ret, 0);
+        std::filesystem::remove(hint_path(file));
+        KVStore store(file);
+        std::vector<uint8_t> r_value;
+        std::string r_mime;
+        CHECK_EQ(store.read_entry("d", r_value, r_mime), 0);
+        CHECK_EQ(store.read_entry("torn", r_value, r_mime), 1);
+        std::filesystem::resize_file(file, good_size);
+    }
+    // so is a last entry whose value went bad
+    flip_at(good_size - 100);
+    std::filesystem::remove(hint_path(file));
+    {
+        KVStore store(file);
+        CHECK_EQ(store.get_all_keys().size(), 2);
+    }
+    remove_store_files(file);
+}
 
-            store.merge();
+TEST_CASE("KVStore verify") {
+    std::string file = "./test-store-verify.kvstore";
+    std::vector<uint8_t> value(1000, 'v');
+    {
+        KVStore store(file, KVOptions { .segment_size = 64 * 1024 });
+        file = store.getFilename();
+        for (size_t i = 0; i < 500; ++i) {
+            REQUIRE_EQ(store.write_entry(fmt::format("key-{}", i), value, "text/plain"), 0);
+        }
+    }
+    uint64_t total = std::filesystem::file_size(file) - header_size;
+    for (size_t id = 1; std::filesystem::exists(fmt::format("{}.{}", file, id)); ++id) {
+        total += std::filesystem::file_size(fmt::format("{}.{}", file, id)) - header_size;
+    }
+    CHECK_GT(total, std::filesystem::file_size(file));
+    for (size_t threads : { 1u, 4u }) {
+        KVVerifyResult result;
+        REQUIRE_EQ(KVStore::verify(file, threads, result), 0);
+        CHECK_EQ(result.entries, 500);
+        CHECK_EQ(result.bytes, total);
+        CHECK(result.errors.empty());
+    }
+    auto flip_at = [&](const std::string& path, uint64_t offset) {
+        std::FILE* f = std::fopen(path.c_str(), "r+b");
+        REQUIRE(f);
+        REQUIRE_EQ(file_seek(f, offset), 0);
+        int byte = std::fgetc(f);
+        REQUIRE_EQ(file_seek(f, offset), 0);
+        std::fputc(byte ^ 0x01, f);
+        std::fclose(f);
+    };
+    // the value of the first entry, and the head of the first entry of the second segment
+    flip_at(file, header_size + 4 * 4 + 5 + 10);
+    flip_at(file + ".1", header_size + 1);
+    KVVerifyResult result;
+    REQUIRE_EQ(KVStore::verify(file, 4, result), 0);
+    REQUIRE_EQ(result.errors.size(), 2);
+    CHECK_NE(result.errors[0].find("key-0"), std::string::npos);
+    CHECK_NE(result.errors[1].find("can't be read"), std::string::npos);
+    remove_store_files(file);
+}
 
-            std::vector<uint8_t> r_value;
-            std::string r_mime;
-            ret = store.read_entry(key, r_value, r_mime);
-            CHECK_EQ(ret, 0);
-            CHECK_EQ(mime, r_mime);
-            CHECK(std::equal(value.begin(), value.end(), r_value.begin(), r_value.end()));
+TEST_CASE("KVStore migration from v2") {
+    std::string file = "./test-store-v2.kvs";
+    // a v2 store with two segments, the second one ending in a partial entry
+    auto write_v2 = [](const std::string& path, const std::vector<std::array<std::string, 3>>& entries, size_t torn) {
+        std::FILE* f = std::fopen(path.c_str(), "wb");
+        REQUIRE(f);
+        KVStore::KVHeader hdr;
+        hdr.set_version(2, 0, 0);
+        REQUIRE_EQ(hdr.write_to_file(f), 0);
+        for (const auto& [key, entry_value, mime] : entries) {
+            std::array<uint32_t, 3> lengths { uint32_t(key.size()), uint32_t(entry_value.size()), uint32_t(mime.size()) };
+            REQUIRE_EQ(file_write(lengths.data(), sizeof(lengths), f), 0);
+            REQUIRE_EQ(file_write(key.data(), key.size(), f), 0);
+            REQUIRE_EQ(file_write(entry_value.data(), entry_value.size(), f), 0);
+            REQUIRE_EQ(file_write(mime.data(), mime.size(), f), 0);
         }
+        std::array<uint8_t, 16> junk {};
+        junk[0] = 5;
+        REQUIRE_EQ(file_write(junk.data(), torn, f), 0);
+        std::fclose(f);
+    };
+    write_v2(file, { { "a", "first", "text/plain" }, { "b", "second", "text/html" } }, 0);
+    write_v2(file + ".1", { { "a", "third", "text/plain" } }, 7);
+    {
+        KVStore store(file);
+        CHECK_EQ(store.get_all_keys().size(), 2);
+        std::vector<uint8_t> r_value;
+        std::string r_mime;
+        REQUIRE_EQ(store.read_entry("a", r_value, r_mime), 0);
+        CHECK_EQ(std::string(r_value.begin(), r_value.end()), "third");
+        REQUIRE_EQ(store.read_entry("b", r_value, r_mime), 0);
+        CHECK_EQ(std::string(r_value.begin(), r_value.end()), "second");
+        CHECK_EQ(r_mime, "text/html");
+        REQUIRE_EQ(store.write_entry("c", r_value, "text/plain"), 0);
+    }
+    {
+        // migrated entries carry their mime type, merging interns it
+        KVStore store(file);
+        CHECK_EQ(store.get_all_keys().size(), 3);
+        auto before = store.disk_size();
+        CHECK_EQ(store.merge(), 0);
+        CHECK_LT(store.disk_size(), before);
+        std::vector<uint8_t> r_value;
+        std::string r_mime;
+        REQUIRE_EQ(store.read_entry("a", r_value, r_mime), 0);
+        CHECK_EQ(std::string(r_value.begin(), r_value.end()), "third");
     }
-    std::filesystem::remove(file);
+    {
+        KVStore store(file);
+        std::vector<uint8_t> r_value;
+        std::string r_mime;
+        REQUIRE_EQ(store.read_entry("b", r_value, r_mime), 0);
+        CHECK_EQ(r_mime, "text/html");
+    }
+    KVVerifyResult result;
+    REQUIRE_EQ(KVStore::verify(file, 1, result), 0);
+    CHECK(result.errors.empty());
+    // the merged entries only refer to the table now
+    std::filesystem::remove(file + ".mime");
+    {
+        KVStore store(file);
+        std::vector<uint8_t> r_value;
+        std::string r_mime;
+        CHECK_EQ(store.read_entry("b", r_value, r_mime), -EBADMSG);
+    }
+    remove_store_files(file);
 }
+
 bool KVStore::KVHeader::is_header(std::FILE* file) {
     int ret = std::fseek(file, 0, SEEK_SET);
     if (ret < 0) {
@@ -489,6 +4556,57 @@ TEST_CASE("KVHeader version") {
     CHECK_EQ(pat, 53);
 }
 
+TEST_CASE("KVStore format version") {
+    std::string file = "./test-store-format.kvstore";
+    auto format_of = [](const std::string& path) {
+        KVStore::KVHeader hdr;
+        std::FILE* f = std::fopen(path.c_str(), "rb");
+        CHECK(f);
+        if (!f) {
+            return uint8_t(0xff);
+        }
+        CHECK_EQ(hdr.parse_from_file(f), 0);
+        std::fclose(f);
+        auto [maj, min, pat] = hdr.get_version();
+        CHECK_EQ(maj, PRJ_VERSION_MAJOR);
+        return min;
+    };
+    std::vector<uint8_t> value(10, 'v');
+    {
+        KVStore store(file);
+        file = store.getFilename();
+        // without a mime type, nothing is interned
+        REQUIRE_EQ(store.write_entry("a", value, ""), 0);
+        CHECK_EQ(format_of(file), format_checksums);
+        REQUIRE_EQ(store.write_entry("b", value, "text/plain"), 0);
+        CHECK_EQ(format_of(file), format_interned_mimes);
+        // merging the first segment away keeps the format
+        REQUIRE_EQ(store.merge(), 0);
+        CHECK_EQ(format_of(file), format_interned_mimes);
+        REQUIRE_EQ(store.delete_entry("a"), 0);
+        CHECK_EQ(format_of(file), format_tombstones);
+        // it stays raised, even once the tombstone is gone
+        REQUIRE_EQ(store.merge(), 0);
+        CHECK_EQ(format_of(file), format_tombstones);
+        REQUIRE_EQ(store.write_entry("c", value, "text/plain", KVStore::now() + 60 * 1000), 0);
+        CHECK_EQ(format_of(file), format_expiry);
+    }
+    {
+        KVStore store(file);
+        std::vector<uint8_t> r_value;
+        std::string r_mime;
+        CHECK_EQ(store.read_entry("b", r_value, r_mime), 0);
+        CHECK_EQ(r_mime, "text/plain");
+    }
+    // a store written by a newer version isn't opened
+    REQUIRE_EQ(write_format(file, latest_format + 1), 0);
+    CHECK_THROWS_AS(KVStore(file), std::runtime_error);
+    KVVerifyResult result;
+    REQUIRE_EQ(KVStore::verify(file, 1, result), 0);
+    CHECK_FALSE(result.errors.empty());
+    remove_store_files(file);
+}
+
 int KVStore::KVHeader::write_to_file(std::FILE* file) {
     int ret = std::fseek(file, 0, SEEK_SET);
     if (ret < 0) {
@@ -507,11 +4625,109 @@ int KVStore::KVHeader::write_to_file(std::FILE* file) {
     return 0;
 }
 
+int KVStore::version_of(const std::string& key, KVVersion& out_version) const {
+    const auto& shard = m_shards[shard_of(key)];
+    std::shared_lock lock(shard.mtx);
+    auto found = shard.keydir.find(key);
+    if (!found || !found->live(now())) {
+        return 1;
+    }
+    out_version = found->version();
+    return 0;
+}
+
 std::vector<std::string> KVStore::get_all_keys() const {
     std::vector<std::string> result;
-    for (const auto& [key, pos] : m_keydir) {
-        (void)pos;
-        result.push_back(key);
+    uint64_t time = now();
+    // a shard at a time, so writers only ever wait for the copy of one shard
+    for (const auto& shard : m_shards) {
+        std::shared_lock lock(shard.mtx);
+        shard.keydir.for_each([&](std::string_view key, const KVLocation& location) {
+            if (location.live(time)) {
+                result.emplace_back(key);
+            }
+        });
+    }
+    return result;
+}
+
+size_t KVStore::key_count() const {
+    size_t count = 0;
+    for (const auto& shard : m_shards) {
+        std::shared_lock lock(shard.mtx);
+        count += shard.keydir.size() - shard.keydir.tombstones();
+    }
+    return count;
+}
+
+std::vector<std::string> KVStore::scan(const KVScanRange& range) const {
+    std::vector<std::string> result;
+    if (range.limit == 0) {
+        return result;
+    }
+    // nothing before the prefix starts with it
+    std::string_view start = std::max(range.start, range.prefix);
+    auto in_range = [&](std::string_view key) {
+        return key.starts_with(range.prefix) && (range.end.empty() || key < range.end);
+    };
+    uint64_t time = now();
+    if (!m_options.ordered_index) {
+        for (const auto& shard : m_shards) {
+            std::shared_lock lock(shard.mtx);
+            shard.keydir.for_each([&](std::string_view key, const KVLocation& location) {
+                if (location.live(time) && key >= start && in_range(key)) {
+                    result.emplace_back(key);
+                }
+            });
+        }
+        std::sort(result.begin(), result.end());
+        if (result.size() > range.limit) {
+            result.resize(range.limit);
+        }
+        return result;
+    }
+    if (!m_expiring) {
+        std::shared_lock lock(m_index_mtx);
+        m_index.for_each_from(start, [&](std::string_view key) {
+            // the keys are in order, so once one is out of range, all following ones are
+            if (!in_range(key)) {
+                return false;
+            }
+            result.emplace_back(key);
+            return result.size() < range.limit;
+        });
+        return result;
+    }
+    // the index has keys which expired but weren't evicted yet. they're checked against
+    // the keydir, which can't be locked while holding the index, so it's done in batches
+    std::string from(start);
+    for (bool done = false; !done;) {
+        std::vector<std::string> batch;
+        size_t wanted = range.limit - result.size();
+        {
+            std::shared_lock lock(m_index_mtx);
+            m_index.for_each_from(from, [&](std::string_view key) {
+                if (!in_range(key)) {
+                    return false;
+                }
+                batch.emplace_back(key);
+                return batch.size() < wanted;
+            });
+        }
+        done = batch.size() < wanted;
+        if (!batch.empty()) {
+            // the smallest key after the last one
+            from = batch.back() + '\0';
+        }
+        for (auto& key : batch) {
+            const auto& shard = m_shards[shard_of(key)];
+            std::shared_lock lock(shard.mtx);
+            auto location = shard.keydir.find(key);
+            if (location && location->live(time)) {
+                result.push_back(std::move(key));
+            }
+        }
+        done = done || result.size() == range.limit;
     }
     return result;
 }
@@ -520,21 +4736,30 @@ std::string KVStore::getFilename() {
     return m_filename;
 }
 
-KVStore& KVStore::operator=(KVStore&& other) {
-    if (m_file) {
-        std::fclose(m_file);
+uint64_t KVStore::dead_bytes() {
+    std::unique_lock lock(m_mtx);
+    std::shared_lock segments_lock(m_segments_mtx);
+    uint64_t dead = 0;
+    for (const auto& [id, segment] : m_segments) {
+        uint64_t size = segment_end(*segment);
+        if (size > header_size) {
+            dead += size - header_size - segment->live_bytes;
+        }
     }
-    m_file = std::move(other.m_file);
-    other.m_file = nullptr;
-    m_filename = std::move(other.m_filename);
-    m_header = std::move(other.m_header);
-    m_keydir = std::move(other.m_keydir);
-    return *this;
+    return dead;
 }
-KVStore::KVStore(KVStore&& other)
-    : m_file(std::move(other.m_file))
-    , m_filename(std::move(other.m_filename))
-    , m_header(std::move(other.m_header))
-    , m_keydir(std::move(other.m_keydir)) {
-    other.m_file = nullptr;
+ValueCacheStats KVStore::cache_stats() const {
+    return m_cache ? m_cache->stats() : ValueCacheStats {};
+}
+KVRecovery KVStore::recovery() const {
+    return KVRecovery { .good_end = m_good_end, .truncated_bytes = m_truncated_bytes };
+}
+uint64_t KVStore::disk_size() {
+    std::unique_lock lock(m_mtx);
+    std::shared_lock segments_lock(m_segments_mtx);
+    uint64_t size = 0;
+    for (const auto& [id, segment] : m_segments) {
+        size += segment_end(*segment);
+    }
+    return size;
 }
@@ -1,42 +1,189 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
 #include <fmt/core.h>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <thread>
 #include <vector>
 #include <spdlog/spdlog.h>
 
+#include "Compression.h"
+#include "File.h"
+#include "KeyDir.h"
+#include "KeyIndex.h"
+#include "MimeTable.h"
+#include "TimerWheel.h"
+#include "ValueCache.h"
+
+// when written entries are flushed to the disk. in all cases, an entry has
+// been handed to the OS (and is visible to readers) once its write returns.
+enum class KVDurability {
+    // never sync explicitly, the OS writes the data back whenever it likes
+    None,
+    // sync every group of concurrent writes before any of them return
+    Batch,
+    // sync in the background every KVOptions::sync_interval
+    Interval,
+};
+
+struct KVOptions {
+    // serve reads from a memory mapping of the store file instead of copying
+    // them out with pread. falls back to pread where mmap isn't available.
+    bool mmap_reads { false };
+    KVDurability durability { KVDurability::None };
+    std::chrono::milliseconds sync_interval { 1000 };
+    // once the active segment file reaches this size, it's sealed and a new one is started
+    uint64_t segment_size { 256 * 1024 * 1024 };
+    // merge sealed segments in the background, once at least compaction_ratio of
+    // a segment is dead (overwritten entries), or compaction_waste bytes overall
+    bool auto_compaction { false };
+    double compaction_ratio { 0.5 };
+    uint64_t compaction_waste { 1024ull * 1024 * 1024 };
+    // how many bytes of segments a single background merge takes on at most
+    uint64_t compaction_max_bytes { 1024ull * 1024 * 1024 };
+    // how many bytes per second a background merge writes at most, 0 for no limit
+    uint64_t compaction_rate { 0 };
+    // how often to check whether there's something to compact
+    std::chrono::milliseconds compaction_interval { 10000 };
+    // bytes of recently read values to keep in memory, 0 for no cache. only values
+    // read with pread are cached, mmap reads don't copy them in the first place
+    uint64_t cache_size { 0 };
+    // gzip values of a compressible mime type (see is_compressible_mime) of at least
+    // compression_min_size bytes, if that saves at least an eighth. streamed values
+    // which are spilled to a file (see KVEntryWriter) are stored as they are
+    bool compression { false };
+    uint64_t compression_min_size { 256 };
+    // keep the keys in order as well (see KeyIndex), so that scans don't sort all
+    // keys. costs about 16 bytes per key, plus the key
+    bool ordered_index { true };
+    // how often keys which expired are evicted from the keydir (see KVStore::write_entry).
+    // expired keys are never read, this only frees their memory
+    std::chrono::milliseconds expiry_interval { 1000 };
+    // for tests: called instead of syncing the active segment after a write with
+    // KVDurability::Batch, returns like AppendFile::sync
+    std::function<int(AppendFile&)> sync_hook {};
+};
+
+// what indexing found at the end of the active segment
+struct KVRecovery {
+    // end of the last intact entry, where new entries are appended
+    uint64_t good_end;
+    // bytes of torn entries which were cut off behind it, since the store was opened
+    uint64_t truncated_bytes;
+};
+
+// the result of KVStore::merge
+struct KVMergeResult {
+    // entries written to the merged segment
+    uint64_t entries { 0 };
+    // deleted keys which are gone for good, since no older entry of them is left
+    uint64_t dropped_tombstones { 0 };
+    // the same for expired keys which were still in the keydir
+    uint64_t dropped_expired { 0 };
+    // size of the merged segments, minus that of the merged one
+    uint64_t reclaimed_bytes { 0 };
+};
+
+// a precondition of a write, checked atomically with it, for compare-and-set
+struct KVCondition {
+    // the key must have a value
+    bool exists { false };
+    // and, unless this is empty, one of these versions (see KeyLocation::version)
+    std::span<const KeyVersion> versions {};
+};
+
+// the result of KVStore::verify
+struct KVVerifyResult {
+    uint64_t entries { 0 };
+    uint64_t bytes { 0 };
+    // one line per corrupt entry (or unreadable rest of a segment)
+    std::vector<std::string> errors;
+};
+
 class KVStore {
 private:
     union KVSize {
         uint32_t value;
         uint8_t bytes[sizeof(uint32_t)];
     };
+    using KVLocation = KeyLocation;
+    // one file of the store. entries are only appended to the newest (active)
+    // segment, the others are sealed and never change, until a merge replaces them.
+    struct Segment {
+        uint32_t id;
+        std::string filename;
+        std::shared_ptr<PReadFile> file;
+        // only used with mmap reads. a sealed segment is mapped once, the active
+        // one is remapped as it grows
+        std::shared_ptr<FileMapping> mapping;
+        bool sealed { false };
+        // size of a sealed segment
+        uint64_t size { 0 };
+        // bytes of entries the keydir points to, the rest is dead. changes
+        // together with the keydir shards, under their locks
+        std::atomic<uint64_t> live_bytes { 0 };
+        // size of the file when its hint file was last written or loaded, guarded by m_mtx
+        uint64_t hint_end { 0 };
+    };
     // first 8 bytes are zero
     // and must be the first thing in the file
+    // an entry is [key length][value length][mime length][key checksum][key][expiry][value][mime][data checksum].
+    // the key checksum covers the lengths, the key and the expiry, the data checksum value and mime.
+    // the mime length is a mime word (see KeyLocation::mime_word): the top byte holds the
+    // value's KVEncoding, and whether the mime type is interned. then the entry holds no
+    // mime, and the mime length is the type's id in the store's MimeTable.
+    // a tombstone (deletion) of a key is an entry without value and mime, and a flag
+    // in the mime length. the expiry time (u64, milliseconds since the Unix epoch) is only
+    // there if a flag in the mime length says so.
     struct KVEntry {
         KVSize key_length;
         KVSize value_length;
         KVSize mime_length;
+        KVSize key_checksum;
         std::string key;
-        std::vector<uint8_t> value;
-        std::string mime;
+        // written after the key if it's not 0, see KVLocation::expires_at
+        uint64_t expires_at { 0 };
 
-        int read_from_file(std::FILE* file);
+        // sets the lengths and the key checksum for an entry of `key_view`, with the
+        // value size, mime size or id and encoding of `sizes`
+        void set_head(std::string_view key_view, const KVLocation& sizes);
+        // the lengths and the key checksum, as they're written in front of the key
+        std::array<KVSize, 4> head() const { return { key_length, value_length, mime_length, key_checksum }; }
+        // the expiry time as it's written after the key, empty if the entry doesn't expire
+        std::span<const uint8_t> expiry() const {
+            return { reinterpret_cast<const uint8_t*>(&expires_at), expires_at != 0 ? sizeof(uint64_t) : 0 };
+        }
+        // reads the lengths and the key, and leaves the file at the start of the value.
+        // `available` is what's left of the file. returns negative errno on error,
+        // -EBADMSG if the key checksum doesn't match, 1 if the file ends early, otherwise 0
+        int read_key_from_file(std::FILE* file, uint64_t available);
 
-        int write_to_file(std::FILE* file) const;
+        // location of the value, if the entry is written at `offset` in `segment`
+        KVLocation location_at(uint32_t segment, uint64_t offset) const;
     };
 
 public:
-    KVStore() = default;
+    using KVVersion = KeyVersion;
+
     struct KVHeader {
         KVSize version = { .value = 0 };
 
@@ -47,39 +194,406 @@ public:
         std::tuple<uint8_t, uint8_t, uint8_t> get_version() const;
     };
 
-    KVStore(const std::string& filename);
+    // a read-only view of a value and its mime type. keeps the memory it
+    // points into alive, so it stays valid across merges and remaps. an
+    // interned mime type points into the store's MimeTable, which lives as
+    // long as the store.
+    struct KVValueView {
+        std::span<const uint8_t> value;
+        std::string_view mime;
+        std::shared_ptr<const void> owner;
+    };
+
+    // a value which can be read in pieces, for example to stream it to a client
+    // without holding all of it in memory. keeps the file (or mapping) it points
+    // into alive, so it stays readable across merges.
+    class KVValueRef {
+    public:
+        std::string_view mime() const { return m_interned_mime ? std::string_view(*m_interned_mime) : std::string_view(m_mime); }
+        uint64_t size() const { return m_size; }
+        // the Content-Encoding of the bytes read, empty if they're the value itself
+        std::string_view encoding() const { return encoding_name(m_encoding); }
+        // of the value as it's stored, see KVStore::version_of
+        KVVersion version() const { return m_location.version(); }
+        // pointer to the whole value if it's in memory (mapped or cached) and was
+        // checked by lookup, otherwise nullptr
+        const uint8_t* mapped_value() const;
+        // reads `size` bytes of the value, starting `offset` bytes into it.
+        // values in memory are checked by lookup, the others as they're read front
+        // to back: the read which completes a value with a bad checksum fails. a
+        // value which isn't read from its start isn't checked.
+        // returns negative errno on error, otherwise 0
+        int read(uint64_t offset, void* buffer, size_t size) const;
+
+    private:
+        friend class KVStore;
+        int check_partial(const uint8_t* data, size_t size) const;
+
+        KVLocation m_location {};
+        // the mime type as it's stored in the entry, empty if it's interned
+        std::string m_mime;
+        const std::string* m_interned_mime { nullptr };
+        uint64_t m_size { 0 };
+        KVEncoding m_encoding { KVEncoding::Identity };
+        std::shared_ptr<PReadFile> m_file;
+        std::shared_ptr<FileMapping> m_mapping;
+        // whether lookup checked the mapped value, see lookup's `partial`
+        bool m_mapping_checked { true };
+        // value, mime and checksum, if the value was cached. or the decompressed value
+        ValueCache::Buffer m_buffer;
+        // stored checksum, and the checksum of the first m_checked_size bytes read
+        uint32_t m_checksum { 0 };
+        mutable uint64_t m_checked_size { 0 };
+        mutable uint32_t m_partial_checksum { 0 };
+    };
+
+    // writes a single entry in pieces, as the value arrives. small values are collected
+    // in memory, larger ones in a temporary file next to the store, so that a value
+    // never has to be held in memory as a whole. the store's write lock is only taken
+    // by commit, so a slow upload doesn't hold up the other writers. commit copies a
+    // spilled value into the store under the lock though, so other writes wait for
+    // that copy. if the entry isn't committed, it's dropped.
+    class KVEntryWriter {
+    public:
+        KVEntryWriter() = default;
+        KVEntryWriter(const KVEntryWriter&) = delete;
+        KVEntryWriter& operator=(const KVEntryWriter&) = delete;
+        ~KVEntryWriter();
+
+        // appends the next piece of the value. fails (and drops the entry) if more
+        // than the announced value size is appended.
+        int append(std::span<const uint8_t> chunk);
+        // writes and publishes the entry, once exactly the announced value size was
+        // appended. returns like write_entries, the condition is checked (again) here
+        int commit();
+        // of the committed entry
+        KVVersion version() const { return m_version; }
+
+    private:
+        friend class KVStore;
+        // lets go of the store and the value, after commit or to drop the entry
+        void reset();
 
-    KVStore(KVStore&& other);
+        KVStore* m_store { nullptr };
+        std::string m_key;
+        std::string m_mime;
+        uint32_t m_value_size { 0 };
+        uint64_t m_expires_at { 0 };
+        // a copy of the condition, whose versions belong to the caller
+        bool m_exists { false };
+        std::vector<KVVersion> m_versions;
+        // the value so far, in memory or in the spill file
+        std::vector<uint8_t> m_buffer;
+        std::shared_ptr<AppendFile> m_spill;
+        // of the value appended so far
+        uint32_t m_checksum { 0 };
+        KVVersion m_version {};
+    };
+
+    // one entry of a batch write, pointing to data owned by the caller
+    struct KVWrite {
+        std::string_view key;
+        std::span<const uint8_t> value;
+        std::string_view mime;
+        // how `value` is encoded already. identity values are compressed by the store,
+        // if KVOptions::compression picks them
+        KVEncoding encoding { KVEncoding::Identity };
+        // deletes the key instead, value and mime are ignored
+        bool tombstone { false };
+        // see write_entry
+        uint64_t expires_at { 0 };
+        // see write_entries
+        KVCondition condition {};
+        // set to the version of the entry, once it's written
+        KVVersion* out_version { nullptr };
+    };
 
-    KVStore& operator=(KVStore&& other);
+    KVStore(const std::string& filename, const KVOptions& options = {});
 
+    // not movable, the background sync thread refers to the store
     KVStore& operator=(const KVStore&) = delete;
     KVStore(const KVStore&) = delete;
 
     ~KVStore();
 
+    // seals the active segment and rewrites all sealed segments into one, with only
+    // the latest entry of every key, and without deleted keys. reads and writes continue
+    // while merging, and are only held up to swap in the new segment.
     int merge();
+    int merge(KVMergeResult& out_result);
 
     int index();
 
-    int write_entry(const std::string& key, const std::vector<uint8_t>& value, const std::string& mime);
+    // writes a hint file for every segment which has none (or an outdated one), with the
+    // location of every key in it, so that the next start only reads the hints and the
+    // entries written after them. writers wait until it's done. also done after every
+    // merge, and when the store is closed.
+    int checkpoint();
+
+    // concurrent writes are grouped and written (and synced) together,
+    // by whichever writer got there first. the key expires at `expires_at` (see now()),
+    // unless it's 0: then it's not found anymore, and its memory and disk space are freed
+    // later on
+    int write_entry(const std::string& key, std::span<const uint8_t> value, const std::string& mime, uint64_t expires_at = 0);
+    // writes all entries with a single append, and publishes them together. if the condition
+    // of any entry doesn't hold (checked against the keys' values before the batch), none
+    // are written. returns negative errno on error, 1 if a condition failed, otherwise 0
+    int write_entries(std::span<const KVWrite> entries);
+
+    // deletes the key by writing a tombstone. the key and its entries are freed by the
+    // next merge which includes every segment up to the tombstone's.
+    // returns negative errno on error, 1 if the key doesn't exist, otherwise 0
+    int delete_entry(const std::string& key);
+
+    // starts a streamed write of an entry with a value of `value_size` bytes. returns
+    // like write_entries. the condition is checked right away, so that a request which
+    // fails it fails early, and again by KVEntryWriter::commit
+    int begin_entry(const std::string& key, uint32_t value_size, const std::string& mime, KVEntryWriter& out_writer, uint64_t expires_at = 0, const KVCondition& condition = {});
 
-    // returns -1 on error, 0 on found and read, and 1 on not found
+    // returns -1 on error, 0 on found and read, and 1 on not found.
+    // reads don't share a file cursor and don't block each other or writers.
     int read_entry(const std::string& key, std::vector<uint8_t>& out_value, std::string& out_mime);
+    // same as above, but without copying the value when mmap reads are enabled
+    int read_entry(const std::string& key, KVValueView& out_view);
+    // reads many keys at once, in file order. out_values holds one view per key, or
+    // nullopt where the key doesn't exist. returns negative errno on error, otherwise 0
+    int read_entries(std::span<const std::string> keys, std::vector<std::optional<KVValueView>>& out_values);
+    // finds the value without reading it. returns like read_entry. a compressed value
+    // is decompressed into memory, unless `keep_encoded` is set, then it's read as
+    // it's stored, see KVValueRef::encoding. with `partial`, only parts of the value
+    // may be read: a mapped value isn't checked as a whole upfront then, but as it's
+    // read, like a value read from the file
+    int lookup(const std::string& key, KVValueRef& out_ref, bool keep_encoded = false, bool partial = false);
+
+    // the version of the key's value, straight from the keydir. returns 0, or 1 if the
+    // key doesn't exist
+    int version_of(const std::string& key, KVVersion& out_version) const;
 
     std::vector<std::string> get_all_keys() const;
+    // the number of keys, without copying them. expired keys count until they're evicted
+    size_t key_count() const;
+
+    // a range of keys to scan, every bound is optional
+    struct KVScanRange {
+        // only keys which start with this
+        std::string_view prefix {};
+        // keys from this one on
+        std::string_view start {};
+        // keys before this one, empty for no end
+        std::string_view end {};
+        size_t limit { std::numeric_limits<size_t>::max() };
+    };
+    // the keys in the range, in ascending order. writes which happen during the scan
+    // may or may not be seen. without KVOptions::ordered_index, all keys are collected
+    // and sorted for it
+    std::vector<std::string> scan(const KVScanRange& range) const;
 
     std::string getFilename();
 
+    // size of all segment files together
+    uint64_t disk_size();
+    // bytes of overwritten entries, which the next merge frees
+    uint64_t dead_bytes();
+    // bytes freed by merges (including background ones), since the store was opened
+    uint64_t reclaimed_bytes() const { return m_reclaimed_bytes; }
+    // expired keys dropped from the keydir before a merge, since the store was opened
+    uint64_t evicted_keys() const { return m_evicted_keys; }
+    // all zero without KVOptions::cache_size
+    ValueCacheStats cache_stats() const;
+    KVRecovery recovery() const;
+
+    // checks every entry of the store against its checksums, without opening it.
+    // segments are split into chunks, which `threads` threads check in parallel.
+    // returns negative errno if the store can't be read, otherwise 0
+    static int verify(const std::string& filename, size_t threads, KVVerifyResult& out_result);
+
+    // milliseconds since the Unix epoch, the clock of expiry times
+    static uint64_t now();
+
 private:
-    int write_entry_impl(const KVEntry& entry);
+    // entries which are written and published together, and the result
+    struct PendingWrite {
+        std::span<const KVWrite> entries;
+        // the interned id of each entry's mime type, or 0
+        std::span<const uint32_t> mime_ids;
+        int result { 0 };
+        bool done { false };
+    };
+
+    // values of streamed writes up to this size are collected in memory, larger ones
+    // in a spill file, see KVEntryWriter
+    static constexpr uint32_t max_buffered_value = 1024 * 1024;
+    static constexpr size_t keydir_shard_bits = 5;
+    static constexpr size_t keydir_shards = size_t(1) << keydir_shard_bits;
+    static constexpr uint64_t all_shards = (uint64_t(1) << keydir_shards) - 1;
+    // one part of the keydir. lookups and updates of keys in different shards
+    // don't contend, and each shard sits on its own cache line
+    struct alignas(64) KeyDirShard {
+        mutable std::shared_mutex mtx;
+        KeyDir keydir;
+    };
+    using ShardedKeyDir = std::array<KeyDir, keydir_shards>;
+    // holds the locks of several shards, given as a bit mask
+    class ShardLocks {
+    public:
+        ShardLocks(const KVStore& store, uint64_t mask, bool shared);
+        ~ShardLocks();
+        ShardLocks(const ShardLocks&) = delete;
+        ShardLocks& operator=(const ShardLocks&) = delete;
+
+    private:
+        const KVStore& m_store;
+        uint64_t m_mask;
+        bool m_shared;
+    };
+    static size_t shard_of(std::string_view key);
+    // whether the condition holds for a key at `location`, or without one
+    static bool condition_holds(const KVCondition& condition, const std::optional<KVLocation>& location, uint64_t now);
+
+    // queues the entries for the next group commit, and waits for it
+    int commit_entries(std::span<const KVWrite> entries, std::span<const uint32_t> mime_ids);
+    // writes all entries of the group with a single append, m_mtx must be held
+    int write_group(const std::vector<PendingWrite*>& group);
+    // syncs according to the durability policy, after entries were appended
+    int sync_after_write();
+    void sync_thread_main();
+    // reads value and mime at the location with a single read
+    int read_location(const PReadFile& file, const KVLocation& location, std::vector<uint8_t>& out_value, std::string& out_mime) const;
+    // the mime type of the entry at `location`, whose value starts at `data`: the
+    // interned type, or the one behind the value. returns -EBADMSG for an unknown id
+    int mime_of(const KVLocation& location, const uint8_t* data, std::string_view& out_mime) const;
+    // points the view at the value and mime starting at `data`, and decodes the value
+    int view_of(const KVLocation& location, const uint8_t* data, std::shared_ptr<const void> owner, KVValueView& out_view) const;
+    // reads value and mime at the location in one buffer, through the value cache.
+    // returns 1 if the value is too large to be cached
+    int read_cached(const std::string& key, const KVLocation& location, const PReadFile& file, ValueCache::Buffer& out_buffer);
+    // finds the key's location and the file (and mapping) it's valid for
+    int find_location(const std::string& key, KVLocation& out_location, std::shared_ptr<PReadFile>& out_file, std::shared_ptr<FileMapping>& out_mapping);
+    // maps the segment so that at least `end` bytes are covered, unless
+    // that's already the case. returns negative errno on failure.
+    int ensure_mapping(uint32_t segment, uint64_t end);
+    // file name of the segment with the given id
+    static std::string segment_filename(const std::string& filename, uint32_t id);
+    std::string segment_filename(uint32_t id) const { return segment_filename(m_filename, id); }
+    // ids of the segment files on disk, in ascending order
+    static std::vector<uint32_t> segment_ids(const std::string& filename);
+    // finishes a merge which was interrupted after its manifest was written, or discards
+    // its files if it was interrupted before the merged file was moved into place
+    int recover_merge();
+    // finds the segment files of the store and opens them, the newest one for appending
+    void open_segments();
+    // rewrites all segments of a store written by v2 in the current format
+    void migrate_from_v2();
+    // returns 1 if the segment is in the current format already
+    static int migrate_segment_from_v2(const std::string& filename);
+    // size of the segment's file, m_mtx must be held
+    uint64_t segment_end(const Segment& segment) const;
+    // seals the active segment and starts a new one, m_mtx must be held
+    int roll_over();
+    // raises the store's format to at least `format` before an entry which needs it is
+    // written, by rewriting the header of the first segment, so that older versions
+    // refuse the store instead of misreading it. returns negative errno on error, otherwise 0
+    int require_format(uint8_t format);
+    // rewrites the entries of the given sealed segments, which are still in the keydir,
+    // into the one with the highest id and removes the others. tombstones are dropped if
+    // no segment older than theirs is left out. writes at most `rate_limit` bytes per
+    // second, unless it's 0. m_merge_mtx must be held
+    int merge_segments(const std::vector<uint32_t>& ids, KVMergeResult& out_result, uint64_t rate_limit = 0);
+    // the sealed segments which are worth merging, by KVOptions::compaction_*
+    std::vector<uint32_t> pick_compaction();
+    void compaction_thread_main();
+    void expiry_thread_main();
+    // drops the keys of the timers from the keydir, if they're still expired and evictable
+    // (see KeyLocation::evictable). nothing may be locked
+    void evict_expired(std::vector<TimerWheel::Timer>& timers);
+    // points the key to the new location, and updates the segments' live bytes, the
+    // ordered index and the expiry timers. the key's shard must be locked exclusively,
+    // and m_segments_mtx (shared)
+    void set_location(std::string_view key, const KVLocation& location);
+    // reads all entries of all segments, in order. m_mtx must be held
+    int index_impl(ShardedKeyDir& keydir);
+    // reads all entries of the segment, starting after the hint file's entries
+    // if there is a valid one. m_mtx must be held
+    int index_segment(Segment& segment, ShardedKeyDir& keydir);
+    // writes the hint files for all segments which have new entries since
+    // their last hints. fails if index never succeeded. m_merge_mtx and m_mtx must be held
+    int write_hints();
+    // loads the segment's hint file and sets out_end to the end of the data it covers.
+    // returns 1 if there is no hint file, or it doesn't match the segment.
+    int load_hint(const Segment& segment, std::vector<std::pair<std::string, KVLocation>>& out_records, uint64_t& out_end);
 
+    // serializes merges (and anything else replacing segment files).
+    // always locked before m_mtx
+    std::mutex m_merge_mtx;
+    // serializes appends and rolling over to a new segment
     std::mutex m_mtx;
-    std::FILE* m_file { nullptr };
+    // the active segment
+    std::shared_ptr<AppendFile> m_append_file;
+    uint32_t m_active_id { 0 };
+    // whether index built the keydir completely at least once, guarded by m_mtx.
+    // a failed index leaves the keydir as it was
+    bool m_indexed { false };
+    // the first segment, which is the file the store is known by
     std::string m_filename;
+    KVOptions m_options;
 
     KVHeader m_header;
+    // the minor version of the store's format, which tells the features its entries may
+    // use, see require_format. nothing else is locked while holding m_format_mtx
+    std::atomic<uint8_t> m_format { 0 };
+    std::mutex m_format_mtx;
+    // the interned mime types, see KVEntry
+    MimeTable m_mimes;
+    std::atomic<uint64_t> m_reclaimed_bytes { 0 };
+    std::atomic<uint64_t> m_evicted_keys { 0 };
+    std::atomic<uint64_t> m_good_end { 0 };
+    std::atomic<uint64_t> m_truncated_bytes { 0 };
+
+    // the keydir, split by key hash. readers only hold a shard's lock (shared)
+    // for the lookup, not for the actual read. shards are always locked in
+    // ascending order, and before m_segments_mtx
+    std::array<KeyDirShard, keydir_shards> m_shards;
+    // guards m_segments
+    mutable std::shared_mutex m_segments_mtx;
+    std::map<uint32_t, std::shared_ptr<Segment>> m_segments;
+    // the keys which aren't deleted, in order. only with KVOptions::ordered_index. nothing
+    // else is locked while holding m_index_mtx, it's locked last
+    mutable std::shared_mutex m_index_mtx;
+    KeyIndex m_index;
+
+    // nullptr without KVOptions::cache_size
+    std::unique_ptr<ValueCache> m_cache;
+
+    // group commit: the first writer to find no leader becomes the leader,
+    // and writes everything queued up in the meantime on behalf of the others
+    std::mutex m_commit_mtx;
+    std::condition_variable m_commit_cv;
+    std::vector<PendingWrite*> m_commit_queue;
+    bool m_commit_leader { false };
+
+    // KVDurability::Interval
+    std::mutex m_sync_mtx;
+    std::condition_variable m_sync_cv;
+    bool m_sync_stop { false };
+    bool m_sync_dirty { false };
+    std::thread m_sync_thread;
+
+    // KVOptions::auto_compaction
+    std::mutex m_compaction_mtx;
+    std::condition_variable m_compaction_cv;
+    bool m_compaction_stop { false };
+    std::thread m_compaction_thread;
 
-    std::unordered_map<std::string, std::fpos_t> m_keydir;
+    // expiry: a timer for every key which expires, fired by a thread which is started
+    // with the first one. a key keeps its timer when it's overwritten, it's only moved
+    // when it fires. m_expiry_mtx is locked last, after everything else
+    std::mutex m_expiry_mtx;
+    std::condition_variable m_expiry_cv;
+    bool m_expiry_stop { false };
+    TimerWheel m_wheel;
+    // whether any key expires, so scans have to check them against the keydir
+    std::atomic<bool> m_expiring { false };
+    std::once_flag m_expiry_started;
+    std::thread m_expiry_thread;
 };
 
@@ -0,0 +1,505 @@
+#include "KeyDir.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <doctest/doctest.h>
+#include <fmt/core.h>
+#include <functional>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <unordered_map>
+
+// a record in the arena:
+// [value size (u32)][mime word (u32)][checksum (u32)][expiry time (u64), if it expires][key length (LEB128)][key]
+static constexpr size_t record_sizes = 3 * sizeof(uint32_t);
+
+// set in the top byte of the mime word of an evictable key, see KeyLocation::evictable
+static constexpr uint32_t evictable_bit = uint32_t(0x10) << 24;
+
+static constexpr uint64_t ref_mask = (uint64_t(1) << 48) - 1;
+
+static size_t hash_key(std::string_view key) {
+    return std::hash<std::string_view> {}(key);
+}
+
+static uint64_t tag_of(size_t hash) {
+    return (uint64_t(hash) >> 48) << 48;
+}
+
+// decodes the key length, and returns the number of bytes it took
+static size_t read_length(const uint8_t* data, uint64_t& out_length) {
+    out_length = 0;
+    size_t i = 0;
+    for (;; ++i) {
+        out_length |= uint64_t(data[i] & 0x7f) << (7 * i);
+        if ((data[i] & 0x80) == 0) {
+            return i + 1;
+        }
+    }
+}
+
+static size_t length_size(uint64_t length) {
+    size_t n = 1;
+    while (length >= 0x80) {
+        length >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+const uint8_t* KeyDir::record(uint64_t key_ref) const {
+    uint64_t offset = (key_ref & ref_mask) - 1;
+    return m_blocks[offset / block_size] + offset % block_size;
+}
+
+uint8_t* KeyDir::record(uint64_t key_ref) {
+    uint64_t offset = (key_ref & ref_mask) - 1;
+    return m_blocks[offset / block_size] + offset % block_size;
+}
+
+// bytes between the start of the record and the key length
+static size_t sizes_size(const uint8_t* data) {
+    uint32_t mime_word;
+    std::memcpy(&mime_word, data + sizeof(uint32_t), sizeof(uint32_t));
+    return record_sizes + (KeyLocation::expires(mime_word) ? sizeof(uint64_t) : 0);
+}
+
+static size_t sizes_size(const KeyLocation& location) {
+    return record_sizes + (location.expires_at != 0 ? sizeof(uint64_t) : 0);
+}
+
+std::string_view KeyDir::key_of(const Slot& slot) const {
+    const uint8_t* data = record(slot.key_ref);
+    data += sizes_size(data);
+    uint64_t length;
+    data += read_length(data, length);
+    return { reinterpret_cast<const char*>(data), length };
+}
+
+// the second size is the mime word, see KeyLocation::mime_word
+static void write_sizes(uint8_t* data, const KeyLocation& location) {
+    assert(location.mime_size <= KeyDir::max_mime_size && location.mime_id <= KeyDir::max_mime_size);
+    assert(location.encoding <= KeyLocation::encoding_mask);
+    uint32_t mime_word = location.mime_word() | (location.evictable ? evictable_bit : 0);
+    std::memcpy(data, &location.value_size, sizeof(uint32_t));
+    std::memcpy(data + sizeof(uint32_t), &mime_word, sizeof(uint32_t));
+    std::memcpy(data + 2 * sizeof(uint32_t), &location.checksum, sizeof(uint32_t));
+    if (location.expires_at != 0) {
+        std::memcpy(data + record_sizes, &location.expires_at, sizeof(uint64_t));
+    }
+}
+
+KeyLocation KeyDir::location_of(const Slot& slot) const {
+    KeyLocation location;
+    const uint8_t* data = record(slot.key_ref);
+    uint32_t mime_word;
+    std::memcpy(&location.value_size, data, sizeof(uint32_t));
+    std::memcpy(&mime_word, data + sizeof(uint32_t), sizeof(uint32_t));
+    location.set_mime_word(mime_word);
+    std::memcpy(&location.checksum, data + 2 * sizeof(uint32_t), sizeof(uint32_t));
+    location.evictable = (mime_word & evictable_bit) != 0;
+    if (KeyLocation::expires(mime_word)) {
+        std::memcpy(&location.expires_at, data + record_sizes, sizeof(uint64_t));
+    }
+    location.value_offset = slot.locator & max_value_offset;
+    location.segment = static_cast<uint32_t>(slot.locator >> 40);
+    return location;
+}
+
+void KeyDir::set_sizes(uint64_t key_ref, const KeyLocation& location) {
+    write_sizes(record(key_ref), location);
+}
+
+static uint64_t pack_locator(const KeyLocation& location) {
+    assert(location.value_offset <= KeyDir::max_value_offset);
+    assert(location.segment <= KeyDir::max_segment);
+    return (uint64_t(location.segment) << 40) | location.value_offset;
+}
+
+size_t KeyDir::probe(std::string_view key, size_t hash) const {
+    size_t mask = m_slots.size() - 1;
+    uint64_t tag = tag_of(hash);
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        const Slot& slot = m_slots[i];
+        if (slot.key_ref == 0 || ((slot.key_ref & ~ref_mask) == tag && key_of(slot) == key)) {
+            return i;
+        }
+    }
+}
+
+uint64_t KeyDir::append_record(std::string_view key, const KeyLocation& location) {
+    size_t size = sizes_size(location) + length_size(key.size()) + key.size();
+    uint64_t offset = m_arena_end;
+    size_t used = offset % block_size;
+    if (m_blocks.empty() || (used != 0 && used + size > block_size)) {
+        // start a new block, what's left of the current one is wasted
+        offset = m_blocks.size() * block_size;
+        used = 0;
+    }
+    if (offset / block_size >= m_blocks.size()) {
+        size_t blocks = (size + block_size - 1) / block_size;
+        // the first block starts small, so small key dirs stay small
+        size_t capacity = blocks > 1 || !m_blocks.empty() ? blocks * block_size : std::max(size, min_block_size);
+        auto& storage = m_block_storage.emplace_back(new uint8_t[capacity]);
+        for (size_t i = 0; i < blocks; ++i) {
+            m_blocks.push_back(storage.get() + i * block_size);
+        }
+        m_tail_capacity = std::min(capacity, block_size);
+        m_arena_capacity += capacity;
+    } else if (used + size > m_tail_capacity) {
+        // only the first block grows, all later ones start out full size
+        size_t capacity = std::min(block_size, std::max(used + size, m_tail_capacity * 2));
+        std::unique_ptr<uint8_t[]> grown(new uint8_t[capacity]);
+        std::memcpy(grown.get(), m_blocks.back(), used);
+        m_blocks.back() = grown.get();
+        m_block_storage.back() = std::move(grown);
+        m_arena_capacity += capacity - m_tail_capacity;
+        m_tail_capacity = capacity;
+    }
+    m_arena_end = offset + size;
+    uint8_t* data = m_blocks[offset / block_size] + offset % block_size;
+    write_sizes(data, location);
+    data += sizes_size(location);
+    uint64_t length = key.size();
+    do {
+        *data++ = static_cast<uint8_t>((length & 0x7f) | (length >= 0x80 ? 0x80 : 0));
+        length >>= 7;
+    } while (length > 0);
+    std::memcpy(data, key.data(), key.size());
+    return offset;
+}
+
+std::optional<KeyLocation> KeyDir::find(std::string_view key) const {
+    if (m_size == 0) {
+        return std::nullopt;
+    }
+    const Slot& slot = m_slots[probe(key, hash_key(key))];
+    if (slot.key_ref == 0) {
+        return std::nullopt;
+    }
+    return location_of(slot);
+}
+
+std::optional<KeyLocation> KeyDir::insert_or_assign(std::string_view key, const KeyLocation& new_location) {
+    // at most 7/8 full, so probe sequences stay short
+    if ((m_size + 1) * 8 > m_slots.size() * 7) {
+        rebuild(std::max<size_t>(16, m_slots.size() * 2));
+    }
+    size_t hash = hash_key(key);
+    Slot& slot = m_slots[probe(key, hash)];
+    std::optional<KeyLocation> previous;
+    if (slot.key_ref != 0) {
+        previous = location_of(slot);
+    }
+    KeyLocation location = new_location;
+    location.evictable = KeyLocation::evictable_after(previous, location);
+    if (location.tombstone) {
+        ++m_tombstones;
+    }
+    if (previous) {
+        if (previous->tombstone) {
+            --m_tombstones;
+        }
+        if (sizes_size(*previous) == sizes_size(location)) {
+            set_sizes(slot.key_ref, location);
+        } else {
+            // the expiry time came or went, the record doesn't fit anymore
+            m_arena_garbage += sizes_size(*previous) + length_size(key.size()) + key.size();
+            slot.key_ref = tag_of(hash) | (append_record(key, location) + 1);
+        }
+        slot.locator = pack_locator(location);
+        return previous;
+    }
+    slot.key_ref = tag_of(hash) | (append_record(key, location) + 1);
+    slot.locator = pack_locator(location);
+    ++m_size;
+    return std::nullopt;
+}
+
+std::optional<KeyLocation> KeyDir::erase(std::string_view key) {
+    if (m_size == 0) {
+        return std::nullopt;
+    }
+    size_t i = probe(key, hash_key(key));
+    if (m_slots[i].key_ref == 0) {
+        return std::nullopt;
+    }
+    auto previous = location_of(m_slots[i]);
+    m_arena_garbage += sizes_size(previous) + length_size(key.size()) + key.size();
+    // backward shift deletion: move following entries of the probe sequence
+    // up, so no tombstones are needed
+    size_t mask = m_slots.size() - 1;
+    for (size_t j = (i + 1) & mask; m_slots[j].key_ref != 0; j = (j + 1) & mask) {
+        size_t home = hash_key(key_of(m_slots[j])) & mask;
+        // whether home is cyclically outside of (i, j]
+        bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            m_slots[i] = m_slots[j];
+            i = j;
+        }
+    }
+    m_slots[i] = Slot { 0, 0 };
+    --m_size;
+    if (previous.tombstone) {
+        --m_tombstones;
+    }
+    // drop the garbage once it's most of the arena
+    if (m_arena_garbage > block_size && m_arena_garbage * 2 > m_arena_end) {
+        rebuild(m_slots.size());
+    }
+    return previous;
+}
+
+void KeyDir::clear() {
+    *this = KeyDir();
+}
+
+void KeyDir::reserve(size_t count) {
+    size_t capacity = std::max<size_t>(16, m_slots.size());
+    while (count * 8 > capacity * 7) {
+        capacity *= 2;
+    }
+    if (capacity != m_slots.size()) {
+        rebuild(capacity);
+    }
+}
+
+void KeyDir::rebuild(size_t capacity) {
+    KeyDir rebuilt;
+    rebuilt.m_slots.resize(capacity, Slot { 0, 0 });
+    bool compact = m_arena_garbage > 0;
+    size_t mask = capacity - 1;
+    for (const auto& slot : m_slots) {
+        if (slot.key_ref == 0) {
+            continue;
+        }
+        auto key = key_of(slot);
+        size_t hash = hash_key(key);
+        size_t i = hash & mask;
+        while (rebuilt.m_slots[i].key_ref != 0) {
+            i = (i + 1) & mask;
+        }
+        // without garbage, the arena is taken over as it is
+        uint64_t offset = compact ? rebuilt.append_record(key, location_of(slot)) : (slot.key_ref & ref_mask) - 1;
+        rebuilt.m_slots[i] = Slot { tag_of(hash) | (offset + 1), slot.locator };
+    }
+    if (!compact) {
+        rebuilt.m_blocks = std::move(m_blocks);
+        rebuilt.m_block_storage = std::move(m_block_storage);
+        rebuilt.m_arena_end = m_arena_end;
+        rebuilt.m_tail_capacity = m_tail_capacity;
+        rebuilt.m_arena_capacity = m_arena_capacity;
+    }
+    rebuilt.m_size = m_size;
+    rebuilt.m_tombstones = m_tombstones;
+    *this = std::move(rebuilt);
+}
+
+size_t KeyDir::memory_usage() const {
+    return m_slots.capacity() * sizeof(Slot) + m_arena_capacity + m_blocks.capacity() * sizeof(uint8_t*);
+}
+
+TEST_CASE("KeyDir") {
+    KeyDir keydir;
+    auto location_for = [](size_t i) {
+        return KeyLocation {
+            .value_offset = i * 1000 + 7,
+            .value_size = static_cast<uint32_t>(i),
+            .mime_size = i % 3 == 0 ? 0 : static_cast<uint32_t>(i % 30),
+            .segment = static_cast<uint32_t>(i % 5),
+            .encoding = static_cast<uint8_t>(i % 2),
+            .mime_id = i % 3 == 0 ? static_cast<uint32_t>(i % 7 + 1) : 0,
+            .tombstone = i % 11 == 0,
+            .expires_at = i % 4 == 1 ? 1700000000000 + i : 0,
+            .checksum = static_cast<uint32_t>(i * 2654435761u),
+        };
+    };
+    auto check_location = [](const std::optional<KeyLocation>& location, const KeyLocation& expected) {
+        REQUIRE(location);
+        CHECK_EQ(location->value_offset, expected.value_offset);
+        CHECK_EQ(location->value_size, expected.value_size);
+        CHECK_EQ(location->mime_size, expected.mime_size);
+        CHECK_EQ(location->segment, expected.segment);
+        CHECK_EQ(location->encoding, expected.encoding);
+        CHECK_EQ(location->mime_id, expected.mime_id);
+        CHECK_EQ(location->tombstone, expected.tombstone);
+        CHECK_EQ(location->expires_at, expected.expires_at);
+        CHECK(location->version() == expected.version());
+    };
+    constexpr size_t count = 10000;
+    for (size_t i = 0; i < count; ++i) {
+        CHECK_FALSE(keydir.insert_or_assign(fmt::format("key/{}", i), location_for(i)));
+    }
+    CHECK_EQ(keydir.size(), count);
+    for (size_t i = 0; i < count; ++i) {
+        check_location(keydir.find(fmt::format("key/{}", i)), location_for(i));
+    }
+    CHECK_FALSE(keydir.find("missing"));
+    CHECK_FALSE(keydir.find(""));
+
+    // overwrites return the previous location
+    for (size_t i = 0; i < count; i += 2) {
+        check_location(keydir.insert_or_assign(fmt::format("key/{}", i), location_for(i + 1)), location_for(i));
+    }
+    // erase every third key, the others must still be found
+    for (size_t i = 0; i < count; i += 3) {
+        CHECK(keydir.erase(fmt::format("key/{}", i)));
+    }
+    CHECK_FALSE(keydir.erase("key/0"));
+    size_t seen = 0;
+    size_t tombstones = 0;
+    keydir.for_each([&](std::string_view key, const KeyLocation& location) {
+        size_t i = std::stoul(std::string(key.substr(4)));
+        CHECK_NE(i % 3, 0);
+        CHECK_EQ(location.value_offset, location_for(i % 2 == 0 ? i + 1 : i).value_offset);
+        ++seen;
+        tombstones += location.tombstone ? 1u : 0u;
+    });
+    CHECK_EQ(seen, keydir.size());
+    CHECK_EQ(tombstones, keydir.tombstones());
+    for (size_t i = 0; i < count; ++i) {
+        auto location = keydir.find(fmt::format("key/{}", i));
+        if (i % 3 == 0) {
+            CHECK_FALSE(location);
+        } else {
+            check_location(location, location_for(i % 2 == 0 ? i + 1 : i));
+        }
+    }
+
+    // empty and very long keys
+    std::string long_key(3 * 1024 * 1024, 'x');
+    keydir.insert_or_assign("", location_for(1));
+    keydir.insert_or_assign(long_key, location_for(2));
+    check_location(keydir.find(""), location_for(1));
+    check_location(keydir.find(long_key), location_for(2));
+    keydir.insert_or_assign("after-long-key", location_for(3));
+    check_location(keydir.find("after-long-key"), location_for(3));
+
+    // the largest locations which fit
+    auto largest = KeyLocation { .value_offset = KeyDir::max_value_offset, .value_size = UINT32_MAX, .mime_size = KeyDir::max_mime_size, .segment = KeyDir::max_segment, .encoding = KeyLocation::encoding_mask, .tombstone = true, .expires_at = UINT64_MAX, .checksum = UINT32_MAX };
+    keydir.insert_or_assign("largest", largest);
+    check_location(keydir.find("largest"), largest);
+    largest.mime_size = 0;
+    largest.mime_id = KeyDir::max_mime_size;
+    keydir.insert_or_assign("largest-id", largest);
+    check_location(keydir.find("largest-id"), largest);
+
+    // erasing the long key leaves most of the arena garbage, which compacts it
+    size_t before = keydir.memory_usage();
+    CHECK(keydir.erase(long_key));
+    CHECK_LT(keydir.memory_usage(), before);
+    check_location(keydir.find("after-long-key"), location_for(3));
+    check_location(keydir.find("key/1"), location_for(1));
+    CHECK_FALSE(keydir.find(long_key));
+
+    keydir.clear();
+    CHECK(keydir.empty());
+    CHECK_FALSE(keydir.find("key/1"));
+}
+
+TEST_CASE("KeyDir evictable keys") {
+    KeyDir keydir;
+    auto at = [](uint32_t segment, uint64_t expires_at) {
+        return KeyLocation { .value_offset = 0, .value_size = 1, .mime_size = 0, .segment = segment, .expires_at = expires_at };
+    };
+    // nothing before
+    keydir.insert_or_assign("a", at(1, 100));
+    CHECK(keydir.find("a")->evictable);
+    // an older segment, but it expires before
+    keydir.insert_or_assign("a", at(2, 200));
+    CHECK(keydir.find("a")->evictable);
+    // the previous entry could come back once this one is dropped
+    keydir.insert_or_assign("a", at(3, 150));
+    CHECK_FALSE(keydir.find("a")->evictable);
+    // and then nothing after it is evictable anymore, until a merge drops it
+    keydir.insert_or_assign("a", at(3, 300));
+    CHECK_FALSE(keydir.find("a")->evictable);
+
+    // entries of the same segment go away together
+    keydir.insert_or_assign("b", at(1, 0));
+    keydir.insert_or_assign("b", at(1, 100));
+    CHECK(keydir.find("b")->evictable);
+    keydir.insert_or_assign("c", at(1, 0));
+    keydir.insert_or_assign("c", at(2, 100));
+    CHECK_FALSE(keydir.find("c")->evictable);
+
+    // the record moves when the expiry time comes or goes
+    keydir.insert_or_assign("d", at(1, 0));
+    keydir.insert_or_assign("d", at(1, 42));
+    CHECK_EQ(keydir.find("d")->expires_at, 42);
+    keydir.insert_or_assign("d", at(1, 0));
+    CHECK_EQ(keydir.find("d")->expires_at, 0);
+    CHECK_EQ(keydir.find("c")->expires_at, 100);
+    size_t keys = 0;
+    keydir.for_each([&](std::string_view, const KeyLocation&) { ++keys; });
+    CHECK_EQ(keys, 4);
+}
+
+// counts the bytes a container allocates
+template <typename T>
+struct CountingAllocator {
+    using value_type = T;
+    size_t* allocated;
+
+    explicit CountingAllocator(size_t* counter)
+        : allocated(counter) { }
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U>& other)
+        : allocated(other.allocated) { }
+
+    T* allocate(size_t n) {
+        *allocated += n * sizeof(T);
+        return std::allocator<T> {}.allocate(n);
+    }
+    void deallocate(T* p, size_t n) {
+        *allocated -= n * sizeof(T);
+        std::allocator<T> {}.deallocate(p, n);
+    }
+    template <typename U>
+    bool operator==(const CountingAllocator<U>& other) const { return allocated == other.allocated; }
+};
+
+TEST_CASE("KeyDir memory per key") {
+    // keys like the ones the README suggests, and the previous keydir for comparison
+    using String = std::basic_string<char, std::char_traits<char>, CountingAllocator<char>>;
+    struct Hash {
+        size_t operator()(const String& str) const { return hash_key(str); }
+    };
+    using Map = std::unordered_map<String, KeyLocation, Hash, std::equal_to<String>, CountingAllocator<std::pair<const String, KeyLocation>>>;
+    for (size_t key_length : { 8u, 24u, 64u }) {
+        constexpr size_t count = 200000;
+        size_t map_bytes = 0;
+        size_t key_bytes = 0;
+        size_t map_peak;
+        double map_seconds;
+        double keydir_seconds;
+        KeyDir keydir;
+        {
+            Map map(0, Hash {}, std::equal_to<String> {}, CountingAllocator<std::pair<const String, KeyLocation>>(&map_bytes));
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < count; ++i) {
+                auto formatted = fmt::format("tenant/{:0{}}", i, key_length - 7);
+                String key(formatted.begin(), formatted.end(), CountingAllocator<char>(&map_bytes));
+                key_bytes += key.size();
+                KeyLocation location { .value_offset = i * 100, .value_size = 100, .mime_size = 10, .segment = 0 };
+                map.insert_or_assign(std::move(key), location);
+            }
+            map_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            map_peak = map_bytes;
+            start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < count; ++i) {
+                KeyLocation location { .value_offset = i * 100, .value_size = 100, .mime_size = 10, .segment = 0 };
+                keydir.insert_or_assign(fmt::format("tenant/{:0{}}", i, key_length - 7), location);
+            }
+            keydir_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        double key_average = double(key_bytes) / count;
+        double map_per_key = double(map_peak) / count;
+        double keydir_per_key = double(keydir.memory_usage()) / count;
+        spdlog::info("keydir memory, {:.0f} byte keys: unordered_map {:.1f} bytes/key ({:.0f} ms), KeyDir {:.1f} bytes/key ({:.0f} ms)",
+            key_average, map_per_key, map_seconds * 1000, keydir_per_key, keydir_seconds * 1000);
+        // excludes malloc's own overhead, which only makes the map worse
+        CHECK_LT(keydir_per_key, map_per_key);
+    }
+}
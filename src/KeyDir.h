@@ -0,0 +1,200 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// identifies the value and mime type of an entry, without reading them: the checksum
+// of both and their sizes, as they're stored. the same value written twice has the
+// same version. a different one of the same size has it too if its CRC-32C matches,
+// which is rare by chance but easy to do on purpose
+struct KeyVersion {
+    uint32_t checksum;
+    uint32_t value_size;
+    // see KeyLocation::mime_word, without the expiry flag
+    uint32_t mime_word;
+
+    // how the value is stored, see KeyLocation::encoding
+    uint8_t encoding() const;
+
+    bool operator==(const KeyVersion&) const = default;
+};
+
+// where an entry's value lives in the store. the mime type and the checksum of
+// both are stored right after the value, so a lookup needs exactly one read.
+// mime types which are interned (see MimeTable) aren't stored at all, only their id.
+// entries are never modified once written, so a location stays valid until the
+// next merge.
+struct KeyLocation {
+    uint64_t value_offset;
+    uint32_t value_size;
+    uint32_t mime_size;
+    uint32_t segment;
+    // how the value is stored, see KVEncoding. value_size is what's stored
+    uint8_t encoding { 0 };
+    // id of the interned mime type, then mime_size is 0. 0 if the mime type is stored
+    uint32_t mime_id { 0 };
+    // the entry deletes the key, it has no value and no mime
+    bool tombstone { false };
+    // when the entry expires, in milliseconds since the Unix epoch. 0 if it never does
+    uint64_t expires_at { 0 };
+    // the data checksum stored behind the mime
+    uint32_t checksum { 0 };
+    // only in the key dir: no older entry of the key is left in an older segment which
+    // could outlive this one, so the key can be dropped from the key dir as soon as it
+    // expired, instead of waiting for a merge. set by KeyDir::insert_or_assign
+    bool evictable { false };
+
+    // set in the top byte of the mime word if it holds an id
+    static constexpr uint8_t interned_mime = 0x80;
+    // set in the top byte of the mime word of a tombstone
+    static constexpr uint8_t tombstone_flag = 0x40;
+    // set in the top byte of the mime word of an entry which expires, the expiry time
+    // follows the key
+    static constexpr uint8_t expires_flag = 0x20;
+    // the bits of the top byte which hold the encoding
+    static constexpr uint8_t encoding_mask = 0x0f;
+    // mime size (or id) and encoding in one word, the way entries, hints and the key dir
+    // store them: [flags (8 bits)][mime size or id (24 bits)]. the flags are the encoding,
+    // interned_mime, tombstone_flag and expires_flag
+    uint32_t mime_word() const {
+        uint32_t flags = encoding | (mime_id != 0 ? interned_mime : 0) | (tombstone ? tombstone_flag : 0) | (expires_at != 0 ? expires_flag : 0);
+        return (mime_id != 0 ? mime_id : mime_size) | (flags << 24);
+    }
+    // everything but the expiry time, which is stored separately
+    void set_mime_word(uint32_t word) {
+        uint8_t flags = static_cast<uint8_t>(word >> 24);
+        uint32_t size_or_id = word & 0xffffff;
+        encoding = static_cast<uint8_t>(flags & encoding_mask);
+        mime_id = (flags & interned_mime) ? size_or_id : 0;
+        mime_size = (flags & interned_mime) ? 0 : size_or_id;
+        tombstone = (flags & tombstone_flag) != 0;
+    }
+    static bool expires(uint32_t mime_word) { return ((mime_word >> 24) & expires_flag) != 0; }
+
+    bool expired(uint64_t now) const { return expires_at != 0 && expires_at <= now; }
+    KeyVersion version() const { return { checksum, value_size, mime_word() & ~(uint32_t(expires_flag) << 24) }; }
+    // the key has a value: it's neither deleted nor expired
+    bool live(uint64_t now) const { return !tombstone && !expired(now); }
+
+    // value, mime and their checksum
+    uint64_t data_size() const { return uint64_t(value_size) + mime_size + sizeof(uint32_t); }
+    // where the entry ends in the file
+    uint64_t end() const { return value_offset + data_size(); }
+    // everything in front of the value: the lengths and the checksum of the key, key, and expiry time
+    uint64_t head_size(size_t key_size) const { return 4 * sizeof(uint32_t) + key_size + (expires_at != 0 ? sizeof(uint64_t) : 0); }
+    // size of the whole entry in the file
+    uint64_t entry_size(size_t key_size) const { return head_size(key_size) + data_size(); }
+
+    // whether an entry which replaces `previous` in the key dir is evictable. it is if
+    // there was nothing before, or if `previous` was evictable and goes away no later
+    // than this entry: it's in the same segment, or it expires before
+    static bool evictable_after(const std::optional<KeyLocation>& previous, const KeyLocation& location) {
+        if (!previous) {
+            return true;
+        }
+        if (!previous->evictable) {
+            return false;
+        }
+        return previous->segment == location.segment
+            || (previous->expires_at != 0 && location.expires_at != 0 && previous->expires_at <= location.expires_at);
+    }
+};
+
+inline uint8_t KeyVersion::encoding() const {
+    return static_cast<uint8_t>((mime_word >> 24) & KeyLocation::encoding_mask);
+}
+
+// A hash map from key to KeyLocation, built to keep the memory per key low.
+//
+// It's an open addressing (linear probing) table of 16 byte slots. A slot holds a
+// reference to the key's record in an arena, and the segment and value offset
+// packed into 64 bits. The record holds the value and mime size, the data checksum,
+// the expiry time of keys which expire, and the key itself. The arena is made of large blocks, so it grows without copying and
+// without the slack of a growing vector. Only the first block starts small and
+// grows, so that small key dirs stay small.
+//
+// Value offsets must be below 2^40 (1 TiB), segment ids, mime sizes and ids below 2^24,
+// encodings below 2^4.
+// Not thread safe.
+class KeyDir {
+public:
+    static constexpr uint64_t max_value_offset = (uint64_t(1) << 40) - 1;
+    static constexpr uint32_t max_segment = (uint32_t(1) << 24) - 1;
+    static constexpr uint32_t max_mime_size = (uint32_t(1) << 24) - 1;
+
+    KeyDir() = default;
+    KeyDir(KeyDir&&) noexcept = default;
+    KeyDir& operator=(KeyDir&&) noexcept = default;
+    KeyDir(const KeyDir&) = delete;
+    KeyDir& operator=(const KeyDir&) = delete;
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    // how many of the keys are tombstones
+    size_t tombstones() const { return m_tombstones; }
+
+    std::optional<KeyLocation> find(std::string_view key) const;
+    bool contains(std::string_view key) const { return find(key).has_value(); }
+    // returns the location the key had before, if it existed
+    std::optional<KeyLocation> insert_or_assign(std::string_view key, const KeyLocation& location);
+    // returns the location the key had, if it existed
+    std::optional<KeyLocation> erase(std::string_view key);
+    void clear();
+    // makes room for `count` keys without rehashing
+    void reserve(size_t count);
+
+    // calls f(std::string_view key, const KeyLocation& location) for every key, in no
+    // particular order. the key stays valid until the key dir is modified.
+    template <typename F>
+    void for_each(F&& f) const {
+        for (const auto& slot : m_slots) {
+            if (slot.key_ref != 0) {
+                f(key_of(slot), location_of(slot));
+            }
+        }
+    }
+
+    // bytes allocated for slots and the arena
+    size_t memory_usage() const;
+
+private:
+    struct Slot {
+        // tag (16 bits of the hash) | arena offset of the record + 1 (48 bits), 0 if empty
+        uint64_t key_ref;
+        // segment (24 bits) | value offset (40 bits)
+        uint64_t locator;
+    };
+
+    static constexpr size_t block_size = 1024 * 1024;
+    static constexpr size_t min_block_size = 1024;
+
+    const uint8_t* record(uint64_t key_ref) const;
+    uint8_t* record(uint64_t key_ref);
+    std::string_view key_of(const Slot& slot) const;
+    KeyLocation location_of(const Slot& slot) const;
+    // index of the key's slot, or of the empty slot where it would go
+    size_t probe(std::string_view key, size_t hash) const;
+    // appends a record for the key to the arena, and returns its offset
+    uint64_t append_record(std::string_view key, const KeyLocation& location);
+    void set_sizes(uint64_t key_ref, const KeyLocation& location);
+    // rehashes into `capacity` slots, and drops erased records from the arena
+    void rebuild(size_t capacity);
+
+    std::vector<Slot> m_slots;
+    size_t m_size { 0 };
+    size_t m_tombstones { 0 };
+    // the arena. a record never crosses a block boundary, unless it's larger than a
+    // block; then it gets consecutive block indices which all point into one allocation.
+    std::vector<uint8_t*> m_blocks;
+    std::vector<std::unique_ptr<uint8_t[]>> m_block_storage;
+    uint64_t m_arena_end { 0 };
+    // bytes allocated for the last block, and for all blocks
+    size_t m_tail_capacity { 0 };
+    size_t m_arena_capacity { 0 };
+    // bytes in the arena of records which were erased
+    uint64_t m_arena_garbage { 0 };
+};
@@ -0,0 +1,400 @@
+#include "KeyIndex.h"
+
+#include <algorithm>
+#include <chrono>
+#include <doctest/doctest.h>
+#include <fmt/core.h>
+#include <limits>
+#include <random>
+#include <set>
+#include <spdlog/spdlog.h>
+
+// nodes built by assign are filled to this, so inserts don't split them right away
+static constexpr size_t fill_percent = 75;
+
+// the shortest string which is greater than `left` and not greater than `right`,
+// for left < right
+static std::string_view shortest_separator(std::string_view left, std::string_view right) {
+    auto common = static_cast<size_t>(std::mismatch(left.begin(), left.end(), right.begin(), right.end()).first - left.begin());
+    return right.substr(0, common + 1);
+}
+
+size_t KeyIndex::Leaf::lower_bound(std::string_view key) const {
+    size_t low = 0;
+    size_t high = count();
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (this->key(mid) < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void KeyIndex::Leaf::insert_at(size_t i, std::string_view key) {
+    size_t begin = i == 0 ? 0 : ends[i - 1];
+    bytes.insert(begin, key);
+    ends.insert(ends.begin() + static_cast<ptrdiff_t>(i), static_cast<uint32_t>(begin + key.size()));
+    for (size_t j = i + 1; j < ends.size(); ++j) {
+        ends[j] += static_cast<uint32_t>(key.size());
+    }
+}
+
+void KeyIndex::Leaf::erase_at(size_t i) {
+    size_t begin = i == 0 ? 0 : ends[i - 1];
+    uint32_t size = ends[i] - static_cast<uint32_t>(begin);
+    bytes.erase(begin, size);
+    ends.erase(ends.begin() + static_cast<ptrdiff_t>(i));
+    for (size_t j = i; j < ends.size(); ++j) {
+        ends[j] -= size;
+    }
+}
+
+size_t KeyIndex::Inner::child_for(std::string_view key) const {
+    // a key equal to a separator belongs to the child right of it
+    return static_cast<size_t>(std::upper_bound(separators.begin(), separators.end(), key) - separators.begin());
+}
+
+KeyIndex::KeyIndex()
+    : m_root(std::make_unique<Leaf>()) {
+}
+
+KeyIndex::~KeyIndex() = default;
+
+const KeyIndex::Leaf* KeyIndex::find_leaf(std::string_view key) const {
+    const Node* node = m_root.get();
+    while (!node->leaf) {
+        const auto& inner = static_cast<const Inner&>(*node);
+        node = inner.children[inner.child_for(key)].get();
+    }
+    return static_cast<const Leaf*>(node);
+}
+
+bool KeyIndex::contains(std::string_view key) const {
+    const Leaf* leaf = find_leaf(key);
+    size_t i = leaf->lower_bound(key);
+    return i < leaf->count() && leaf->key(i) == key;
+}
+
+bool KeyIndex::insert(std::string_view key) {
+    bool inserted = false;
+    auto split = insert(*m_root, key, inserted);
+    if (split) {
+        // the tree only ever grows at the root
+        auto root = std::make_unique<Inner>();
+        root->children.push_back(std::move(m_root));
+        root->separators.push_back(std::move(split->separator));
+        root->children.push_back(std::move(split->node));
+        m_root = std::move(root);
+    }
+    m_size += inserted ? 1 : 0;
+    return inserted;
+}
+
+std::optional<KeyIndex::Split> KeyIndex::insert(Node& node, std::string_view key, bool& out_inserted) {
+    if (node.leaf) {
+        auto& leaf = static_cast<Leaf&>(node);
+        size_t i = leaf.lower_bound(key);
+        if (i < leaf.count() && leaf.key(i) == key) {
+            return std::nullopt;
+        }
+        leaf.insert_at(i, key);
+        out_inserted = true;
+        if (!leaf.full()) {
+            return std::nullopt;
+        }
+        // split at half the bytes rather than half the keys, so a few long keys
+        // don't end up in one leaf
+        size_t half = leaf.bytes.size() / 2;
+        size_t mid = static_cast<size_t>(std::upper_bound(leaf.ends.begin(), leaf.ends.end(), half) - leaf.ends.begin());
+        mid = std::clamp<size_t>(mid, 1, leaf.count() - 1);
+        uint32_t offset = leaf.ends[mid - 1];
+        auto right = std::make_unique<Leaf>();
+        right->bytes.assign(leaf.bytes, offset);
+        right->ends.reserve(leaf.count() - mid);
+        for (size_t j = mid; j < leaf.count(); ++j) {
+            right->ends.push_back(leaf.ends[j] - offset);
+        }
+        leaf.bytes.resize(offset);
+        leaf.ends.resize(mid);
+        right->prev = &leaf;
+        right->next = leaf.next;
+        if (leaf.next) {
+            leaf.next->prev = right.get();
+        }
+        leaf.next = right.get();
+        std::string separator(shortest_separator(leaf.key(mid - 1), right->key(0)));
+        return Split { std::move(separator), std::move(right) };
+    }
+    auto& inner = static_cast<Inner&>(node);
+    size_t i = inner.child_for(key);
+    auto split = insert(*inner.children[i], key, out_inserted);
+    if (!split) {
+        return std::nullopt;
+    }
+    inner.separators.insert(inner.separators.begin() + static_cast<ptrdiff_t>(i), std::move(split->separator));
+    inner.children.insert(inner.children.begin() + static_cast<ptrdiff_t>(i + 1), std::move(split->node));
+    if (inner.children.size() <= max_children) {
+        return std::nullopt;
+    }
+    // the separator between the halves moves up, it's not needed in either
+    size_t mid = inner.children.size() / 2;
+    auto right = std::make_unique<Inner>();
+    std::string separator = std::move(inner.separators[mid - 1]);
+    right->separators.assign(std::make_move_iterator(inner.separators.begin() + static_cast<ptrdiff_t>(mid)),
+        std::make_move_iterator(inner.separators.end()));
+    right->children.assign(std::make_move_iterator(inner.children.begin() + static_cast<ptrdiff_t>(mid)),
+        std::make_move_iterator(inner.children.end()));
+    inner.separators.resize(mid - 1);
+    inner.children.resize(mid);
+    return Split { std::move(separator), std::move(right) };
+}
+
+bool KeyIndex::erase(std::string_view key) {
+    bool erased = false;
+    erase(*m_root, key, erased);
+    // a root with a single child is one level too many
+    while (!m_root->leaf && static_cast<Inner&>(*m_root).children.size() == 1) {
+        m_root = std::move(static_cast<Inner&>(*m_root).children.front());
+    }
+    m_size -= erased ? 1 : 0;
+    return erased;
+}
+
+bool KeyIndex::erase(Node& node, std::string_view key, bool& out_erased) {
+    if (node.leaf) {
+        auto& leaf = static_cast<Leaf&>(node);
+        size_t i = leaf.lower_bound(key);
+        if (i == leaf.count() || leaf.key(i) != key) {
+            return false;
+        }
+        leaf.erase_at(i);
+        out_erased = true;
+        return leaf.count() == 0;
+    }
+    auto& inner = static_cast<Inner&>(node);
+    size_t i = inner.child_for(key);
+    if (!erase(*inner.children[i], key, out_erased)) {
+        return false;
+    }
+    remove_child(inner, i);
+    return inner.children.empty();
+}
+
+void KeyIndex::remove_child(Inner& inner, size_t index) {
+    if (inner.children[index]->leaf) {
+        auto& leaf = static_cast<Leaf&>(*inner.children[index]);
+        if (leaf.prev) {
+            leaf.prev->next = leaf.next;
+        }
+        if (leaf.next) {
+            leaf.next->prev = leaf.prev;
+        }
+    }
+    inner.children.erase(inner.children.begin() + static_cast<ptrdiff_t>(index));
+    // the neighbour takes over the range of the removed child
+    if (!inner.separators.empty()) {
+        inner.separators.erase(inner.separators.begin() + static_cast<ptrdiff_t>(index == 0 ? 0 : index - 1));
+    }
+}
+
+void KeyIndex::clear() {
+    m_root = std::make_unique<Leaf>();
+    m_size = 0;
+}
+
+void KeyIndex::assign(std::span<const std::string_view> sorted_keys) {
+    clear();
+    if (sorted_keys.empty()) {
+        return;
+    }
+    // the nodes of one level of the tree, with the first and last key below each
+    struct Built {
+        std::unique_ptr<Node> node;
+        std::string_view first;
+        std::string_view last;
+    };
+    std::vector<Built> level;
+    Leaf* previous = nullptr;
+    size_t first = 0;
+    auto leaf = std::make_unique<Leaf>();
+    auto finish_leaf = [&](size_t end) {
+        leaf->prev = previous;
+        if (previous) {
+            previous->next = leaf.get();
+        }
+        previous = leaf.get();
+        level.push_back({ std::move(leaf), sorted_keys[first], sorted_keys[end - 1] });
+        leaf = std::make_unique<Leaf>();
+        first = end;
+    };
+    for (size_t i = 0; i < sorted_keys.size(); ++i) {
+        std::string_view key = sorted_keys[i];
+        if (leaf->count() > 0
+            && (leaf->count() >= max_leaf_keys * fill_percent / 100 || leaf->bytes.size() + key.size() > max_leaf_bytes * fill_percent / 100)) {
+            finish_leaf(i);
+        }
+        leaf->insert_at(leaf->count(), key);
+    }
+    finish_leaf(sorted_keys.size());
+
+    constexpr size_t fill = max_children * fill_percent / 100;
+    while (level.size() > 1) {
+        std::vector<Built> parents;
+        parents.reserve(level.size() / fill + 1);
+        for (size_t i = 0; i < level.size(); i += fill) {
+            size_t end = std::min(i + fill, level.size());
+            auto inner = std::make_unique<Inner>();
+            inner->separators.reserve(end - i - 1);
+            inner->children.reserve(end - i);
+            for (size_t j = i; j < end; ++j) {
+                if (j > i) {
+                    inner->separators.emplace_back(shortest_separator(level[j - 1].last, level[j].first));
+                }
+                inner->children.push_back(std::move(level[j].node));
+            }
+            parents.push_back({ std::move(inner), level[i].first, level[end - 1].last });
+        }
+        level = std::move(parents);
+    }
+    m_root = std::move(level.front().node);
+    m_size = sorted_keys.size();
+}
+
+size_t KeyIndex::memory_usage() const {
+    return memory_usage(*m_root);
+}
+
+size_t KeyIndex::memory_usage(const Node& node) {
+    if (node.leaf) {
+        const auto& leaf = static_cast<const Leaf&>(node);
+        return sizeof(Leaf) + leaf.bytes.capacity() + leaf.ends.capacity() * sizeof(uint32_t);
+    }
+    const auto& inner = static_cast<const Inner&>(node);
+    size_t bytes = sizeof(Inner) + inner.separators.capacity() * sizeof(std::string)
+        + inner.children.capacity() * sizeof(std::unique_ptr<Node>);
+    for (const auto& separator : inner.separators) {
+        bytes += separator.capacity();
+    }
+    for (const auto& child : inner.children) {
+        bytes += memory_usage(*child);
+    }
+    return bytes;
+}
+
+TEST_CASE("KeyIndex") {
+    KeyIndex index;
+    std::set<std::string> expected;
+    // every key from `start` on, in both
+    auto check_from = [&](const std::string& start, size_t limit) {
+        auto iter = expected.lower_bound(start);
+        size_t seen = 0;
+        bool matches = true;
+        index.for_each_from(start, [&](std::string_view key) {
+            if (iter == expected.end() || key != *iter) {
+                matches = false;
+                return false;
+            }
+            ++iter;
+            return ++seen < limit;
+        });
+        CHECK(matches);
+        if (seen < limit) {
+            CHECK(iter == expected.end());
+        }
+    };
+    CHECK(index.empty());
+    check_from("", 10);
+
+    // short keys with shared prefixes, the empty key, and a few long ones which
+    // split leaves by size
+    std::mt19937 rng(42);
+    auto random_key = [&]() {
+        std::uniform_int_distribution<int> kind(0, 99);
+        std::uniform_int_distribution<int> letter('a', 'd');
+        std::string key;
+        size_t length = kind(rng) == 0 ? 5000 : static_cast<size_t>(kind(rng) % 12);
+        for (size_t i = 0; i < length; ++i) {
+            key += static_cast<char>(letter(rng));
+        }
+        return key;
+    };
+    for (int round = 0; round < 3; ++round) {
+        // mostly inserts, then mostly erases
+        for (int step = 0; step < 2; ++step) {
+            for (int i = 0; i < 20000; ++i) {
+                std::string key = random_key();
+                bool insert = (std::uniform_int_distribution<int>(0, 99)(rng) < 75) == (step == 0);
+                if (insert) {
+                    CHECK_EQ(index.insert(key), expected.insert(key).second);
+                } else {
+                    CHECK_EQ(index.erase(key), expected.erase(key) == 1);
+                }
+            }
+            CHECK_EQ(index.size(), expected.size());
+            check_from("", std::numeric_limits<size_t>::max());
+            for (int i = 0; i < 100; ++i) {
+                std::string start = random_key();
+                CHECK_EQ(index.contains(start), expected.contains(start));
+                check_from(start, 50);
+            }
+        }
+        // a bulk loaded tree behaves the same
+        std::vector<std::string_view> keys(expected.begin(), expected.end());
+        index.assign(keys);
+        CHECK_EQ(index.size(), expected.size());
+        check_from("", std::numeric_limits<size_t>::max());
+        check_from("bb", 100);
+    }
+
+    // erasing everything leaves an empty tree, which still works
+    for (const auto& key : expected) {
+        CHECK(index.erase(key));
+    }
+    expected.clear();
+    CHECK(index.empty());
+    check_from("", 10);
+    CHECK(index.insert("again"));
+    expected.insert("again");
+    check_from("", 10);
+    index.assign({});
+    CHECK(index.empty());
+}
+
+TEST_CASE("KeyIndex scan instead of sort") {
+    // listing a page of keys from the index, compared to sorting all keys for it
+    constexpr size_t count = 200000;
+    std::vector<std::string> keys;
+    keys.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        keys.push_back(fmt::format("tenant/{:08}", (i * 7919) % count));
+    }
+    KeyIndex index;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& key : keys) {
+        index.insert(key);
+    }
+    double insert_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    std::vector<std::string> page;
+    index.for_each_from("tenant/00100000", [&](std::string_view key) {
+        page.emplace_back(key);
+        return page.size() < 100;
+    });
+    double scan_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    auto sorted = keys;
+    std::sort(sorted.begin(), sorted.end());
+    auto first = std::lower_bound(sorted.begin(), sorted.end(), "tenant/00100000");
+    std::vector<std::string> sorted_page(first, first + 100);
+    double sort_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    CHECK_EQ(page, sorted_page);
+    spdlog::info("key index: {:.1f} bytes/key, {} keys inserted in {:.0f} ms, a page of 100 in {:.3f} ms (sorting: {:.0f} ms)",
+        double(index.memory_usage()) / count, count, insert_seconds * 1000, scan_seconds * 1000, sort_seconds * 1000);
+    CHECK_LT(scan_seconds, sort_seconds);
+}
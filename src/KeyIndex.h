@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// The keys of a store in order, so that ranges of them can be listed without
+// sorting all keys. The KeyDir answers lookups, this only answers "what comes next".
+//
+// It's a B+tree. A leaf holds up to max_leaf_keys keys back to back in one buffer,
+// with the offset where each ends, so a leaf is a few contiguous allocations and a
+// scan walks memory in order. Leaves are linked, so a scan descends the tree once
+// and then only follows the links. Inner nodes hold the shortest separators which
+// tell their children apart, not whole keys.
+//
+// Emptied nodes are removed, but nodes aren't merged with their siblings, so a
+// tree which shrank a lot can be sparser than one built from the same keys.
+// Not thread safe.
+class KeyIndex {
+public:
+    static constexpr size_t max_leaf_keys = 64;
+    // a leaf with more than one key is also split once its keys take this many bytes
+    static constexpr size_t max_leaf_bytes = 16 * 1024;
+    static constexpr size_t max_children = 64;
+
+    KeyIndex();
+    ~KeyIndex();
+    KeyIndex(const KeyIndex&) = delete;
+    KeyIndex& operator=(const KeyIndex&) = delete;
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    bool contains(std::string_view key) const;
+    // returns false if the key was there already
+    bool insert(std::string_view key);
+    // returns false if the key wasn't there
+    bool erase(std::string_view key);
+    void clear();
+    void swap(KeyIndex& other) noexcept {
+        m_root.swap(other.m_root);
+        std::swap(m_size, other.m_size);
+    }
+    // replaces all keys, which must be sorted and unique. much faster than inserting
+    // them one by one, and leaves room in every node for later inserts
+    void assign(std::span<const std::string_view> sorted_keys);
+
+    // calls f(std::string_view key) for every key from `start` on, in ascending order,
+    // until it returns false. the key stays valid until the index is modified.
+    template <typename F>
+    void for_each_from(std::string_view start, F&& f) const {
+        const Leaf* leaf = find_leaf(start);
+        for (size_t i = leaf->lower_bound(start); leaf; leaf = leaf->next, i = 0) {
+            for (; i < leaf->count(); ++i) {
+                if (!f(leaf->key(i))) {
+                    return;
+                }
+            }
+        }
+    }
+
+    // bytes allocated for all nodes
+    size_t memory_usage() const;
+
+private:
+    struct Node {
+        explicit Node(bool is_leaf)
+            : leaf(is_leaf) { }
+        virtual ~Node() = default;
+        bool leaf;
+    };
+    struct Leaf : Node {
+        Leaf()
+            : Node(true) { }
+        // the keys back to back, key i ends at ends[i]
+        std::string bytes;
+        std::vector<uint32_t> ends;
+        Leaf* prev { nullptr };
+        Leaf* next { nullptr };
+
+        size_t count() const { return ends.size(); }
+        std::string_view key(size_t i) const {
+            size_t begin = i == 0 ? 0 : ends[i - 1];
+            return std::string_view(bytes).substr(begin, ends[i] - begin);
+        }
+        // index of the first key which isn't less than `key`
+        size_t lower_bound(std::string_view key) const;
+        void insert_at(size_t i, std::string_view key);
+        void erase_at(size_t i);
+        bool full() const { return count() > max_leaf_keys || (count() > 1 && bytes.size() > max_leaf_bytes); }
+    };
+    struct Inner : Node {
+        Inner()
+            : Node(false) { }
+        // children[i] holds the keys from separators[i - 1] up to (not including) separators[i]
+        std::vector<std::string> separators;
+        std::vector<std::unique_ptr<Node>> children;
+
+        size_t child_for(std::string_view key) const;
+    };
+    // a node split off from another, which goes right of it, and the separator between them
+    struct Split {
+        std::string separator;
+        std::unique_ptr<Node> node;
+    };
+
+    // the leaf where `key` is or would be
+    const Leaf* find_leaf(std::string_view key) const;
+    std::optional<Split> insert(Node& node, std::string_view key, bool& out_inserted);
+    // returns true if the node is empty afterwards
+    bool erase(Node& node, std::string_view key, bool& out_erased);
+    // removes an empty child, and unlinks it if it's a leaf
+    static void remove_child(Inner& inner, size_t index);
+    static size_t memory_usage(const Node& node);
+
+    // never nullptr, an empty index is an empty leaf
+    std::unique_ptr<Node> m_root;
+    size_t m_size { 0 };
+};
@@ -0,0 +1,147 @@
+#include "KeyList.h"
+
+#include <doctest/doctest.h>
+#include <fmt/core.h>
+#include <nlohmann/json.hpp>
+#include <vector>
+
+// the page around the rows, split where they go
+static const std::pair<std::string, std::string>& html_frame() {
+    static const auto frame = [] {
+        constexpr std::string_view marker = "<!-- rows -->";
+        std::string html = fmt::format(
+#include "all-keys.html"
+            , marker);
+        size_t at = html.find(marker);
+        return std::pair { html.substr(0, at), html.substr(at + marker.size()) };
+    }();
+    return frame;
+}
+
+static std::string json_string(const std::string& key) {
+    // keys are bytes, not necessarily UTF-8
+    return nlohmann::json(key).dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+static void append_html_escaped(std::string& out, std::string_view str) {
+    for (char c : str) {
+        switch (c) {
+        case '&':
+            out += "&amp;";
+            break;
+        case '<':
+            out += "&lt;";
+            break;
+        case '>':
+            out += "&gt;";
+            break;
+        default:
+            out += c;
+        }
+    }
+}
+
+std::string KeyListWriter::begin() const {
+    switch (m_format) {
+    case KeyListFormat::Json:
+        return "[";
+    case KeyListFormat::NdJson:
+        return "";
+    case KeyListFormat::Html:
+        return html_frame().first;
+    default:
+        return "";
+    }
+}
+
+std::string KeyListWriter::page(std::span<const std::string> keys) {
+    std::string out;
+    for (const auto& key : keys) {
+        switch (m_format) {
+        case KeyListFormat::Json:
+            if (!m_first) {
+                out += ',';
+            }
+            out += json_string(key);
+            break;
+        case KeyListFormat::NdJson:
+            out += json_string(key);
+            out += '\n';
+            break;
+        case KeyListFormat::Html:
+            out += "<tr><td>";
+            append_html_escaped(out, key);
+            out += "</td></tr>";
+            break;
+        default:
+            break;
+        }
+        m_first = false;
+    }
+    return out;
+}
+
+std::string KeyListWriter::end() const {
+    switch (m_format) {
+    case KeyListFormat::Json:
+        return "]";
+    case KeyListFormat::NdJson:
+        return "";
+    case KeyListFormat::Html:
+        return html_frame().second;
+    default:
+        return "";
+    }
+}
+
+std::string percent_encode(std::string_view str) {
+    static constexpr char hex[] = "0123456789ABCDEF";
+    std::string out;
+    out.reserve(str.size());
+    for (char c : str) {
+        auto byte = static_cast<unsigned char>(c);
+        if ((byte >= 'a' && byte <= 'z') || (byte >= 'A' && byte <= 'Z') || (byte >= '0' && byte <= '9')
+            || byte == '-' || byte == '.' || byte == '_' || byte == '~') {
+            out += c;
+        } else {
+            out += '%';
+            out += hex[byte >> 4];
+            out += hex[byte & 0xf];
+        }
+    }
+    return out;
+}
+
+TEST_CASE("key list formats") {
+    std::vector<std::string> keys { "a", "b\"c", "<d>", std::string("e\0f", 3) };
+    // the same listing, in pages of every size
+    for (size_t page_size : { 1u, 2u, 3u, 4u }) {
+        for (auto format : { KeyListFormat::Json, KeyListFormat::NdJson, KeyListFormat::Html }) {
+            KeyListWriter writer(format);
+            std::string listing = writer.begin();
+            for (size_t i = 0; i < keys.size(); i += page_size) {
+                listing += writer.page(std::span(keys).subspan(i, std::min(page_size, keys.size() - i)));
+            }
+            listing += writer.end();
+            if (format == KeyListFormat::Json) {
+                CHECK_EQ(nlohmann::json::parse(listing), nlohmann::json(keys));
+            } else if (format == KeyListFormat::NdJson) {
+                std::vector<std::string> lines;
+                for (size_t start = 0, end; (end = listing.find('\n', start)) != std::string::npos; start = end + 1) {
+                    lines.push_back(nlohmann::json::parse(listing.substr(start, end - start)).get<std::string>());
+                }
+                CHECK_EQ(lines, keys);
+            } else {
+                CHECK_NE(listing.find("<tr><td>b\"c</td></tr><tr><td>&lt;d&gt;</td></tr>"), std::string::npos);
+                CHECK(listing.starts_with("\n<!DOCTYPE html>"));
+                CHECK(listing.ends_with("</html>\n"));
+            }
+        }
+    }
+    KeyListWriter empty(KeyListFormat::Json);
+    CHECK_EQ(empty.begin() + empty.page({}) + empty.end(), "[]");
+
+    CHECK_EQ(percent_encode("a-b_c.d~e"), "a-b_c.d~e");
+    CHECK_EQ(percent_encode("a/b c%\n"), "a%2Fb%20c%25%0A");
+    CHECK_EQ(percent_encode(std::string("\0\xff", 2)), "%00%FF");
+}
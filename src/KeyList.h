@@ -0,0 +1,36 @@
+#pragma once
+
+#include <span>
+#include <string>
+#include <string_view>
+
+// Formats of the /all-keys response, written a page of keys at a time, so that a
+// listing never holds more than a page in memory.
+//  - JSON:   ["key", ...]
+//  - NDJSON: one JSON string per line
+//  - HTML:   a table with one row per key
+enum class KeyListFormat {
+    Json,
+    NdJson,
+    Html,
+};
+
+// writes a listing in pieces: begin(), then page() for every page of keys, then end().
+// the pieces concatenated are the whole listing
+class KeyListWriter {
+public:
+    explicit KeyListWriter(KeyListFormat format)
+        : m_format(format) { }
+
+    std::string begin() const;
+    std::string page(std::span<const std::string> keys);
+    std::string end() const;
+
+private:
+    KeyListFormat m_format;
+    bool m_first { true };
+};
+
+// the string with everything but unreserved characters (RFC 3986) percent-encoded,
+// so that it can be sent in a header and used as a query parameter
+std::string percent_encode(std::string_view str);
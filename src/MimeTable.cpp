@@ -0,0 +1,192 @@
+#include "MimeTable.h"
+#include "Crc32c.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <doctest/doctest.h>
+#include <filesystem>
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+#include <vector>
+
+// the length and the checksum around every record
+static constexpr size_t record_overhead = 2 * sizeof(uint32_t);
+
+int MimeTable::open(const std::string& path) {
+    std::FILE* created = std::fopen(path.c_str(), "ab");
+    if (!created) {
+        return -errno;
+    }
+    std::fclose(created);
+    std::error_code ec;
+    uint64_t file_size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return -ec.value();
+    }
+    std::vector<uint8_t> data(file_size);
+    if (file_size > 0) {
+        auto file = PReadFile::open(path);
+        if (!file) {
+            return -errno;
+        }
+        int ret = file->read_at(data.data(), data.size(), 0);
+        if (ret != 0) {
+            return ret < 0 ? ret : -EIO;
+        }
+    }
+    std::unique_lock lock(m_mtx);
+    uint32_t count = 0;
+    uint64_t offset = 0;
+    while (offset < file_size) {
+        uint32_t length = 0;
+        uint32_t checksum = 0;
+        uint64_t left = file_size - offset;
+        if (left >= sizeof(length)) {
+            std::memcpy(&length, data.data() + offset, sizeof(length));
+        }
+        // a record which reaches the end of the file may have been torn by a crash.
+        // it was never synced, so no entry refers to it
+        if (left < record_overhead || length > left - record_overhead) {
+            break;
+        }
+        std::memcpy(&checksum, data.data() + offset + sizeof(length) + length, sizeof(checksum));
+        bool intact = length <= max_type_size && count < max_types
+            && crc32c({ data.data() + offset, sizeof(length) + length }) == checksum;
+        if (!intact && offset + record_overhead + length == file_size) {
+            break;
+        } else if (!intact) {
+            spdlog::error("mime: \"{}\" has a corrupt record at offset {}", path, offset);
+            return -EBADMSG;
+        }
+        auto& block = m_blocks[count / block_size];
+        if (!block) {
+            block = std::make_unique<Block>();
+        }
+        auto& type = (*block)[count % block_size];
+        type.assign(reinterpret_cast<const char*>(data.data() + offset + sizeof(length)), length);
+        ++count;
+        m_ids.emplace(type, count);
+        offset += record_overhead + length;
+    }
+    m_file = AppendFile::open(path);
+    if (!m_file) {
+        return -errno;
+    }
+    if (offset < file_size) {
+        spdlog::error("mime: \"{}\" ends in a partial record, truncating {} bytes", path, file_size - offset);
+        int ret = m_file->truncate(offset);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    m_size.store(count, std::memory_order_release);
+    return 0;
+}
+
+uint32_t MimeTable::intern(std::string_view mime) {
+    if (mime.empty() || mime.size() > max_type_size) {
+        return 0;
+    }
+    std::unique_lock lock(m_mtx);
+    auto iter = m_ids.find(mime);
+    if (iter != m_ids.end()) {
+        return iter->second;
+    }
+    uint32_t count = m_size.load(std::memory_order_relaxed);
+    if (!m_file || count == max_types) {
+        return 0;
+    }
+    std::vector<uint8_t> record(record_overhead + mime.size());
+    uint32_t length = static_cast<uint32_t>(mime.size());
+    std::memcpy(record.data(), &length, sizeof(length));
+    std::memcpy(record.data() + sizeof(length), mime.data(), mime.size());
+    uint32_t checksum = crc32c({ record.data(), sizeof(length) + mime.size() });
+    std::memcpy(record.data() + sizeof(length) + mime.size(), &checksum, sizeof(checksum));
+    std::span<const uint8_t> slice(record);
+    // entries with the id may be synced any moment after this returns, so the type goes first
+    int ret = m_file->append({ &slice, 1 });
+    if (ret == 0) {
+        ret = m_file->sync();
+    }
+    if (ret != 0) {
+        spdlog::error("mime: failed to add \"{}\": {}", mime, std::strerror(-ret));
+        return 0;
+    }
+    auto& block = m_blocks[count / block_size];
+    if (!block) {
+        block = std::make_unique<Block>();
+    }
+    auto& type = (*block)[count % block_size];
+    type.assign(mime);
+    m_ids.emplace(type, count + 1);
+    m_size.store(count + 1, std::memory_order_release);
+    return count + 1;
+}
+
+const std::string* MimeTable::find(uint32_t id) const {
+    if (id == 0 || id > size()) {
+        return nullptr;
+    }
+    uint32_t index = id - 1;
+    return &(*m_blocks[index / block_size])[index % block_size];
+}
+
+TEST_CASE("MimeTable") {
+    std::string path = "./test-mime-table.mime";
+    std::filesystem::remove(path);
+    {
+        MimeTable table;
+        REQUIRE_EQ(table.open(path), 0);
+        CHECK_EQ(table.size(), 0);
+        CHECK_EQ(table.intern("text/plain"), 1);
+        CHECK_EQ(table.intern("application/json"), 2);
+        CHECK_EQ(table.intern("text/plain"), 1);
+        // empty and long types aren't worth an id
+        CHECK_EQ(table.intern(""), 0);
+        CHECK_EQ(table.intern(std::string(MimeTable::max_type_size + 1, 'x')), 0);
+        REQUIRE(table.find(2));
+        CHECK_EQ(*table.find(2), "application/json");
+        CHECK_FALSE(table.find(0));
+        CHECK_FALSE(table.find(3));
+    }
+    {
+        // the ids survive a restart
+        MimeTable table;
+        REQUIRE_EQ(table.open(path), 0);
+        CHECK_EQ(table.size(), 2);
+        CHECK_EQ(*table.find(1), "text/plain");
+        CHECK_EQ(table.intern("application/json"), 2);
+        // more than fit into a block
+        for (uint32_t i = 0; i < 100; ++i) {
+            CHECK_EQ(table.intern(fmt::format("application/x-type-{}", i)), i + 3);
+        }
+        CHECK_EQ(*table.find(102), "application/x-type-99");
+    }
+    uint64_t intact_size = std::filesystem::file_size(path);
+    {
+        // a torn record at the end is cut off
+        std::FILE* file = std::fopen(path.c_str(), "ab");
+        REQUIRE(file);
+        uint32_t length = 20;
+        std::fwrite(&length, sizeof(length), 1, file);
+        std::fwrite("text/h", 1, 6, file);
+        std::fclose(file);
+        MimeTable table;
+        REQUIRE_EQ(table.open(path), 0);
+        CHECK_EQ(table.size(), 102);
+        CHECK_EQ(std::filesystem::file_size(path), intact_size);
+        CHECK_EQ(table.intern("text/html"), 103);
+    }
+    {
+        // a corrupt record before others isn't
+        std::FILE* file = std::fopen(path.c_str(), "r+b");
+        REQUIRE(file);
+        std::fseek(file, sizeof(uint32_t), SEEK_SET);
+        std::fputc('T', file);
+        std::fclose(file);
+        MimeTable table;
+        CHECK_EQ(table.open(path), -EBADMSG);
+    }
+    std::filesystem::remove(path);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "File.h"
+
+// The mime types of a store, each written once to a side file next to it, so
+// that entries only carry a small id instead of the whole type.
+//
+// The file is a list of records, [length (u32)][mime][checksum (u32)], and a
+// type's id is its position in the list, starting at 1. Records are only ever
+// appended, and synced before their id is handed out, so an entry on disk can't
+// refer to a type which isn't. Types are never removed, and ids never change.
+//
+// Looking up a type by id doesn't lock, interning does.
+class MimeTable {
+public:
+    // types beyond these are stored in each entry instead
+    static constexpr uint32_t max_types = 4096;
+    static constexpr size_t max_type_size = 255;
+
+    MimeTable() = default;
+    MimeTable(const MimeTable&) = delete;
+    MimeTable& operator=(const MimeTable&) = delete;
+
+    // reads the table from `path`, creating the file if it doesn't exist. a torn
+    // record at the end is cut off. returns negative errno on error, -EBADMSG if
+    // any other record is corrupt
+    int open(const std::string& path);
+
+    // id of the mime type, which is added first if it's new. returns 0 if it can't
+    // be interned: it's empty or too long, the table is full, or writing failed
+    uint32_t intern(std::string_view mime);
+    // the type with the id, which stays valid as long as the table, or nullptr
+    const std::string* find(uint32_t id) const;
+    uint32_t size() const { return m_size.load(std::memory_order_acquire); }
+
+private:
+    static constexpr uint32_t block_size = 64;
+    using Block = std::array<std::string, block_size>;
+
+    // a block is filled in before the size which covers it is published, and
+    // neither ever changes after, so readers don't need m_mtx
+    std::array<std::unique_ptr<Block>, max_types / block_size> m_blocks;
+    std::atomic<uint32_t> m_size { 0 };
+
+    // guards appending
+    std::mutex m_mtx;
+    // views into the blocks
+    std::unordered_map<std::string_view, uint32_t> m_ids;
+    std::shared_ptr<AppendFile> m_file;
+};
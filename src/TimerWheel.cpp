@@ -0,0 +1,143 @@
+#include "TimerWheel.h"
+
+#include <algorithm>
+#include <doctest/doctest.h>
+#include <fmt/core.h>
+#include <map>
+#include <random>
+
+TimerWheel::TimerWheel(uint64_t tick_ms, uint64_t now)
+    : m_tick_ms(std::max<uint64_t>(tick_ms, 1))
+    , m_current(now / m_tick_ms) {
+}
+
+bool TimerWheel::add(std::string_view key, uint64_t due) {
+    if (m_keys.find(key) != m_keys.end()) {
+        return false;
+    }
+    const auto& stored = *m_keys.emplace(key).first;
+    place(Entry { &stored, due }, std::max(fire_tick(due), m_current + 1));
+    return true;
+}
+
+void TimerWheel::place(Entry entry, uint64_t tick) {
+    uint64_t delta = tick - m_current;
+    if (delta >> (slot_bits * levels) != 0) {
+        // out of range, it's put back when the wheel gets to this slot
+        tick = m_current + (uint64_t(1) << (slot_bits * levels)) - 1;
+        delta = tick - m_current;
+    }
+    // the lowest level whose slots the wheel doesn't wrap around before then
+    size_t level = 0;
+    while (delta >> (slot_bits * (level + 1)) != 0) {
+        ++level;
+    }
+    m_slots[level][(tick >> (slot_bits * level)) & slot_mask].push_back(entry);
+}
+
+void TimerWheel::advance(uint64_t now, std::vector<Timer>& out_due) {
+    uint64_t target = now / m_tick_ms;
+    // a fired timer frees its key for a new one
+    auto fire = [&](const Entry& entry) {
+        out_due.push_back(Timer { *entry.key, entry.due });
+        m_keys.erase(out_due.back().key);
+    };
+    while (m_current < target) {
+        if (m_keys.empty()) {
+            m_current = target;
+            break;
+        }
+        uint64_t tick = ++m_current;
+        // from the top, so that timers can move down more than one level at once
+        for (size_t level = levels - 1; level > 0; --level) {
+            if ((tick & ((uint64_t(1) << (slot_bits * level)) - 1)) != 0) {
+                continue;
+            }
+            auto entries = std::move(m_slots[level][(tick >> (slot_bits * level)) & slot_mask]);
+            m_slots[level][(tick >> (slot_bits * level)) & slot_mask].clear();
+            for (const auto& entry : entries) {
+                uint64_t fire_at = fire_tick(entry.due);
+                if (fire_at <= tick) {
+                    fire(entry);
+                } else {
+                    place(entry, fire_at);
+                }
+            }
+        }
+        auto& slot = m_slots[0][tick & slot_mask];
+        for (const auto& entry : slot) {
+            fire(entry);
+        }
+        slot.clear();
+    }
+}
+
+TEST_CASE("TimerWheel") {
+    constexpr uint64_t tick = 1000;
+    constexpr uint64_t start = 1'000'003;
+    TimerWheel wheel(tick, start);
+    std::mt19937_64 rng(7);
+    std::map<std::string, uint64_t> pending;
+    // due within every level, far beyond the wheel's range, and in the past
+    for (size_t i = 0; i < 5000; ++i) {
+        uint64_t range = uint64_t(1) << (rng() % 36);
+        uint64_t due = start - 100 + rng() % range;
+        auto key = fmt::format("timer/{}", i);
+        pending[key] = due;
+        wheel.add(key, due);
+    }
+    CHECK_EQ(wheel.size(), pending.size());
+
+    // timers which were due already fire with the first tick
+    auto fires_after = [&](uint64_t when) { return std::max(when, (start / tick + 1) * tick); };
+    std::vector<TimerWheel::Timer> due;
+    uint64_t now = start;
+    // small steps first, then ever larger ones
+    for (uint64_t step = 1; !pending.empty(); step = std::min<uint64_t>(step * 2, uint64_t(1) << 30)) {
+        uint64_t previous = now;
+        now += step + rng() % step;
+        due.clear();
+        wheel.advance(now, due);
+        for (const auto& timer : due) {
+            auto it = pending.find(timer.key);
+            REQUIRE(it != pending.end());
+            CHECK_EQ(timer.due, it->second);
+            CHECK_LE(timer.due, now);
+            // not earlier than the tick it's due in
+            CHECK_GT(fires_after(timer.due), previous / tick * tick);
+            pending.erase(it);
+        }
+        // everything due by the last full tick fired
+        for (const auto& [key, when] : pending) {
+            CHECK_GT(fires_after(when), now / tick * tick);
+        }
+        CHECK_EQ(wheel.size(), pending.size());
+    }
+    CHECK(wheel.empty());
+
+    // an empty wheel jumps ahead, and then fires new timers on time
+    now = (now / tick + 1'000'000'000) * tick;
+    wheel.advance(now, due);
+    wheel.add("late", now + 2500);
+    due.clear();
+    wheel.advance(now + 2999, due);
+    CHECK(due.empty());
+    wheel.advance(now + 3000, due);
+    REQUIRE_EQ(due.size(), 1);
+    CHECK_EQ(due[0].key, "late");
+
+    // a key keeps its first timer, until it fired
+    now += 3000;
+    CHECK(wheel.add("once", now + 5000));
+    CHECK_FALSE(wheel.add("once", now + 1000));
+    CHECK_FALSE(wheel.add("once", now + 9000));
+    CHECK_EQ(wheel.size(), 1);
+    due.clear();
+    wheel.advance(now + 4999, due);
+    CHECK(due.empty());
+    wheel.advance(now + 5000, due);
+    REQUIRE_EQ(due.size(), 1);
+    CHECK_EQ(due[0].due, now + 5000);
+    CHECK(wheel.empty());
+    CHECK(wheel.add("once", now + 9000));
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+// A hierarchical timing wheel (Varghese and Lauck): timers are sorted into slots by
+// the tick they're due in, so adding a timer and firing the due ones costs the same
+// however many timers there are, instead of log n for a heap.
+//
+// There are 4 levels of 64 slots. A slot of level 0 holds the timers of one tick, a
+// slot of level n those of 64^n ticks. Whenever the wheel moves on to the next slot of
+// a level above 0, its timers are spread over the slots of the levels below. Timers
+// further out than 64^4 ticks wait in the top level and are put back there until
+// they're in range.
+//
+// A key has at most one timer. Timers can't be removed or moved, whoever fires them
+// checks whether they're still current, and adds them again if they're due later.
+// Not thread safe.
+class TimerWheel {
+public:
+    struct Timer {
+        std::string key;
+        // in milliseconds, on the same clock as `now`
+        uint64_t due;
+    };
+
+    TimerWheel(uint64_t tick_ms, uint64_t now);
+
+    // timers which are due already fire with the next tick. a key which has a timer
+    // already keeps that one, whenever it's due. returns whether the timer was added
+    bool add(std::string_view key, uint64_t due);
+    // moves the wheel forward to `now`, and appends the timers which are due by then to
+    // out_due. a timer fires no earlier than it's due, and at most a tick later
+    void advance(uint64_t now, std::vector<Timer>& out_due);
+
+    size_t size() const { return m_keys.size(); }
+    bool empty() const { return m_keys.empty(); }
+    uint64_t tick_ms() const { return m_tick_ms; }
+
+private:
+    static constexpr size_t levels = 4;
+    static constexpr size_t slot_bits = 6;
+    static constexpr uint64_t slot_mask = (uint64_t(1) << slot_bits) - 1;
+
+    struct KeyHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view key) const { return std::hash<std::string_view> {}(key); }
+    };
+    // a timer in a slot, its key is in m_keys
+    struct Entry {
+        const std::string* key;
+        uint64_t due;
+    };
+
+    // the first tick by whose end the timer is due
+    uint64_t fire_tick(uint64_t due) const { return due / m_tick_ms + (due % m_tick_ms != 0 ? 1 : 0); }
+    // puts the timer into the slot for `tick`, which is after m_current
+    void place(Entry entry, uint64_t tick);
+
+    uint64_t m_tick_ms;
+    // the last tick which was fired
+    uint64_t m_current;
+    // the keys which have a timer. the slots point into it, its nodes don't move
+    std::unordered_set<std::string, KeyHash, std::equal_to<>> m_keys;
+    std::array<std::array<std::vector<Entry>, size_t(1) << slot_bits>, levels> m_slots;
+};
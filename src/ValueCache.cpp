@@ -0,0 +1,195 @@
+#include "ValueCache.h"
+
+#include <doctest/doctest.h>
+#include <fmt/core.h>
+#include <functional>
+
+// what an entry costs besides its key and value: the list node, the index
+// entry and the buffer's control block, roughly
+static constexpr uint64_t entry_overhead = 128;
+
+static bool same_location(const KeyLocation& a, const KeyLocation& b) {
+    return a.segment == b.segment && a.value_offset == b.value_offset;
+}
+
+ValueCache::ValueCache(uint64_t capacity)
+    : m_shard_capacity(capacity / shard_count) {
+}
+
+uint64_t ValueCache::entry_size(const Entry& entry) {
+    return entry.key.size() + entry.buffer->size() + entry_overhead;
+}
+
+ValueCache::Shard& ValueCache::shard_for(std::string_view key) {
+    return m_shards[(uint64_t(std::hash<std::string_view> {}(key)) * 0x9e3779b97f4a7c15) >> 60];
+}
+
+bool ValueCache::admits(uint64_t size) const {
+    return size + entry_overhead <= m_shard_capacity / 4;
+}
+
+ValueCache::Buffer ValueCache::find(std::string_view key, const KeyLocation& location) {
+    auto& shard = shard_for(key);
+    std::unique_lock lock(shard.mtx);
+    auto iter = shard.index.find(key);
+    if (iter == shard.index.end()) {
+        ++shard.misses;
+        return nullptr;
+    }
+    auto entry = iter->second;
+    if (!same_location(entry->location, location)) {
+        // the key was overwritten (or merged) since, this value is never coming back
+        remove(shard, entry);
+        ++shard.misses;
+        return nullptr;
+    }
+    ++shard.hits;
+    if (entry->protected_segment) {
+        shard.protected_entries.splice(shard.protected_entries.begin(), shard.protected_entries, entry);
+    } else {
+        // read a second time, so it's worth protecting
+        entry->protected_segment = true;
+        shard.probation_bytes -= entry_size(*entry);
+        shard.protected_bytes += entry_size(*entry);
+        shard.protected_entries.splice(shard.protected_entries.begin(), shard.probation, entry);
+    }
+    auto buffer = entry->buffer;
+    shrink(shard);
+    return buffer;
+}
+
+void ValueCache::insert(std::string_view key, const KeyLocation& location, Buffer buffer) {
+    if (!admits(buffer->size() + key.size())) {
+        return;
+    }
+    auto& shard = shard_for(key);
+    std::unique_lock lock(shard.mtx);
+    auto iter = shard.index.find(key);
+    if (iter != shard.index.end()) {
+        // a concurrent read got here first, or the value is outdated
+        remove(shard, iter->second);
+    }
+    shard.probation.push_front(Entry { .key = std::string(key), .location = location, .buffer = std::move(buffer), .protected_segment = false });
+    auto entry = shard.probation.begin();
+    shard.index.emplace(entry->key, entry);
+    shard.probation_bytes += entry_size(*entry);
+    shrink(shard);
+}
+
+void ValueCache::erase(std::string_view key) {
+    auto& shard = shard_for(key);
+    std::unique_lock lock(shard.mtx);
+    auto iter = shard.index.find(key);
+    if (iter != shard.index.end()) {
+        remove(shard, iter->second);
+    }
+}
+
+void ValueCache::relocate(std::string_view key, const KeyLocation& from, const KeyLocation& to) {
+    auto& shard = shard_for(key);
+    std::unique_lock lock(shard.mtx);
+    auto iter = shard.index.find(key);
+    if (iter != shard.index.end() && same_location(iter->second->location, from)) {
+        iter->second->location = to;
+    }
+}
+
+void ValueCache::remove(Shard& shard, List::iterator entry) {
+    shard.index.erase(entry->key);
+    if (entry->protected_segment) {
+        shard.protected_bytes -= entry_size(*entry);
+        shard.protected_entries.erase(entry);
+    } else {
+        shard.probation_bytes -= entry_size(*entry);
+        shard.probation.erase(entry);
+    }
+}
+
+void ValueCache::shrink(Shard& shard) {
+    uint64_t protected_capacity = m_shard_capacity / 5 * 4;
+    while (shard.protected_bytes > protected_capacity) {
+        auto entry = std::prev(shard.protected_entries.end());
+        entry->protected_segment = false;
+        shard.protected_bytes -= entry_size(*entry);
+        shard.probation_bytes += entry_size(*entry);
+        shard.probation.splice(shard.probation.begin(), shard.protected_entries, entry);
+    }
+    while (shard.probation_bytes + shard.protected_bytes > m_shard_capacity && !shard.probation.empty()) {
+        remove(shard, std::prev(shard.probation.end()));
+        ++shard.evictions;
+    }
+}
+
+ValueCacheStats ValueCache::stats() const {
+    ValueCacheStats stats {};
+    for (const auto& shard : m_shards) {
+        std::unique_lock lock(shard.mtx);
+        stats.hits += shard.hits;
+        stats.misses += shard.misses;
+        stats.evictions += shard.evictions;
+        stats.entries += shard.index.size();
+        stats.bytes += shard.probation_bytes + shard.protected_bytes;
+    }
+    return stats;
+}
+
+TEST_CASE("ValueCache") {
+    auto location_at = [](uint64_t offset) {
+        return KeyLocation { .value_offset = offset, .value_size = 100, .mime_size = 0, .segment = 0 };
+    };
+    auto buffer_of = [](uint8_t fill) {
+        return std::make_shared<const std::vector<uint8_t>>(100, fill);
+    };
+    // room for about 6 entries per shard
+    ValueCache cache(16 * 6 * (100 + 8 + entry_overhead));
+
+    cache.insert("a", location_at(1), buffer_of(1));
+    auto found = cache.find("a", location_at(1));
+    REQUIRE(found);
+    CHECK_EQ(found->front(), 1);
+    // a value is only found for the location it was read from
+    CHECK_FALSE(cache.find("a", location_at(2)));
+    CHECK_FALSE(cache.find("a", location_at(1)));
+    CHECK_FALSE(cache.find("missing", location_at(1)));
+
+    cache.insert("b", location_at(1), buffer_of(2));
+    cache.relocate("b", location_at(1), location_at(5));
+    CHECK_FALSE(cache.find("b", location_at(1)));
+    cache.insert("b", location_at(1), buffer_of(2));
+    cache.relocate("b", location_at(1), location_at(5));
+    CHECK(cache.find("b", location_at(5)));
+    cache.erase("b");
+    CHECK_FALSE(cache.find("b", location_at(5)));
+
+    auto stats = cache.stats();
+    CHECK_EQ(stats.hits, 2);
+    CHECK_EQ(stats.misses, 5);
+    CHECK_EQ(stats.entries, 0);
+    CHECK_EQ(stats.bytes, 0);
+
+    // too large to cache at all
+    CHECK_FALSE(cache.admits(1024 * 1024));
+    cache.insert("large", location_at(1), std::make_shared<const std::vector<uint8_t>>(1024 * 1024));
+    CHECK_FALSE(cache.find("large", location_at(1)));
+
+    // a hot set which is read often, then a scan over many more keys which are read once
+    std::vector<std::string> hot;
+    for (size_t i = 0; i < 32; ++i) {
+        hot.push_back(fmt::format("hot-{}", i));
+        cache.insert(hot.back(), location_at(i), buffer_of(3));
+        CHECK(cache.find(hot.back(), location_at(i)));
+    }
+    for (size_t i = 0; i < 10000; ++i) {
+        auto key = fmt::format("scan-{}", i);
+        cache.insert(key, location_at(i), buffer_of(4));
+    }
+    size_t hot_hits = 0;
+    for (size_t i = 0; i < hot.size(); ++i) {
+        hot_hits += cache.find(hot[i], location_at(i)) ? 1u : 0u;
+    }
+    // with plain LRU, none would be left
+    CHECK_GT(hot_hits, hot.size() / 2);
+    stats = cache.stats();
+    CHECK_GT(stats.evictions, 9000);
+    CHECK_LE(stats.bytes, 16 * 6 * (100 + 8 + entry_overhead));
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "KeyDir.h"
+
+struct ValueCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;
+    uint64_t bytes;
+};
+
+// A cache of recently read values, bounded by bytes. A value is kept as one
+// immutable buffer with the mime type right behind it (like in the store file),
+// which readers share, and keep alive after it's evicted.
+//
+// Every value is cached for the location it was read from, and only found for
+// that location. A value read before the key was overwritten can thus never be
+// served afterwards, no matter in which order reads and writes finish.
+//
+// Eviction is a segmented LRU: new values start out on probation, and only move
+// to the protected segment (80% of the capacity) when they're read again. A scan
+// over many keys only pushes out values which were read once.
+class ValueCache {
+public:
+    using Buffer = std::shared_ptr<const std::vector<uint8_t>>;
+
+    explicit ValueCache(uint64_t capacity);
+    ValueCache(const ValueCache&) = delete;
+    ValueCache& operator=(const ValueCache&) = delete;
+
+    // the value of the key if it's cached for this location, otherwise nullptr
+    Buffer find(std::string_view key, const KeyLocation& location);
+    // whether a value and mime of this size would be cached at all. a single value
+    // may take up at most a quarter of a shard, so it can't flush everything else
+    bool admits(uint64_t size) const;
+    void insert(std::string_view key, const KeyLocation& location, Buffer buffer);
+    void erase(std::string_view key);
+    // keeps the value cached after it moved, as long as it's still cached for `from`
+    void relocate(std::string_view key, const KeyLocation& from, const KeyLocation& to);
+
+    ValueCacheStats stats() const;
+
+private:
+    static constexpr size_t shard_count = 16;
+
+    struct Entry {
+        std::string key;
+        KeyLocation location;
+        Buffer buffer;
+        bool protected_segment;
+    };
+    using List = std::list<Entry>;
+
+    struct Shard {
+        mutable std::mutex mtx;
+        // most recently used first
+        List probation;
+        List protected_entries;
+        // keys point into the entries, which never move
+        std::unordered_map<std::string_view, List::iterator> index;
+        uint64_t probation_bytes { 0 };
+        uint64_t protected_bytes { 0 };
+        uint64_t hits { 0 };
+        uint64_t misses { 0 };
+        uint64_t evictions { 0 };
+    };
+
+    static uint64_t entry_size(const Entry& entry);
+    Shard& shard_for(std::string_view key);
+    void remove(Shard& shard, List::iterator entry);
+    // moves protected entries back to probation, and evicts from probation, until
+    // the shard fits its capacity again
+    void shrink(Shard& shard);
+
+    uint64_t m_shard_capacity;
+    std::array<Shard, shard_count> m_shards;
+};
@@ -1,6 +1,13 @@
 #include "Accept.h"
+#include "Batch.h"
+#include "ETag.h"
+#include "GetValue.h"
+#include "KeyList.h"
 #include "KVStore.h"
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
+#include <charconv>
 #include <chrono>
 #include <csignal>
 #include <cstdint>
@@ -12,10 +19,15 @@
 #include <fmt/core.h>
 #include <httplib.h>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <nlohmann/json.hpp>
+#include <optional>
+#include <shared_mutex>
 #include <spdlog/spdlog.h>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 
 static httplib::Server server {};
@@ -25,6 +37,61 @@ static void sighandler(int) {
     server.stop();
 }
 
+// `kv-api verify <store-path> [--threads=<n>]`: checks every entry of the store (or of
+// all stores in the directory) against its checksums, without starting the server.
+// returns 0 if everything is intact, 2 if anything is corrupt, 1 on other errors
+static int verify_main(int argc, const char** argv) {
+    if (argc < 3) {
+        spdlog::error("error: not enough arguments. verify <store-path> [--threads=<n>] expected.\n\texample: {} verify store/mystore.kvs", argv[0]);
+        return 1;
+    }
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 3; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg.starts_with("--threads=")) {
+            auto count = arg.substr(arg.find('=') + 1);
+            if (std::from_chars(count.data(), count.data() + count.size(), threads).ec != std::errc() || threads == 0) {
+                spdlog::error("error: invalid number of threads \"{}\"", count);
+                return 1;
+            }
+        } else {
+            spdlog::error("error: unknown option \"{}\"", arg);
+            return 1;
+        }
+    }
+    std::vector<std::filesystem::path> store_files;
+    std::filesystem::path path = argv[2];
+    if (std::filesystem::is_directory(path)) {
+        for (const auto& store_path : std::filesystem::directory_iterator(path)) {
+            if (store_path.path().extension() == ".kvs") {
+                store_files.push_back(store_path.path());
+            }
+        }
+        std::sort(store_files.begin(), store_files.end());
+    } else if (std::filesystem::exists(path)) {
+        store_files.push_back(path);
+    } else {
+        spdlog::error("error: \"{}\" doesn't exist", path.string());
+        return 1;
+    }
+    bool corrupt = false;
+    for (const auto& store_file : store_files) {
+        auto start = std::chrono::steady_clock::now();
+        KVVerifyResult result;
+        int ret = KVStore::verify(store_file.string(), threads, result);
+        if (ret < 0) {
+            spdlog::error("verify: failed to read \"{}\": {}", store_file.string(), std::strerror(-ret));
+            return 1;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double megabytes = double(result.bytes) / (1024 * 1024);
+        spdlog::info("verify: \"{}\": {} entries, {:.1f} MiB in {:.3f} s, {:.1f} MiB/s, {}", store_file.string(), result.entries, megabytes,
+            elapsed.count(), megabytes / std::max(elapsed.count(), 1e-9), result.errors.empty() ? "intact" : fmt::format("{} corrupt", result.errors.size()));
+        corrupt = corrupt || !result.errors.empty();
+    }
+    return corrupt ? 2 : 0;
+}
+
 int main(int argc, const char** argv) {
     setlocale(LC_ALL, "C");
 
@@ -38,11 +105,107 @@ int main(int argc, const char** argv) {
     }
 
     spdlog::info("KV API v{}.{}.{}-{}", PRJ_VERSION_MAJOR, PRJ_VERSION_MINOR, PRJ_VERSION_PATCH, PRJ_GIT_HASH);
-    if (argc != 4) {
-        spdlog::error("error: not enough arguments. <host> <port> <store-path> expected.\n\texample: {} 127.0.0.1 8080 store", argv[0]);
+    if (argc >= 2 && std::string_view(argv[1]) == "verify") {
+        return verify_main(argc, argv);
+    }
+    if (argc < 4) {
+        spdlog::error("error: not enough arguments. <host> <port> <store-path> [options] expected.\n\texample: {} 127.0.0.1 8080 store", argv[0]);
+        spdlog::error("to check the stores for corruption instead: {} verify <store-path> [--threads=<n>]", argv[0]);
+        spdlog::error("options:\n"
+                      "\t--mmap\tserve reads from memory mapped store files\n"
+                      "\t--durability=none|batch|<ms>\twhen writes are synced to disk: never explicitly (default), before every (group) write returns, or every <ms> milliseconds\n"
+                      "\t--segment-size=<MiB>\tsize at which a store file is sealed and a new one is started (default: 256)\n"
+                      "\t--auto-compaction[=<ratio>]\tmerge segments in the background once <ratio> of them is garbage (default: 0.5)\n"
+                      "\t--compaction-rate=<MiB/s>\tlimit how fast background merges write (default: no limit)\n"
+                      "\t--cache=<MiB>\tkeep up to this much of recently read values in memory, per store (default: no cache)\n"
+                      "\t--compress[=<bytes>]\tgzip text and JSON values of at least this size (default: 256) on disk\n"
+                      "\t--no-ordered-index\tdon't keep the keys in order, which saves memory but makes /scan sort all keys\n"
+                      "\t--load-threads=<n>\thow many stores are loaded in parallel on startup (default: one per core)\n"
+                      "\t--background-load\tstart listening right away, stores which are still loading respond with 503");
         return 1;
     }
 
+    KVOptions options;
+    unsigned load_threads = std::max(1u, std::thread::hardware_concurrency());
+    bool background_load = false;
+    for (int i = 4; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--mmap") {
+            options.mmap_reads = true;
+        } else if (arg.starts_with("--segment-size=")) {
+            auto size = arg.substr(arg.find('=') + 1);
+            uint64_t mebibytes = 0;
+            if (std::from_chars(size.data(), size.data() + size.size(), mebibytes).ec != std::errc() || mebibytes == 0) {
+                spdlog::error("error: invalid segment size \"{}\"", size);
+                return 1;
+            }
+            options.segment_size = mebibytes * 1024 * 1024;
+        } else if (arg == "--auto-compaction") {
+            options.auto_compaction = true;
+        } else if (arg.starts_with("--auto-compaction=")) {
+            auto ratio = std::string(arg.substr(arg.find('=') + 1));
+            char* end = nullptr;
+            options.auto_compaction = true;
+            options.compaction_ratio = std::strtod(ratio.c_str(), &end);
+            if (end != ratio.c_str() + ratio.size() || !(options.compaction_ratio > 0 && options.compaction_ratio <= 1)) {
+                spdlog::error("error: invalid compaction ratio \"{}\", expected a number between 0 and 1", ratio);
+                return 1;
+            }
+        } else if (arg.starts_with("--compaction-rate=")) {
+            auto rate = arg.substr(arg.find('=') + 1);
+            uint64_t mebibytes = 0;
+            if (std::from_chars(rate.data(), rate.data() + rate.size(), mebibytes).ec != std::errc() || mebibytes == 0) {
+                spdlog::error("error: invalid compaction rate \"{}\"", rate);
+                return 1;
+            }
+            options.compaction_rate = mebibytes * 1024 * 1024;
+        } else if (arg.starts_with("--cache=")) {
+            auto size = arg.substr(arg.find('=') + 1);
+            uint64_t mebibytes = 0;
+            if (std::from_chars(size.data(), size.data() + size.size(), mebibytes).ec != std::errc()) {
+                spdlog::error("error: invalid cache size \"{}\"", size);
+                return 1;
+            }
+            options.cache_size = mebibytes * 1024 * 1024;
+        } else if (arg == "--compress") {
+            options.compression = true;
+        } else if (arg.starts_with("--compress=")) {
+            auto size = arg.substr(arg.find('=') + 1);
+            options.compression = true;
+            if (std::from_chars(size.data(), size.data() + size.size(), options.compression_min_size).ec != std::errc()) {
+                spdlog::error("error: invalid minimum size to compress \"{}\"", size);
+                return 1;
+            }
+        } else if (arg == "--no-ordered-index") {
+            options.ordered_index = false;
+        } else if (arg == "--background-load") {
+            background_load = true;
+        } else if (arg.starts_with("--load-threads=")) {
+            auto count = arg.substr(arg.find('=') + 1);
+            if (std::from_chars(count.data(), count.data() + count.size(), load_threads).ec != std::errc() || load_threads == 0) {
+                spdlog::error("error: invalid number of load threads \"{}\"", count);
+                return 1;
+            }
+        } else if (arg.starts_with("--durability=")) {
+            auto policy = arg.substr(arg.find('=') + 1);
+            unsigned interval = 0;
+            if (policy == "none") {
+                options.durability = KVDurability::None;
+            } else if (policy == "batch") {
+                options.durability = KVDurability::Batch;
+            } else if (std::from_chars(policy.data(), policy.data() + policy.size(), interval).ec == std::errc() && interval > 0) {
+                options.durability = KVDurability::Interval;
+                options.sync_interval = std::chrono::milliseconds(interval);
+            } else {
+                spdlog::error("error: invalid durability \"{}\", expected none, batch or a number of milliseconds", policy);
+                return 1;
+            }
+        } else {
+            spdlog::error("error: unknown option \"{}\"", arg);
+            return 1;
+        }
+    }
+
     server.set_payload_max_length(std::numeric_limits<uint32_t>::max());
 
     const std::string root_path = argv[3];
@@ -51,14 +214,116 @@ int main(int argc, const char** argv) {
         std::filesystem::create_directory(root_path);
     }
 
-    std::map<std::string, KVStore> stores;
+    // stores which are still loading are in the map, but nullptr. stores are
+    // never removed, so a store stays valid after the lock is released.
+    std::shared_mutex stores_mtx;
+    std::map<std::string, std::unique_ptr<KVStore>> stores;
+    std::vector<std::filesystem::path> store_files;
     std::filesystem::directory_iterator store_paths = std::filesystem::directory_iterator(root_path);
     for (const auto& store_path : store_paths) {
-        std::string store_name = store_path.path().stem().string();
-        spdlog::info("loading store \"{}\" from \"{}\"", store_name, store_path.path().string());
-        stores[store_name] = KVStore(store_path.path().string());
+        // merge temporaries, hint files and other files that live next to the stores
+        if (store_path.path().extension() != ".kvs") {
+            spdlog::info("skipping \"{}\", not a store", store_path.path().string());
+            continue;
+        }
+        store_files.push_back(store_path.path());
+        stores[store_path.path().stem().string()] = nullptr;
+    }
+
+    // stores are indexed in parallel, each by one of the threads
+    std::atomic<size_t> next_store = 0;
+    std::atomic<size_t> failed_stores = 0;
+    auto load_stores = [&] {
+        for (size_t i = next_store++; i < store_files.size(); i = next_store++) {
+            const auto& path = store_files[i];
+            std::string store_name = path.stem().string();
+            spdlog::info("loading store \"{}\" from \"{}\"", store_name, path.string());
+            auto start = std::chrono::steady_clock::now();
+            std::unique_ptr<KVStore> store;
+            try {
+                store = std::make_unique<KVStore>(path.string(), options);
+            } catch (const std::exception& e) {
+                spdlog::error("failed to load store \"{}\": {}", store_name, e.what());
+                ++failed_stores;
+                std::unique_lock lock(stores_mtx);
+                stores.erase(store_name);
+                continue;
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            double megabytes = double(store->disk_size()) / (1024 * 1024);
+            spdlog::info("loaded store \"{}\" ({} keys, {:.1f} MiB) in {:.3f} s, {:.1f} MiB/s", store_name,
+                store->key_count(), megabytes, elapsed.count(), megabytes / std::max(elapsed.count(), 1e-9));
+            std::unique_lock lock(stores_mtx);
+            stores[store_name] = std::move(store);
+        }
+    };
+    std::vector<std::thread> loaders;
+    auto load_start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < std::min<size_t>(load_threads, store_files.size()); ++i) {
+        loaders.emplace_back(load_stores);
+    }
+    auto join_loaders = [&] {
+        for (auto& thread : loaders) {
+            thread.join();
+        }
+        loaders.clear();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - load_start;
+        spdlog::info("loaded {} stores in {:.3f} s", store_files.size() - failed_stores, elapsed.count());
+    };
+    if (!background_load) {
+        join_loaders();
+        if (failed_stores > 0) {
+            return 1;
+        }
     }
 
+    // finds the store, or responds with 404 if it doesn't exist, or 503 if it's still loading
+    auto find_store = [&](const std::string& store_name, const httplib::Request& req, httplib::Response& res) -> KVStore* {
+        std::shared_lock lock(stores_mtx);
+        auto iter = stores.find(store_name);
+        if (iter == stores.end()) {
+            spdlog::error("{} {}: requested store \"{}\" doesn't exist", req.method, req.path, store_name);
+            res.set_content("Not found", "text/plain");
+            res.status = 404;
+            return nullptr;
+        }
+        if (!iter->second) {
+            res.set_content("Store is loading", "text/plain");
+            res.set_header("Retry-After", "1");
+            res.status = 503;
+            return nullptr;
+        }
+        return iter->second.get();
+    };
+    // same as find_store, but creates the store if it doesn't exist
+    auto find_or_create_store = [&](const std::string& store_name, const httplib::Request& req, httplib::Response& res) -> KVStore* {
+        {
+            std::shared_lock lock(stores_mtx);
+            if (stores.contains(store_name)) {
+                lock.unlock();
+                return find_store(store_name, req, res);
+            }
+        }
+        std::unique_lock lock(stores_mtx);
+        auto& store = stores[store_name];
+        if (!store) {
+            // someone else may have created it in the meantime
+            try {
+                store = std::make_unique<KVStore>(root_path + "/" + store_name, options);
+            } catch (...) {
+                stores.erase(store_name);
+                throw;
+            }
+        }
+        return store.get();
+    };
+
+    // whether a request body is JSON, by its Content-Type, which may have a charset
+    auto is_json = [](std::string_view content_type) {
+        auto mime = parse_content_type(content_type);
+        return mime.type == "application" && mime.subtype == "json";
+    };
+
     server.set_error_handler([&](const httplib::Request& req, httplib::Response& res) {
         res.set_content(fmt::format("error {} for {} {}", res.status, req.method, req.path), "text/plain");
     });
@@ -86,48 +351,228 @@ int main(int argc, const char** argv) {
     server.Get(kv_path, [&](const httplib::Request& req, httplib::Response& res) {
         std::string store_name = req.matches[1].str();
         std::string key = req.matches[2].str();
-        if (!stores.contains(store_name)) {
-            spdlog::error("GET {}: requested store \"{}\" doesn't exist", req.path, store_name);
-            res.set_content("Not found", "text/plain");
-            res.status = 404;
+        KVStore* store_ptr = find_store(store_name, req, res);
+        if (!store_ptr) {
             return;
         }
 
-        KVStore& store = stores[store_name];
+        get_value(*store_ptr, key, req, res, options.compression);
+    });
+
+    server.Delete(kv_path, [&](const httplib::Request& req, httplib::Response& res) {
+        std::string store_name = req.matches[1].str();
+        std::string key = req.matches[2].str();
+        KVStore* store_ptr = find_store(store_name, req, res);
+        if (!store_ptr) {
+            return;
+        }
 
-        std::vector<uint8_t> data;
-        std::string mime;
-        int ret = store.read_entry(key, data, mime);
-        spdlog::info("GET {}: {}", req.path, ret == 1 ? "Not found" : std::strerror(ret));
+        KVStore& store = *store_ptr;
+        int ret = store.delete_entry(key);
+        spdlog::info("DELETE {}: {}", req.path, ret == 1 ? "Not found" : std::strerror(-ret));
         if (ret < 0) {
-            res.set_content(fmt::format("error: {}", std::strerror(ret)), "text/plain");
+            res.set_content(fmt::format("error: {}", std::strerror(-ret)), "text/plain");
             res.status = 500;
         } else if (ret == 1) {
             res.set_content("Not found", "text/plain");
             res.status = 404;
         } else {
-            res.set_content(reinterpret_cast<const char*>(data.data()), data.size(), mime);
+            res.set_content("OK", "text/plain");
         }
     });
 
-    server.Post(kv_path, [&](const httplib::Request& req, httplib::Response& res) {
+    server.Post(kv_path, [&](const httplib::Request& req, httplib::Response& res, const httplib::ContentReader& content_reader) {
         std::string store_name = req.matches[1].str();
         std::string key = req.matches[2].str();
 
-        if (!stores.contains(store_name)) {
-            stores[store_name] = KVStore(root_path + "/" + store_name);
+        // seconds until the key expires, as a query parameter or header
+        uint64_t expires_at = 0;
+        std::string ttl = req.has_param("ttl") ? req.get_param_value("ttl") : req.get_header_value("X-TTL");
+        if (!ttl.empty()) {
+            constexpr uint64_t max_ttl = 100ull * 365 * 24 * 3600;
+            uint64_t seconds = 0;
+            auto [ttl_end, ttl_ec] = std::from_chars(ttl.data(), ttl.data() + ttl.size(), seconds);
+            if (ttl_ec != std::errc() || ttl_end != ttl.data() + ttl.size() || seconds == 0 || seconds > max_ttl) {
+                res.set_content(fmt::format("Invalid TTL, expected 1 to {} seconds", max_ttl), "text/plain");
+                res.status = 400;
+                return;
+            }
+            expires_at = KVStore::now() + seconds * 1000;
+        }
+
+        // compare-and-set: the key must have a value, with one of the listed ETags
+        KVCondition condition;
+        std::vector<KVStore::KVVersion> if_match;
+        if (req.has_header("If-Match")) {
+            auto tags = entity_tags(req.get_header_value("If-Match"), false);
+            bool any = std::find(tags.begin(), tags.end(), "*") != tags.end();
+            for (auto tag : tags) {
+                if (auto version = version_of_etag(tag)) {
+                    if_match.push_back(*version);
+                }
+            }
+            // none of them can match
+            if (!any && if_match.empty()) {
+                res.set_content("Precondition failed", "text/plain");
+                res.status = 412;
+                return;
+            }
+            condition.exists = true;
+            if (!any) {
+                condition.versions = if_match;
+            }
+            // no key has a value in a store which doesn't exist, and it's not created for this
+            std::shared_lock lock(stores_mtx);
+            if (!stores.contains(store_name)) {
+                spdlog::info("POST {}: Precondition failed, store \"{}\" doesn't exist", req.path, store_name);
+                res.set_content("Precondition failed", "text/plain");
+                res.status = 412;
+                return;
+            }
+        }
+
+        KVStore* store_ptr = find_or_create_store(store_name, req, res);
+        if (!store_ptr) {
+            return;
         }
 
-        KVStore& store = stores[store_name];
-        std::vector<uint8_t> data;
+        KVStore& store = *store_ptr;
         std::string mime = req.get_header_value("Content-Type");
         if (mime.empty()) {
             mime = "application/octet-stream";
         }
-        int ret = store.write_entry(key, std::vector<uint8_t>(req.body.begin(), req.body.end()), mime);
-        spdlog::info("POST {} ({}): {}", req.path, mime, std::strerror(ret));
+        int ret = 0;
+        KVStore::KVVersion written {};
+        uint64_t length = 0;
+        std::string length_header = req.get_header_value("Content-Length");
+        auto [ptr, ec] = std::from_chars(length_header.data(), length_header.data() + length_header.size(), length);
+        // httplib decompresses encoded bodies, so then the length doesn't match what we receive
+        if (ec == std::errc() && !req.has_header("Content-Encoding")) {
+            if (length > std::numeric_limits<uint32_t>::max()) {
+                res.set_content("Payload too large", "text/plain");
+                res.status = 413;
+                return;
+            }
+            // write the body to the store as it arrives
+            KVStore::KVEntryWriter writer;
+            ret = store.begin_entry(key, static_cast<uint32_t>(length), mime, writer, expires_at, condition);
+            if (ret == 0) {
+                bool received = content_reader([&](const char* data, size_t size) {
+                    ret = writer.append({ reinterpret_cast<const uint8_t*>(data), size });
+                    return ret == 0;
+                });
+                if (ret == 0 && !received) {
+                    ret = -ECONNRESET;
+                }
+            }
+            if (ret == 0) {
+                ret = writer.commit();
+            }
+            if (ret == 0) {
+                written = writer.version();
+            }
+        } else {
+            // without a known length (e.g. chunked), the body has to be buffered
+            std::vector<uint8_t> body;
+            content_reader([&](const char* data, size_t size) {
+                body.insert(body.end(), data, data + size);
+                return true;
+            });
+            KVStore::KVWrite write { .key = key, .value = body, .mime = mime, .expires_at = expires_at, .condition = condition, .out_version = &written };
+            ret = store.write_entries({ &write, 1 });
+        }
+        spdlog::info("POST {} ({}): {}", req.path, mime, ret == 1 ? "Precondition failed" : std::strerror(-ret));
         if (ret < 0) {
-            res.set_content(std::strerror(ret), "text/plain");
+            res.set_content(std::strerror(-ret), "text/plain");
+            res.status = 500;
+        } else if (ret == 1) {
+            res.set_content("Precondition failed", "text/plain");
+            res.status = 412;
+        } else {
+            res.set_header("ETag", etag_of(written, false));
+            res.set_content("OK", "text/plain");
+        }
+    });
+
+    // the store name in the batch endpoints follows the same rules as in kv_path
+    server.Post(R"(/mget/([^\/<>:"\\|?*]+))", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string store_name = req.matches[1].str();
+        KVStore* store_ptr = find_store(store_name, req, res);
+        if (!store_ptr) {
+            return;
+        }
+
+        KVStore& store = *store_ptr;
+        std::vector<std::string> keys;
+        bool valid;
+        if (is_json(req.get_header_value("Content-Type"))) {
+            valid = parse_batch_keys_json(req.body, keys);
+        } else {
+            valid = parse_batch_keys(req.body, keys);
+        }
+        if (!valid) {
+            res.set_content("Malformed key list", "text/plain");
+            res.status = 400;
+            return;
+        }
+
+        std::string accept = req.get_header_value("Accept");
+        const std::vector<Mime> allowed_types = {
+            { "application", "octet-stream" },
+            { "application", "json" },
+        };
+        if (accept.empty()) {
+            accept = "application/octet-stream";
+        } else {
+            // parses and sorts
+            AcceptValues values(accept);
+            Mime highest = values.highest_in(allowed_types);
+            if (highest.type == "*" && highest.subtype == "*") {
+                highest = allowed_types.front();
+            }
+            accept = highest.type + "/" + highest.subtype;
+        }
+
+        std::vector<std::optional<KVStore::KVValueView>> values;
+        int ret = store.read_entries(keys, values);
+        spdlog::info("POST {}: {} keys: {}", req.path, keys.size(), std::strerror(-ret));
+        if (ret < 0) {
+            res.set_content(fmt::format("error: {}", std::strerror(-ret)), "text/plain");
+            res.status = 500;
+        } else if (accept == "application/json") {
+            res.set_content(encode_batch_values_json(keys, values), accept);
+        } else {
+            res.set_content(encode_batch_values(values), accept);
+        }
+    });
+
+    server.Post(R"(/mset/([^\/<>:"\\|?*]+))", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string store_name = req.matches[1].str();
+
+        KVStore* store_ptr = find_or_create_store(store_name, req, res);
+        if (!store_ptr) {
+            return;
+        }
+
+        KVStore& store = *store_ptr;
+        std::vector<KVStore::KVWrite> writes;
+        std::vector<std::string> storage;
+        bool valid;
+        if (is_json(req.get_header_value("Content-Type"))) {
+            valid = parse_batch_writes_json(req.body, storage, writes);
+        } else {
+            valid = parse_batch_writes(req.body, writes);
+        }
+        if (!valid) {
+            res.set_content("Malformed entry list", "text/plain");
+            res.status = 400;
+            return;
+        }
+
+        int ret = store.write_entries(writes);
+        spdlog::info("POST {}: {} entries: {}", req.path, writes.size(), std::strerror(-ret));
+        if (ret < 0) {
+            res.set_content(std::strerror(-ret), "text/plain");
             res.status = 500;
         } else {
             res.set_content("OK", "text/plain");
@@ -142,25 +587,55 @@ int main(int argc, const char** argv) {
 
     server.Get("/merge/(.+)", [&](const httplib::Request& req, httplib::Response& res) {
         std::string store_name = req.matches[1];
-        if (!stores.contains(store_name)) {
-            spdlog::error("GET {}: requested store \"{}\" doesn't exist", req.path, store_name);
-            res.set_content("Not found", "text/plain");
-            res.status = 404;
+        KVStore* store_ptr = find_store(store_name, req, res);
+        if (!store_ptr) {
             return;
         }
 
-        KVStore& store = stores[req.matches[1]];
-        auto before = std::filesystem::file_size(store.getFilename());
-        int ret = store.merge();
+        KVStore& store = *store_ptr;
+        auto before = store.disk_size();
+        KVMergeResult result;
+        int ret = store.merge(result);
         if (ret == 0) {
-            auto after = std::filesystem::file_size(store.getFilename());
-            res.set_content(fmt::format("before: {} bytes, after: {} bytes", before, after), "text/plain");
+            auto after = store.disk_size();
+            res.set_content(fmt::format("before: {} bytes, after: {} bytes, reclaimed: {} bytes, deleted keys dropped: {}, expired keys dropped: {}",
+                                before, after, result.reclaimed_bytes, result.dropped_tombstones, result.dropped_expired),
+                "text/plain");
         } else {
-            res.set_content(fmt::format("error: {}", std::strerror(ret)), "text/plain");
+            res.set_content(fmt::format("error: {}", std::strerror(-ret)), "text/plain");
             res.status = 500;
         }
     });
 
+    server.Get("/stats/(.+)", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string store_name = req.matches[1];
+        KVStore* store_ptr = find_store(store_name, req, res);
+        if (!store_ptr) {
+            return;
+        }
+
+        KVStore& store = *store_ptr;
+        auto cache = store.cache_stats();
+        nlohmann::json stats;
+        stats["disk_size"] = store.disk_size();
+        stats["dead_bytes"] = store.dead_bytes();
+        stats["reclaimed_bytes"] = store.reclaimed_bytes();
+        stats["evicted_keys"] = store.evicted_keys();
+        auto recovery = store.recovery();
+        stats["recovery"] = {
+            { "good_end", recovery.good_end },
+            { "truncated_bytes", recovery.truncated_bytes },
+        };
+        stats["cache"] = {
+            { "hits", cache.hits },
+            { "misses", cache.misses },
+            { "evictions", cache.evictions },
+            { "entries", cache.entries },
+            { "bytes", cache.bytes },
+        };
+        res.set_content(stats.dump(), "application/json");
+    });
+
     server.Get("/all-stores", [&](const httplib::Request& req, httplib::Response& res) {
         std::string accept = req.get_header_value("Accept");
         const std::vector<Mime> allowed_types = {
@@ -181,10 +656,13 @@ int main(int argc, const char** argv) {
             accept = highest.type + "/" + highest.subtype;
         }
         std::vector<std::string> store_names;
-        store_names.reserve(stores.size());
-        for (const auto& [k, v] : stores) {
-            (void)v;
-            store_names.push_back(k);
+        {
+            std::shared_lock lock(stores_mtx);
+            store_names.reserve(stores.size());
+            for (const auto& [k, v] : stores) {
+                (void)v;
+                store_names.push_back(k);
+            }
         }
         std::sort(store_names.begin(), store_names.end());
         if (accept == "text/html") {
@@ -210,17 +688,15 @@ int main(int argc, const char** argv) {
 
     server.Get("/all-keys/(.+)", [&](const httplib::Request& req, httplib::Response& res) {
         std::string store_name = req.matches[1];
-        if (!stores.contains(store_name)) {
-            spdlog::error("GET {}: requested store \"{}\" doesn't exist", req.path, store_name);
-            res.set_content("Not found", "text/plain");
-            res.status = 404;
+        KVStore* store_ptr = find_store(store_name, req, res);
+        if (!store_ptr) {
             return;
         }
 
-        KVStore& store = stores[store_name];
         std::string accept = req.get_header_value("Accept");
         const std::vector<Mime> allowed_types = {
             { "application", "json" },
+            { "application", "x-ndjson" },
             { "text", "html" },
         };
         if (accept.empty()) {
@@ -236,27 +712,145 @@ int main(int argc, const char** argv) {
             }
             accept = highest.type + "/" + highest.subtype;
         }
-        auto keys = store.get_all_keys();
-        std::sort(keys.begin(), keys.end());
+        KeyListFormat format = KeyListFormat::Json;
         if (accept == "text/html") {
-            std::string html;
-            std::string rows = "";
+            format = KeyListFormat::Html;
+        } else if (accept == "application/x-ndjson") {
+            format = KeyListFormat::NdJson;
+        }
+        constexpr size_t max_page_limit = 10000;
+        size_t limit = 0;
+        if (req.has_param("limit")) {
+            auto value = req.get_param_value("limit");
+            if (std::from_chars(value.data(), value.data() + value.size(), limit).ec != std::errc() || limit == 0 || limit > max_page_limit) {
+                res.set_content(fmt::format("Invalid limit, expected 1 to {}", max_page_limit), "text/plain");
+                res.status = 400;
+                return;
+            }
+        }
+        std::string cursor = req.get_param_value("cursor");
+
+        // pages come from the ordered index. without it, every page would sort all
+        // keys, so they're sorted once up front instead
+        std::shared_ptr<std::vector<std::string>> sorted;
+        if (!options.ordered_index) {
+            sorted = std::make_shared<std::vector<std::string>>(store_ptr->get_all_keys());
+            std::sort(sorted->begin(), sorted->end());
+        }
+        auto next_page = [store_ptr, sorted](const std::string& start, size_t count) {
+            if (!sorted) {
+                return store_ptr->scan({ .start = start, .limit = count });
+            }
+            auto first = std::lower_bound(sorted->begin(), sorted->end(), start);
+            auto last = first + static_cast<ptrdiff_t>(std::min<size_t>(count, static_cast<size_t>(sorted->end() - first)));
+            return std::vector<std::string>(first, last);
+        };
 
-            for (const auto& key : keys) {
-                rows += fmt::format(R"(<tr><td>{}</td></tr>)", key);
+        if (limit != 0) {
+            // one more than asked for, to tell where the next page starts
+            auto keys = next_page(cursor, limit + 1);
+            if (keys.size() > limit) {
+                res.set_header("X-Next-Cursor", percent_encode(keys.back()));
+                keys.pop_back();
             }
+            spdlog::info("GET {}: {} keys", req.path, keys.size());
+            KeyListWriter writer(format);
+            res.set_content(writer.begin() + writer.page(keys) + writer.end(), accept);
+            return;
+        }
+        // all keys from the cursor on, a page per chunk, so the listing takes as much
+        // memory for a huge store as for a small one, and the first keys go out right away
+        constexpr size_t chunk_keys = 1000;
+        spdlog::info("GET {}: streaming all keys", req.path);
+        res.set_chunked_content_provider(accept,
+            [writer = KeyListWriter(format), next_page, next = cursor, started = false](size_t, httplib::DataSink& sink) mutable {
+                std::string chunk;
+                if (!started) {
+                    chunk = writer.begin();
+                    started = true;
+                }
+                auto keys = next_page(next, chunk_keys + 1);
+                bool last = keys.size() <= chunk_keys;
+                if (!last) {
+                    next = std::move(keys.back());
+                    keys.pop_back();
+                }
+                chunk += writer.page(keys);
+                if (last) {
+                    chunk += writer.end();
+                }
+                if (!sink.write(chunk.data(), chunk.size())) {
+                    return false;
+                }
+                if (last) {
+                    sink.done();
+                }
+                return true;
+            });
+    });
 
-            html = fmt::format(
-#include "all-keys.html"
-                , rows);
+    // keys in order, from the store's ordered index: ?prefix=&start=&end=&limit=&values=true
+    server.Get("/scan/(.+)", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string store_name = req.matches[1];
+        KVStore* store_ptr = find_store(store_name, req, res);
+        if (!store_ptr) {
+            return;
+        }
 
-            res.set_content(html, accept);
-        } else if (accept == "application/json") {
-            res.set_content(nlohmann::json(keys).dump(), accept);
+        KVStore& store = *store_ptr;
+        constexpr size_t max_scan_limit = 10000;
+        size_t limit = 1000;
+        if (req.has_param("limit")) {
+            auto value = req.get_param_value("limit");
+            if (std::from_chars(value.data(), value.data() + value.size(), limit).ec != std::errc() || limit == 0 || limit > max_scan_limit) {
+                res.set_content(fmt::format("Invalid limit, expected 1 to {}", max_scan_limit), "text/plain");
+                res.status = 400;
+                return;
+            }
+        }
+        std::string values_param = req.get_param_value("values");
+        bool with_values = values_param == "true" || values_param == "1";
+        std::string prefix = req.get_param_value("prefix");
+        std::string start = req.get_param_value("start");
+        std::string end = req.get_param_value("end");
+        // one more than asked for, to tell where the next page starts
+        auto keys = store.scan({ .prefix = prefix, .start = start, .end = end, .limit = limit + 1 });
+        nlohmann::json result;
+        if (keys.size() > limit) {
+            result["next"] = std::move(keys.back());
+            keys.pop_back();
         } else {
+            result["next"] = nullptr;
+        }
+        spdlog::info("GET {}: {} keys", req.path, keys.size());
+        // keys are bytes, not necessarily UTF-8
+        constexpr auto replace = nlohmann::json::error_handler_t::replace;
+        if (!with_values) {
+            result["keys"] = std::move(keys);
+            res.set_content(result.dump(-1, ' ', false, replace), "application/json");
+            return;
+        }
+        std::vector<std::optional<KVStore::KVValueView>> values;
+        int ret = store.read_entries(keys, values);
+        if (ret < 0) {
+            res.set_content(fmt::format("error: {}", std::strerror(-ret)), "text/plain");
             res.status = 500;
-            res.set_content("Internal server error", "text/plain");
+            return;
         }
+        auto entries = nlohmann::json::array();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            // deleted since the scan
+            if (!values[i]) {
+                continue;
+            }
+            entries.push_back({
+                { "key", keys[i] },
+                { "mime", values[i]->mime },
+                { "value", base64_encode(values[i]->value) },
+            });
+        }
+        result["entries"] = std::move(entries);
+        res.set_content(result.dump(-1, ' ', false, replace), "application/json");
     });
 
     signal(SIGINT, sighandler);
@@ -269,5 +863,9 @@ int main(int argc, const char** argv) {
     spdlog::info("POST/GET to http://{}:{}/kv/<store>/<key>", host, port);
     spdlog::info("How-to: http://{}:{}/help", host, port);
     server.listen(host, port);
+    // stores still loading in the background are finished, so they shut down cleanly
+    if (!loaders.empty()) {
+        join_loaders();
+    }
     spdlog::info("Terminating gracefully");
 }